@@ -130,7 +130,8 @@ struct sec_TCP_con {
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
 };
 
-struct sec_TCP_con *new_TCP_con(TCP_Server *tcp_s)
+/* tcp_s is run between the steps of the handshake if not NULL, for servers that don't run by themselves. */
+struct sec_TCP_con *new_TCP_con_key(TCP_Server *tcp_s, const uint8_t *server_public_key)
 {
     struct sec_TCP_con *sec_c = malloc(sizeof(struct sec_TCP_con));
     sock_t sock = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
@@ -154,20 +155,26 @@ struct sec_TCP_con *new_TCP_con(TCP_Server *tcp_s)
     memcpy(handshake, sec_c->public_key, crypto_box_PUBLICKEYBYTES);
     new_nonce(handshake + crypto_box_PUBLICKEYBYTES);
 
-    ret = encrypt_data(tcp_s->public_key, f_secret_key, handshake + crypto_box_PUBLICKEYBYTES, handshake_plain,
+    ret = encrypt_data(server_public_key, f_secret_key, handshake + crypto_box_PUBLICKEYBYTES, handshake_plain,
                        TCP_HANDSHAKE_PLAIN_SIZE, handshake + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES);
     ck_assert_msg(ret == TCP_CLIENT_HANDSHAKE_SIZE - (crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES),
                   "Encrypt failed.");
     ck_assert_msg(send(sock, handshake, TCP_CLIENT_HANDSHAKE_SIZE - 1, 0) == TCP_CLIENT_HANDSHAKE_SIZE - 1, "send Failed.");
-    do_TCP_server(tcp_s);
+
+    if (tcp_s)
+        do_TCP_server(tcp_s);
+
     c_sleep(50);
     ck_assert_msg(send(sock, handshake + (TCP_CLIENT_HANDSHAKE_SIZE - 1), 1, 0) == 1, "send Failed.");
     c_sleep(50);
-    do_TCP_server(tcp_s);
+
+    if (tcp_s)
+        do_TCP_server(tcp_s);
+
     uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
     uint8_t response_plain[TCP_HANDSHAKE_PLAIN_SIZE];
     ck_assert_msg(recv(sock, response, TCP_SERVER_HANDSHAKE_SIZE, 0) == TCP_SERVER_HANDSHAKE_SIZE, "recv Failed.");
-    ret = decrypt_data(tcp_s->public_key, f_secret_key, response, response + crypto_box_NONCEBYTES,
+    ret = decrypt_data(server_public_key, f_secret_key, response, response + crypto_box_NONCEBYTES,
                        TCP_SERVER_HANDSHAKE_SIZE - crypto_box_NONCEBYTES, response_plain);
     ck_assert_msg(ret == TCP_HANDSHAKE_PLAIN_SIZE, "Decrypt Failed.");
     encrypt_precompute(response_plain, t_secret_key, sec_c->shared_key);
@@ -176,6 +183,11 @@ struct sec_TCP_con *new_TCP_con(TCP_Server *tcp_s)
     return sec_c;
 }
 
+struct sec_TCP_con *new_TCP_con(TCP_Server *tcp_s)
+{
+    return new_TCP_con_key(tcp_s, tcp_s->public_key);
+}
+
 void kill_TCP_con(struct sec_TCP_con *con)
 {
     kill_sock(con->sock);
@@ -304,6 +316,190 @@ START_TEST(test_some)
 }
 END_TEST
 
+#ifdef TCP_SERVER_USE_EPOLL
+/* Connect a client to relay and wait until it is confirmed by sending it a ping. */
+static struct sec_TCP_con *new_TCP_relay_con(TCP_Relay *relay)
+{
+    struct sec_TCP_con *con = new_TCP_con_key(NULL, relay->shards[0]->public_key);
+
+    uint8_t ping_packet[1 + sizeof(uint64_t)] = {4, 8, 6, 9, 67};
+    write_packet_TCP_secure_connection(con, ping_packet, sizeof(ping_packet));
+    uint8_t data[2048];
+    int len = read_packet_sec_TCP(con, data, 2 + sizeof(ping_packet) + crypto_box_MACBYTES);
+    ck_assert_msg(len == sizeof(ping_packet), "wrong len %u", len);
+    ck_assert_msg(data[0] == 5, "wrong packet id %u", data[0]);
+    return con;
+}
+
+START_TEST(test_relay_shards)
+{
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+    TCP_Relay *relay = new_TCP_relay(1, NUM_PORTS, ports, self_secret_key, NULL, 2);
+    ck_assert_msg(relay != NULL, "Failed to create TCP relay");
+    ck_assert_msg(relay->num_shards == 2, "Wrong number of shards");
+    ck_assert_msg(relay->shards[1]->num_listening_socks == NUM_PORTS, "Failed to bind all shards to all ports");
+
+    struct sec_TCP_con *con1 = new_TCP_relay_con(relay);
+    int shard1 = TCP_relay_key_shard(relay, con1->public_key);
+    ck_assert_msg(shard1 != -1, "Client not in any shard");
+
+    /* Which shard a connection goes to is up to the kernel, connect until one goes to the other. */
+    struct sec_TCP_con *con2 = NULL;
+    unsigned int i;
+
+    for (i = 0; i < 64; ++i) {
+        con2 = new_TCP_relay_con(relay);
+
+        if (TCP_relay_key_shard(relay, con2->public_key) != shard1)
+            break;
+
+        kill_TCP_con(con2);
+        con2 = NULL;
+    }
+
+    ck_assert_msg(con2 != NULL, "All the clients went to the same shard");
+
+    uint8_t requ_p[1 + crypto_box_PUBLICKEYBYTES];
+    requ_p[0] = 0;
+    memcpy(requ_p + 1, con2->public_key, crypto_box_PUBLICKEYBYTES);
+    write_packet_TCP_secure_connection(con1, requ_p, sizeof(requ_p));
+    c_sleep(50);
+    memcpy(requ_p + 1, con1->public_key, crypto_box_PUBLICKEYBYTES);
+    write_packet_TCP_secure_connection(con2, requ_p, sizeof(requ_p));
+
+    uint8_t data[2048];
+    int len = read_packet_sec_TCP(con1, data, 2 + 1 + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES);
+    ck_assert_msg(len == 1 + 1 + crypto_box_PUBLICKEYBYTES, "wrong len %u", len);
+    ck_assert_msg(data[0] == 1 && data[1] == 16, "wrong routing response %u %u", data[0], data[1]);
+    len = read_packet_sec_TCP(con2, data, 2 + 1 + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES);
+    ck_assert_msg(len == 1 + 1 + crypto_box_PUBLICKEYBYTES, "wrong len %u", len);
+    ck_assert_msg(data[0] == 1 && data[1] == 16, "wrong routing response %u %u", data[0], data[1]);
+
+    len = read_packet_sec_TCP(con1, data, 2 + 2 + crypto_box_MACBYTES);
+    ck_assert_msg(len == 2 && data[0] == 2 && data[1] == 16, "no connect notification across shards");
+    len = read_packet_sec_TCP(con2, data, 2 + 2 + crypto_box_MACBYTES);
+    ck_assert_msg(len == 2 && data[0] == 2 && data[1] == 16, "no connect notification across shards");
+
+    uint8_t test_packet[512] = {16, 17, 16, 86, 99, 127, 255, 189, 78};
+
+    for (i = 0; i < 3; ++i) {
+        write_packet_TCP_secure_connection(con2, test_packet, sizeof(test_packet));
+        write_packet_TCP_secure_connection(con1, test_packet, sizeof(test_packet));
+    }
+
+    for (i = 0; i < 3; ++i) {
+        len = read_packet_sec_TCP(con1, data, 2 + sizeof(test_packet) + crypto_box_MACBYTES);
+        ck_assert_msg(len == sizeof(test_packet), "wrong len %u", len);
+        ck_assert_msg(memcmp(data, test_packet, sizeof(test_packet)) == 0, "packet is wrong");
+        len = read_packet_sec_TCP(con2, data, 2 + sizeof(test_packet) + crypto_box_MACBYTES);
+        ck_assert_msg(len == sizeof(test_packet), "wrong len %u", len);
+        ck_assert_msg(memcmp(data, test_packet, sizeof(test_packet)) == 0, "packet is wrong");
+    }
+
+    uint8_t oob_packet[1 + crypto_box_PUBLICKEYBYTES + 4] = {6};
+    memcpy(oob_packet + 1, con2->public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(oob_packet + 1 + crypto_box_PUBLICKEYBYTES, "test", 4);
+    write_packet_TCP_secure_connection(con1, oob_packet, sizeof(oob_packet));
+    len = read_packet_sec_TCP(con2, data, 2 + sizeof(oob_packet) + crypto_box_MACBYTES);
+    ck_assert_msg(len == sizeof(oob_packet), "wrong len %u", len);
+    ck_assert_msg(data[0] == 7, "wrong packet id %u", data[0]);
+    ck_assert_msg(public_key_cmp(data + 1, con1->public_key) == 0, "wrong OOB sender");
+    ck_assert_msg(memcmp(data + 1 + crypto_box_PUBLICKEYBYTES, "test", 4) == 0, "wrong OOB data");
+
+    uint8_t disconnect_packet[2] = {3, 16};
+    write_packet_TCP_secure_connection(con1, disconnect_packet, sizeof(disconnect_packet));
+    len = read_packet_sec_TCP(con2, data, 2 + 2 + crypto_box_MACBYTES);
+    ck_assert_msg(len == 2 && data[0] == 3 && data[1] == 16, "no disconnect notification across shards");
+
+    kill_TCP_relay(relay);
+    kill_TCP_con(con1);
+    kill_TCP_con(con2);
+}
+END_TEST
+#endif
+
+#ifdef TCP_SERVER_USE_IO_URING
+static TCP_Secure_Connection *only_accepted_connection(TCP_Server *tcp_s)
+{
+    uint32_t i;
+
+    for (i = 0; i < tcp_s->size_accepted_connections; ++i) {
+        if (tcp_s->accepted_connection_array[i].status == TCP_STATUS_CONFIRMED)
+            return &tcp_s->accepted_connection_array[i];
+    }
+
+    return NULL;
+}
+
+START_TEST(test_uring)
+{
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(1, NUM_PORTS, ports, self_secret_key, NULL);
+    ck_assert_msg(tcp_s != NULL, "Failed to create TCP relay server");
+
+    if (tcp_s->ring == NULL) {
+        /* Kernel without io_uring, everything stays on epoll. */
+        kill_TCP_server(tcp_s);
+        return;
+    }
+
+    /* The first packet confirms the connection, which then moves to the ring. */
+    struct sec_TCP_con *con = new_TCP_con(tcp_s);
+    uint8_t ping_packet[1 + sizeof(uint64_t)] = {TCP_PACKET_PING, 1};
+    uint8_t data[2048];
+    write_packet_TCP_secure_connection(con, ping_packet, sizeof(ping_packet));
+    c_sleep(50);
+    do_TCP_server(tcp_s);
+    c_sleep(50);
+    int len = read_packet_sec_TCP(con, data, 2 + sizeof(ping_packet) + crypto_box_MACBYTES);
+    ck_assert_msg(len == sizeof(ping_packet) && data[0] == TCP_PACKET_PONG, "first ping not answered");
+
+    TCP_Secure_Connection *conn = only_accepted_connection(tcp_s);
+    ck_assert_msg(conn != NULL && conn->uring != NULL, "connection not moved to the ring");
+
+    /* Pings received by the ring, more than one receive takes, are all answered in order. */
+    unsigned int i;
+
+    for (i = 0; i < 256; ++i) {
+        uint64_t ping_id = i + 2;
+        memcpy(ping_packet + 1, &ping_id, sizeof(uint64_t));
+        write_packet_TCP_secure_connection(con, ping_packet, sizeof(ping_packet));
+    }
+
+    c_sleep(50);
+    do_TCP_server(tcp_s);
+    c_sleep(50);
+
+    for (i = 0; i < 256; ++i) {
+        uint64_t ping_id;
+        len = read_packet_sec_TCP(con, data, 2 + sizeof(ping_packet) + crypto_box_MACBYTES);
+        memcpy(&ping_id, data + 1, sizeof(uint64_t));
+        ck_assert_msg(len == sizeof(ping_packet) && data[0] == TCP_PACKET_PONG, "wrong packet %i", len);
+        ck_assert_msg(ping_id == i + 2, "pong %u out of order", i);
+    }
+
+    /* A connection closed by the other side is killed through its receive. */
+    struct sec_TCP_con *con2 = new_TCP_con(tcp_s);
+    write_packet_TCP_secure_connection(con2, ping_packet, sizeof(ping_packet));
+    c_sleep(50);
+    do_TCP_server(tcp_s);
+    ck_assert_msg(tcp_s->num_accepted_connections == 2, "second connection not accepted");
+    kill_TCP_con(con2);
+    c_sleep(50);
+    do_TCP_server(tcp_s);
+    ck_assert_msg(tcp_s->num_accepted_connections == 1, "closed connection not killed");
+
+    /* The receive still posted for con is waited for. */
+    kill_TCP_server(tcp_s);
+    kill_TCP_con(con);
+}
+END_TEST
+#endif
+
 static int response_callback_good;
 static uint8_t response_callback_connection_id;
 static uint8_t response_callback_public_key[crypto_box_PUBLICKEYBYTES];
@@ -508,6 +704,163 @@ START_TEST(test_client_invalid)
 }
 END_TEST
 
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+#include <sys/socket.h>
+
+START_TEST(test_send_queue)
+{
+    int socks[2];
+    ck_assert_msg(socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == 0, "socketpair failed");
+    ck_assert_msg(set_socket_nonblock(socks[0]) && set_socket_nonblock(socks[1]), "set_socket_nonblock failed");
+
+    /* Make the socket buffer small so that the queue only goes out a part at a time. */
+    int size = 4096;
+    setsockopt(socks[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    TCP_Send_Pool pool;
+    ck_assert_msg(send_pool_init(&pool, 3) == 0, "send_pool_init failed");
+
+    TCP_Send_Queue a, b;
+    send_queue_init(&a, &pool);
+    send_queue_init(&b, &pool);
+    ck_assert_msg(send_queue_empty(&a), "new queue not empty");
+
+    uint8_t data[3000];
+    uint32_t i;
+
+    for (i = 0; i < sizeof(data); ++i) {
+        data[i] = i;
+    }
+
+    ck_assert_msg(send_queue_add(&a, data, sizeof(data)) == 0, "send_queue_add failed");
+    ck_assert_msg(send_queue_add(&a, data, sizeof(data)) == 0, "send_queue_add failed");
+    ck_assert_msg(a.num_pages == 2 && pool.pages_used == 2, "wrong number of pages: %u %u", a.num_pages, pool.pages_used);
+    ck_assert_msg(send_queue_add(&b, data, sizeof(data)) == 0, "send_queue_add failed");
+    ck_assert_msg(!send_queue_has_room(&b, 2000), "pool limit not enforced");
+    ck_assert_msg(send_queue_add(&b, data, 2000) == -1, "pool limit not enforced");
+    ck_assert_msg(send_queue_add(&b, data, 1000) == 0, "send_queue_add failed with room left in the page");
+    ck_assert_msg(pool.pages_used == 3, "wrong number of pages: %u", pool.pages_used);
+
+    /* Per connection limit. */
+    TCP_Send_Queue c;
+    send_queue_init(&c, NULL);
+
+    for (i = 0; send_queue_add(&c, data, sizeof(data)) == 0; ++i);
+
+    ck_assert_msg(c.num_pages == TCP_SEND_QUEUE_MAX_PAGES, "wrong number of pages: %u", c.num_pages);
+    uint32_t c_length = i * sizeof(data);
+
+    /* Everything comes out in order. */
+    uint32_t length = 2 * sizeof(data) + c_length, received = 0;
+    uint8_t *out = malloc(length);
+    ck_assert_msg(out != NULL, "malloc failed");
+
+    while (send_queue_flush(&a, socks[0]) == -1 || send_queue_flush(&c, socks[0]) == -1) {
+        ck_assert_msg(received < length, "queue sent more than it holds");
+        ssize_t len = recv(socks[1], out + received, length - received, 0);
+
+        if (len > 0)
+            received += len;
+    }
+
+    ssize_t len;
+
+    while (received < length && (len = recv(socks[1], out + received, length - received, 0)) > 0) {
+        received += len;
+    }
+
+    ck_assert_msg(received == length, "received %u bytes instead of %u", received, length);
+    ck_assert_msg(send_queue_empty(&a) && send_queue_empty(&c), "queues not empty");
+    ck_assert_msg(a.num_pages == 0 && pool.pages_used == 1, "pages not given back: %u %u", a.num_pages, pool.pages_used);
+
+    for (i = 0; i < length; ++i) {
+        ck_assert_msg(out[i] == data[i % sizeof(data)], "wrong byte at %u", i);
+    }
+
+    free(out);
+    send_queue_wipe(&b);
+    ck_assert_msg(pool.pages_used == 0, "pages not given back: %u", pool.pages_used);
+    send_pool_free(&pool);
+    kill_sock(socks[0]);
+    kill_sock(socks[1]);
+}
+END_TEST
+
+/* Put an encrypted packet of length bytes of value with its length in packet.
+ *
+ * return the size of the packet.
+ */
+static uint16_t make_test_packet(uint8_t *packet, const uint8_t *shared_key, uint8_t *nonce, uint8_t value,
+                                 uint16_t length)
+{
+    uint8_t plain[length];
+    memset(plain, value, length);
+    uint16_t c_length = htons(length + crypto_box_MACBYTES);
+    memcpy(packet, &c_length, sizeof(uint16_t));
+    ck_assert_msg(encrypt_data_symmetric(shared_key, nonce, plain, length, packet + sizeof(uint16_t)) ==
+                  length + crypto_box_MACBYTES, "encrypt_data_symmetric failed");
+    increment_nonce(nonce);
+    return sizeof(uint16_t) + length + crypto_box_MACBYTES;
+}
+
+START_TEST(test_recv_buffer)
+{
+    int socks[2];
+    ck_assert_msg(socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == 0, "socketpair failed");
+    ck_assert_msg(set_socket_nonblock(socks[1]), "set_socket_nonblock failed");
+
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    uint8_t sent_nonce[crypto_box_NONCEBYTES], recv_nonce[crypto_box_NONCEBYTES];
+    new_symmetric_key(shared_key);
+    random_nonce(sent_nonce);
+    memcpy(recv_nonce, sent_nonce, crypto_box_NONCEBYTES);
+
+    TCP_Recv_Buffer buffer = {{0}};
+    uint8_t data[MAX_PACKET_SIZE];
+
+    ck_assert_msg(read_packet_TCP_secure_connection(socks[1], &buffer, shared_key, recv_nonce, data, sizeof(data)) == 0,
+                  "read a packet from an empty socket");
+
+    /* Several packets taken in one recv(), then one that is only half there. */
+    uint8_t packet[MAX_PACKET_SIZE + sizeof(uint16_t)];
+    unsigned int i;
+
+    for (i = 0; i < 5; ++i) {
+        uint16_t size = make_test_packet(packet, shared_key, sent_nonce, i, 300 + i);
+        ck_assert_msg(send(socks[0], packet, size, 0) == size, "send failed");
+    }
+
+    uint16_t size = make_test_packet(packet, shared_key, sent_nonce, 5, 1000);
+    ck_assert_msg(send(socks[0], packet, 500, 0) == 500, "send failed");
+
+    for (i = 0; i < 5; ++i) {
+        int len = read_packet_TCP_secure_connection(socks[1], &buffer, shared_key, recv_nonce, data, sizeof(data));
+        ck_assert_msg(len == 300 + i, "wrong packet length %i", len);
+        ck_assert_msg(data[0] == i && data[len - 1] == i, "wrong packet data");
+    }
+
+    ck_assert_msg(read_packet_TCP_secure_connection(socks[1], &buffer, shared_key, recv_nonce, data, sizeof(data)) == 0,
+                  "read an incomplete packet");
+
+    /* The rest of the packet arrives. */
+    ck_assert_msg(send(socks[0], packet + 500, size - 500, 0) == size - 500, "send failed");
+
+    int len = read_packet_TCP_secure_connection(socks[1], &buffer, shared_key, recv_nonce, data, sizeof(data));
+    ck_assert_msg(len == 1000 && data[0] == 5 && data[999] == 5, "wrong packet %i", len);
+    ck_assert_msg(buffer.start == 0 && buffer.end == 0, "buffer not empty");
+
+    /* Packets longer than MAX_PACKET_SIZE kill the connection. */
+    uint16_t c_length = htons(MAX_PACKET_SIZE + 1);
+    ck_assert_msg(send(socks[0], &c_length, sizeof(c_length), 0) == sizeof(c_length), "send failed");
+    ck_assert_msg(read_packet_TCP_secure_connection(socks[1], &buffer, shared_key, recv_nonce, data, sizeof(data)) == -1,
+                  "invalid length accepted");
+
+    kill_sock(socks[0]);
+    kill_sock(socks[1]);
+}
+END_TEST
+#endif
+
 #include "../toxcore/TCP_connection.h"
 
 _Bool tcp_data_callback_called;
@@ -718,6 +1071,16 @@ Suite *TCP_suite(void)
 
     DEFTESTCASE_SLOW(basic, 5);
     DEFTESTCASE_SLOW(some, 10);
+#ifdef TCP_SERVER_USE_EPOLL
+    DEFTESTCASE_SLOW(relay_shards, 20);
+#endif
+#ifdef TCP_SERVER_USE_IO_URING
+    DEFTESTCASE_SLOW(uring, 10);
+#endif
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+    DEFTESTCASE(send_queue);
+    DEFTESTCASE(recv_buffer);
+#endif
     DEFTESTCASE_SLOW(client, 10);
     DEFTESTCASE_SLOW(client_invalid, 15);
     DEFTESTCASE_SLOW(tcp_connection, 20);
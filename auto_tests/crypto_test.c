@@ -2,7 +2,7 @@
 #include "config.h"
 #endif
 
-#include "../toxcore/net_crypto.h"
+#include "../toxcore/net_crypto.c"
 #include <sys/types.h>
 #include <stdint.h>
 #include <string.h>
@@ -294,6 +294,33 @@ void increment_nonce_number_cmp(uint8_t *nonce, uint32_t num)
     memcpy(nonce + (crypto_box_NONCEBYTES - sizeof(num2)), &num2, sizeof(num2));
 }
 
+START_TEST(test_data_symmetric_nocopy)
+{
+    unsigned char k[crypto_box_KEYBYTES];
+    unsigned char n[crypto_box_NONCEBYTES];
+
+    unsigned char m1[crypto_box_ZEROBYTES + 1000];
+    unsigned char c1[1000 + crypto_box_MACBYTES];
+    unsigned char c2[crypto_box_BOXZEROBYTES + 1000 + crypto_box_MACBYTES];
+    unsigned char m1prime[1000];
+
+    rand_bytes(m1, sizeof(m1));
+    rand_bytes(n, crypto_box_NONCEBYTES);
+    new_symmetric_key(k);
+
+    int c1len = encrypt_data_symmetric(k, n, m1 + crypto_box_ZEROBYTES, 1000, c1);
+    ck_assert_msg(c1len == sizeof(c1), "could not encrypt data");
+
+    int c2len = encrypt_data_symmetric_nocopy(k, n, m1 + crypto_box_ZEROBYTES, 1000, c2 + crypto_box_BOXZEROBYTES);
+    ck_assert_msg(c2len == sizeof(c1), "could not encrypt data without copying");
+    ck_assert_msg(memcmp(c1, c2 + crypto_box_BOXZEROBYTES, sizeof(c1)) == 0, "encrypted texts differ");
+
+    int m1plen = decrypt_data_symmetric(k, n, c2 + crypto_box_BOXZEROBYTES, c2len, m1prime);
+    ck_assert_msg(m1plen == sizeof(m1prime), "decrypted text lengths differ");
+    ck_assert_msg(memcmp(m1prime, m1 + crypto_box_ZEROBYTES, sizeof(m1prime)) == 0, "decrypted texts differ");
+}
+END_TEST
+
 START_TEST(test_increment_nonce)
 {
     long long unsigned int i;
@@ -322,6 +349,270 @@ START_TEST(test_increment_nonce)
 }
 END_TEST
 
+START_TEST(test_packet_pool)
+{
+    Slab_Pool pool;
+    Slab_Pool_Stats stats;
+    Packet_Data *packets[PACKET_POOL_SLAB_LENGTH * 3];
+    unsigned int i, j;
+
+    ck_assert_msg(slab_pool_init(&pool, sizeof(Packet_Data), PACKET_POOL_SLAB_LENGTH) == 0, "Failed to init pool");
+
+    for (i = 0; i < PACKET_POOL_SLAB_LENGTH * 3; ++i) {
+        packets[i] = slab_pool_alloc(&pool);
+        ck_assert_msg(packets[i] != NULL, "Failed to allocate");
+        ck_assert_msg((uintptr_t)packets[i] % sizeof(uint64_t) == 0, "Packet not aligned");
+        packets[i]->length = i;
+        memset(packets[i]->data, i, sizeof(packets[i]->data));
+    }
+
+    slab_pool_get_stats(&pool, &stats);
+    ck_assert_msg(stats.slabs == 3 && stats.elements_used == PACKET_POOL_SLAB_LENGTH * 3 && stats.elements_free == 0,
+                  "Bad stats: %u %u %u", stats.slabs, stats.elements_used, stats.elements_free);
+
+    /* The packets don't overlap. */
+    for (i = 0; i < PACKET_POOL_SLAB_LENGTH * 3; ++i) {
+        ck_assert_msg(packets[i]->length == i, "Packet overwritten");
+
+        for (j = 0; j < sizeof(packets[i]->data); ++j) {
+            ck_assert_msg(packets[i]->data[j] == (uint8_t)i, "Packet overwritten");
+        }
+    }
+
+    /* Freeing one packet of each slab keeps them. */
+    for (i = 0; i < PACKET_POOL_SLAB_LENGTH * 3; i += PACKET_POOL_SLAB_LENGTH) {
+        slab_pool_release(&pool, packets[i]);
+    }
+
+    slab_pool_get_stats(&pool, &stats);
+    ck_assert_msg(stats.slabs == 3 && stats.elements_used == PACKET_POOL_SLAB_LENGTH * 3 - 3 && stats.elements_free == 3,
+                  "Bad stats: %u %u %u", stats.slabs, stats.elements_used, stats.elements_free);
+
+    /* Freed packets are reused before new slabs are allocated. */
+    for (i = 0; i < PACKET_POOL_SLAB_LENGTH * 3; i += PACKET_POOL_SLAB_LENGTH) {
+        packets[i] = slab_pool_alloc(&pool);
+    }
+
+    slab_pool_get_stats(&pool, &stats);
+    ck_assert_msg(stats.slabs == 3 && stats.elements_free == 0, "Bad stats: %u %u", stats.slabs, stats.elements_free);
+
+    /* Empty slabs are freed, except one. */
+    for (i = 0; i < PACKET_POOL_SLAB_LENGTH * 3; ++i) {
+        slab_pool_release(&pool, packets[i]);
+    }
+
+    slab_pool_get_stats(&pool, &stats);
+    ck_assert_msg(stats.slabs == 1 && stats.elements_used == 0 && stats.elements_free == PACKET_POOL_SLAB_LENGTH,
+                  "Bad stats: %u %u %u", stats.slabs, stats.elements_used, stats.elements_free);
+
+    slab_pool_release(&pool, NULL);
+    slab_pool_free(&pool);
+}
+END_TEST
+
+/* Check that every packet number from start to end (but not end) holds the packet put there
+ * by test_packets_array, or nothing for the numbers it skipped.
+ */
+static void check_packets_array(const Packets_Array *array, uint32_t start, uint32_t end)
+{
+    uint32_t i;
+
+    for (i = start; i != end; ++i) {
+        Packet_Data *data = NULL;
+        int ret = get_data_pointer(array, &data, i);
+
+        if (i % 3 == 0) {
+            ck_assert_msg(ret == 0, "Packet %u should be missing: %i", i, ret);
+            continue;
+        }
+
+        ck_assert_msg(ret == 1, "Packet %u missing: %i", i, ret);
+
+        uint32_t number;
+        memcpy(&number, data->data, sizeof(number));
+        ck_assert_msg(number == i && data->length == (uint16_t)i, "Packet %u is at %u", number, i);
+    }
+}
+
+START_TEST(test_packets_array)
+{
+    Slab_Pool pool;
+    Packets_Array array;
+    memset(&array, 0, sizeof(array));
+
+    ck_assert_msg(slab_pool_init(&pool, sizeof(Packet_Data), PACKET_POOL_SLAB_LENGTH) == 0, "Failed to init pool");
+
+    /* Packet numbers wrap around in the middle of the packets. */
+    const uint32_t start = UINT32_MAX - CRYPTO_MIN_PACKET_BUFFER_SIZE / 2;
+    const uint32_t count = CRYPTO_MIN_PACKET_BUFFER_SIZE * 8;
+    const uint32_t end = start + count;
+    array.buffer_start = start;
+    array.buffer_end = start;
+
+    uint32_t i;
+
+    /* Every third number is left empty. The array grows several times while it holds
+     * packets on both sides of the wrap. */
+    for (i = start; i != end; ++i) {
+        if (i % 3 == 0)
+            continue;
+
+        Packet_Data *data = slab_pool_alloc(&pool);
+        ck_assert_msg(data != NULL, "Failed to allocate");
+        memcpy(data->data, &i, sizeof(i));
+        data->length = i;
+        ck_assert_msg(add_data_to_buffer(&array, i, data) == 0, "Failed to add packet %u", i);
+    }
+
+    ck_assert_msg(array.buffer_end == end, "Bad buffer end %u", array.buffer_end);
+    ck_assert_msg(array.capacity == count, "Array didn't grow: %u", array.capacity);
+    check_packets_array(&array, start, end);
+
+    /* Shrinking keeps the packets while the array is more than a quarter full. */
+    shrink_packets_array(&array);
+    ck_assert_msg(array.capacity == count, "Array shrank while full: %u", array.capacity);
+
+    /* Drop all but the last packets, past the wrap, then shrink back to the minimum. */
+    const uint32_t kept_start = end - CRYPTO_MIN_PACKET_BUFFER_SIZE / 4;
+    ck_assert_msg(clear_buffer_until(&pool, &array, kept_start) == 0, "Failed to clear packets");
+
+    uint32_t capacity = array.capacity;
+
+    while (capacity > CRYPTO_MIN_PACKET_BUFFER_SIZE) {
+        shrink_packets_array(&array);
+        ck_assert_msg(array.capacity == capacity / 2, "Array didn't shrink: %u", array.capacity);
+        check_packets_array(&array, kept_start, end);
+        capacity = array.capacity;
+    }
+
+    shrink_packets_array(&array);
+    ck_assert_msg(array.capacity == CRYPTO_MIN_PACKET_BUFFER_SIZE, "Array shrank below minimum: %u", array.capacity);
+
+    /* It grows again from the shrunk buffer. */
+    for (i = end; i != end + CRYPTO_MIN_PACKET_BUFFER_SIZE; ++i) {
+        if (i % 3 == 0) {
+            ck_assert_msg(set_buffer_end(&array, i + 1) == 0, "Failed to skip packet %u", i);
+            continue;
+        }
+
+        Packet_Data *data = slab_pool_alloc(&pool);
+        ck_assert_msg(data != NULL, "Failed to allocate");
+        memcpy(data->data, &i, sizeof(i));
+        data->length = i;
+        ck_assert_msg(add_data_end_of_buffer(&array, data) == i, "Packet %u added at the wrong number", i);
+    }
+
+    ck_assert_msg(array.capacity == CRYPTO_MIN_PACKET_BUFFER_SIZE * 2, "Array didn't grow: %u", array.capacity);
+    check_packets_array(&array, kept_start, end + CRYPTO_MIN_PACKET_BUFFER_SIZE);
+
+    clear_buffer(&pool, &array);
+
+    Slab_Pool_Stats stats;
+    slab_pool_get_stats(&pool, &stats);
+    ck_assert_msg(stats.elements_used == 0, "Packets leaked: %u", stats.elements_used);
+    slab_pool_free(&pool);
+}
+END_TEST
+
+static IP_Port test_ip_port(uint8_t family, uint8_t host, uint16_t port)
+{
+    IP_Port ip_port;
+    memset(&ip_port, 0, sizeof(ip_port));
+    ip_port.ip.family = family;
+
+    if (family == AF_INET) {
+        /* 203.0.113.0/24, reserved for documentation and not a LAN address. */
+        ip_port.ip.ip4.uint8[0] = 203;
+        ip_port.ip.ip4.uint8[1] = 0;
+        ip_port.ip.ip4.uint8[2] = 113;
+        ip_port.ip.ip4.uint8[3] = host;
+    } else {
+        /* 2001:db8::/32, reserved for documentation. */
+        ip_port.ip.ip6.uint8[0] = 0x20;
+        ip_port.ip.ip6.uint8[1] = 0x01;
+        ip_port.ip.ip6.uint8[2] = 0x0d;
+        ip_port.ip.ip6.uint8[3] = 0xb8;
+        ip_port.ip.ip6.uint8[15] = host;
+    }
+
+    ip_port.port = htons(port);
+    return ip_port;
+}
+
+START_TEST(test_connection_index)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    Networking_Core *net = new_networking(ip, 34590);
+    ck_assert_msg(net != NULL, "Failed to create networking");
+    DHT *dht = new_DHT(net);
+    ck_assert_msg(dht != NULL, "Failed to create DHT");
+    TCP_Proxy_Info inf = {0};
+    Net_Crypto *c = new_net_crypto(dht, &inf);
+    ck_assert_msg(c != NULL, "Failed to create net_crypto");
+
+    uint8_t pk1[crypto_box_PUBLICKEYBYTES], pk2[crypto_box_PUBLICKEYBYTES];
+    uint8_t dht_pk[crypto_box_PUBLICKEYBYTES], dht_pk2[crypto_box_PUBLICKEYBYTES];
+    rand_bytes(pk1, sizeof(pk1));
+    rand_bytes(pk2, sizeof(pk2));
+    rand_bytes(dht_pk, sizeof(dht_pk));
+    rand_bytes(dht_pk2, sizeof(dht_pk2));
+
+    IP_Port addr1 = test_ip_port(AF_INET, 1, 33445);
+    IP_Port addr2 = test_ip_port(AF_INET, 2, 33445);
+    IP_Port addr3 = test_ip_port(AF_INET6, 3, 33445);
+    IP_Port addr4 = test_ip_port(AF_INET, 4, 33445);
+
+    int id = new_crypto_connection(c, pk1, dht_pk);
+    ck_assert_msg(id != -1, "Failed to create connection");
+    ck_assert_msg(new_crypto_connection(c, pk1, dht_pk) == id, "Second connection to the same key");
+    ck_assert_msg(getcryptconnection_id(c, pk1) == id, "Public key not indexed");
+
+    ck_assert_msg(set_direct_ip_port(c, id, addr1, 1) == 0, "Failed to set address");
+    ck_assert_msg(set_direct_ip_port(c, id, addr3, 1) == 0, "Failed to set IPv6 address");
+    ck_assert_msg(crypto_id_ip_port(c, addr1) == id, "Address not indexed");
+    ck_assert_msg(crypto_id_ip_port(c, addr3) == id, "IPv6 address not indexed");
+
+    /* Same address with another port is another key. */
+    IP_Port other_port = addr1;
+    other_port.port = htons(33446);
+    ck_assert_msg(crypto_id_ip_port(c, other_port) == -1, "Wrong port found");
+
+    /* A new address replaces the old one. */
+    ck_assert_msg(set_direct_ip_port(c, id, addr2, 1) == 0, "Failed to change address");
+    ck_assert_msg(crypto_id_ip_port(c, addr2) == id, "New address not indexed");
+    ck_assert_msg(crypto_id_ip_port(c, addr1) == -1, "Old address still indexed");
+    ck_assert_msg(crypto_id_ip_port(c, addr3) == id, "IPv6 address lost");
+
+    /* Killing the connection removes it from both indexes. */
+    ck_assert_msg(crypto_kill(c, id) == 0, "Failed to kill connection");
+    ck_assert_msg(getcryptconnection_id(c, pk1) == -1, "Killed public key still indexed");
+    ck_assert_msg(crypto_id_ip_port(c, addr2) == -1, "Killed address still indexed");
+    ck_assert_msg(crypto_id_ip_port(c, addr3) == -1, "Killed IPv6 address still indexed");
+
+    /* The slot is reused without stale entries. */
+    int id2 = new_crypto_connection(c, pk2, dht_pk);
+    ck_assert_msg(id2 == id, "Slot not reused: %i %i", id2, id);
+    ck_assert_msg(getcryptconnection_id(c, pk1) == -1, "Old public key found in reused slot");
+    ck_assert_msg(getcryptconnection_id(c, pk2) == id2, "Public key not indexed");
+    ck_assert_msg(crypto_id_ip_port(c, addr2) == -1, "Old address found in reused slot");
+    ck_assert_msg(crypto_id_ip_port(c, addr3) == -1, "Old IPv6 address found in reused slot");
+
+    ck_assert_msg(set_direct_ip_port(c, id2, addr4, 1) == 0, "Failed to set address");
+    ck_assert_msg(crypto_id_ip_port(c, addr4) == id2, "Address not indexed");
+    ck_assert_msg(crypto_id_ip_port(c, addr2) == -1, "Old address found in reused slot");
+
+    /* A new connection to the old key gets a new slot. */
+    int id3 = new_crypto_connection(c, pk1, dht_pk2);
+    ck_assert_msg(id3 != -1 && id3 != id2, "Bad connection id %i", id3);
+    ck_assert_msg(getcryptconnection_id(c, pk1) == id3 && getcryptconnection_id(c, pk2) == id2, "Keys mixed up");
+
+    kill_net_crypto(c);
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
 Suite *crypto_suite(void)
 {
     Suite *s = suite_create("Crypto");
@@ -331,7 +622,11 @@ Suite *crypto_suite(void)
     DEFTESTCASE_SLOW(endtoend, 15); /* waiting up to 15 seconds */
     DEFTESTCASE(large_data);
     DEFTESTCASE(large_data_symmetric);
+    DEFTESTCASE(data_symmetric_nocopy);
     DEFTESTCASE_SLOW(increment_nonce, 20);
+    DEFTESTCASE(packet_pool);
+    DEFTESTCASE(packets_array);
+    DEFTESTCASE(connection_index);
 
     return s;
 }
@@ -7,6 +7,7 @@
 
 #include "../toxcore/tox.h"
 #include "../toxcore/DHT.c"
+#include "../toxcore/crypto_pool.h"
 
 #include "helpers.h"
 
@@ -409,6 +410,226 @@ void test_add_to_list(uint8_t cmp_list[][crypto_box_PUBLICKEYBYTES + 1], unsigne
     }
 }
 
+/* The byte by byte versions the distance kernels must agree with. */
+static int ref_id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
+{
+    size_t i;
+
+    for (i = 0; i < crypto_box_PUBLICKEYBYTES; ++i) {
+        uint8_t distance1 = pk[i] ^ pk1[i];
+        uint8_t distance2 = pk[i] ^ pk2[i];
+
+        if (distance1 < distance2)
+            return 1;
+
+        if (distance1 > distance2)
+            return 2;
+    }
+
+    return 0;
+}
+
+static unsigned int ref_bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
+{
+    unsigned int i, j = 0;
+
+    for (i = 0; i < crypto_box_PUBLICKEYBYTES; ++i) {
+        if (pk1[i] == pk2[i])
+            continue;
+
+        for (j = 0; j < 8; ++j) {
+            if ((pk1[i] & (1 << (7 - j))) != (pk2[i] & (1 << (7 - j))))
+                break;
+        }
+
+        break;
+    }
+
+    return i * 8 + j;
+}
+
+static unsigned int test_rank(const void *entry)
+{
+    return ((const Client_data *)entry)->assoc4.timestamp % 3;
+}
+
+START_TEST(test_distance)
+{
+    uint8_t pk[crypto_box_PUBLICKEYBYTES], pk1[crypto_box_PUBLICKEYBYTES], pk2[crypto_box_PUBLICKEYBYTES];
+    unsigned int i, j;
+
+    for (i = 0; i < 100000; ++i) {
+        randombytes(pk, sizeof(pk));
+        randombytes(pk1, sizeof(pk1));
+        randombytes(pk2, sizeof(pk2));
+
+        /* Make the keys share prefixes of every length, down to being equal. */
+        unsigned int common = i % (crypto_box_PUBLICKEYBYTES + 1);
+        memcpy(pk1, pk2, common);
+
+        if (i % 7 == 0 && common < crypto_box_PUBLICKEYBYTES)
+            pk1[common] = pk2[common] ^ (1 << (i % 8));
+
+        ck_assert_msg(id_closest(pk, pk1, pk2) == ref_id_closest(pk, pk1, pk2), "id_closest differs");
+        ck_assert_msg(id_closest(pk, pk2, pk1) == ref_id_closest(pk, pk2, pk1), "id_closest differs");
+        ck_assert_msg(bit_by_bit_cmp(pk1, pk2) == ref_bit_by_bit_cmp(pk1, pk2), "bit_by_bit_cmp differs");
+    }
+
+    /* Lists are sorted by rank, then from the furthest to the closest. */
+    Client_data list[MAX_DISTANCE_SORT_LENGTH];
+    memset(list, 0, sizeof(list));
+    randombytes(pk, sizeof(pk));
+
+    for (i = 0; i < MAX_DISTANCE_SORT_LENGTH; ++i) {
+        randombytes(list[i].public_key, sizeof(list[i].public_key));
+        memcpy(list[i].public_key, pk, i % 4);
+        list[i].assoc4.timestamp = rand();
+    }
+
+    ck_assert_msg(sort_by_distance(list, MAX_DISTANCE_SORT_LENGTH, sizeof(Client_data), offsetof(Client_data, public_key),
+                                   pk, test_rank) == 0, "Failed to sort");
+
+    for (i = 1; i < MAX_DISTANCE_SORT_LENGTH; ++i) {
+        unsigned int rank1 = test_rank(&list[i - 1]), rank2 = test_rank(&list[i]);
+        ck_assert_msg(rank1 <= rank2, "Not sorted by rank");
+
+        if (rank1 == rank2 && rank1 != 0)
+            ck_assert_msg(id_closest(pk, list[i - 1].public_key, list[i].public_key) != 1, "Not sorted by distance");
+    }
+
+    /* add_to_list keeps the closest nodes. */
+    Node_format nodes[MAX_SENT_NODES];
+    Node_format all_nodes[64];
+
+    for (i = 0; i < 64; ++i) {
+        randombytes(all_nodes[i].public_key, sizeof(all_nodes[i].public_key));
+        all_nodes[i].ip_port.port = i;
+
+        if (i < MAX_SENT_NODES)
+            nodes[i] = all_nodes[i];
+        else
+            add_to_list(nodes, MAX_SENT_NODES, all_nodes[i].public_key, all_nodes[i].ip_port, pk);
+    }
+
+    for (i = 0; i < 64; ++i) {
+        unsigned int closer = 0;
+
+        for (j = 0; j < 64; ++j) {
+            if (id_closest(pk, all_nodes[j].public_key, all_nodes[i].public_key) == 1)
+                ++closer;
+        }
+
+        _Bool in_list = client_in_nodelist(nodes, MAX_SENT_NODES, all_nodes[i].public_key);
+        ck_assert_msg(in_list == (closer < MAX_SENT_NODES), "add_to_list didn't keep the closest nodes");
+    }
+}
+END_TEST
+
+#define CLOSE_BUCKET_SIZE 32
+
+START_TEST(test_close_buckets)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint8[0] = 127;
+    ip.ip4.uint8[3] = 1;
+    DHT *dht = new_DHT(new_networking(ip, DHT_DEFAULT_PORT));
+    ck_assert_msg(dht != 0, "Failed to create DHT");
+    ck_assert_msg(DHT_set_close_bucket_size(dht, CLOSE_BUCKET_SIZE) == 0, "Failed to set the bucket size");
+    ck_assert_msg(dht->close_clientlist_length == LCLIENT_LENGTH * CLOSE_BUCKET_SIZE, "Wrong close list length");
+
+    IP_Port ip_port = { .ip = ip, .port = htons(DHT_DEFAULT_PORT) };
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    unsigned int i, j, k;
+
+    /* Fill one bucket in 4, and put one node in the others: keys with exactly i bits
+     * in common with ours go in bucket i. */
+    uint32_t expected = 0;
+
+    for (i = 0; i < LCLIENT_LENGTH; ++i) {
+        unsigned int bucket_nodes = i % 4 == 0 ? CLOSE_BUCKET_SIZE : 1;
+        expected += bucket_nodes;
+
+        for (j = 0; j < bucket_nodes; ++j) {
+            randombytes(public_key, sizeof(public_key));
+
+            for (k = 0; k < i / 8; ++k)
+                public_key[k] = dht->self_public_key[k];
+
+            uint8_t mask = 0xFF << (8 - i % 8);
+            public_key[i / 8] = (dht->self_public_key[i / 8] & mask) | (~dht->self_public_key[i / 8] & (0x80 >> (i % 8)))
+                                | (public_key[i / 8] & ~mask & ~(0x80 >> (i % 8)));
+            ck_assert_msg(bit_by_bit_cmp(public_key, dht->self_public_key) == i, "Wrong test key");
+
+            addto_lists(dht, ip_port, public_key);
+        }
+    }
+
+    uint32_t num = 0;
+
+    for (i = 0; i < dht->close_clientlist_length; ++i) {
+        if (is_timeout(dht->close_clientlist[i].assoc4.timestamp, BAD_NODE_TIMEOUT))
+            continue;
+
+        ++num;
+        ck_assert_msg(close_list_find(dht, dht->close_clientlist[i].public_key) == (int)i, "Node not indexed");
+    }
+
+    ck_assert_msg(num == expected, "Wrong number of nodes in the close list: %u", num);
+    ck_assert_msg(num > LCLIENT_LIST, "Close list not bigger than the default");
+
+    /* The buckets searched must give the same nodes as searching the whole list. */
+    for (i = 0; i < 256; ++i) {
+        Node_format nodes[MAX_SENT_NODES], all_nodes[MAX_SENT_NODES];
+        uint32_t num_all = 0;
+
+        randombytes(public_key, sizeof(public_key));
+
+        /* Half of the targets are close to us, up to sharing more than LCLIENT_LENGTH bits. */
+        if (i % 2)
+            memcpy(public_key, dht->self_public_key, i % 19);
+
+        memset(all_nodes, 0, sizeof(all_nodes));
+        get_close_nodes_inner(public_key, all_nodes, AF_INET, dht->close_clientlist, dht->close_clientlist_length,
+                              &num_all, 1, 0);
+        int num_nodes = get_close_nodes(dht, public_key, nodes, AF_INET, 1, 0);
+        ck_assert_msg(num_nodes == MAX_SENT_NODES && num_all == MAX_SENT_NODES, "Wrong number of nodes");
+
+        for (j = 0; j < MAX_SENT_NODES; ++j) {
+            ck_assert_msg(client_in_nodelist(all_nodes, MAX_SENT_NODES, nodes[j].public_key), "Node is not one of the closest");
+        }
+    }
+
+    /* A bad node is replaced, and can't be found anymore. */
+    Client_data *client = &dht->close_clientlist[4 * CLOSE_BUCKET_SIZE + 3];
+    uint8_t old_key[crypto_box_PUBLICKEYBYTES];
+    id_copy(old_key, client->public_key);
+    mark_bad(&client->assoc4);
+    memcpy(public_key, old_key, sizeof(public_key));
+    public_key[31] ^= 1;
+    ck_assert_msg(addto_lists(dht, ip_port, public_key) >= 1, "Node not added");
+    ck_assert_msg(close_list_find(dht, old_key) == -1, "Replaced node still in the index");
+    ck_assert_msg(close_list_find(dht, public_key) == 4 * CLOSE_BUCKET_SIZE + 3, "New node not indexed");
+    ck_assert_msg(route_packet(dht, old_key, public_key, sizeof(public_key)) == -1, "Routed to a replaced node");
+
+    /* Smaller buckets keep their first nodes. */
+    ck_assert_msg(DHT_set_close_bucket_size(dht, LCLIENT_NODES) == 0, "Failed to set the bucket size");
+    ck_assert_msg(dht->close_clientlist_index.n == (LCLIENT_LENGTH / 4) * (LCLIENT_NODES + 3),
+                  "Wrong number of nodes in the index");
+
+    for (i = 0; i < LCLIENT_LIST; ++i) {
+        if (is_timeout(dht->close_clientlist[i].assoc4.timestamp, BAD_NODE_TIMEOUT))
+            continue;
+
+        ck_assert_msg(close_list_find(dht, dht->close_clientlist[i].public_key) == (int)i, "Node not indexed");
+    }
+
+    void *n = dht->net;
+    kill_DHT(dht);
+    kill_networking(n);
+}
+END_TEST
+
 #define NUM_DHT 100
 
 void test_list_main()
@@ -529,6 +750,186 @@ void test_list_main()
 }
 
 
+/* Get the shared key of public_key from shared_keys and check it is the right one. */
+static void check_shared_key(Shared_Keys *shared_keys, const uint8_t *secret_key, const uint8_t *public_key)
+{
+    uint8_t shared_key[crypto_box_BEFORENMBYTES], expected[crypto_box_BEFORENMBYTES];
+    get_shared_key(shared_keys, shared_key, secret_key, public_key);
+    encrypt_precompute(public_key, secret_key, expected);
+    ck_assert_msg(memcmp(shared_key, expected, sizeof(expected)) == 0, "Wrong shared key");
+}
+
+static void check_shared_keys_stats(const Shared_Keys *shared_keys, uint64_t hits, uint64_t misses, uint64_t evictions)
+{
+    Shared_Keys_Stats stats;
+    shared_keys_get_stats(shared_keys, &stats);
+    ck_assert_msg(stats.hits == hits && stats.misses == misses && stats.evictions == evictions,
+                  "Bad stats: %u hits %u misses %u evictions, expected %u %u %u", (unsigned int)stats.hits,
+                  (unsigned int)stats.misses, (unsigned int)stats.evictions, (unsigned int)hits, (unsigned int)misses,
+                  (unsigned int)evictions);
+}
+
+START_TEST(test_shared_keys)
+{
+    uint8_t public_keys[6][crypto_box_PUBLICKEYBYTES];
+    uint8_t secret_keys[6][crypto_box_SECRETKEYBYTES];
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES], secret_key[crypto_box_SECRETKEYBYTES];
+    Shared_Keys shared_keys;
+    unsigned int i;
+
+    crypto_box_keypair(public_key, secret_key);
+
+    for (i = 0; i < 6; ++i) {
+        crypto_box_keypair(public_keys[i], secret_keys[i]);
+    }
+
+    ck_assert_msg(shared_keys_init(&shared_keys, 4) == 0, "Failed to init");
+
+    for (i = 0; i < 4; ++i) {
+        check_shared_key(&shared_keys, secret_key, public_keys[i]);
+    }
+
+    check_shared_keys_stats(&shared_keys, 0, 4, 0);
+
+    /* Once key 0 is used again, keys 1 and 2 are the least recently used ones. */
+    check_shared_key(&shared_keys, secret_key, public_keys[0]);
+    check_shared_key(&shared_keys, secret_key, public_keys[4]);
+    check_shared_keys_stats(&shared_keys, 1, 5, 1);
+    check_shared_key(&shared_keys, secret_key, public_keys[1]);
+    check_shared_keys_stats(&shared_keys, 1, 6, 2);
+    check_shared_key(&shared_keys, secret_key, public_keys[0]);
+    check_shared_key(&shared_keys, secret_key, public_keys[3]);
+    check_shared_key(&shared_keys, secret_key, public_keys[4]);
+    check_shared_keys_stats(&shared_keys, 4, 6, 2);
+
+    /* Shrinking keeps the most recently used keys: 0, 3 and 4. */
+    ck_assert_msg(shared_keys_set_size(&shared_keys, 3) == 0, "Failed to resize");
+    check_shared_key(&shared_keys, secret_key, public_keys[0]);
+    check_shared_key(&shared_keys, secret_key, public_keys[3]);
+    check_shared_key(&shared_keys, secret_key, public_keys[4]);
+    check_shared_keys_stats(&shared_keys, 7, 6, 2);
+    check_shared_key(&shared_keys, secret_key, public_keys[5]);
+    check_shared_key(&shared_keys, secret_key, public_keys[3]);
+    check_shared_key(&shared_keys, secret_key, public_keys[0]);
+    check_shared_keys_stats(&shared_keys, 8, 8, 4);
+
+    /* Growing keeps all of them. */
+    ck_assert_msg(shared_keys_set_size(&shared_keys, 1000) == 0, "Failed to resize");
+
+    for (i = 0; i < 1000; ++i) {
+        check_shared_key(&shared_keys, secret_key, public_keys[(i % 3) * 2 + 1]);
+    }
+
+    check_shared_keys_stats(&shared_keys, 8 + 1000 - 1, 9, 4);
+    shared_keys_free(&shared_keys);
+
+    /* A cache that couldn't be initialized still gives the right keys. */
+    memset(&shared_keys, 0, sizeof(shared_keys));
+    check_shared_key(&shared_keys, secret_key, public_keys[0]);
+    check_shared_key(&shared_keys, secret_key, public_keys[0]);
+    check_shared_keys_stats(&shared_keys, 0, 2, 0);
+}
+END_TEST
+
+
+#define POOL_TEST_PACKET 200
+#define POOL_TEST_KEYS 8
+#define POOL_TEST_ROUNDS 4
+
+static Shared_Keys pool_shared_keys;
+static uint8_t pool_secret_key[crypto_box_SECRETKEYBYTES];
+static uint8_t pool_last_round[POOL_TEST_KEYS];
+static unsigned int pool_handled;
+
+/* Packets are [id][public key][round][key number]. */
+static int handle_pool_test_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    ck_assert_msg(length == 1 + crypto_box_PUBLICKEYBYTES + 2, "Wrong length");
+    ck_assert_msg(shared_keys_contains(&pool_shared_keys, packet + 1), "Shared key not computed by the pool");
+    check_shared_key(&pool_shared_keys, pool_secret_key, packet + 1);
+
+    uint8_t round = packet[1 + crypto_box_PUBLICKEYBYTES];
+    uint8_t key = packet[1 + crypto_box_PUBLICKEYBYTES + 1];
+    ck_assert_msg(round == pool_last_round[key] + 1, "Packets of a key out of order");
+    pool_last_round[key] = round;
+    ++pool_handled;
+    return 0;
+}
+
+START_TEST(test_crypto_pool)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    Networking_Core *net = new_networking_no_socket(ip, 33445);
+    ck_assert_msg(net != NULL, "Failed to create networking");
+
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    crypto_box_keypair(public_key, pool_secret_key);
+    ck_assert_msg(shared_keys_init(&pool_shared_keys, 64) == 0, "Failed to init");
+    networking_registerhandler(net, POOL_TEST_PACKET, &handle_pool_test_packet, NULL);
+
+    Crypto_Pool *pool = new_crypto_pool(net, 3);
+    ck_assert_msg(pool != NULL, "Failed to create pool");
+    ck_assert_msg(crypto_pool_register(pool, POOL_TEST_PACKET, &pool_shared_keys, pool_secret_key, 1) == 0,
+                  "Failed to register");
+    ck_assert_msg(crypto_pool_register(pool, POOL_TEST_PACKET, &pool_shared_keys, pool_secret_key, 1) == -1,
+                  "Registered twice");
+
+    uint8_t packets[POOL_TEST_KEYS][1 + crypto_box_PUBLICKEYBYTES + 2];
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    unsigned int i, j;
+
+    for (i = 0; i < POOL_TEST_KEYS; ++i) {
+        packets[i][0] = POOL_TEST_PACKET;
+        crypto_box_keypair(packets[i] + 1, secret_key);
+        packets[i][1 + crypto_box_PUBLICKEYBYTES + 1] = i;
+    }
+
+    IP_Port source;
+    source.ip = ip;
+    source.port = htons(1234);
+
+    for (j = 1; j <= POOL_TEST_ROUNDS; ++j) {
+        for (i = 0; i < POOL_TEST_KEYS; ++i) {
+            packets[i][1 + crypto_box_PUBLICKEYBYTES] = j;
+            networking_handle_packet(net, source, packets[i], sizeof(packets[i]));
+        }
+    }
+
+    /* Nothing is handled until the keys are computed. */
+    Crypto_Pool_Stats stats;
+    crypto_pool_get_stats(pool, &stats);
+    ck_assert_msg(stats.packets_offloaded == POOL_TEST_KEYS * POOL_TEST_ROUNDS, "Packets not offloaded");
+    ck_assert_msg(pool_handled == 0, "Packets handled before their key was computed");
+
+    Socket_Wait_List wait_socks = {0};
+
+    for (i = 0; i < 100 && pool_handled != POOL_TEST_KEYS * POOL_TEST_ROUNDS; ++i) {
+        socket_wait_list_clear(&wait_socks);
+        ck_assert_msg(crypto_pool_wait_socks(pool, &wait_socks) == 0, "Failed to get wait socket");
+        socket_wait(&wait_socks, 100);
+        do_crypto_pool(pool);
+    }
+
+    socket_wait_list_free(&wait_socks);
+    ck_assert_msg(pool_handled == POOL_TEST_KEYS * POOL_TEST_ROUNDS, "Only %u packets handled", pool_handled);
+
+    /* Packets whose key is known are handled right away. */
+    packets[0][1 + crypto_box_PUBLICKEYBYTES] = POOL_TEST_ROUNDS + 1;
+    networking_handle_packet(net, source, packets[0], sizeof(packets[0]));
+    ck_assert_msg(pool_handled == POOL_TEST_KEYS * POOL_TEST_ROUNDS + 1, "Packet with known key not handled");
+    crypto_pool_get_stats(pool, &stats);
+    ck_assert_msg(stats.packets_offloaded == POOL_TEST_KEYS * POOL_TEST_ROUNDS, "Packet with known key offloaded");
+
+    kill_crypto_pool(pool);
+    ck_assert_msg(net->packethandlers[POOL_TEST_PACKET].function == &handle_pool_test_packet, "Handler not restored");
+
+    shared_keys_free(&pool_shared_keys);
+    kill_networking(net);
+}
+END_TEST
+
+
 START_TEST(test_list)
 {
     unsigned int i;
@@ -639,6 +1040,10 @@ Suite *dht_suite(void)
 
     //DEFTESTCASE(addto_lists_ipv4);
     //DEFTESTCASE(addto_lists_ipv6);
+    DEFTESTCASE(distance);
+    DEFTESTCASE(close_buckets);
+    DEFTESTCASE(shared_keys);
+    DEFTESTCASE(crypto_pool);
     DEFTESTCASE_SLOW(list, 20);
     DEFTESTCASE_SLOW(DHT_test, 50);
     return s;
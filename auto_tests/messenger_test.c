@@ -120,6 +120,50 @@ START_TEST(test_m_delfriend)
                   REALLY_BIG_NUMBER);
 }
 END_TEST
+#define NUM_LOOKUP_FRIENDS 300
+
+START_TEST(test_getfriend_id)
+{
+    uint8_t keys[NUM_LOOKUP_FRIENDS][crypto_box_PUBLICKEYBYTES];
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    int32_t numbers[NUM_LOOKUP_FRIENDS];
+    int i;
+
+    for (i = 0; i < NUM_LOOKUP_FRIENDS; ++i) {
+        crypto_box_keypair(keys[i], secret_key);
+        numbers[i] = m_addfriend_norequest(m, keys[i]);
+        ck_assert_msg(numbers[i] >= 0, "Failed to add friend %d", i);
+    }
+
+    /* Deleting friends must not change the number of the others. */
+    for (i = 0; i < NUM_LOOKUP_FRIENDS; i += 3) {
+        ck_assert_msg(m_delfriend(m, numbers[i]) == 0, "Failed to delete friend %d", i);
+    }
+
+    for (i = 0; i < NUM_LOOKUP_FRIENDS; ++i) {
+        _Bool deleted = i % 3 == 0;
+        ck_assert_msg(getfriend_id(m, keys[i]) == (deleted ? -1 : numbers[i]), "Wrong friend number for friend %d", i);
+        ck_assert_msg((getfriend_conn_id_pk(m->fr_c, keys[i]) == -1) == deleted, "Wrong friend connection for friend %d", i);
+        ck_assert_msg((onion_friend_num(m->onion_c, keys[i]) == -1) == deleted, "Wrong onion friend for friend %d", i);
+    }
+
+    /* Deleted friends are added again in the free slots. */
+    for (i = 0; i < NUM_LOOKUP_FRIENDS; i += 3) {
+        numbers[i] = m_addfriend_norequest(m, keys[i]);
+        ck_assert_msg(numbers[i] >= 0, "Failed to add friend %d again", i);
+    }
+
+    for (i = 0; i < NUM_LOOKUP_FRIENDS; ++i) {
+        ck_assert_msg(getfriend_id(m, keys[i]) == numbers[i], "Wrong friend number for friend %d", i);
+        ck_assert_msg(getfriend_conn_id_pk(m->fr_c, keys[i]) == m->friendlist[numbers[i]].friendcon_id,
+                      "Wrong friend connection for friend %d", i);
+        ck_assert_msg(m_delfriend(m, numbers[i]) == 0, "Failed to delete friend %d", i);
+    }
+
+    ck_assert_msg(getfriend_id(m, (uint8_t *)friend_id) == friend_id_num, "Lost the default friend");
+}
+END_TEST
+
 /*
 START_TEST(test_m_addfriend)
 {
@@ -315,6 +359,7 @@ Suite *messenger_suite(void)
     DEFTESTCASE(m_friend_exists);
     DEFTESTCASE(m_get_friend_connectionstatus);
     DEFTESTCASE(m_delfriend);
+    DEFTESTCASE(getfriend_id);
 
     DEFTESTCASE(setname);
     DEFTESTCASE(getname);
@@ -13,6 +13,13 @@
 
 #include "helpers.h"
 
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
 START_TEST(test_addr_resolv_localhost)
 {
 #ifdef __CYGWIN__
@@ -134,12 +141,143 @@ START_TEST(test_ip_equal)
 }
 END_TEST
 
+static unsigned int hook_handled, hook_received, hook_sent;
+
+static int hook_handle(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    ++hook_handled;
+    /* Answer, the packet should go to the send hook. */
+    sendpacket(object, ip_port, data, length);
+    return 0;
+}
+
+static int hook_recv(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    ck_assert_msg(hook_handled == hook_received, "recv hook wasn't called before the handler.");
+    ++hook_received;
+    return 0;
+}
+
+static int hook_send(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    ++hook_sent;
+    return length;
+}
+
+START_TEST(test_hooks_no_socket)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    Networking_Core *net = new_networking_no_socket(ip, 33445);
+    ck_assert_msg(net != NULL, "Failed to create networking without a socket.");
+    ck_assert_msg(!sock_valid(net->sock), "Networking without a socket has a valid socket.");
+
+    networking_registerhandler(net, 100, hook_handle, net);
+    networking_set_recv_hook(net, hook_recv, NULL);
+    networking_set_send_hook(net, hook_send, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.ip.ip6.uint8[15] = 1;
+    ip_port.port = htons(33446);
+    uint8_t packet[10] = {100};
+
+    networking_handle_packet(net, ip_port, packet, sizeof(packet));
+    packet[0] = 101;
+    networking_handle_packet(net, ip_port, packet, sizeof(packet));
+
+    ck_assert_msg(hook_received == 2, "recv hook called %u times instead of 2.", hook_received);
+    ck_assert_msg(hook_handled == 1, "handler called %u times instead of 1.", hook_handled);
+    ck_assert_msg(hook_sent == 1, "send hook called %u times instead of 1.", hook_sent);
+
+    Net_Packet_Stats stats;
+    networking_get_packet_stats(net, 100, &stats);
+    ck_assert_msg(stats.packets_recv == 1 && stats.packets_sent == 1, "Wrong packet stats.");
+    networking_get_packet_stats(net, 101, &stats);
+    ck_assert_msg(stats.packets_recv == 1 && stats.packets_dropped == 1, "Wrong packet stats.");
+
+    /* Doesn't try to read from the missing socket. */
+    networking_poll(net);
+    kill_networking(net);
+}
+END_TEST
+
+#define BATCH_PACKETS 100
+
+static unsigned int batch_received;
+
+static int handle_batch_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    const uint16_t *lengths = object;
+
+    ck_assert_msg(batch_received < BATCH_PACKETS, "Received too many packets.");
+    ck_assert_msg(length == lengths[batch_received], "Packet %u has length %u instead of %u.", batch_received, length,
+                  lengths[batch_received]);
+    ck_assert_msg(data[1] == batch_received && data[length - 1] == batch_received, "Packet %u out of order.",
+                  batch_received);
+    ++batch_received;
+    return 0;
+}
+
+START_TEST(test_sendpacket_batch)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+    Networking_Core *net1 = new_networking(ip, 33545);
+    Networking_Core *net2 = new_networking(ip, 33546);
+    ck_assert_msg(net1 && net2, "Failed to create networking.");
+
+    /* Runs of packets of the same length, a shorter one ending some, to be sent with GSO. */
+    static uint8_t packets[BATCH_PACKETS][1400];
+    const uint8_t *data[BATCH_PACKETS];
+    uint16_t lengths[BATCH_PACKETS];
+    unsigned int i;
+
+    for (i = 0; i < BATCH_PACKETS; ++i) {
+        lengths[i] = (i % 40 < 30) ? 1400 : 100 + i;
+        memset(packets[i], i, lengths[i]);
+        packets[i][0] = 200;
+        data[i] = packets[i];
+    }
+
+    networking_registerhandler(net2, 200, handle_batch_packet, lengths);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net2->port;
+    ck_assert_msg(sendpacket_batch(net1, ip_port, data, lengths, BATCH_PACKETS) == BATCH_PACKETS,
+                  "Failed to send the batch.");
+
+    Net_Packet_Stats stats;
+    networking_get_packet_stats(net1, 200, &stats);
+    ck_assert_msg(stats.packets_sent == BATCH_PACKETS, "%llu packets counted as sent.",
+                  (unsigned long long)stats.packets_sent);
+
+    for (i = 0; i < 100 && batch_received != BATCH_PACKETS; ++i) {
+        networking_poll(net2);
+        c_sleep(10);
+    }
+
+    ck_assert_msg(batch_received == BATCH_PACKETS, "Received %u packets of %u.", batch_received, BATCH_PACKETS);
+
+    IP_Port invalid;
+    memset(&invalid, 0, sizeof(invalid));
+    ck_assert_msg(sendpacket_batch(net1, invalid, data, lengths, 1) == -1, "Sent to an invalid address.");
+
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
 Suite *network_suite(void)
 {
     Suite *s = suite_create("Network");
 
     DEFTESTCASE(addr_resolv_localhost);
     DEFTESTCASE(ip_equal);
+    DEFTESTCASE(hooks_no_socket);
+    DEFTESTCASE(sendpacket_batch);
 
     return s;
 }
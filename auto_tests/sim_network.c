@@ -0,0 +1,477 @@
+/* sim_network.c
+ *
+ * In-process simulated UDP network for tests with many nodes.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sim_network.h"
+
+#include "../toxcore/util.h"
+
+/* Node i is 198.18.0.1 + i, in the range reserved for benchmarks (RFC 2544).
+ * The DHT treats LAN addresses differently, so the simulated ones must not be LAN ips.
+ */
+#define SIM_BASE_IP 0xC6120001
+#define SIM_MAX_NODES ((1 << 17) - 2)
+#define SIM_PORT TOX_PORT_DEFAULT
+
+/* Ports used by symmetric NATs. */
+#define SIM_SYMMETRIC_PORT_FIRST 1024
+#define SIM_SYMMETRIC_PORTS 64000
+
+/* Start the clock at a non zero time, timestamps of 0 have special meanings. */
+#define SIM_START_TIME_US 1000000000ULL
+
+/* Open addressing set of ip and port pairs, 0 is the empty slot. */
+typedef struct {
+    uint64_t *keys;
+    uint32_t size;
+    uint32_t count;
+} Sim_Key_Set;
+
+typedef struct {
+    Sim_Network *sim;
+    uint32_t index;
+    uint8_t nat_type;
+    uint8_t has_sent;
+    uint64_t busy_until; /* us, end of the upload of the last packet sent. */
+    Sim_Key_Set contacted;
+    Networking_Core *net;
+} Sim_Node;
+
+typedef struct {
+    uint64_t time; /* us */
+    uint64_t seq;
+    uint32_t to;
+    uint16_t to_port;
+    IP_Port from;
+    uint16_t length;
+    uint8_t data[];
+} Sim_Packet;
+
+struct Sim_Network {
+    uint64_t now; /* us */
+    uint64_t rng;
+
+    uint32_t latency_ms;
+    uint32_t jitter_ms;
+    uint32_t loss_per_million;
+    uint32_t bytes_per_second;
+
+    Sim_Node **nodes;
+    uint32_t num_nodes;
+
+    /* Min heap on (time, seq) of the packets in flight. */
+    Sim_Packet **queue;
+    uint32_t queue_length;
+    uint32_t queue_size;
+    uint64_t next_seq;
+
+    Sim_Network_Stats stats;
+};
+
+static Sim_Network *clock_network;
+
+static uint64_t sim_clock(void)
+{
+    return clock_network->now / 1000;
+}
+
+/* xorshift64* */
+static uint64_t sim_random(Sim_Network *sim)
+{
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+    return sim->rng * 2685821657736338717ULL;
+}
+
+static uint64_t ip_port_key(uint32_t ip, uint16_t port)
+{
+    return ((uint64_t)ip << 16) | port;
+}
+
+static uint32_t key_hash(uint64_t key)
+{
+    key *= 0x9E3779B97F4A7C15ULL;
+    return key >> 32;
+}
+
+static int key_set_contains(const Sim_Key_Set *set, uint64_t key)
+{
+    if (set->size == 0)
+        return 0;
+
+    uint32_t i = key_hash(key) & (set->size - 1);
+
+    while (set->keys[i]) {
+        if (set->keys[i] == key)
+            return 1;
+
+        i = (i + 1) & (set->size - 1);
+    }
+
+    return 0;
+}
+
+static int key_set_add(Sim_Key_Set *set, uint64_t key);
+
+static int key_set_grow(Sim_Key_Set *set)
+{
+    Sim_Key_Set bigger;
+    bigger.size = set->size ? set->size * 2 : 16;
+    bigger.count = 0;
+    bigger.keys = calloc(bigger.size, sizeof(uint64_t));
+
+    if (bigger.keys == NULL)
+        return -1;
+
+    uint32_t i;
+
+    for (i = 0; i < set->size; ++i) {
+        if (set->keys[i])
+            key_set_add(&bigger, set->keys[i]);
+    }
+
+    free(set->keys);
+    *set = bigger;
+    return 0;
+}
+
+static int key_set_add(Sim_Key_Set *set, uint64_t key)
+{
+    if ((set->count + 1) * 2 > set->size && key_set_grow(set) == -1)
+        return -1;
+
+    uint32_t i = key_hash(key) & (set->size - 1);
+
+    while (set->keys[i]) {
+        if (set->keys[i] == key)
+            return 0;
+
+        i = (i + 1) & (set->size - 1);
+    }
+
+    set->keys[i] = key;
+    ++set->count;
+    return 0;
+}
+
+static uint16_t symmetric_port(uint64_t remote_key)
+{
+    return SIM_SYMMETRIC_PORT_FIRST + key_hash(remote_key) % SIM_SYMMETRIC_PORTS;
+}
+
+static int packet_before(const Sim_Packet *a, const Sim_Packet *b)
+{
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static int queue_push(Sim_Network *sim, Sim_Packet *packet)
+{
+    if (sim->queue_length == sim->queue_size) {
+        uint32_t size = sim->queue_size ? sim->queue_size * 2 : 1024;
+        Sim_Packet **temp = realloc(sim->queue, size * sizeof(Sim_Packet *));
+
+        if (temp == NULL)
+            return -1;
+
+        sim->queue = temp;
+        sim->queue_size = size;
+    }
+
+    uint32_t i = sim->queue_length++;
+
+    while (i > 0 && packet_before(packet, sim->queue[(i - 1) / 2])) {
+        sim->queue[i] = sim->queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    sim->queue[i] = packet;
+    return 0;
+}
+
+static Sim_Packet *queue_pop(Sim_Network *sim)
+{
+    Sim_Packet *top = sim->queue[0];
+    Sim_Packet *last = sim->queue[--sim->queue_length];
+    uint32_t i = 0;
+
+    while (1) {
+        uint32_t child = i * 2 + 1;
+
+        if (child >= sim->queue_length)
+            break;
+
+        if (child + 1 < sim->queue_length && packet_before(sim->queue[child + 1], sim->queue[child]))
+            ++child;
+
+        if (!packet_before(sim->queue[child], last))
+            break;
+
+        sim->queue[i] = sim->queue[child];
+        i = child;
+    }
+
+    sim->queue[i] = last;
+    return top;
+}
+
+/* return the ipv4 address in host byte order, 0 if ip_port isn't an ipv4 address. */
+static uint32_t ipv4_of(IP_Port ip_port)
+{
+    if (ip_port.ip.family == AF_INET)
+        return ntohl(ip_port.ip.ip4.uint32);
+
+    if (ip_port.ip.family == AF_INET6 && IPV6_IPV4_IN_V6(ip_port.ip.ip6))
+        return ntohl(ip_port.ip.ip6.uint32[3]);
+
+    return 0;
+}
+
+/* Send hook of the nodes. */
+static int sim_send(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    Sim_Node *node = object;
+    Sim_Network *sim = node->sim;
+    ++sim->stats.sent;
+
+    uint32_t ip = ipv4_of(ip_port);
+
+    if (ip < SIM_BASE_IP || ip - SIM_BASE_IP >= sim->num_nodes) {
+        ++sim->stats.unroutable;
+        return length;
+    }
+
+    uint64_t remote_key = ip_port_key(ip, ntohs(ip_port.port));
+
+    if (node->nat_type != SIM_NAT_NONE) {
+        node->has_sent = 1;
+
+        if (node->nat_type != SIM_NAT_FULL_CONE)
+            key_set_add(&node->contacted, remote_key);
+    }
+
+    if (sim->loss_per_million && sim_random(sim) % 1000000 < sim->loss_per_million) {
+        ++sim->stats.lost;
+        return length;
+    }
+
+    Sim_Packet *packet = malloc(sizeof(Sim_Packet) + length);
+
+    if (packet == NULL)
+        return -1;
+
+    uint64_t start = node->busy_until > sim->now ? node->busy_until : sim->now;
+
+    if (sim->bytes_per_second)
+        start += (uint64_t)length * 1000000 / sim->bytes_per_second;
+
+    node->busy_until = start;
+
+    uint64_t delay = (uint64_t)sim->latency_ms * 1000;
+
+    if (sim->jitter_ms)
+        delay += sim_random(sim) % ((uint64_t)sim->jitter_ms * 1000 + 1);
+
+    packet->time = start + delay;
+    packet->seq = sim->next_seq++;
+    packet->to = ip - SIM_BASE_IP;
+    packet->to_port = ntohs(ip_port.port);
+    packet->from.ip.family = AF_INET;
+    packet->from.ip.ip4.uint32 = htonl(SIM_BASE_IP + node->index);
+    packet->from.port = htons(node->nat_type == SIM_NAT_SYMMETRIC ? symmetric_port(remote_key) : SIM_PORT);
+    packet->length = length;
+    memcpy(packet->data, data, length);
+
+    if (queue_push(sim, packet) == -1) {
+        free(packet);
+        return -1;
+    }
+
+    return length;
+}
+
+/* return 1 if the NAT of node lets the packet in. */
+static int nat_allows(const Sim_Node *node, const Sim_Packet *packet)
+{
+    uint64_t remote_key = ip_port_key(ntohl(packet->from.ip.ip4.uint32), ntohs(packet->from.port));
+
+    switch (node->nat_type) {
+        case SIM_NAT_NONE:
+            return packet->to_port == SIM_PORT;
+
+        case SIM_NAT_FULL_CONE:
+            return packet->to_port == SIM_PORT && node->has_sent;
+
+        case SIM_NAT_RESTRICTED:
+            return packet->to_port == SIM_PORT && key_set_contains(&node->contacted, remote_key);
+
+        case SIM_NAT_SYMMETRIC:
+            return packet->to_port == symmetric_port(remote_key) && key_set_contains(&node->contacted, remote_key);
+    }
+
+    return 0;
+}
+
+Sim_Network *new_sim_network(uint32_t seed)
+{
+    if (clock_network)
+        return NULL;
+
+    Sim_Network *sim = calloc(1, sizeof(Sim_Network));
+
+    if (sim == NULL)
+        return NULL;
+
+    sim->now = SIM_START_TIME_US;
+    sim->rng = seed ? seed : 1;
+
+    clock_network = sim;
+    set_monotonic_time_function(sim_clock);
+    unix_time_update();
+    return sim;
+}
+
+void kill_sim_network(Sim_Network *sim)
+{
+    if (sim == NULL)
+        return;
+
+    uint32_t i;
+
+    for (i = 0; i < sim->queue_length; ++i) {
+        free(sim->queue[i]);
+    }
+
+    for (i = 0; i < sim->num_nodes; ++i) {
+        kill_networking(sim->nodes[i]->net);
+        free(sim->nodes[i]->contacted.keys);
+        free(sim->nodes[i]);
+    }
+
+    free(sim->queue);
+    free(sim->nodes);
+    free(sim);
+
+    set_monotonic_time_function(NULL);
+    clock_network = NULL;
+}
+
+void sim_network_set_latency(Sim_Network *sim, uint32_t latency_ms, uint32_t jitter_ms)
+{
+    sim->latency_ms = latency_ms;
+    sim->jitter_ms = jitter_ms;
+}
+
+void sim_network_set_loss(Sim_Network *sim, uint32_t loss_per_million)
+{
+    sim->loss_per_million = loss_per_million;
+}
+
+void sim_network_set_bandwidth(Sim_Network *sim, uint32_t bytes_per_second)
+{
+    sim->bytes_per_second = bytes_per_second;
+}
+
+Networking_Core *sim_network_add_node(Sim_Network *sim, uint8_t nat_type)
+{
+    if (sim->num_nodes == SIM_MAX_NODES || nat_type > SIM_NAT_SYMMETRIC)
+        return NULL;
+
+    Sim_Node **temp = realloc(sim->nodes, (sim->num_nodes + 1) * sizeof(Sim_Node *));
+
+    if (temp == NULL)
+        return NULL;
+
+    sim->nodes = temp;
+
+    Sim_Node *node = calloc(1, sizeof(Sim_Node));
+
+    if (node == NULL)
+        return NULL;
+
+    IP ip;
+    ip_init(&ip, 0);
+    node->net = new_networking_no_socket(ip, SIM_PORT);
+
+    if (node->net == NULL) {
+        free(node);
+        return NULL;
+    }
+
+    node->sim = sim;
+    node->index = sim->num_nodes;
+    node->nat_type = nat_type;
+    networking_set_send_hook(node->net, sim_send, node);
+
+    sim->nodes[sim->num_nodes] = node;
+    ++sim->num_nodes;
+    return node->net;
+}
+
+uint32_t sim_network_num_nodes(const Sim_Network *sim)
+{
+    return sim->num_nodes;
+}
+
+IP_Port sim_network_node_ip_port(const Sim_Network *sim, uint32_t i)
+{
+    IP_Port ip_port;
+    memset(&ip_port, 0, sizeof(ip_port));
+    ip_port.ip.family = AF_INET;
+    ip_port.ip.ip4.uint32 = htonl(SIM_BASE_IP + i);
+    ip_port.port = htons(SIM_PORT);
+    return ip_port;
+}
+
+uint32_t sim_network_node_queue_delay(const Sim_Network *sim, uint32_t i)
+{
+    const Sim_Node *node = sim->nodes[i];
+
+    if (node->busy_until <= sim->now)
+        return 0;
+
+    return (node->busy_until - sim->now) / 1000;
+}
+
+void sim_network_advance(Sim_Network *sim, uint32_t ms)
+{
+    uint64_t end = sim->now + (uint64_t)ms * 1000;
+
+    while (sim->queue_length && sim->queue[0]->time <= end) {
+        Sim_Packet *packet = queue_pop(sim);
+
+        if (packet->time > sim->now) {
+            sim->now = packet->time;
+            unix_time_update();
+        }
+
+        Sim_Node *node = sim->nodes[packet->to];
+
+        if (nat_allows(node, packet)) {
+            ++sim->stats.delivered;
+            networking_handle_packet(node->net, packet->from, packet->data, packet->length);
+        } else {
+            ++sim->stats.filtered;
+        }
+
+        free(packet);
+    }
+
+    sim->now = end;
+    unix_time_update();
+}
+
+uint64_t sim_network_time(const Sim_Network *sim)
+{
+    return sim->now / 1000;
+}
+
+void sim_network_get_stats(const Sim_Network *sim, Sim_Network_Stats *stats)
+{
+    *stats = sim->stats;
+}
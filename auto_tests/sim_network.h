@@ -0,0 +1,82 @@
+/* sim_network.h
+ *
+ * In-process simulated UDP network for tests with many nodes.
+ *
+ * Every node gets a Networking_Core without a socket whose packets are routed
+ * through an in-memory network with configurable latency, loss, bandwidth and
+ * NAT behavior. Time is simulated too: the network drives current_time_monotonic()
+ * and only moves forward with sim_network_advance().
+ */
+
+#ifndef SIM_NETWORK_H
+#define SIM_NETWORK_H
+
+#include "../toxcore/network.h"
+
+enum {
+    SIM_NAT_NONE,       /* Public address, everyone can reach the node. */
+    SIM_NAT_FULL_CONE,  /* One public port, reachable by everyone once the node sent something. */
+    SIM_NAT_RESTRICTED, /* One public port, only reachable by the ip and ports the node sent to. */
+    SIM_NAT_SYMMETRIC,  /* A public port per destination, only reachable by that destination. */
+};
+
+typedef struct Sim_Network Sim_Network;
+
+/* Create a simulated network, seed makes the loss and jitter reproducible.
+ *
+ * Only one simulated network may exist at a time since it replaces the clock
+ * of current_time_monotonic().
+ *
+ * return NULL on failure.
+ */
+Sim_Network *new_sim_network(uint32_t seed);
+
+void kill_sim_network(Sim_Network *sim);
+
+/* Packets take latency_ms plus a random value in [0, jitter_ms] to arrive. */
+void sim_network_set_latency(Sim_Network *sim, uint32_t latency_ms, uint32_t jitter_ms);
+
+/* Drop loss_per_million of a million packets at random. */
+void sim_network_set_loss(Sim_Network *sim, uint32_t loss_per_million);
+
+/* Limit the upload of every node to bytes_per_second, 0 for no limit.
+ * Packets that don't fit are queued, like in the send buffer of a real link.
+ */
+void sim_network_set_bandwidth(Sim_Network *sim, uint32_t bytes_per_second);
+
+/* Add a node behind nat_type (a SIM_NAT_* value).
+ *
+ * return its Networking_Core on success, to be passed to new_DHT() and friends.
+ * return NULL on failure.
+ */
+Networking_Core *sim_network_add_node(Sim_Network *sim, uint8_t nat_type);
+
+/* return the number of nodes in the network. */
+uint32_t sim_network_num_nodes(const Sim_Network *sim);
+
+/* return the address others can reach node number i at, if it allows them to. */
+IP_Port sim_network_node_ip_port(const Sim_Network *sim, uint32_t i);
+
+/* return how many ms a packet sent now by node number i would wait for the upload of
+ * the packets it sent before, because of the bandwidth limit.
+ */
+uint32_t sim_network_node_queue_delay(const Sim_Network *sim, uint32_t i);
+
+/* Move the simulated time forward by ms and deliver the packets that arrived by then. */
+void sim_network_advance(Sim_Network *sim, uint32_t ms);
+
+/* return the current simulated time in ms. */
+uint64_t sim_network_time(const Sim_Network *sim);
+
+/* Counters of all the packets since the network was created. */
+typedef struct {
+    uint64_t sent;
+    uint64_t delivered;
+    uint64_t lost;
+    uint64_t filtered; /* Dropped by a NAT. */
+    uint64_t unroutable;
+} Sim_Network_Stats;
+
+void sim_network_get_stats(const Sim_Network *sim, Sim_Network_Stats *stats);
+
+#endif // SIM_NETWORK_H
@@ -0,0 +1,768 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/net_crypto.h"
+#include "sim_network.h"
+
+#include "helpers.h"
+
+#define TEST_PACKET_ID 254
+
+static uint32_t received;
+static IP_Port received_from;
+
+static int handle_test_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    ++received;
+    received_from = source;
+    return 0;
+}
+
+static void send_test_packet(Networking_Core *net, IP_Port ip_port)
+{
+    uint8_t packet[100] = {TEST_PACKET_ID};
+    ck_assert_msg(sendpacket(net, ip_port, packet, sizeof(packet)) == sizeof(packet), "sendpacket failed");
+}
+
+START_TEST(test_latency_loss)
+{
+    Sim_Network *sim = new_sim_network(1);
+    ck_assert_msg(sim != NULL, "Failed to create the simulated network");
+
+    Networking_Core *a = sim_network_add_node(sim, SIM_NAT_NONE);
+    Networking_Core *b = sim_network_add_node(sim, SIM_NAT_NONE);
+    ck_assert_msg(a && b, "Failed to add nodes");
+    networking_registerhandler(b, TEST_PACKET_ID, handle_test_packet, NULL);
+
+    received = 0;
+    sim_network_set_latency(sim, 50, 0);
+    uint64_t start = sim_network_time(sim);
+    send_test_packet(a, sim_network_node_ip_port(sim, 1));
+    sim_network_advance(sim, 49);
+    ck_assert_msg(received == 0, "Packet arrived too early");
+    sim_network_advance(sim, 1);
+    ck_assert_msg(received == 1, "Packet didn't arrive in time");
+    ck_assert_msg(sim_network_time(sim) == start + 50, "Wrong time: %llu", (unsigned long long)sim_network_time(sim));
+    ck_assert_msg(current_time_monotonic() == start + 50, "current_time_monotonic() doesn't follow the simulation");
+
+    IP_Port a_ip_port = sim_network_node_ip_port(sim, 0);
+    ck_assert_msg(ipport_equal(&received_from, &a_ip_port), "Packet came from the wrong address");
+
+    /* 1000 bytes per second: 100 byte packets are sent 100ms apart. */
+    received = 0;
+    sim_network_set_bandwidth(sim, 1000);
+    send_test_packet(a, sim_network_node_ip_port(sim, 1));
+    send_test_packet(a, sim_network_node_ip_port(sim, 1));
+    sim_network_advance(sim, 150);
+    ck_assert_msg(received == 1, "Bandwidth limit not applied: %u", received);
+    sim_network_advance(sim, 100);
+    ck_assert_msg(received == 2, "Second packet lost: %u", received);
+    sim_network_set_bandwidth(sim, 0);
+
+    received = 0;
+    sim_network_set_loss(sim, 500000);
+    unsigned int i;
+
+    for (i = 0; i < 1000; ++i) {
+        send_test_packet(a, sim_network_node_ip_port(sim, 1));
+    }
+
+    sim_network_advance(sim, 100);
+    ck_assert_msg(received > 400 && received < 600, "Bad loss rate: %u of 1000 received", received);
+
+    Sim_Network_Stats stats;
+    sim_network_get_stats(sim, &stats);
+    ck_assert_msg(stats.sent == 1003, "Wrong number of packets sent: %llu", (unsigned long long)stats.sent);
+    ck_assert_msg(stats.delivered + stats.lost == stats.sent, "Packets went missing");
+
+    kill_sim_network(sim);
+}
+END_TEST
+
+START_TEST(test_nat)
+{
+    Sim_Network *sim = new_sim_network(2);
+    ck_assert_msg(sim != NULL, "Failed to create the simulated network");
+
+    Networking_Core *pub = sim_network_add_node(sim, SIM_NAT_NONE);
+    Networking_Core *cone = sim_network_add_node(sim, SIM_NAT_FULL_CONE);
+    Networking_Core *restricted = sim_network_add_node(sim, SIM_NAT_RESTRICTED);
+    Networking_Core *symmetric = sim_network_add_node(sim, SIM_NAT_SYMMETRIC);
+    Networking_Core *other = sim_network_add_node(sim, SIM_NAT_NONE);
+    ck_assert_msg(pub && cone && restricted && symmetric && other, "Failed to add nodes");
+
+    networking_registerhandler(pub, TEST_PACKET_ID, handle_test_packet, NULL);
+    networking_registerhandler(cone, TEST_PACKET_ID, handle_test_packet, NULL);
+    networking_registerhandler(restricted, TEST_PACKET_ID, handle_test_packet, NULL);
+    networking_registerhandler(symmetric, TEST_PACKET_ID, handle_test_packet, NULL);
+
+    received = 0;
+    uint32_t i;
+
+    for (i = 1; i < 4; ++i) {
+        send_test_packet(pub, sim_network_node_ip_port(sim, i));
+    }
+
+    sim_network_advance(sim, 10);
+    ck_assert_msg(received == 0, "NATs let unsolicited packets in");
+
+    /* Every node behind a NAT talks to pub. */
+    send_test_packet(cone, sim_network_node_ip_port(sim, 0));
+    sim_network_advance(sim, 10);
+    ck_assert_msg(received == 1, "Packet from the full cone node lost");
+    IP_Port cone_ip_port = received_from;
+
+    send_test_packet(restricted, sim_network_node_ip_port(sim, 0));
+    sim_network_advance(sim, 10);
+    ck_assert_msg(received == 2, "Packet from the restricted node lost");
+    IP_Port restricted_ip_port = received_from;
+
+    send_test_packet(symmetric, sim_network_node_ip_port(sim, 0));
+    sim_network_advance(sim, 10);
+    ck_assert_msg(received == 3, "Packet from the symmetric node lost");
+    IP_Port symmetric_ip_port = received_from;
+    IP_Port symmetric_default = sim_network_node_ip_port(sim, 3);
+    ck_assert_msg(symmetric_ip_port.port != symmetric_default.port, "Symmetric NAT didn't map a new port");
+
+    /* pub can now reach all of them at the address it saw. */
+    received = 0;
+    send_test_packet(pub, cone_ip_port);
+    send_test_packet(pub, restricted_ip_port);
+    send_test_packet(pub, symmetric_ip_port);
+    sim_network_advance(sim, 10);
+    ck_assert_msg(received == 3, "Replies didn't go through the NATs: %u", received);
+
+    /* But only the full cone lets other in. */
+    received = 0;
+    send_test_packet(other, cone_ip_port);
+    send_test_packet(other, restricted_ip_port);
+    send_test_packet(other, symmetric_ip_port);
+    sim_network_advance(sim, 10);
+    ck_assert_msg(received == 1, "Wrong number of packets through the NATs: %u", received);
+
+    /* And the symmetric NAT only accepts pub on the port it mapped for it. */
+    send_test_packet(pub, symmetric_default);
+    sim_network_advance(sim, 10);
+    ck_assert_msg(received == 1, "Symmetric NAT accepted a packet on the wrong port");
+
+    Sim_Network_Stats stats;
+    sim_network_get_stats(sim, &stats);
+    ck_assert_msg(stats.filtered == 6, "Wrong number of filtered packets: %llu", (unsigned long long)stats.filtered);
+
+    kill_sim_network(sim);
+}
+END_TEST
+
+/* Build with -DSIM_DHT_NODES=10000 for scaling runs. */
+#ifndef SIM_DHT_NODES
+#define SIM_DHT_NODES 300
+#endif
+
+#define SIM_DHT_FRIENDS 100
+#define SIM_DHT_BOOTSTRAP_NODES 8
+#define SIM_DHT_BOOTSTRAP_INTERVAL 5000
+#define SIM_DHT_STEP 50
+#define SIM_DHT_MAX_TIME (5 * 60 * 1000)
+
+static long max_rss_kb(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+    return usage.ru_maxrss;
+}
+
+START_TEST(test_DHT_scale)
+{
+    long rss_before = max_rss_kb();
+
+    Sim_Network *sim = new_sim_network(3);
+    ck_assert_msg(sim != NULL, "Failed to create the simulated network");
+    sim_network_set_latency(sim, 20, 80);
+    sim_network_set_loss(sim, 10000);
+    sim_network_set_bandwidth(sim, 128 * 1024);
+
+    DHT **dhts = calloc(SIM_DHT_NODES, sizeof(DHT *));
+    ck_assert_msg(dhts != NULL, "calloc failed");
+
+    uint32_t i;
+
+    /* Mostly public nodes, like the ones that stay in the DHT, the rest behind NATs. */
+    for (i = 0; i < SIM_DHT_NODES; ++i) {
+        uint8_t nat_type = SIM_NAT_NONE;
+
+        if (i >= SIM_DHT_BOOTSTRAP_NODES) {
+            if (i % 10 == 7)
+                nat_type = SIM_NAT_FULL_CONE;
+            else if (i % 10 == 8)
+                nat_type = SIM_NAT_RESTRICTED;
+            else if (i % 10 == 9)
+                nat_type = SIM_NAT_SYMMETRIC;
+        }
+
+        Networking_Core *net = sim_network_add_node(sim, nat_type);
+        ck_assert_msg(net != NULL, "Failed to add node %u", i);
+        dhts[i] = new_DHT(net);
+        ck_assert_msg(dhts[i] != NULL, "Failed to create DHT %u", i);
+    }
+
+    /* Any node looks for a public one. */
+    struct {
+        uint32_t searcher;
+        uint32_t searched;
+    } pairs[SIM_DHT_FRIENDS];
+
+    for (i = 0; i < SIM_DHT_FRIENDS; ++i) {
+        pairs[i].searcher = rand() % SIM_DHT_NODES;
+
+        do {
+            pairs[i].searched = rand() % SIM_DHT_NODES;
+        } while (pairs[i].searched == pairs[i].searcher || pairs[i].searched % 10 >= 7);
+
+        /* Friends look for each other, like Messenger does. */
+        ck_assert_msg(DHT_addfriend(dhts[pairs[i].searcher], dhts[pairs[i].searched]->self_public_key, NULL, NULL, 0,
+                                    NULL) == 0, "Failed to add friend");
+        ck_assert_msg(DHT_addfriend(dhts[pairs[i].searched], dhts[pairs[i].searcher]->self_public_key, NULL, NULL, 0,
+                                    NULL) == 0, "Failed to add friend");
+    }
+
+    uint64_t start = sim_network_time(sim);
+    uint64_t connected_time = 0, found_time = 0;
+    uint32_t found = 0;
+
+    uint64_t last_bootstrap = 0;
+
+    while (sim_network_time(sim) - start < SIM_DHT_MAX_TIME) {
+        /* Like clients do, bootstrap again while not connected since packets get lost. */
+        if (last_bootstrap + SIM_DHT_BOOTSTRAP_INTERVAL <= sim_network_time(sim)) {
+            for (i = 0; i < SIM_DHT_NODES; ++i) {
+                if (DHT_isconnected(dhts[i]))
+                    continue;
+
+                uint32_t j = (i + last_bootstrap / SIM_DHT_BOOTSTRAP_INTERVAL) % SIM_DHT_BOOTSTRAP_NODES;
+
+                if (j == i)
+                    j = (i + 1) % SIM_DHT_BOOTSTRAP_NODES;
+
+                DHT_bootstrap(dhts[i], sim_network_node_ip_port(sim, j), dhts[j]->self_public_key);
+            }
+
+            last_bootstrap = sim_network_time(sim);
+        }
+
+        for (i = 0; i < SIM_DHT_NODES; ++i) {
+            do_DHT(dhts[i]);
+        }
+
+        sim_network_advance(sim, SIM_DHT_STEP);
+
+        if (!connected_time) {
+            for (i = 0; i < SIM_DHT_NODES; ++i) {
+                if (!DHT_isconnected(dhts[i]))
+                    break;
+            }
+
+            if (i == SIM_DHT_NODES)
+                connected_time = sim_network_time(sim) - start;
+        }
+
+        IP_Port ip_port;
+        found = 0;
+
+        for (i = 0; i < SIM_DHT_FRIENDS; ++i) {
+            if (DHT_getfriendip(dhts[pairs[i].searcher], dhts[pairs[i].searched]->self_public_key, &ip_port) == 1)
+                ++found;
+        }
+
+        if (!found_time && found == SIM_DHT_FRIENDS)
+            found_time = sim_network_time(sim) - start;
+
+        if (connected_time && found_time)
+            break;
+    }
+
+    uint64_t get_nodes_sent = 0;
+
+    for (i = 0; i < SIM_DHT_NODES; ++i) {
+        Net_Packet_Stats packet_stats;
+        networking_get_packet_stats(dhts[i]->net, NET_PACKET_GET_NODES, &packet_stats);
+        get_nodes_sent += packet_stats.packets_sent;
+    }
+
+    Sim_Network_Stats stats;
+    sim_network_get_stats(sim, &stats);
+    printf("%u nodes: all connected after %llums, %u of %u friends found", SIM_DHT_NODES,
+           (unsigned long long)connected_time, found, SIM_DHT_FRIENDS);
+
+    if (found_time)
+        printf(", all after %llums", (unsigned long long)found_time);
+
+    printf("\n");
+    printf("%llu packets sent, %llu lost, %llu filtered by NATs, %llu get nodes requests per node\n",
+           (unsigned long long)stats.sent, (unsigned long long)stats.lost, (unsigned long long)stats.filtered,
+           (unsigned long long)(get_nodes_sent / SIM_DHT_NODES));
+    printf("about %ld bytes of memory per node\n", (max_rss_kb() - rss_before) * 1024 / SIM_DHT_NODES);
+
+    /* Friend lookups are only reported: friend client lists get sorted only when one of their
+     * nodes times out, so some searches get stuck on nodes that aren't the closest ones.
+     */
+    ck_assert_msg(connected_time, "Not all %u nodes connected to the DHT", SIM_DHT_NODES);
+    ck_assert_msg(found, "No friend was found");
+
+    for (i = 0; i < SIM_DHT_NODES; ++i) {
+        kill_DHT(dhts[i]);
+    }
+
+    free(dhts);
+    kill_sim_network(sim);
+}
+END_TEST
+
+/* A link of SIM_CC_BANDWIDTH bytes per second with SIM_CC_RTT ms of round trip time. */
+#define SIM_CC_BANDWIDTH 1000000
+#define SIM_CC_RTT 200
+#define SIM_CC_STEP 5
+#define SIM_CC_DURATION 30000
+/* Throughput and queueing delay are measured after the connection had SIM_CC_RAMP_UP ms to get up to speed. */
+#define SIM_CC_RAMP_UP 10000
+
+typedef struct {
+    double throughput; /* Bytes per second received. */
+    double avg_queue_delay; /* ms */
+    uint32_t max_queue_delay; /* ms */
+    uint64_t time_to_half; /* ms until the sender reached half the bandwidth */
+} Sim_CC_Result;
+
+static uint64_t sim_cc_received;
+
+/* Make the connections only use PACKET_ID_REQUEST request packets, like older peers. */
+static _Bool sim_legacy_requests;
+
+static int sim_crypto_new_connection(void *object, New_Connection *n_c)
+{
+    Net_Crypto *nc = object;
+    int id = accept_crypto_connection(nc, n_c);
+    ck_assert_msg(id != -1, "Failed to accept the connection");
+
+    if (sim_legacy_requests)
+        nc->crypto_connections[id].request_ranges_probes = CRYPTO_REQUEST_RANGES_PROBES;
+
+    return 0;
+}
+
+/* Create two Net_Crypto on new nodes of sim and connect the first to the second,
+ * which gets connection 0.
+ *
+ * return the id of the connection on the first.
+ */
+static int sim_crypto_connect(Sim_Network *sim, Net_Crypto *ncs[2], uint8_t algorithm)
+{
+    TCP_Proxy_Info proxy_info = {{{0}}};
+    unsigned int i;
+
+    for (i = 0; i < 2; ++i) {
+        Networking_Core *net = sim_network_add_node(sim, SIM_NAT_NONE);
+        ck_assert_msg(net != NULL, "Failed to add node");
+        DHT *dht = new_DHT(net);
+        ck_assert_msg(dht != NULL, "Failed to create DHT");
+        ncs[i] = new_net_crypto(dht, &proxy_info);
+        ck_assert_msg(ncs[i] != NULL, "Failed to create Net_Crypto");
+        ck_assert_msg(net_crypto_set_congestion_control(ncs[i], algorithm) == 0, "Failed to set the algorithm");
+    }
+
+    new_connection_handler(ncs[1], sim_crypto_new_connection, ncs[1]);
+    int id = new_crypto_connection(ncs[0], ncs[1]->self_public_key, ncs[1]->dht->self_public_key);
+    ck_assert_msg(id != -1, "Failed to create the connection");
+
+    if (sim_legacy_requests)
+        ncs[0]->crypto_connections[id].request_ranges_probes = CRYPTO_REQUEST_RANGES_PROBES;
+
+    set_direct_ip_port(ncs[0], id, sim_network_node_ip_port(sim, 1), 1);
+    uint64_t start = sim_network_time(sim);
+
+    while (crypto_connection_status(ncs[0], id, NULL, NULL) != CRYPTO_CONN_ESTABLISHED
+            || crypto_connection_status(ncs[1], 0, NULL, NULL) != CRYPTO_CONN_ESTABLISHED) {
+        ck_assert_msg(sim_network_time(sim) - start < 10000, "Connection not established");
+        do_net_crypto(ncs[0]);
+        do_net_crypto(ncs[1]);
+        sim_network_advance(sim, SIM_CC_STEP);
+    }
+
+    return id;
+}
+
+static void sim_crypto_kill(Net_Crypto *ncs[2])
+{
+    unsigned int i;
+
+    for (i = 0; i < 2; ++i) {
+        DHT *dht = ncs[i]->dht;
+        kill_net_crypto(ncs[i]);
+        kill_DHT(dht);
+    }
+}
+
+static int sim_cc_data(void *object, int id, uint8_t *data, uint16_t length)
+{
+    sim_cc_received += length;
+    return 0;
+}
+
+static void sim_cc_transfer(uint8_t algorithm, Sim_CC_Result *result)
+{
+    Sim_Network *sim = new_sim_network(4);
+    ck_assert_msg(sim != NULL, "Failed to create the simulated network");
+    sim_network_set_latency(sim, SIM_CC_RTT / 2, 0);
+
+    Net_Crypto *ncs[2];
+    int id = sim_crypto_connect(sim, ncs, algorithm);
+    connection_data_handler(ncs[1], 0, sim_cc_data, NULL, 0);
+    sim_network_set_bandwidth(sim, SIM_CC_BANDWIDTH);
+
+    uint8_t data[MAX_CRYPTO_DATA_SIZE] = {160};
+    uint64_t start = sim_network_time(sim);
+    uint64_t received_at_ramp_up = 0, queue_delay_sum = 0, num_samples = 0;
+    memset(result, 0, sizeof(Sim_CC_Result));
+    sim_cc_received = 0;
+
+    while (sim_network_time(sim) - start < SIM_CC_DURATION) {
+        while (write_cryptpacket(ncs[0], id, data, sizeof(data), 1) != -1);
+
+        do_net_crypto(ncs[0]);
+        do_net_crypto(ncs[1]);
+        sim_network_advance(sim, SIM_CC_STEP);
+
+        uint64_t elapsed = sim_network_time(sim) - start;
+
+        if (!result->time_to_half && ncs[0]->crypto_connections[id].packet_send_rate * MAX_CRYPTO_PACKET_SIZE >
+                SIM_CC_BANDWIDTH / 2)
+            result->time_to_half = elapsed;
+
+        if (elapsed < SIM_CC_RAMP_UP) {
+            received_at_ramp_up = sim_cc_received;
+            continue;
+        }
+
+        uint32_t queue_delay = sim_network_node_queue_delay(sim, 0);
+        queue_delay_sum += queue_delay;
+        ++num_samples;
+
+        if (queue_delay > result->max_queue_delay)
+            result->max_queue_delay = queue_delay;
+    }
+
+    result->throughput = (double)(sim_cc_received - received_at_ramp_up) * 1000.0 / (SIM_CC_DURATION - SIM_CC_RAMP_UP);
+    result->avg_queue_delay = (double)queue_delay_sum / num_samples;
+
+    sim_crypto_kill(ncs);
+    kill_sim_network(sim);
+}
+
+START_TEST(test_congestion_control)
+{
+    static const char *const names[CONGESTION_CONTROL_NUM_ALGORITHMS] = {"legacy", "LEDBAT"};
+    Sim_CC_Result results[CONGESTION_CONTROL_NUM_ALGORITHMS];
+    uint8_t i;
+
+    for (i = 0; i < CONGESTION_CONTROL_NUM_ALGORITHMS; ++i) {
+        sim_cc_transfer(i, &results[i]);
+        printf("%s: %.0f bytes/s of %u, %.1fms average and %ums max queueing delay, half the bandwidth after %llums\n",
+               names[i], results[i].throughput, SIM_CC_BANDWIDTH, results[i].avg_queue_delay, results[i].max_queue_delay,
+               (unsigned long long)results[i].time_to_half);
+    }
+
+    /* LEDBAT must use the link about as well as the legacy algorithm without filling its queue. */
+    ck_assert_msg(results[CONGESTION_CONTROL_LEDBAT].throughput > SIM_CC_BANDWIDTH / 2, "LEDBAT too slow");
+    ck_assert_msg(results[CONGESTION_CONTROL_LEDBAT].avg_queue_delay < 200, "LEDBAT fills the queue");
+}
+END_TEST
+
+/* SIM_SACK_PACKETS packets numbered in order are sent over a link losing SIM_SACK_LOSS per million packets. */
+#define SIM_SACK_PACKETS 10000
+#define SIM_SACK_LOSS 50000
+
+static uint32_t sim_sack_next;
+
+static int sim_sack_data(void *object, int id, uint8_t *data, uint16_t length)
+{
+    uint32_t number;
+    memcpy(&number, data + 1, sizeof(number));
+    ck_assert_msg(number == sim_sack_next, "Received packet %u instead of %u", number, sim_sack_next);
+    ++sim_sack_next;
+    return 0;
+}
+
+/* return the time in ms it took to deliver all the packets. */
+static uint64_t sim_sack_transfer(_Bool legacy_requests)
+{
+    Sim_Network *sim = new_sim_network(5);
+    ck_assert_msg(sim != NULL, "Failed to create the simulated network");
+    sim_network_set_latency(sim, SIM_CC_RTT / 2, 0);
+
+    sim_legacy_requests = legacy_requests;
+    Net_Crypto *ncs[2];
+    int id = sim_crypto_connect(sim, ncs, CONGESTION_CONTROL_LEDBAT);
+    sim_legacy_requests = 0;
+
+    connection_data_handler(ncs[1], 0, sim_sack_data, NULL, 0);
+    sim_network_set_bandwidth(sim, SIM_CC_BANDWIDTH);
+    sim_network_set_loss(sim, SIM_SACK_LOSS);
+
+    uint8_t data[MAX_CRYPTO_DATA_SIZE] = {160};
+    uint64_t start = sim_network_time(sim);
+    uint32_t sent = 0;
+    sim_sack_next = 0;
+
+    while (sim_sack_next != SIM_SACK_PACKETS) {
+        ck_assert_msg(sim_network_time(sim) - start < 300000, "Only %u packets received", sim_sack_next);
+
+        while (sent != SIM_SACK_PACKETS) {
+            memcpy(data + 1, &sent, sizeof(sent));
+
+            if (write_cryptpacket(ncs[0], id, data, sizeof(data), 1) == -1)
+                break;
+
+            ++sent;
+        }
+
+        do_net_crypto(ncs[0]);
+        do_net_crypto(ncs[1]);
+        sim_network_advance(sim, SIM_CC_STEP);
+    }
+
+    ck_assert_msg(ncs[0]->crypto_connections[id].request_ranges == !legacy_requests
+                  && ncs[1]->crypto_connections[0].request_ranges == !legacy_requests, "Wrong request packets used");
+
+    uint64_t time = sim_network_time(sim) - start;
+    sim_crypto_kill(ncs);
+    kill_sim_network(sim);
+    return time;
+}
+
+START_TEST(test_request_ranges)
+{
+    uint64_t legacy_time = sim_sack_transfer(1);
+    uint64_t ranges_time = sim_sack_transfer(0);
+
+    printf("%u packets with %u%% loss: %llums with PACKET_ID_REQUEST, %llums with PACKET_ID_REQUEST_RANGES\n",
+           SIM_SACK_PACKETS, SIM_SACK_LOSS / 10000, (unsigned long long)legacy_time, (unsigned long long)ranges_time);
+    ck_assert_msg(ranges_time <= legacy_time + legacy_time / 10, "Range requests recover slower");
+}
+END_TEST
+
+/* SIM_QUEUE_THREADS threads each queue SIM_QUEUE_PACKETS numbered lossless packets and one lossy packet. */
+#define SIM_QUEUE_THREADS 4
+#define SIM_QUEUE_PACKETS 5000
+
+typedef struct {
+    Net_Crypto *nc;
+    int id;
+    uint8_t thread;
+} Sim_Queue_Producer;
+
+static uint32_t sim_queue_next[SIM_QUEUE_THREADS];
+static uint32_t sim_queue_received, sim_queue_lossy_received;
+
+static void *sim_queue_producer(void *arg)
+{
+    Sim_Queue_Producer *producer = arg;
+    uint8_t data[MAX_CRYPTO_DATA_SIZE] = {160, producer->thread};
+    uint32_t i;
+
+    for (i = 0; i < SIM_QUEUE_PACKETS; ++i) {
+        memcpy(data + 2, &i, sizeof(i));
+
+        /* Full queue, wait for do_net_crypto() to send some. */
+        while (queue_cryptpacket(producer->nc, producer->id, data, sizeof(data), 1) == -1) {
+            sched_yield();
+        }
+    }
+
+    data[0] = PACKET_ID_LOSSY_RANGE_START;
+
+    while (queue_cryptpacket(producer->nc, producer->id, data, 2, 0) == -1) {
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+static int sim_queue_data(void *object, int id, uint8_t *data, uint16_t length)
+{
+    uint32_t number;
+    memcpy(&number, data + 2, sizeof(number));
+    ck_assert_msg(data[1] < SIM_QUEUE_THREADS, "Wrong thread %u", data[1]);
+    ck_assert_msg(number == sim_queue_next[data[1]], "Received packet %u of thread %u instead of %u", number, data[1],
+                  sim_queue_next[data[1]]);
+    ++sim_queue_next[data[1]];
+    ++sim_queue_received;
+    return 0;
+}
+
+static int sim_queue_lossy_data(void *object, int id, const uint8_t *data, uint16_t length)
+{
+    ++sim_queue_lossy_received;
+    return 0;
+}
+
+START_TEST(test_queue_cryptpacket)
+{
+    Sim_Network *sim = new_sim_network(6);
+    ck_assert_msg(sim != NULL, "Failed to create the simulated network");
+    sim_network_set_latency(sim, SIM_CC_RTT / 2, 0);
+
+    Net_Crypto *ncs[2];
+    int id = sim_crypto_connect(sim, ncs, CONGESTION_CONTROL_LEDBAT);
+    connection_data_handler(ncs[1], 0, sim_queue_data, NULL, 0);
+    connection_lossy_data_handler(ncs[1], 0, sim_queue_lossy_data, NULL, 0);
+    sim_network_set_bandwidth(sim, SIM_CC_BANDWIDTH);
+
+    uint8_t data[MAX_CRYPTO_DATA_SIZE] = {160};
+    ck_assert_msg(queue_cryptpacket(ncs[0], id + 1, data, sizeof(data), 1) == -1, "Queued on an invalid connection");
+    data[0] = PACKET_ID_REQUEST;
+    ck_assert_msg(queue_cryptpacket(ncs[0], id, data, sizeof(data), 1) == -1, "Queued a reserved packet");
+
+    /* Producers run while the network loop sends. */
+    Sim_Queue_Producer producers[SIM_QUEUE_THREADS];
+    pthread_t threads[SIM_QUEUE_THREADS];
+    unsigned int i;
+
+    for (i = 0; i < SIM_QUEUE_THREADS; ++i) {
+        producers[i].nc = ncs[0];
+        producers[i].id = id;
+        producers[i].thread = i;
+        ck_assert_msg(pthread_create(&threads[i], NULL, sim_queue_producer, &producers[i]) == 0,
+                      "Failed to start a thread");
+    }
+
+    uint64_t start = sim_network_time(sim);
+
+    while (sim_queue_received != SIM_QUEUE_THREADS * SIM_QUEUE_PACKETS
+            || sim_queue_lossy_received != SIM_QUEUE_THREADS) {
+        ck_assert_msg(sim_network_time(sim) - start < 300000, "Only %u packets received", sim_queue_received);
+        do_net_crypto(ncs[0]);
+        do_net_crypto(ncs[1]);
+        sim_network_advance(sim, SIM_CC_STEP);
+    }
+
+    for (i = 0; i < SIM_QUEUE_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    ck_assert_msg(ncs[0]->crypto_connections[id].send_queue->length == 0, "Packets left in the queue");
+
+    sim_crypto_kill(ncs);
+    kill_sim_network(sim);
+}
+END_TEST
+
+#define SIM_IDLE_TIME 5000
+
+static uint32_t sim_idle_received;
+
+static int sim_idle_data(void *object, int id, uint8_t *data, uint16_t length)
+{
+    ++sim_idle_received;
+    return 0;
+}
+
+static void sim_idle_run(Sim_Network *sim, Net_Crypto *ncs[2], uint64_t time)
+{
+    uint64_t start = sim_network_time(sim);
+
+    while (sim_network_time(sim) - start < time) {
+        do_net_crypto(ncs[0]);
+        do_net_crypto(ncs[1]);
+        sim_network_advance(sim, SIM_CC_STEP);
+    }
+}
+
+/* return 1 if the connection is only scheduled to run for its next request packet. */
+static _Bool sim_idle_scheduled(const Net_Crypto *nc, int id)
+{
+    uint64_t next_time;
+
+    if (event_heap_next_time(&nc->schedule, &next_time) != 0)
+        return 0;
+
+    return next_time > nc->crypto_connections[id].last_request_packet_sent + CRYPTO_SEND_PACKET_INTERVAL;
+}
+
+START_TEST(test_idle_connection)
+{
+    Sim_Network *sim = new_sim_network(4);
+    ck_assert_msg(sim != NULL, "Failed to create the simulated network");
+    sim_network_set_latency(sim, SIM_CC_RTT / 2, 0);
+
+    Net_Crypto *ncs[2];
+    int id = sim_crypto_connect(sim, ncs, CONGESTION_CONTROL_LEGACY);
+    connection_data_handler(ncs[1], 0, sim_idle_data, NULL, 0);
+
+    sim_idle_run(sim, ncs, SIM_IDLE_TIME);
+    ck_assert_msg(sim_idle_scheduled(ncs[0], id) && sim_idle_scheduled(ncs[1], 0),
+                  "Idle connections are run before their next request packet");
+
+    /* Packets written to an idle connection go out and wake it up until they are acknowledged. */
+    uint8_t data[MAX_CRYPTO_DATA_SIZE] = {160};
+    ck_assert_msg(write_cryptpacket(ncs[0], id, data, sizeof(data), 1) != -1, "Failed to write a packet");
+    do_net_crypto(ncs[0]);
+    ck_assert_msg(!sim_idle_scheduled(ncs[0], id), "Connection with a packet in flight not woken up");
+    sim_idle_run(sim, ncs, SIM_CC_RTT * 2);
+    ck_assert_msg(sim_idle_received == 1, "Packet not received");
+    Packets_Array *send_array = &ncs[0]->crypto_connections[id].send_array;
+    ck_assert_msg(send_array->buffer_start == send_array->buffer_end, "Packet not acknowledged");
+
+    /* Same for packets queued from another thread. */
+    ck_assert_msg(queue_cryptpacket(ncs[0], id, data, sizeof(data), 1) == 0, "Failed to queue a packet");
+    sim_idle_run(sim, ncs, SIM_CC_RTT * 2);
+    ck_assert_msg(sim_idle_received == 2, "Queued packet not received");
+
+    sim_idle_run(sim, ncs, SIM_IDLE_TIME);
+    ck_assert_msg(sim_idle_scheduled(ncs[0], id) && sim_idle_scheduled(ncs[1], 0),
+                  "Connections didn't go back to idle");
+
+    sim_crypto_kill(ncs);
+    kill_sim_network(sim);
+}
+END_TEST
+
+Suite *sim_network_suite(void)
+{
+    Suite *s = suite_create("Simulated network");
+
+    DEFTESTCASE(latency_loss);
+    DEFTESTCASE(nat);
+    DEFTESTCASE_SLOW(DHT_scale, 300);
+    DEFTESTCASE_SLOW(congestion_control, 120);
+    DEFTESTCASE_SLOW(request_ranges, 120);
+    DEFTESTCASE_SLOW(queue_cryptpacket, 120);
+    DEFTESTCASE_SLOW(idle_connection, 60);
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand(1);
+
+    Suite *sim_network = sim_network_suite();
+    SRunner *test_runner = srunner_create(sim_network);
+
+    int number_failed = 0;
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
@@ -391,6 +391,77 @@ START_TEST(test_one)
 }
 END_TEST
 
+START_TEST(test_wait)
+{
+    Tox *tox1 = tox_new(0, 0);
+    Tox *tox2 = tox_new(0, 0);
+    ck_assert_msg(tox1 && tox2, "Failed to create 2 tox instances");
+
+    ck_assert_msg(!tox_wait(tox1, 500), "tox_wait returned true with no data to read.");
+
+    TOX_ERR_GET_PORT port_error;
+    uint16_t port = tox_self_get_udp_port(tox1, &port_error);
+    ck_assert_msg(port_error == TOX_ERR_GET_PORT_OK, "Failed to get the udp port.");
+
+    uint8_t dpk[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_dht_id(tox1, dpk);
+    ck_assert_msg(tox_bootstrap(tox2, "::1", port, dpk, 0), "Bootstrap error");
+
+    uint64_t start = time(NULL);
+    ck_assert_msg(tox_wait(tox1, 10000), "tox_wait did not return true when a packet arrived.");
+    ck_assert_msg(time(NULL) - start < 5, "tox_wait took too long to notice a packet.");
+
+    tox_kill(tox1);
+    tox_kill(tox2);
+}
+END_TEST
+
+START_TEST(test_packet_stats)
+{
+    Tox *tox1 = tox_new(0, 0);
+    Tox *tox2 = tox_new(0, 0);
+    ck_assert_msg(tox1 && tox2, "Failed to create 2 tox instances");
+
+    struct Tox_Packet_Stats stats;
+    tox_self_get_packet_stats(tox1, 2, &stats);
+    ck_assert_msg(stats.packets_received == 0 && stats.packets_sent == 0, "New instance has non zero stats.");
+
+    uint8_t dpk[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_dht_id(tox1, dpk);
+    ck_assert_msg(tox_bootstrap(tox2, "::1", tox_self_get_udp_port(tox1, 0), dpk, 0), "Bootstrap error");
+
+    /* tox_bootstrap sends a get nodes request (packet id 2). */
+    tox_self_get_packet_stats(tox2, 2, &stats);
+    ck_assert_msg(stats.packets_sent == 1 && stats.bytes_sent > 0, "Sent packet wasn't counted.");
+
+    unsigned int tries;
+
+    for (tries = 0; tries < 20; ++tries) {
+        tox_wait(tox1, 1000);
+        tox_iterate(tox1);
+        tox_self_get_packet_stats(tox1, 2, &stats);
+
+        if (stats.packets_received)
+            break;
+    }
+
+    ck_assert_msg(tries < 20, "Sent packet was never received.");
+    ck_assert_msg(stats.packets_received == 1 && stats.bytes_received > 0, "Received packet wasn't counted.");
+
+    uint64_t handled = 0;
+    unsigned int i;
+
+    for (i = 0; i < TOX_PACKET_STATS_HISTOGRAM_SIZE; ++i) {
+        handled += stats.handler_time[i];
+    }
+
+    ck_assert_msg(handled + stats.packets_dropped == stats.packets_received, "Handler time histogram is wrong.");
+
+    tox_kill(tox1);
+    tox_kill(tox2);
+}
+END_TEST
+
 START_TEST(test_few_clients)
 {
     long long unsigned int con_time, cur_time = time(NULL);
@@ -480,6 +551,28 @@ START_TEST(test_few_clients)
 
     printf("tox clients messaging succeeded\n");
 
+    {
+        struct Tox_Transport_Stats stats;
+        TOX_ERR_FRIEND_QUERY error;
+        ck_assert_msg(tox_friend_get_transport_stats(tox2, 0, &stats, &error), "Failed to get transport stats");
+        ck_assert_msg(error == TOX_ERR_FRIEND_QUERY_OK, "wrong error");
+        ck_assert_msg(stats.connection == TOX_CONNECTION_UDP, "Wrong connection %u", stats.connection);
+        /* Before a round trip is measured rtt is 1000. */
+        ck_assert_msg(stats.rtt < 1000, "Round trip time not measured");
+        ck_assert_msg(stats.send_rate > 0, "No send rate");
+        ck_assert_msg(stats.packets_sent > 0 && stats.packets_received > 0, "Packets not counted");
+
+        struct Tox_Self_Transport_Stats self_stats;
+        tox_self_get_transport_stats(tox2, &self_stats);
+        ck_assert_msg(self_stats.friends_udp == 1 && self_stats.friends_tcp == 0, "Wrong number of friends");
+        ck_assert_msg(self_stats.packets_sent == stats.packets_sent, "Totals don't add up");
+
+        ck_assert_msg(!tox_friend_get_transport_stats(tox2, 1, &stats, &error), "Got stats of an invalid friend");
+        ck_assert_msg(error == TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND, "wrong error");
+        ck_assert_msg(!tox_friend_get_transport_stats(tox2, 0, NULL, &error), "Got stats in NULL");
+        ck_assert_msg(error == TOX_ERR_FRIEND_QUERY_NULL, "wrong error");
+    }
+
     unsigned int save_size1 = tox_get_savedata_size(tox2);
     ck_assert_msg(save_size1 != 0 && save_size1 < 4096, "save is invalid size %u", save_size1);
     printf("%u\n", save_size1);
@@ -1276,6 +1369,8 @@ Suite *tox_suite(void)
     Suite *s = suite_create("Tox");
 
     DEFTESTCASE(one);
+    DEFTESTCASE(wait);
+    DEFTESTCASE(packet_stats);
     DEFTESTCASE_SLOW(few_clients, 80);
     DEFTESTCASE_SLOW(many_clients, 80);
     DEFTESTCASE_SLOW(many_clients_tcp, 20);
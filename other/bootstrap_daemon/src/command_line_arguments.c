@@ -44,6 +44,8 @@ void print_help()
               "Usage: tox-bootstrapd [OPTION]... --config=FILE_PATH\n"
               "\n"
               "Options:\n"
+              "  --capture=FILE_PATH    Record the received UDP packets into FILE_PATH,\n"
+              "                         to be replayed with packet_replay.\n"
               "  --config=FILE_PATH     Specify path to the config file.\n"
               "                         This is a required option.\n"
               "                         Set FILE_PATH to a path to an empty file in order to\n"
@@ -61,7 +63,7 @@ void print_help()
 }
 
 void handle_command_line_arguments(int argc, char *argv[], char **cfg_file_path, LOG_BACKEND *log_backend,
-                                   bool *run_in_foreground)
+                                   bool *run_in_foreground, char **capture_file_path)
 {
     if (argc < 2) {
         write_log(LOG_LEVEL_ERROR, "Error: No arguments provided.\n\n");
@@ -72,6 +74,7 @@ void handle_command_line_arguments(int argc, char *argv[], char **cfg_file_path,
     opterr = 0;
 
     static struct option long_options[] = {
+        {"capture",     required_argument, 0, 'p'},
         {"config",      required_argument, 0, 'c'}, // required option
         {"foreground",  no_argument,       0, 'f'},
         {"help",        no_argument,       0, 'h'},
@@ -84,6 +87,7 @@ void handle_command_line_arguments(int argc, char *argv[], char **cfg_file_path,
     bool log_backend_set   = false;
 
     *run_in_foreground = false;
+    *capture_file_path = NULL;
 
     int opt;
 
@@ -91,6 +95,10 @@ void handle_command_line_arguments(int argc, char *argv[], char **cfg_file_path,
 
         switch (opt) {
 
+            case 'p':
+                *capture_file_path = optarg;
+                break;
+
             case 'c':
                 *cfg_file_path = optarg;
                 cfg_file_path_set = true;
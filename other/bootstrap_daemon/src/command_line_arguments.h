@@ -36,7 +36,9 @@
  * @param cfg_file_path Sets to the provided by the user config file path.
  * @param log_backend Sets to the provided by the user log backend option.
  * @param run_in_foreground Sets to the provided by the user foreground option.
+ * @param capture_file_path Sets to the provided by the user capture file path, NULL if none.
  */
-void handle_command_line_arguments(int argc, char *argv[], char **cfg_file_path, LOG_BACKEND *log_backend, bool *run_in_foreground);
+void handle_command_line_arguments(int argc, char *argv[], char **cfg_file_path, LOG_BACKEND *log_backend,
+                                   bool *run_in_foreground, char **capture_file_path);
 
 #endif // COMMAND_LINE_ARGUMENTS_H
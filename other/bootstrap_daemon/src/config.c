@@ -145,7 +145,8 @@ void parse_tcp_relay_ports_config(config_t *cfg, uint16_t **tcp_relay_ports, int
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
                        int *enable_ipv6,
                        int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay, uint16_t **tcp_relay_ports,
-                       int *tcp_relay_port_count, int *enable_motd, char **motd)
+                       int *tcp_relay_port_count, int *enable_motd, char **motd, int *worker_threads,
+                       int *crypto_threads, int *tcp_relay_threads)
 {
     config_t cfg;
 
@@ -158,6 +159,9 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
     const char *NAME_ENABLE_TCP_RELAY     = "enable_tcp_relay";
     const char *NAME_ENABLE_MOTD          = "enable_motd";
     const char *NAME_MOTD                 = "motd";
+    const char *NAME_WORKER_THREADS       = "worker_threads";
+    const char *NAME_CRYPTO_THREADS       = "crypto_threads";
+    const char *NAME_TCP_RELAY_THREADS    = "tcp_relay_threads";
 
     config_init(&cfg);
 
@@ -261,6 +265,27 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         (*motd)[motd_length - 1] = '\0';
     }
 
+    // Get number of worker threads
+    if (config_lookup_int(&cfg, NAME_WORKER_THREADS, worker_threads) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_WORKER_THREADS);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_WORKER_THREADS, DEFAULT_WORKER_THREADS);
+        *worker_threads = DEFAULT_WORKER_THREADS;
+    }
+
+    // Get number of crypto threads
+    if (config_lookup_int(&cfg, NAME_CRYPTO_THREADS, crypto_threads) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_CRYPTO_THREADS);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_CRYPTO_THREADS, DEFAULT_CRYPTO_THREADS);
+        *crypto_threads = DEFAULT_CRYPTO_THREADS;
+    }
+
+    // Get number of TCP relay threads
+    if (config_lookup_int(&cfg, NAME_TCP_RELAY_THREADS, tcp_relay_threads) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_TCP_RELAY_THREADS);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_TCP_RELAY_THREADS, DEFAULT_TCP_RELAY_THREADS);
+        *tcp_relay_threads = DEFAULT_TCP_RELAY_THREADS;
+    }
+
     config_destroy(&cfg);
 
     write_log(LOG_LEVEL_INFO, "Successfully read:\n");
@@ -293,6 +318,10 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         write_log(LOG_LEVEL_INFO, "'%s': %s\n", NAME_MOTD, *motd);
     }
 
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_WORKER_THREADS,       *worker_threads);
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_CRYPTO_THREADS,       *crypto_threads);
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_TCP_RELAY_THREADS,    *tcp_relay_threads);
+
     return 1;
 }
 
@@ -38,5 +38,8 @@
 #define DEFAULT_TCP_RELAY_PORTS_COUNT 3
 #define DEFAULT_ENABLE_MOTD           1 // 1 - true, 0 - false
 #define DEFAULT_MOTD                  DAEMON_NAME
+#define DEFAULT_WORKER_THREADS        0 // 0 - everything is done by the main thread
+#define DEFAULT_CRYPTO_THREADS        0 // 0 - shared keys are computed by the main thread
+#define DEFAULT_TCP_RELAY_THREADS     0 // 0 - the TCP relay is run by the main thread
 
 #endif // CONFIG_DEFAULTS_H
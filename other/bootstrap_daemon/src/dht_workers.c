@@ -0,0 +1,491 @@
+/* dht_workers.c
+ *
+ * Tox DHT bootstrap daemon.
+ * Worker threads answering stateless DHT and onion requests.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "dht_workers.h"
+
+#include "log.h"
+
+// system provided
+#include <poll.h>
+#include <pthread.h>
+
+// C
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// toxcore
+#include "../../../toxcore/ping.h"
+#include "../../../toxcore/util.h"
+
+// Number of messages a worker can queue for the main thread before it starts dropping them.
+#define WORKER_QUEUE_SIZE 1024
+
+// Longest time a worker blocks waiting for packets, so it notices when it should stop.
+#define WORKER_POLL_TIMEOUT_MS 500
+
+// How often the main thread publishes its close list to the workers, in seconds.
+#define WORKER_PUBLISH_INTERVAL 1
+
+typedef enum WORKER_MESSAGE_TYPE {
+    // A packet the worker can't handle, dispatched to the handler of the main socket.
+    WORKER_MESSAGE_PACKET,
+    // A node that proved it owns the public key in data, added to the ping list of the main DHT.
+    WORKER_MESSAGE_NODE,
+    // An onion response for a client of the TCP relay, which only the main thread can reach.
+    WORKER_MESSAGE_ONION_TCP
+} WORKER_MESSAGE_TYPE;
+
+typedef struct Worker_Message {
+    WORKER_MESSAGE_TYPE type;
+    IP_Port ip_port;
+    uint16_t length;
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+} Worker_Message;
+
+// What the workers need to know about the state of the main thread.
+typedef struct DHT_View {
+    Client_data *close_clientlist;
+    uint32_t close_clientlist_length;
+    Client_data friend_clients[DHT_FAKE_FRIEND_NUMBER][MAX_FRIEND_CLIENTS];
+    uint8_t onion_key[crypto_box_KEYBYTES];
+    uint64_t version;
+} DHT_View;
+
+typedef struct Worker {
+    DHT_Workers *workers;
+    pthread_t thread;
+
+    // Our own socket and a DHT and onion instance that only ever answer requests.
+    Networking_Core *net;
+    DHT *dht;
+    Onion *onion;
+
+    // The handlers new_DHT() and new_onion() registered on net.
+    Packet_Handles handlers[256];
+    uint64_t view_version;
+
+    pthread_mutex_t queue_mutex;
+    Worker_Message *queue;
+    uint32_t queue_start;
+    uint32_t queue_count;
+    uint32_t queue_dropped;
+} Worker;
+
+struct DHT_Workers {
+    DHT *dht;
+    Onion *onion;
+
+    pthread_rwlock_t view_lock;
+    DHT_View *view;
+    uint64_t last_publish;
+
+    pthread_mutex_t running_mutex;
+    bool running;
+
+    Worker *workers;
+    unsigned int count;
+
+    // Messages taken out of a worker queue, so the queue isn't locked while they are handled.
+    Worker_Message *scratch;
+};
+
+static bool workers_running(DHT_Workers *workers)
+{
+    pthread_mutex_lock(&workers->running_mutex);
+    bool running = workers->running;
+    pthread_mutex_unlock(&workers->running_mutex);
+    return running;
+}
+
+// returns 0 on success
+//         -1 if the queue is full
+static int worker_queue_push(Worker *worker, WORKER_MESSAGE_TYPE type, IP_Port ip_port, const uint8_t *data,
+                             uint16_t length)
+{
+    if (length > MAX_UDP_PACKET_SIZE) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&worker->queue_mutex);
+
+    if (worker->queue_count == WORKER_QUEUE_SIZE) {
+        ++worker->queue_dropped;
+        pthread_mutex_unlock(&worker->queue_mutex);
+        return -1;
+    }
+
+    Worker_Message *message = &worker->queue[(worker->queue_start + worker->queue_count) % WORKER_QUEUE_SIZE];
+    message->type = type;
+    message->ip_port = ip_port;
+    message->length = length;
+    memcpy(message->data, data, length);
+    ++worker->queue_count;
+
+    pthread_mutex_unlock(&worker->queue_mutex);
+    return 0;
+}
+
+static int worker_forward_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    Worker *worker = object;
+
+    if (worker_queue_push(worker, WORKER_MESSAGE_PACKET, source, packet, length) != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Ping and get nodes requests are answered here, but the main thread still has to learn about the sender.
+static int worker_handle_node_request(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    Worker *worker = object;
+    const Packet_Handles *handler = &worker->handlers[packet[0]];
+
+    if (handler->function(handler->object, source, packet, length) != 0) {
+        return 1;
+    }
+
+    // the handler succeeded, so the sender owns the public key at the start of the packet
+    worker_queue_push(worker, WORKER_MESSAGE_NODE, source, packet + 1, crypto_box_PUBLICKEYBYTES);
+    return 0;
+}
+
+static int worker_onion_recv_1_tcp(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
+{
+    Worker *worker = object;
+
+    if (worker_queue_push(worker, WORKER_MESSAGE_ONION_TCP, dest, data, length) != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static void worker_update_view(Worker *worker)
+{
+    const DHT_View *view = worker->workers->view;
+
+    pthread_rwlock_rdlock(&worker->workers->view_lock);
+
+    if (view->version != worker->view_version) {
+        if (DHT_copy_close_list(worker->dht, view->close_clientlist, view->close_clientlist_length) != 0) {
+            // keep answering with the old list, the next version will be tried again
+            pthread_rwlock_unlock(&worker->workers->view_lock);
+            return;
+        }
+
+        unsigned int i;
+
+        for (i = 0; i < DHT_FAKE_FRIEND_NUMBER && i < worker->dht->num_friends; ++i) {
+            memcpy(worker->dht->friends_list[i].client_list, view->friend_clients[i], sizeof(view->friend_clients[i]));
+        }
+
+        memcpy(worker->onion->secret_symmetric_key, view->onion_key, crypto_box_KEYBYTES);
+        // the main thread decides when the key changes
+        worker->onion->timestamp = unix_time();
+        worker->view_version = view->version;
+    }
+
+    pthread_rwlock_unlock(&worker->workers->view_lock);
+}
+
+static void *worker_thread(void *arg)
+{
+    Worker *worker = arg;
+
+    struct pollfd pfd;
+    pfd.fd = worker->net->sock;
+    pfd.events = POLLIN;
+
+    while (workers_running(worker->workers)) {
+        poll(&pfd, 1, WORKER_POLL_TIMEOUT_MS);
+        worker_update_view(worker);
+        // the main loop owns unix_time(), workers only read it
+        networking_poll_packets(worker->net);
+    }
+
+    return NULL;
+}
+
+// Publishes the close list and onion key of the main thread to the workers.
+static void dht_workers_publish(DHT_Workers *workers)
+{
+    DHT *dht = workers->dht;
+    DHT_View *view = workers->view;
+
+    pthread_rwlock_wrlock(&workers->view_lock);
+
+    if (view->close_clientlist_length != dht->close_clientlist_length) {
+        Client_data *list = realloc(view->close_clientlist, dht->close_clientlist_length * sizeof(Client_data));
+
+        if (list != NULL) {
+            view->close_clientlist = list;
+            view->close_clientlist_length = dht->close_clientlist_length;
+        }
+    }
+
+    // if the view couldn't be resized, the workers keep the last close list that could be published
+    if (view->close_clientlist_length == dht->close_clientlist_length) {
+        memcpy(view->close_clientlist, dht->close_clientlist, dht->close_clientlist_length * sizeof(Client_data));
+    }
+
+    unsigned int i;
+
+    for (i = 0; i < DHT_FAKE_FRIEND_NUMBER && i < dht->num_friends; ++i) {
+        memcpy(view->friend_clients[i], dht->friends_list[i].client_list, sizeof(view->friend_clients[i]));
+    }
+
+    memcpy(view->onion_key, workers->onion->secret_symmetric_key, crypto_box_KEYBYTES);
+    ++view->version;
+
+    pthread_rwlock_unlock(&workers->view_lock);
+
+    workers->last_publish = unix_time();
+}
+
+static void worker_handle_message(DHT_Workers *workers, const Worker_Message *message)
+{
+    switch (message->type) {
+        case WORKER_MESSAGE_PACKET:
+            networking_handle_packet(workers->dht->net, message->ip_port, message->data, message->length);
+            break;
+
+        case WORKER_MESSAGE_NODE:
+            add_to_ping(workers->dht->ping, message->data, message->ip_port);
+            break;
+
+        case WORKER_MESSAGE_ONION_TCP:
+            if (workers->onion->recv_1_function) {
+                workers->onion->recv_1_function(workers->onion->callback_object, message->ip_port, message->data,
+                                                message->length);
+            }
+
+            break;
+    }
+}
+
+void do_dht_workers(DHT_Workers *workers)
+{
+    unsigned int i;
+
+    for (i = 0; i < workers->count; ++i) {
+        Worker *worker = &workers->workers[i];
+
+        pthread_mutex_lock(&worker->queue_mutex);
+
+        uint32_t count = worker->queue_count;
+        uint32_t first = WORKER_QUEUE_SIZE - worker->queue_start;
+
+        if (first > count) {
+            first = count;
+        }
+
+        memcpy(workers->scratch, worker->queue + worker->queue_start, first * sizeof(Worker_Message));
+        memcpy(workers->scratch + first, worker->queue, (count - first) * sizeof(Worker_Message));
+        worker->queue_start = (worker->queue_start + count) % WORKER_QUEUE_SIZE;
+        worker->queue_count = 0;
+
+        uint32_t dropped = worker->queue_dropped;
+        worker->queue_dropped = 0;
+
+        pthread_mutex_unlock(&worker->queue_mutex);
+
+        if (dropped) {
+            write_log(LOG_LEVEL_WARNING, "Worker #%u dropped %u packets, main thread is too slow.\n", i, dropped);
+        }
+
+        uint32_t j;
+
+        for (j = 0; j < count; ++j) {
+            worker_handle_message(workers, &workers->scratch[j]);
+        }
+    }
+
+    // responses to the forwarded packets leave through the main socket
+    networking_flush(workers->dht->net);
+
+    if (is_timeout(workers->last_publish, WORKER_PUBLISH_INTERVAL)) {
+        dht_workers_publish(workers);
+    }
+}
+
+static void kill_worker(Worker *worker)
+{
+    kill_onion(worker->onion);
+
+    if (worker->dht != NULL) {
+        kill_DHT(worker->dht);
+    }
+
+    kill_networking(worker->net);
+    free(worker->queue);
+    pthread_mutex_destroy(&worker->queue_mutex);
+}
+
+// returns 1 on success
+//         0 on failure
+static int init_worker(DHT_Workers *workers, Worker *worker, IP ip, uint16_t port)
+{
+    if (pthread_mutex_init(&worker->queue_mutex, NULL) != 0) {
+        return 0;
+    }
+
+    worker->workers = workers;
+    worker->queue = calloc(WORKER_QUEUE_SIZE, sizeof(Worker_Message));
+    worker->net = new_networking_reuseport(ip, port, NULL);
+    worker->dht = new_DHT(worker->net);
+    worker->onion = new_onion(worker->dht);
+
+    if (worker->queue == NULL || worker->onion == NULL) {
+        kill_worker(worker);
+        return 0;
+    }
+
+    networking_set_send_queue(worker->net, 1);
+
+    memcpy(worker->dht->self_public_key, workers->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(worker->dht->self_secret_key, workers->dht->self_secret_key, crypto_box_SECRETKEYBYTES);
+
+    // remember the stateless handlers, then send everything else to the main thread
+    memcpy(worker->handlers, worker->net->packethandlers, sizeof(worker->handlers));
+
+    unsigned int i;
+
+    for (i = 0; i < 256; ++i) {
+        networking_registerhandler(worker->net, i, &worker_forward_packet, worker);
+    }
+
+    networking_registerhandler(worker->net, NET_PACKET_PING_REQUEST, &worker_handle_node_request, worker);
+    networking_registerhandler(worker->net, NET_PACKET_GET_NODES, &worker_handle_node_request, worker);
+
+    const uint8_t onion_packets[] = {
+        NET_PACKET_ONION_SEND_INITIAL, NET_PACKET_ONION_SEND_1, NET_PACKET_ONION_SEND_2,
+        NET_PACKET_ONION_RECV_3, NET_PACKET_ONION_RECV_2, NET_PACKET_ONION_RECV_1
+    };
+
+    for (i = 0; i < sizeof(onion_packets); ++i) {
+        const Packet_Handles *handler = &worker->handlers[onion_packets[i]];
+        networking_registerhandler(worker->net, onion_packets[i], handler->function, handler->object);
+    }
+
+    set_callback_handle_recv_1(worker->onion, &worker_onion_recv_1_tcp, worker);
+
+    return 1;
+}
+
+DHT_Workers *new_dht_workers(DHT *dht, Onion *onion, IP ip, uint16_t port, unsigned int count)
+{
+    if (count == 0 || count > MAX_WORKER_THREADS) {
+        return NULL;
+    }
+
+    DHT_Workers *workers = calloc(1, sizeof(DHT_Workers));
+
+    if (workers == NULL) {
+        return NULL;
+    }
+
+    workers->dht = dht;
+    workers->onion = onion;
+    workers->running = true;
+    workers->view = calloc(1, sizeof(DHT_View));
+    workers->workers = calloc(count, sizeof(Worker));
+    workers->scratch = calloc(WORKER_QUEUE_SIZE, sizeof(Worker_Message));
+
+    if (workers->view == NULL || workers->workers == NULL || workers->scratch == NULL
+            || pthread_rwlock_init(&workers->view_lock, NULL) != 0) {
+        free(workers->view);
+        free(workers->workers);
+        free(workers->scratch);
+        free(workers);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&workers->running_mutex, NULL) != 0) {
+        pthread_rwlock_destroy(&workers->view_lock);
+        free(workers->view);
+        free(workers->workers);
+        free(workers->scratch);
+        free(workers);
+        return NULL;
+    }
+
+    dht_workers_publish(workers);
+
+    unsigned int i;
+
+    for (i = 0; i < count; ++i) {
+        Worker *worker = &workers->workers[i];
+
+        if (!init_worker(workers, worker, ip, port)) {
+            write_log(LOG_LEVEL_ERROR, "Couldn't initialize worker #%u.\n", i);
+            break;
+        }
+
+        worker_update_view(worker);
+
+        if (pthread_create(&worker->thread, NULL, worker_thread, worker) != 0) {
+            write_log(LOG_LEVEL_ERROR, "Couldn't start worker #%u.\n", i);
+            kill_worker(worker);
+            break;
+        }
+
+        ++workers->count;
+    }
+
+    if (workers->count != count) {
+        kill_dht_workers(workers);
+        return NULL;
+    }
+
+    return workers;
+}
+
+void kill_dht_workers(DHT_Workers *workers)
+{
+    if (workers == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&workers->running_mutex);
+    workers->running = false;
+    pthread_mutex_unlock(&workers->running_mutex);
+
+    unsigned int i;
+
+    for (i = 0; i < workers->count; ++i) {
+        pthread_join(workers->workers[i].thread, NULL);
+        kill_worker(&workers->workers[i]);
+    }
+
+    pthread_mutex_destroy(&workers->running_mutex);
+    pthread_rwlock_destroy(&workers->view_lock);
+    free(workers->view->close_clientlist);
+    free(workers->view);
+    free(workers->workers);
+    free(workers->scratch);
+    free(workers);
+}
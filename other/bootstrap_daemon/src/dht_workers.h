@@ -0,0 +1,54 @@
+/* dht_workers.h
+ *
+ * Tox DHT bootstrap daemon.
+ * Worker threads answering stateless DHT and onion requests.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DHT_WORKERS_H
+#define DHT_WORKERS_H
+
+#include "../../../toxcore/onion.h"
+
+#define MAX_WORKER_THREADS 64
+
+typedef struct DHT_Workers DHT_Workers;
+
+// Starts `count` worker threads, each polling its own UDP socket bound to `port` with SO_REUSEPORT.
+//
+// The main `dht` must have been created on a socket that was also bound with SO_REUSEPORT
+// (new_networking_reuseport()), and its keys must be final, since the workers copy them.
+//
+// Workers answer pings, get nodes requests and onion forwarding themselves, using a copy
+// of the close list of the main thread. Everything else is handed over to the main thread,
+// which has to call do_dht_workers() in its loop.
+//
+// returns the workers on success
+//         NULL on failure
+DHT_Workers *new_dht_workers(DHT *dht, Onion *onion, IP ip, uint16_t port, unsigned int count);
+
+// Handles the packets and events the workers passed to the main thread and, about once a
+// second, publishes the close list and onion key of the main thread to the workers.
+void do_dht_workers(DHT_Workers *workers);
+
+// Stops the worker threads and frees everything.
+void kill_dht_workers(DHT_Workers *workers);
+
+#endif // DHT_WORKERS_H
@@ -26,12 +26,14 @@
 #include <unistd.h>
 
 // C
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
 // toxcore
+#include "../../../toxcore/crypto_pool.h"
 #include "../../../toxcore/LAN_discovery.h"
 #include "../../../toxcore/onion_announce.h"
 #include "../../../toxcore/TCP_server.h"
@@ -39,15 +41,80 @@
 
 // misc
 #include "../../bootstrap_node_packets.h"
+#include "../../packet_capture.h"
 
 #include "command_line_arguments.h"
 #include "config.h"
+#include "dht_workers.h"
 #include "global.h"
 #include "log.h"
 
 
 #define SLEEP_MILLISECONDS(MS) usleep(1000*MS)
 
+#define MAX_SLEEP_MILLISECONDS 30
+
+// Nodes per bucket of the close list: a bootstrap node knows of many more nodes than a client,
+// so it can answer get nodes requests with nodes closer to what was asked for
+#define DAEMON_CLOSE_BUCKET_SIZE 32
+
+// Keys kept in each shared key cache: a bootstrap node talks to many more nodes than a client,
+// and computing a shared key is the most expensive thing it does
+#define DAEMON_SHARED_KEYS_SIZE 8192
+
+// Stop capturing after this many packets, so the capture file can't fill up the disk
+#define MAX_CAPTURED_PACKETS 10000000
+
+typedef struct {
+    FILE *file;
+    uint64_t start_time;
+    uint32_t count;
+} Capture;
+
+// Set by the SIGINT and SIGTERM handler to leave the main loop
+static volatile sig_atomic_t caught_signal = 0;
+
+static void handle_signal(int signum)
+{
+    caught_signal = signum;
+}
+
+// Writes the received packet into the capture file, called by networking_handle_packet()
+static int capture_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    Capture *capture = object;
+
+    if (capture->file == NULL) {
+        return 0;
+    }
+
+    if (capture->count == MAX_CAPTURED_PACKETS
+            || packet_capture_write(capture->file, current_time_monotonic() - capture->start_time, ip_port, data, length) == -1) {
+        write_log(LOG_LEVEL_INFO, "Stopped capturing packets after %u packets.\n", capture->count);
+        fclose(capture->file);
+        capture->file = NULL;
+        return 0;
+    }
+
+    ++capture->count;
+    return 0;
+}
+
+// Creates the UDP socket of the DHT.
+// With worker threads it is bound with SO_REUSEPORT to exactly `port`, so the workers can share it.
+//
+// returns Networking_Core on success
+//         NULL on failure
+
+Networking_Core *new_daemon_networking(IP ip, int port, int worker_threads)
+{
+    if (worker_threads > 0) {
+        return new_networking_reuseport(ip, port, NULL);
+    }
+
+    return new_networking(ip, port);
+}
+
 // Uses the already existing key or creates one if it didn't exist
 //
 // retirns 1 on success
@@ -178,12 +245,13 @@ int main(int argc, char *argv[])
     char *cfg_file_path;
     LOG_BACKEND log_backend;
     bool run_in_foreground;
+    char *capture_file_path;
 
     // choose backend for printing command line argument parsing output based on whether the daemon is being run from a terminal
     log_backend = isatty(STDOUT_FILENO) ? LOG_BACKEND_STDOUT : LOG_BACKEND_SYSLOG;
 
     open_log(log_backend);
-    handle_command_line_arguments(argc, argv, &cfg_file_path, &log_backend, &run_in_foreground);
+    handle_command_line_arguments(argc, argv, &cfg_file_path, &log_backend, &run_in_foreground, &capture_file_path);
     close_log();
 
     open_log(log_backend);
@@ -200,9 +268,13 @@ int main(int argc, char *argv[])
     int tcp_relay_port_count;
     int enable_motd;
     char *motd;
+    int worker_threads;
+    int crypto_threads;
+    int tcp_relay_threads;
 
     if (get_general_config(cfg_file_path, &pid_file_path, &keys_file_path, &port, &enable_ipv6, &enable_ipv4_fallback,
-                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd)) {
+                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd,
+                           &worker_threads, &crypto_threads, &tcp_relay_threads)) {
         write_log(LOG_LEVEL_INFO, "General config read successfully\n");
     } else {
         write_log(LOG_LEVEL_ERROR, "Couldn't read config file: %s. Exiting.\n", cfg_file_path);
@@ -215,6 +287,47 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (worker_threads < 0 || worker_threads > MAX_WORKER_THREADS) {
+        write_log(LOG_LEVEL_ERROR, "Invalid number of worker threads: %d, should be in [0, %d]. Exiting.\n", worker_threads,
+                  MAX_WORKER_THREADS);
+        return 1;
+    }
+
+    if (crypto_threads < 0 || crypto_threads > CRYPTO_POOL_MAX_THREADS) {
+        write_log(LOG_LEVEL_ERROR, "Invalid number of crypto threads: %d, should be in [0, %d]. Exiting.\n", crypto_threads,
+                  CRYPTO_POOL_MAX_THREADS);
+        return 1;
+    }
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_relay_threads < 0 || tcp_relay_threads > TCP_RELAY_MAX_SHARDS) {
+        write_log(LOG_LEVEL_ERROR, "Invalid number of TCP relay threads: %d, should be in [0, %d]. Exiting.\n",
+                  tcp_relay_threads, TCP_RELAY_MAX_SHARDS);
+        return 1;
+    }
+
+#else
+
+    if (tcp_relay_threads != 0) {
+        write_log(LOG_LEVEL_ERROR, "TCP relay threads need epoll support, which this build lacks. Exiting.\n");
+        return 1;
+    }
+
+#endif
+
+    // Opened before daemonizing, which changes the working directory
+    Capture capture = {0};
+
+    if (capture_file_path != NULL) {
+        capture.file = fopen(capture_file_path, "wb");
+
+        if (capture.file == NULL || packet_capture_write_header(capture.file) == -1) {
+            write_log(LOG_LEVEL_ERROR, "Couldn't open capture file: %s. Exiting.\n", capture_file_path);
+            return 1;
+        }
+    }
+
     if (!run_in_foreground) {
         daemonize(log_backend, pid_file_path);
     }
@@ -224,14 +337,14 @@ int main(int argc, char *argv[])
     IP ip;
     ip_init(&ip, enable_ipv6);
 
-    Networking_Core *net = new_networking(ip, port);
+    Networking_Core *net = new_daemon_networking(ip, port, worker_threads);
 
     if (net == NULL) {
         if (enable_ipv6 && enable_ipv4_fallback) {
             write_log(LOG_LEVEL_WARNING, "Couldn't initialize IPv6 networking. Falling back to using IPv4.\n");
             enable_ipv6 = 0;
             ip_init(&ip, enable_ipv6);
-            net = new_networking(ip, port);
+            net = new_daemon_networking(ip, port, worker_threads);
 
             if (net == NULL) {
                 write_log(LOG_LEVEL_ERROR, "Couldn't fallback to IPv4. Exiting.\n");
@@ -243,6 +356,20 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (networking_set_send_queue(net, 1) == 0) {
+        write_log(LOG_LEVEL_INFO, "Batched sending of UDP packets enabled.\n");
+    }
+
+    if (capture.file != NULL) {
+        capture.start_time = current_time_monotonic();
+        networking_set_recv_hook(net, capture_packet, &capture);
+        write_log(LOG_LEVEL_INFO, "Capturing received packets into %s.\n", capture_file_path);
+
+        if (worker_threads > 0) {
+            write_log(LOG_LEVEL_WARNING, "Packets answered by worker threads are not captured.\n");
+        }
+    }
+
     DHT *dht = new_DHT(net);
 
     if (dht == NULL) {
@@ -250,6 +377,10 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (DHT_set_close_bucket_size(dht, DAEMON_CLOSE_BUCKET_SIZE) != 0) {
+        write_log(LOG_LEVEL_WARNING, "Couldn't enlarge the DHT close list, using the default size.\n");
+    }
+
     Onion *onion = new_onion(dht);
     Onion_Announce *onion_a = new_onion_announce(dht);
 
@@ -258,6 +389,15 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (shared_keys_set_size(&dht->shared_keys_recv, DAEMON_SHARED_KEYS_SIZE) != 0
+            || shared_keys_set_size(&dht->shared_keys_sent, DAEMON_SHARED_KEYS_SIZE) != 0
+            || shared_keys_set_size(&onion->shared_keys_1, DAEMON_SHARED_KEYS_SIZE) != 0
+            || shared_keys_set_size(&onion->shared_keys_2, DAEMON_SHARED_KEYS_SIZE) != 0
+            || shared_keys_set_size(&onion->shared_keys_3, DAEMON_SHARED_KEYS_SIZE) != 0
+            || shared_keys_set_size(&onion_a->shared_keys_recv, DAEMON_SHARED_KEYS_SIZE) != 0) {
+        write_log(LOG_LEVEL_WARNING, "Couldn't enlarge the shared key caches, using the default size.\n");
+    }
+
     if (enable_motd) {
         if (bootstrap_set_callbacks(dht->net, DAEMON_VERSION_NUMBER, (uint8_t *)motd, strlen(motd) + 1) == 0) {
             write_log(LOG_LEVEL_INFO, "Set MOTD successfully.\n");
@@ -279,6 +419,7 @@ int main(int argc, char *argv[])
     free(keys_file_path);
 
     TCP_Server *tcp_server = NULL;
+    TCP_Relay *tcp_relay = NULL;
 
     if (enable_tcp_relay) {
         if (tcp_relay_port_count == 0) {
@@ -286,12 +427,23 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-        tcp_server = new_TCP_server(enable_ipv6, tcp_relay_port_count, tcp_relay_ports, dht->self_secret_key, onion);
+#ifdef TCP_SERVER_USE_EPOLL
+
+        if (tcp_relay_threads > 0) {
+            tcp_relay = new_TCP_relay(enable_ipv6, tcp_relay_port_count, tcp_relay_ports, dht->self_secret_key, onion,
+                                      tcp_relay_threads);
+        } else
+#endif
+        {
+            tcp_server = new_TCP_server(enable_ipv6, tcp_relay_port_count, tcp_relay_ports, dht->self_secret_key, onion);
+        }
 
         // tcp_relay_port_count != 0 at this point
         free(tcp_relay_ports);
 
-        if (tcp_server != NULL) {
+        if (tcp_relay != NULL) {
+            write_log(LOG_LEVEL_INFO, "Started Tox TCP relay in %d threads successfully.\n", tcp_relay_threads);
+        } else if (tcp_server != NULL) {
             write_log(LOG_LEVEL_INFO, "Initialized Tox TCP server successfully.\n");
         } else {
             write_log(LOG_LEVEL_ERROR, "Couldn't initialize Tox TCP server. Exiting.\n");
@@ -308,17 +460,50 @@ int main(int argc, char *argv[])
 
     print_public_key(dht->self_public_key);
 
+    DHT_Workers *workers = NULL;
+
+    if (worker_threads > 0) {
+        workers = new_dht_workers(dht, onion, ip, port, worker_threads);
+
+        if (workers != NULL) {
+            write_log(LOG_LEVEL_INFO, "Started %d worker threads successfully.\n", worker_threads);
+        } else {
+            write_log(LOG_LEVEL_ERROR, "Couldn't start worker threads. Exiting.\n");
+            return 1;
+        }
+    }
+
+    Crypto_Pool *crypto_pool = NULL;
+
+    if (crypto_threads > 0) {
+        crypto_pool = new_crypto_pool(dht->net, crypto_threads);
+
+        if (crypto_pool != NULL && crypto_pool_register_dht(crypto_pool, dht) == 0
+                && crypto_pool_register_onion(crypto_pool, onion) == 0
+                && crypto_pool_register_onion_announce(crypto_pool, onion_a) == 0) {
+            write_log(LOG_LEVEL_INFO, "Started %d crypto threads successfully.\n", crypto_threads);
+        } else {
+            write_log(LOG_LEVEL_ERROR, "Couldn't start crypto threads. Exiting.\n");
+            return 1;
+        }
+    }
+
     uint64_t last_LANdiscovery = 0;
     const uint16_t htons_port = htons(port);
 
     int waiting_for_dht_connection = 1;
 
+    Socket_Wait_List wait_socks = {0};
+
     if (enable_lan_discovery) {
         LANdiscovery_init(dht);
         write_log(LOG_LEVEL_INFO, "Initialized LAN discovery successfully.\n");
     }
 
-    while (1) {
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    while (!caught_signal) {
         do_DHT(dht);
 
         if (enable_lan_discovery && is_timeout(last_LANdiscovery, LAN_DISCOVERY_INTERVAL)) {
@@ -326,19 +511,60 @@ int main(int argc, char *argv[])
             last_LANdiscovery = unix_time();
         }
 
-        if (enable_tcp_relay) {
+#ifdef TCP_SERVER_USE_EPOLL
+
+        if (tcp_relay != NULL) {
+            do_TCP_relay(tcp_relay);
+        }
+
+#endif
+
+        if (tcp_server != NULL) {
             do_TCP_server(tcp_server);
         }
 
         networking_poll(dht->net);
 
+        // Once per iteration rather than per packet, so a killed daemon loses little of the capture
+        if (capture.file != NULL) {
+            fflush(capture.file);
+        }
+
+        if (crypto_pool != NULL) {
+            do_crypto_pool(crypto_pool);
+        }
+
+        if (workers != NULL) {
+            do_dht_workers(workers);
+        }
+
         if (waiting_for_dht_connection && DHT_isconnected(dht)) {
             write_log(LOG_LEVEL_INFO, "Connected to another bootstrap node successfully.\n");
             waiting_for_dht_connection = 0;
         }
 
-        SLEEP_MILLISECONDS(30);
+        // Sleep until a packet arrives, but no longer than the old fixed interval,
+        // so the timers of the DHT and of the TCP server still run on time
+        socket_wait_list_clear(&wait_socks);
+
+        if (networking_wait_socks(dht->net, &wait_socks) == -1
+                || (tcp_server != NULL && TCP_server_wait_socks(tcp_server, &wait_socks) == -1)
+#ifdef TCP_SERVER_USE_EPOLL
+                || (tcp_relay != NULL && TCP_relay_wait_socks(tcp_relay, &wait_socks) == -1)
+#endif
+                || (crypto_pool != NULL && crypto_pool_wait_socks(crypto_pool, &wait_socks) == -1)
+                || socket_wait(&wait_socks, MAX_SLEEP_MILLISECONDS) == -1) {
+            SLEEP_MILLISECONDS(MAX_SLEEP_MILLISECONDS);
+        }
     }
 
-    return 1;
+    write_log(LOG_LEVEL_INFO, "Received signal %d. Shutting down.\n", (int) caught_signal);
+
+    if (capture.file != NULL) {
+        fclose(capture.file);
+    }
+
+    close_log();
+
+    return 0;
 }
@@ -0,0 +1,132 @@
+/* packet_capture.c
+ *
+ * Reading and writing of capture files of received UDP packets.
+ *
+ * Written by tox-bootstrapd --capture and read by packet_replay.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "packet_capture.h"
+
+int packet_capture_write_header(FILE *file)
+{
+    if (fwrite(PACKET_CAPTURE_MAGIC, 1, PACKET_CAPTURE_MAGIC_LENGTH, file) != PACKET_CAPTURE_MAGIC_LENGTH)
+        return -1;
+
+    return 0;
+}
+
+int packet_capture_write(FILE *file, uint32_t time, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    uint8_t header[4 + 1 + SIZE_IP6 + SIZE_PORT + 2];
+    uint32_t time_be = htonl(time);
+    uint16_t length_be = htons(length);
+    unsigned int size = 0;
+
+    memcpy(header, &time_be, sizeof(time_be));
+    size += sizeof(time_be);
+
+    if (ip_port.ip.family == AF_INET) {
+        header[size] = 4;
+        ++size;
+        memcpy(header + size, ip_port.ip.ip4.uint8, SIZE_IP4);
+        size += SIZE_IP4;
+    } else if (ip_port.ip.family == AF_INET6) {
+        header[size] = 6;
+        ++size;
+        memcpy(header + size, ip_port.ip.ip6.uint8, SIZE_IP6);
+        size += SIZE_IP6;
+    } else {
+        return -1;
+    }
+
+    memcpy(header + size, &ip_port.port, SIZE_PORT);
+    size += SIZE_PORT;
+    memcpy(header + size, &length_be, sizeof(length_be));
+    size += sizeof(length_be);
+
+    if (fwrite(header, 1, size, file) != size || fwrite(data, 1, length, file) != length)
+        return -1;
+
+    return 0;
+}
+
+int packet_capture_read_header(FILE *file)
+{
+    uint8_t magic[PACKET_CAPTURE_MAGIC_LENGTH];
+
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic))
+        return -1;
+
+    if (memcmp(magic, PACKET_CAPTURE_MAGIC, PACKET_CAPTURE_MAGIC_LENGTH) != 0)
+        return -1;
+
+    return 0;
+}
+
+int packet_capture_read(FILE *file, uint32_t *time, IP_Port *ip_port, uint8_t *data, uint16_t *length)
+{
+    uint8_t header[4 + 1];
+    size_t read = fread(header, 1, sizeof(header), file);
+
+    if (read == 0 && feof(file))
+        return 0;
+
+    if (read != sizeof(header))
+        return -1;
+
+    uint32_t time_be;
+    memcpy(&time_be, header, sizeof(time_be));
+    *time = ntohl(time_be);
+
+    memset(ip_port, 0, sizeof(IP_Port));
+
+    if (header[4] == 4) {
+        ip_port->ip.family = AF_INET;
+
+        if (fread(ip_port->ip.ip4.uint8, 1, SIZE_IP4, file) != SIZE_IP4)
+            return -1;
+    } else if (header[4] == 6) {
+        ip_port->ip.family = AF_INET6;
+
+        if (fread(ip_port->ip.ip6.uint8, 1, SIZE_IP6, file) != SIZE_IP6)
+            return -1;
+    } else {
+        return -1;
+    }
+
+    uint16_t length_be;
+
+    if (fread(&ip_port->port, 1, SIZE_PORT, file) != SIZE_PORT)
+        return -1;
+
+    if (fread(&length_be, 1, sizeof(length_be), file) != sizeof(length_be))
+        return -1;
+
+    *length = ntohs(length_be);
+
+    if (*length == 0 || *length > MAX_UDP_PACKET_SIZE)
+        return -1;
+
+    if (fread(data, 1, *length, file) != *length)
+        return -1;
+
+    return 1;
+}
@@ -0,0 +1,67 @@
+/* packet_capture.h
+ *
+ * Reading and writing of capture files of received UDP packets.
+ *
+ * Written by tox-bootstrapd --capture and read by packet_replay.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PACKET_CAPTURE_H
+#define PACKET_CAPTURE_H
+
+#include <stdio.h>
+
+#include "../toxcore/network.h"
+
+/* A capture file starts with these 8 bytes, followed by the packets, each stored as:
+ *
+ * [uint32_t time, ms since the capture started (big endian)]
+ * [uint8_t 4 or 6][IPv4 (4 bytes) or IPv6 (16 bytes) address][uint16_t port (big endian)]
+ * [uint16_t length (big endian)][data]
+ */
+#define PACKET_CAPTURE_MAGIC "TOXPCAP1"
+#define PACKET_CAPTURE_MAGIC_LENGTH 8
+
+/* return 0 on success.
+ * return -1 on failure.
+ */
+int packet_capture_write_header(FILE *file);
+
+/* Append a packet received at time ms after the start of the capture.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int packet_capture_write(FILE *file, uint32_t time, IP_Port ip_port, const uint8_t *data, uint16_t length);
+
+/* return 0 if the file starts with a valid header.
+ * return -1 if it doesn't.
+ */
+int packet_capture_read_header(FILE *file);
+
+/* Read the next packet into data, which must have room for MAX_UDP_PACKET_SIZE bytes.
+ *
+ * return 1 if a packet was read.
+ * return 0 at the end of the file.
+ * return -1 if the file is truncated or corrupted.
+ */
+int packet_capture_read(FILE *file, uint32_t *time, IP_Port *ip_port, uint8_t *data, uint16_t *length);
+
+#endif // PACKET_CAPTURE_H
@@ -0,0 +1,213 @@
+/* packet_replay.c
+ *
+ * Replays a capture file made with tox-bootstrapd --capture into a bootstrap
+ * node stack (DHT, onion and onion announce) without a socket, using the time
+ * of the capture as clock, then prints how long the handlers of each packet id took.
+ *
+ * Usage: packet_replay CAPTURE_FILE [KEYS_FILE]
+ *
+ * Give it the keys file of the node the capture was made on so that the
+ * packets encrypted to it can be decrypted, like they were in production.
+ * Packets using short lived secrets, like the onion return paths, will still
+ * fail to decrypt.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/onion_announce.h"
+#include "../toxcore/util.h"
+
+#include "bootstrap_node_packets.h"
+#include "packet_capture.h"
+
+/* Run do_DHT() every this many ms of capture time, like the main loop of a bootstrap node. */
+#define REPLAY_DO_DHT_INTERVAL 30
+
+/* Start the clock at a non zero time, timestamps of 0 have special meanings. */
+#define REPLAY_START_TIME 1000000
+
+static uint64_t replay_time;
+
+static uint64_t replay_clock(void)
+{
+    return replay_time;
+}
+
+static uint64_t packets_sent;
+
+/* Send hook: the packets are counted by Networking_Core and dropped. */
+static int drop_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    ++packets_sent;
+    return length;
+}
+
+static int load_keys(DHT *dht, const char *keys_file_path)
+{
+    uint8_t keys[crypto_box_PUBLICKEYBYTES + crypto_box_SECRETKEYBYTES];
+    FILE *keys_file = fopen(keys_file_path, "r");
+
+    if (keys_file == NULL)
+        return -1;
+
+    size_t read_size = fread(keys, 1, sizeof(keys), keys_file);
+    fclose(keys_file);
+
+    if (read_size != sizeof(keys))
+        return -1;
+
+    memcpy(dht->self_public_key, keys, crypto_box_PUBLICKEYBYTES);
+    memcpy(dht->self_secret_key, keys + crypto_box_PUBLICKEYBYTES, crypto_box_SECRETKEYBYTES);
+    return 0;
+}
+
+/* return the upper bound in microseconds of the histogram bucket containing the given fraction of the packets. */
+static uint64_t handler_time_percentile(const Net_Packet_Stats *stats, double fraction)
+{
+    uint64_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < NET_STATS_HISTOGRAM_SIZE; ++i) {
+        total += stats->handler_time[i];
+    }
+
+    uint64_t count = 0;
+
+    for (i = 0; i < NET_STATS_HISTOGRAM_SIZE; ++i) {
+        count += stats->handler_time[i];
+
+        if (count && count >= total * fraction)
+            break;
+    }
+
+    return 1ULL << i;
+}
+
+static void print_stats(const Networking_Core *net)
+{
+    printf("%4s %12s %14s %10s %12s %10s %10s\n", "id", "received", "bytes", "dropped", "sent", "p50 (us)", "p99 (us)");
+
+    unsigned int i;
+
+    for (i = 0; i < 256; ++i) {
+        Net_Packet_Stats stats;
+        networking_get_packet_stats(net, i, &stats);
+
+        if (stats.packets_recv == 0 && stats.packets_sent == 0)
+            continue;
+
+        char p50[32], p99[32];
+        snprintf(p50, sizeof(p50), "<%llu", (unsigned long long)handler_time_percentile(&stats, 0.5));
+        snprintf(p99, sizeof(p99), "<%llu", (unsigned long long)handler_time_percentile(&stats, 0.99));
+
+        printf("%4u %12llu %14llu %10llu %12llu %10s %10s\n", i, (unsigned long long)stats.packets_recv,
+               (unsigned long long)stats.bytes_recv, (unsigned long long)stats.packets_dropped,
+               (unsigned long long)stats.packets_sent, p50, p99);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        printf("Usage: %s CAPTURE_FILE [KEYS_FILE]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *capture_file = fopen(argv[1], "rb");
+
+    if (capture_file == NULL || packet_capture_read_header(capture_file) == -1) {
+        printf("Couldn't open capture file %s\n", argv[1]);
+        return 1;
+    }
+
+    replay_time = REPLAY_START_TIME;
+    set_monotonic_time_function(replay_clock);
+    unix_time_update();
+
+    IP ip;
+    ip_init(&ip, 1);
+    Networking_Core *net = new_networking_no_socket(ip, TOX_PORT_DEFAULT);
+
+    if (net == NULL)
+        return 1;
+
+    networking_set_send_hook(net, drop_packet, NULL);
+
+    DHT *dht = new_DHT(net);
+    Onion *onion = new_onion(dht);
+    Onion_Announce *onion_a = new_onion_announce(dht);
+
+    if (!(dht && onion && onion_a)) {
+        printf("Couldn't initialize the DHT and onion\n");
+        return 1;
+    }
+
+    if (argc > 2 && load_keys(dht, argv[2]) == -1) {
+        printf("Couldn't load keys from %s\n", argv[2]);
+        return 1;
+    }
+
+    bootstrap_set_callbacks(net, 1, (uint8_t *)"", 1);
+
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+    uint32_t capture_time = 0;
+    IP_Port ip_port;
+    uint16_t length;
+    uint64_t last_do_dht = 0;
+    uint64_t packets = 0;
+    int res;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while ((res = packet_capture_read(capture_file, &capture_time, &ip_port, data, &length)) == 1) {
+        replay_time = REPLAY_START_TIME + capture_time;
+
+        if (replay_time - last_do_dht >= REPLAY_DO_DHT_INTERVAL) {
+            do_DHT(dht);
+            last_do_dht = replay_time;
+        }
+
+        unix_time_update();
+        networking_handle_packet(net, ip_port, data, length);
+        ++packets;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fclose(capture_file);
+
+    if (res == -1)
+        printf("Capture file is truncated or corrupted, replayed the packets before the error\n");
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Replayed %llu packets covering %u s of capture in %.3f s (%.0f packets/s), %llu packets sent\n\n",
+           (unsigned long long)packets, capture_time / 1000, seconds, seconds > 0 ? packets / seconds : 0,
+           (unsigned long long)packets_sent);
+    print_stats(net);
+
+    kill_onion_announce(onion_a);
+    kill_onion(onion);
+    kill_DHT(dht);
+    kill_networking(net);
+    return 0;
+}
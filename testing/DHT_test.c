@@ -105,7 +105,7 @@ void print_clientlist(DHT *dht)
     uint32_t i;
     printf("___________________CLOSE________________________________\n");
 
-    for (i = 0; i < LCLIENT_LIST; i++) {
+    for (i = 0; i < dht->close_clientlist_length; i++) {
         Client_data *client = &dht->close_clientlist[i];
 
         if (public_key_cmp(client->public_key, zeroes_cid) == 0)
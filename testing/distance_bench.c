@@ -0,0 +1,231 @@
+/* distance_bench.c
+ *
+ * Microbenchmarks of the public key distance functions against the byte by byte
+ * versions they replaced.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/DHT.h"
+
+#define NUM_KEYS 1024
+#define NUM_ROUNDS 2000
+
+static uint8_t keys[NUM_KEYS][crypto_box_PUBLICKEYBYTES];
+static volatile unsigned int sink;
+
+static int old_id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
+{
+    size_t i;
+
+    for (i = 0; i < crypto_box_PUBLICKEYBYTES; ++i) {
+        uint8_t distance1 = pk[i] ^ pk1[i];
+        uint8_t distance2 = pk[i] ^ pk2[i];
+
+        if (distance1 < distance2)
+            return 1;
+
+        if (distance1 > distance2)
+            return 2;
+    }
+
+    return 0;
+}
+
+static unsigned int old_bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
+{
+    unsigned int i, j = 0;
+
+    for (i = 0; i < crypto_box_PUBLICKEYBYTES; ++i) {
+        if (pk1[i] == pk2[i])
+            continue;
+
+        for (j = 0; j < 8; ++j) {
+            if ((pk1[i] & (1 << (7 - j))) != (pk2[i] & (1 << (7 - j))))
+                break;
+        }
+
+        break;
+    }
+
+    return i * 8 + j;
+}
+
+static uint8_t cmp_public_key[crypto_box_PUBLICKEYBYTES];
+static int old_cmp_entry(const void *a, const void *b)
+{
+    Client_data entry1, entry2;
+    memcpy(&entry1, a, sizeof(Client_data));
+    memcpy(&entry2, b, sizeof(Client_data));
+    int t1 = entry1.assoc4.timestamp == 0;
+    int t2 = entry2.assoc4.timestamp == 0;
+
+    if (t1 && t2)
+        return 0;
+
+    if (t1)
+        return -1;
+
+    if (t2)
+        return 1;
+
+    int close = old_id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
+
+    if (close == 1)
+        return 1;
+
+    if (close == 2)
+        return -1;
+
+    return 0;
+}
+
+static unsigned int entry_rank(const void *entry)
+{
+    return ((const Client_data *)entry)->assoc4.timestamp != 0;
+}
+
+static double seconds(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void report(const char *name, double old_time, double new_time, unsigned long count)
+{
+    printf("%-28s %8.1f ns -> %8.1f ns  (%.2fx)\n", name, old_time * 1e9 / count, new_time * 1e9 / count,
+           old_time / new_time);
+}
+
+static void bench_closest(void)
+{
+    unsigned long count = (unsigned long)NUM_ROUNDS * NUM_KEYS;
+    unsigned int i, r, total = 0;
+    clock_t start = clock();
+
+    for (r = 0; r < NUM_ROUNDS; ++r)
+        for (i = 0; i < NUM_KEYS; ++i)
+            total += old_id_closest(keys[r % NUM_KEYS], keys[i], keys[(i + 1) % NUM_KEYS]);
+
+    double old_time = seconds(start);
+    start = clock();
+
+    for (r = 0; r < NUM_ROUNDS; ++r)
+        for (i = 0; i < NUM_KEYS; ++i)
+            total += id_closest(keys[r % NUM_KEYS], keys[i], keys[(i + 1) % NUM_KEYS]);
+
+    report("id_closest", old_time, seconds(start), count);
+    sink = total;
+}
+
+static void bench_common_bits(void)
+{
+    unsigned long count = (unsigned long)NUM_ROUNDS * NUM_KEYS;
+    unsigned int i, r, total = 0;
+    clock_t start = clock();
+
+    for (r = 0; r < NUM_ROUNDS; ++r)
+        for (i = 0; i < NUM_KEYS; ++i)
+            total += old_bit_by_bit_cmp(keys[r % NUM_KEYS], keys[i]);
+
+    double old_time = seconds(start);
+    start = clock();
+
+    for (r = 0; r < NUM_ROUNDS; ++r)
+        for (i = 0; i < NUM_KEYS; ++i)
+            total += pk_common_bits(keys[r % NUM_KEYS], keys[i]);
+
+    report("bit_by_bit_cmp", old_time, seconds(start), count);
+    sink = total;
+}
+
+/* Sort lists of length entries the way they are kept: already sorted, with one new entry. */
+static void bench_sort(const char *name, unsigned int length)
+{
+    Client_data *list = calloc(length, sizeof(Client_data));
+    Client_data *copy = calloc(length, sizeof(Client_data));
+    unsigned int i, r, rounds = NUM_ROUNDS * 64 / length;
+
+    if (!list || !copy) {
+        free(list);
+        free(copy);
+        return;
+    }
+
+    for (i = 0; i < length; ++i) {
+        memcpy(list[i].public_key, keys[i], crypto_box_PUBLICKEYBYTES);
+        list[i].assoc4.timestamp = i % 5 != 0;
+    }
+
+    memcpy(cmp_public_key, keys[NUM_KEYS - 1], crypto_box_PUBLICKEYBYTES);
+    qsort(list, length, sizeof(Client_data), old_cmp_entry);
+
+    clock_t start = clock();
+
+    for (r = 0; r < rounds; ++r) {
+        memcpy(copy, list, length * sizeof(Client_data));
+        memcpy(copy[0].public_key, keys[r % NUM_KEYS], crypto_box_PUBLICKEYBYTES);
+        copy[0].assoc4.timestamp = 1;
+        memcpy(cmp_public_key, keys[NUM_KEYS - 1], crypto_box_PUBLICKEYBYTES);
+        qsort(copy, length, sizeof(Client_data), old_cmp_entry);
+    }
+
+    double old_time = seconds(start);
+    start = clock();
+
+    for (r = 0; r < rounds; ++r) {
+        memcpy(copy, list, length * sizeof(Client_data));
+        memcpy(copy[0].public_key, keys[r % NUM_KEYS], crypto_box_PUBLICKEYBYTES);
+        copy[0].assoc4.timestamp = 1;
+        sort_by_distance(copy, length, sizeof(Client_data), offsetof(Client_data, public_key), keys[NUM_KEYS - 1],
+                         entry_rank);
+    }
+
+    report(name, old_time, seconds(start), rounds);
+    free(list);
+    free(copy);
+}
+
+int main(void)
+{
+    unsigned int i;
+
+    srand(time(NULL));
+
+    /* Give the keys common prefixes, like the ones of nodes close to each other in the DHT. */
+    for (i = 0; i < NUM_KEYS; ++i) {
+        randombytes(keys[i], crypto_box_PUBLICKEYBYTES);
+        memcpy(keys[i], keys[0], rand() % 8);
+    }
+
+    printf("%-28s %11s    %11s\n", "", "byte by byte", "whole key");
+    bench_closest();
+    bench_common_bits();
+    bench_sort("sort 8 entries", MAX_FRIEND_CLIENTS);
+    bench_sort("sort 160 entries", 160);
+    return 0;
+}
@@ -73,92 +73,14 @@
  */
 int id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
 {
-    size_t   i;
-    uint8_t distance1, distance2;
-
-    for (i = 0; i < crypto_box_PUBLICKEYBYTES; ++i) {
-
-        distance1 = pk[i] ^ pk1[i];
-        distance2 = pk[i] ^ pk2[i];
-
-        if (distance1 < distance2)
-            return 1;
-
-        if (distance1 > distance2)
-            return 2;
-    }
-
-    return 0;
+    return pk_distance_closest(pk, pk1, pk2);
 }
 
 /* Return index of first unequal bit number.
  */
 static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
 {
-    unsigned int i, j = 0;
-
-    for (i = 0; i < crypto_box_PUBLICKEYBYTES; ++i) {
-        if (pk1[i] == pk2[i])
-            continue;
-
-        for (j = 0; j < 8; ++j) {
-            if ((pk1[i] & (1 << (7 - j))) != (pk2[i] & (1 << (7 - j))))
-                break;
-        }
-
-        break;
-    }
-
-    return i * 8 + j;
-}
-
-/* Shared key generations are costly, it is therefor smart to store commonly used
- * ones so that they can re used later without being computed again.
- *
- * If shared key is already in shared_keys, copy it to shared_key.
- * else generate it into shared_key and copy it to shared_keys
- */
-void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key, const uint8_t *public_key)
-{
-    uint32_t i, num = ~0, curr = 0;
-
-    for (i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
-        int index = public_key[30] * MAX_KEYS_PER_SLOT + i;
-
-        if (shared_keys->keys[index].stored) {
-            if (public_key_cmp(public_key, shared_keys->keys[index].public_key) == 0) {
-                memcpy(shared_key, shared_keys->keys[index].shared_key, crypto_box_BEFORENMBYTES);
-                ++shared_keys->keys[index].times_requested;
-                shared_keys->keys[index].time_last_requested = unix_time();
-                return;
-            }
-
-            if (num != 0) {
-                if (is_timeout(shared_keys->keys[index].time_last_requested, KEYS_TIMEOUT)) {
-                    num = 0;
-                    curr = index;
-                } else if (num > shared_keys->keys[index].times_requested) {
-                    num = shared_keys->keys[index].times_requested;
-                    curr = index;
-                }
-            }
-        } else {
-            if (num != 0) {
-                num = 0;
-                curr = index;
-            }
-        }
-    }
-
-    encrypt_precompute(public_key, secret_key, shared_key);
-
-    if (num != (uint32_t)~0) {
-        shared_keys->keys[curr].stored = 1;
-        shared_keys->keys[curr].times_requested = 1;
-        memcpy(shared_keys->keys[curr].public_key, public_key, crypto_box_PUBLICKEYBYTES);
-        memcpy(shared_keys->keys[curr].shared_key, shared_key, crypto_box_BEFORENMBYTES);
-        shared_keys->keys[curr].time_last_requested = unix_time();
-    }
+    return pk_common_bits(pk1, pk2);
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -355,6 +277,42 @@ int unpack_nodes(Node_format *nodes, uint16_t max_num_nodes, uint16_t *processed
 
 
 
+/* Refresh the timestamp of client, which has the public key of the node at ip_port,
+ * and update its ip_port. i is the index of client in its list, for the logs.
+ */
+static void update_client(Client_data *client, uint32_t i, IP_Port ip_port, uint64_t temp_time)
+{
+    if (ip_port.ip.family == AF_INET) {
+
+        LOGGER_SCOPE( if (!ipport_equal(&client->assoc4.ip_port, &ip_port)) {
+        LOGGER_TRACE("coipil[%u]: switching ipv4 from %s:%u to %s:%u", i,
+                     ip_ntoa(&client->assoc4.ip_port.ip), ntohs(client->assoc4.ip_port.port),
+                     ip_ntoa(&ip_port.ip), ntohs(ip_port.port));
+        }
+                    );
+
+        if (LAN_ip(client->assoc4.ip_port.ip) != 0 && LAN_ip(ip_port.ip) == 0)
+            return;
+
+        client->assoc4.ip_port = ip_port;
+        client->assoc4.timestamp = temp_time;
+    } else if (ip_port.ip.family == AF_INET6) {
+
+        LOGGER_SCOPE( if (!ipport_equal(&client->assoc4.ip_port, &ip_port)) {
+        LOGGER_TRACE("coipil[%u]: switching ipv6 from %s:%u to %s:%u", i,
+                     ip_ntoa(&client->assoc6.ip_port.ip), ntohs(client->assoc6.ip_port.port),
+                     ip_ntoa(&ip_port.ip), ntohs(ip_port.port));
+        }
+                    );
+
+        if (LAN_ip(client->assoc6.ip_port.ip) != 0 && LAN_ip(ip_port.ip) == 0)
+            return;
+
+        client->assoc6.ip_port = ip_port;
+        client->assoc6.timestamp = temp_time;
+    }
+}
+
 /* Check if client with public_key is already in list of length length.
  * If it is then set its corresponding timestamp to current time.
  * If the id is already in the list with a different ip_port, update it.
@@ -370,37 +328,7 @@ static int client_or_ip_port_in_list(Client_data *list, uint16_t length, const u
     /* if public_key is in list, find it and maybe overwrite ip_port */
     for (i = 0; i < length; ++i)
         if (id_equal(list[i].public_key, public_key)) {
-            /* Refresh the client timestamp. */
-            if (ip_port.ip.family == AF_INET) {
-
-                LOGGER_SCOPE( if (!ipport_equal(&list[i].assoc4.ip_port, &ip_port)) {
-                LOGGER_TRACE("coipil[%u]: switching ipv4 from %s:%u to %s:%u", i,
-                             ip_ntoa(&list[i].assoc4.ip_port.ip), ntohs(list[i].assoc4.ip_port.port),
-                             ip_ntoa(&ip_port.ip), ntohs(ip_port.port));
-                }
-                            );
-
-                if (LAN_ip(list[i].assoc4.ip_port.ip) != 0 && LAN_ip(ip_port.ip) == 0)
-                    return 1;
-
-                list[i].assoc4.ip_port = ip_port;
-                list[i].assoc4.timestamp = temp_time;
-            } else if (ip_port.ip.family == AF_INET6) {
-
-                LOGGER_SCOPE( if (!ipport_equal(&list[i].assoc4.ip_port, &ip_port)) {
-                LOGGER_TRACE("coipil[%u]: switching ipv6 from %s:%u to %s:%u", i,
-                             ip_ntoa(&list[i].assoc6.ip_port.ip), ntohs(list[i].assoc6.ip_port.port),
-                             ip_ntoa(&ip_port.ip), ntohs(ip_port.port));
-                }
-                            );
-
-                if (LAN_ip(list[i].assoc6.ip_port.ip) != 0 && LAN_ip(ip_port.ip) == 0)
-                    return 1;
-
-                list[i].assoc6.ip_port = ip_port;
-                list[i].assoc6.timestamp = temp_time;
-            }
-
+            update_client(&list[i], i, ip_port, temp_time);
             return 1;
         }
 
@@ -436,6 +364,72 @@ static int client_or_ip_port_in_list(Client_data *list, uint16_t length, const u
     return 0;
 }
 
+/* return the bucket of the close list the node with public_key goes in. */
+static unsigned int close_bucket(const DHT *dht, const uint8_t *public_key)
+{
+    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
+
+    if (index >= LCLIENT_LENGTH)
+        index = LCLIENT_LENGTH - 1;
+
+    return index;
+}
+
+/* return the index of the node with public_key in the close list.
+ * return -1 if it isn't in it.
+ */
+static int close_list_find(const DHT *dht, const uint8_t *public_key)
+{
+    return hash_list_find(&dht->close_clientlist_index, public_key);
+}
+
+/* Put public_key in entry index of the close list, in place of the node that was there. */
+static void close_list_set_public_key(DHT *dht, uint32_t index, const uint8_t *public_key)
+{
+    Client_data *client = &dht->close_clientlist[index];
+
+    hash_list_remove(&dht->close_clientlist_index, client->public_key, index);
+    id_copy(client->public_key, public_key);
+
+    if (!hash_list_add(&dht->close_clientlist_index, public_key, index)) {
+        LOGGER_ERROR("close list index: failed to add node");
+    }
+
+    unsigned int bucket = index / dht->close_bucket_size;
+
+    if (bucket >= dht->close_buckets_used)
+        dht->close_buckets_used = bucket + 1;
+}
+
+/* Rebuild the index of the close list after changing it as a whole. */
+static void close_list_reindex(DHT *dht)
+{
+    static const uint8_t empty_public_key[crypto_box_PUBLICKEYBYTES];
+    uint32_t i;
+
+    hash_list_clear(&dht->close_clientlist_index);
+    dht->close_buckets_used = 0;
+
+    for (i = 0; i < dht->close_clientlist_length; ++i) {
+        if (public_key_cmp(dht->close_clientlist[i].public_key, empty_public_key) != 0)
+            close_list_set_public_key(dht, i, dht->close_clientlist[i].public_key);
+    }
+}
+
+/* Same as client_or_ip_port_in_list() for the close list, which is only searched by public key:
+ * a node that changes its public key on the same ip_port is added again and its old entry goes bad.
+ */
+static int client_in_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port)
+{
+    int index = close_list_find(dht, public_key);
+
+    if (index == -1)
+        return 0;
+
+    update_client(&dht->close_clientlist[index], index, ip_port, unix_time());
+    return 1;
+}
+
 /* Check if client with public_key is already in node format list of length length.
  *
  *  return 1 if true.
@@ -458,14 +452,7 @@ static int client_in_nodelist(const Node_format *list, uint16_t length, const ui
  */
 static int friend_number(const DHT *dht, const uint8_t *public_key)
 {
-    uint32_t i;
-
-    for (i = 0; i < dht->num_friends; ++i) {
-        if (id_equal(dht->friends_list[i].public_key, public_key))
-            return i;
-    }
-
-    return -1;
+    return hash_list_find(&dht->friends_index, public_key);
 }
 
 /* Add node to the node list making sure only the nodes closest to cmp_pk are in the list.
@@ -473,26 +460,31 @@ static int friend_number(const DHT *dht, const uint8_t *public_key)
 _Bool add_to_list(Node_format *nodes_list, unsigned int length, const uint8_t *pk, IP_Port ip_port,
                   const uint8_t *cmp_pk)
 {
-    uint8_t pk_bak[crypto_box_PUBLICKEYBYTES];
-    IP_Port ip_port_bak;
+    Node_format node, node_bak;
+    PK_Distance distance, list_distance;
+    _Bool added = 0;
 
     unsigned int i;
 
-    for (i = 0; i < length; ++i) {
-        if (id_closest(cmp_pk, nodes_list[i].public_key, pk) == 2) {
-            memcpy(pk_bak, nodes_list[i].public_key, crypto_box_PUBLICKEYBYTES);
-            ip_port_bak = nodes_list[i].ip_port;
-            memcpy(nodes_list[i].public_key, pk, crypto_box_PUBLICKEYBYTES);
-            nodes_list[i].ip_port = ip_port;
-
-            if (i != (length - 1))
-                add_to_list(nodes_list, length, pk_bak, ip_port_bak, cmp_pk);
+    memcpy(node.public_key, pk, crypto_box_PUBLICKEYBYTES);
+    node.ip_port = ip_port;
+    pk_distance(&distance, pk, cmp_pk);
 
-            return 1;
+    /* The node takes the place of the first one further than it, which then does the same
+     * in the rest of the list, until the last one falls off. */
+    for (i = 0; i < length; ++i) {
+        pk_distance(&list_distance, nodes_list[i].public_key, cmp_pk);
+
+        if (pk_distance_cmp(&list_distance, &distance) > 0) {
+            node_bak = nodes_list[i];
+            nodes_list[i] = node;
+            node = node_bak;
+            distance = list_distance;
+            added = 1;
         }
     }
 
-    return 0;
+    return added;
 }
 
 /*TODO: change this to 7 when done*/
@@ -571,8 +563,10 @@ static void get_close_nodes_inner(const uint8_t *public_key, Node_format *nodes_
 /* Find MAX_SENT_NODES nodes closest to the public_key for the send nodes request:
  * put them in the nodes_list and return how many were found.
  *
- * TODO: For the love of based <your favorite deity, in doubt use "love"> make
- * this function cleaner and much more efficient.
+ * The nodes of bucket b of the close list have exactly b bits in common with us, so if
+ * public_key has p bits in common with us: the nodes of bucket p are the closest to it,
+ * then the ones of the buckets after p (which all have p bits in common with it), then
+ * bucket p - 1, p - 2... Only as many buckets as needed to find MAX_SENT_NODES are searched.
  *
  * want_good : do we want only good nodes as checked with the hardening returned or not?
  */
@@ -580,8 +574,21 @@ static int get_somewhat_close_nodes(const DHT *dht, const uint8_t *public_key, N
                                     sa_family_t sa_family, uint8_t is_LAN, uint8_t want_good)
 {
     uint32_t num_nodes = 0, i;
-    get_close_nodes_inner(public_key, nodes_list, sa_family,
-                          dht->close_clientlist, LCLIENT_LIST, &num_nodes, is_LAN, 0);
+    unsigned int bucket = close_bucket(dht, public_key);
+    uint16_t bucket_size = dht->close_bucket_size;
+
+    if (bucket < dht->close_buckets_used) {
+        get_close_nodes_inner(public_key, nodes_list, sa_family, &dht->close_clientlist[bucket * bucket_size],
+                              (dht->close_buckets_used - bucket) * bucket_size, &num_nodes, is_LAN, 0);
+    } else {
+        bucket = dht->close_buckets_used;
+    }
+
+    while (bucket > 0 && num_nodes < MAX_SENT_NODES) {
+        --bucket;
+        get_close_nodes_inner(public_key, nodes_list, sa_family, &dht->close_clientlist[bucket * bucket_size],
+                              bucket_size, &num_nodes, is_LAN, 0);
+    }
 
     /*TODO uncomment this when hardening is added to close friend clients
         for (i = 0; i < dht->num_friends; ++i)
@@ -657,46 +664,19 @@ int get_close_nodes(const DHT *dht, const uint8_t *public_key, Node_format *node
 #endif
 }
 
-static uint8_t cmp_public_key[crypto_box_PUBLICKEYBYTES];
-static int cmp_dht_entry(const void *a, const void *b)
+/* Sort rank of a client list entry: bad nodes first, then nodes that fail hardening. */
+static unsigned int dht_entry_rank(const void *entry)
 {
-    Client_data entry1, entry2;
-    memcpy(&entry1, a, sizeof(Client_data));
-    memcpy(&entry2, b, sizeof(Client_data));
-    int t1 = is_timeout(entry1.assoc4.timestamp, BAD_NODE_TIMEOUT) && is_timeout(entry1.assoc6.timestamp, BAD_NODE_TIMEOUT);
-    int t2 = is_timeout(entry2.assoc4.timestamp, BAD_NODE_TIMEOUT) && is_timeout(entry2.assoc6.timestamp, BAD_NODE_TIMEOUT);
+    const Client_data *client = entry;
 
-    if (t1 && t2)
+    if (is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT) && is_timeout(client->assoc6.timestamp, BAD_NODE_TIMEOUT))
         return 0;
 
-    if (t1)
-        return -1;
-
-    if (t2)
+    if (hardening_correct(&client->assoc4.hardening) != HARDENING_ALL_OK
+            && hardening_correct(&client->assoc6.hardening) != HARDENING_ALL_OK)
         return 1;
 
-    t1 = hardening_correct(&entry1.assoc4.hardening) != HARDENING_ALL_OK
-         && hardening_correct(&entry1.assoc6.hardening) != HARDENING_ALL_OK;
-    t2 = hardening_correct(&entry2.assoc4.hardening) != HARDENING_ALL_OK
-         && hardening_correct(&entry2.assoc6.hardening) != HARDENING_ALL_OK;
-
-    if (t1 != t2) {
-        if (t1)
-            return -1;
-
-        if (t2)
-            return 1;
-    }
-
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
-
-    if (close == 1)
-        return 1;
-
-    if (close == 2)
-        return -1;
-
-    return 0;
+    return 2;
 }
 
 /* Is it ok to store node with public_key in client.
@@ -716,8 +696,8 @@ static unsigned int store_node_ok(const Client_data *client, const uint8_t *publ
 
 static void sort_client_list(Client_data *list, unsigned int length, const uint8_t *comp_public_key)
 {
-    memcpy(cmp_public_key, comp_public_key, crypto_box_PUBLICKEYBYTES);
-    qsort(list, length, sizeof(Client_data), cmp_dht_entry);
+    sort_by_distance(list, length, sizeof(Client_data), offsetof(Client_data, public_key), comp_public_key,
+                     dht_entry_rank);
 }
 
 /* Replace a first bad (or empty) node with this one
@@ -786,13 +766,10 @@ static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, _B
 {
     unsigned int i;
 
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
-
-    if (index > LCLIENT_LENGTH)
-        index = LCLIENT_LENGTH - 1;
+    unsigned int index = close_bucket(dht, public_key) * dht->close_bucket_size;
 
-    for (i = 0; i < LCLIENT_NODES; ++i) {
-        Client_data *client = &dht->close_clientlist[(index * LCLIENT_NODES) + i];
+    for (i = 0; i < dht->close_bucket_size; ++i) {
+        Client_data *client = &dht->close_clientlist[index + i];
 
         if (is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT) && is_timeout(client->assoc6.timestamp, BAD_NODE_TIMEOUT)) {
             if (!simulate) {
@@ -807,7 +784,7 @@ static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, _B
                     ipptp_clear = &client->assoc4;
                 }
 
-                id_copy(client->public_key, public_key);
+                close_list_set_public_key(dht, index + i, public_key);
                 ipptp_write->ip_port = ip_port;
                 ipptp_write->timestamp = unix_time();
 
@@ -837,6 +814,24 @@ _Bool node_addable_to_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip
     return 0;
 }
 
+/* Return 1 if node is a good node of the close list at ip_port, 0 if it isn't.
+ */
+_Bool node_in_close_list(const DHT *dht, const uint8_t *public_key, IP_Port ip_port)
+{
+    int index = close_list_find(dht, public_key);
+
+    if (index == -1)
+        return 0;
+
+    const Client_data *client = &dht->close_clientlist[index];
+    const IPPTsPng *assoc = ip_port.ip.family == AF_INET ? &client->assoc4 : &client->assoc6;
+
+    if (is_timeout(assoc->timestamp, BAD_NODE_TIMEOUT))
+        return 0;
+
+    return ipport_equal(&assoc->ip_port, &ip_port);
+}
+
 static _Bool is_pk_in_client_list(Client_data *list, unsigned int client_list_length, const uint8_t *public_key,
                                   IP_Port ip_port)
 {
@@ -929,7 +924,7 @@ int addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
     /* NOTE: Current behavior if there are two clients with the same id is
      * to replace the first ip by the second.
      */
-    if (!client_or_ip_port_in_list(dht->close_clientlist, LCLIENT_LIST, public_key, ip_port)) {
+    if (!client_in_close_list(dht, public_key, ip_port)) {
         if (add_to_close(dht, public_key, ip_port, 0))
             used++;
     } else
@@ -992,7 +987,7 @@ int addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
  */
 static int returnedip_ports(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const uint8_t *nodepublic_key)
 {
-    uint32_t i, j;
+    uint32_t j;
     uint64_t temp_time = unix_time();
 
     uint32_t used = 0;
@@ -1004,42 +999,42 @@ static int returnedip_ports(DHT *dht, IP_Port ip_port, const uint8_t *public_key
     }
 
     if (id_equal(public_key, dht->self_public_key)) {
-        for (i = 0; i < LCLIENT_LIST; ++i) {
-            if (id_equal(nodepublic_key, dht->close_clientlist[i].public_key)) {
+        int index = close_list_find(dht, nodepublic_key);
+
+        if (index != -1) {
+            Client_data *client = &dht->close_clientlist[index];
+
+            if (ip_port.ip.family == AF_INET) {
+                client->assoc4.ret_ip_port = ip_port;
+                client->assoc4.ret_timestamp = temp_time;
+            } else if (ip_port.ip.family == AF_INET6) {
+                client->assoc6.ret_ip_port = ip_port;
+                client->assoc6.ret_timestamp = temp_time;
+            }
+
+            ++used;
+        }
+    } else {
+        int friend_num = friend_number(dht, public_key);
+
+        for (j = 0; friend_num != -1 && j < MAX_FRIEND_CLIENTS; ++j) {
+            Client_data *client = &dht->friends_list[friend_num].client_list[j];
+
+            if (id_equal(nodepublic_key, client->public_key)) {
                 if (ip_port.ip.family == AF_INET) {
-                    dht->close_clientlist[i].assoc4.ret_ip_port = ip_port;
-                    dht->close_clientlist[i].assoc4.ret_timestamp = temp_time;
+                    client->assoc4.ret_ip_port = ip_port;
+                    client->assoc4.ret_timestamp = temp_time;
                 } else if (ip_port.ip.family == AF_INET6) {
-                    dht->close_clientlist[i].assoc6.ret_ip_port = ip_port;
-                    dht->close_clientlist[i].assoc6.ret_timestamp = temp_time;
+                    client->assoc6.ret_ip_port = ip_port;
+                    client->assoc6.ret_timestamp = temp_time;
                 }
 
                 ++used;
                 break;
             }
         }
-    } else {
-        for (i = 0; i < dht->num_friends; ++i) {
-            if (id_equal(public_key, dht->friends_list[i].public_key)) {
-                for (j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
-                    if (id_equal(nodepublic_key, dht->friends_list[i].client_list[j].public_key)) {
-                        if (ip_port.ip.family == AF_INET) {
-                            dht->friends_list[i].client_list[j].assoc4.ret_ip_port = ip_port;
-                            dht->friends_list[i].client_list[j].assoc4.ret_timestamp = temp_time;
-                        } else if (ip_port.ip.family == AF_INET6) {
-                            dht->friends_list[i].client_list[j].assoc6.ret_ip_port = ip_port;
-                            dht->friends_list[i].client_list[j].assoc6.ret_timestamp = temp_time;
-                        }
-
-                        ++used;
-                        goto end;
-                    }
-                }
-            }
-        }
     }
 
-end:
 #ifdef ENABLE_ASSOC_DHT
 
     if (dht->assoc) {
@@ -1345,6 +1340,10 @@ int DHT_addfriend(DHT *dht, const uint8_t *public_key, void (*ip_callback)(void
         return -1;
 
     dht->friends_list = temp;
+
+    if (!hash_list_add(&dht->friends_index, public_key, dht->num_friends))
+        return -1;
+
     DHT_Friend *friend = &dht->friends_list[dht->num_friends];
     memset(friend, 0, sizeof(DHT_Friend));
     memcpy(friend->public_key, public_key, crypto_box_PUBLICKEYBYTES);
@@ -1387,12 +1386,16 @@ int DHT_delfriend(DHT *dht, const uint8_t *public_key, uint16_t lock_count)
 
     DHT_Friend *temp;
 
+    hash_list_remove(&dht->friends_index, public_key, friend_num);
     --dht->num_friends;
 
     if (dht->num_friends != friend_num) {
         memcpy( &dht->friends_list[friend_num],
                 &dht->friends_list[dht->num_friends],
                 sizeof(DHT_Friend) );
+
+        hash_list_remove(&dht->friends_index, dht->friends_list[friend_num].public_key, dht->num_friends);
+        hash_list_add(&dht->friends_index, dht->friends_list[friend_num].public_key, friend_num);
     }
 
     if (dht->num_friends == 0) {
@@ -1410,50 +1413,77 @@ int DHT_delfriend(DHT *dht, const uint8_t *public_key, uint16_t lock_count)
     return 0;
 }
 
-/* TODO: Optimize this. */
 int DHT_getfriendip(const DHT *dht, const uint8_t *public_key, IP_Port *ip_port)
 {
-    uint32_t i, j;
+    uint32_t j;
 
     ip_reset(&ip_port->ip);
     ip_port->port = 0;
 
-    for (i = 0; i < dht->num_friends; ++i) {
-        /* Equal */
-        if (id_equal(dht->friends_list[i].public_key, public_key)) {
-            for (j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
-                Client_data *client = &dht->friends_list[i].client_list[j];
-
-                if (id_equal(client->public_key, public_key)) {
-                    IPPTsPng *assoc = NULL;
-                    uint32_t a;
-
-                    for (a = 0, assoc = &client->assoc6; a < 2; a++, assoc = &client->assoc4)
-                        if (!is_timeout(assoc->timestamp, BAD_NODE_TIMEOUT)) {
-                            *ip_port = assoc->ip_port;
-                            return 1;
-                        }
-                }
-            }
+    int friend_num = friend_number(dht, public_key);
 
-            return 0;
+    if (friend_num == -1)
+        return -1;
+
+    for (j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
+        Client_data *client = &dht->friends_list[friend_num].client_list[j];
+
+        if (id_equal(client->public_key, public_key)) {
+            IPPTsPng *assoc = NULL;
+            uint32_t a;
+
+            for (a = 0, assoc = &client->assoc6; a < 2; a++, assoc = &client->assoc4)
+                if (!is_timeout(assoc->timestamp, BAD_NODE_TIMEOUT)) {
+                    *ip_port = assoc->ip_port;
+                    return 1;
+                }
         }
     }
 
-    return -1;
+    return 0;
+}
+
+/* Make room for size good nodes in dht->good_clients and dht->good_assocs.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int reserve_good_nodes(DHT *dht, uint32_t size)
+{
+    if (size <= dht->good_nodes_size)
+        return 0;
+
+    Client_data **clients = realloc(dht->good_clients, size * sizeof(Client_data *));
+
+    if (clients == NULL)
+        return -1;
+
+    dht->good_clients = clients;
+
+    IPPTsPng **assocs = realloc(dht->good_assocs, size * sizeof(IPPTsPng *));
+
+    if (assocs == NULL)
+        return -1;
+
+    dht->good_assocs = assocs;
+    dht->good_nodes_size = size;
+    return 0;
 }
 
 /* returns number of nodes not in kill-timeout */
-static uint8_t do_ping_and_sendnode_requests(DHT *dht, uint64_t *lastgetnode, const uint8_t *public_key,
+static uint32_t do_ping_and_sendnode_requests(DHT *dht, uint64_t *lastgetnode, const uint8_t *public_key,
         Client_data *list, uint32_t list_count, uint32_t *bootstrap_times, _Bool sortable)
 {
     uint32_t i;
-    uint8_t not_kill = 0;
+    uint32_t not_kill = 0;
     uint64_t temp_time = unix_time();
 
+    /* If this fails only the nodes there is room for are picked from. */
+    reserve_good_nodes(dht, list_count * 2);
+
     uint32_t num_nodes = 0;
-    Client_data *client_list[list_count * 2];
-    IPPTsPng    *assoc_list[list_count * 2];
+    Client_data **client_list = dht->good_clients;
+    IPPTsPng    **assoc_list = dht->good_assocs;
     unsigned int sort = 0;
     _Bool sort_ok = 0;
 
@@ -1474,7 +1504,7 @@ static uint8_t do_ping_and_sendnode_requests(DHT *dht, uint64_t *lastgetnode, co
                 }
 
                 /* If node is good. */
-                if (!is_timeout(assoc->timestamp, BAD_NODE_TIMEOUT)) {
+                if (!is_timeout(assoc->timestamp, BAD_NODE_TIMEOUT) && num_nodes < dht->good_nodes_size) {
                     client_list[num_nodes] = client;
                     assoc_list[num_nodes] = assoc;
                     ++num_nodes;
@@ -1543,8 +1573,9 @@ static void do_Close(DHT *dht)
 
     dht->num_to_bootstrap = 0;
 
-    uint8_t not_killed = do_ping_and_sendnode_requests(dht, &dht->close_lastgetnodes, dht->self_public_key,
-                         dht->close_clientlist, LCLIENT_LIST, &dht->close_bootstrap_times, 0);
+    uint32_t not_killed = do_ping_and_sendnode_requests(dht, &dht->close_lastgetnodes, dht->self_public_key,
+                          dht->close_clientlist, dht->close_buckets_used * dht->close_bucket_size,
+                          &dht->close_bootstrap_times, 0);
 
     if (!not_killed) {
         /* all existing nodes are at least KILL_NODE_TIMEOUT,
@@ -1556,7 +1587,7 @@ static void do_Close(DHT *dht)
         uint64_t badonly = unix_time() - BAD_NODE_TIMEOUT;
         size_t i, a;
 
-        for (i = 0; i < LCLIENT_LIST; i++) {
+        for (i = 0; i < dht->close_clientlist_length; i++) {
             Client_data *client = &dht->close_clientlist[i];
             IPPTsPng *assoc;
 
@@ -1621,20 +1652,17 @@ int DHT_bootstrap_from_address(DHT *dht, const char *address, uint8_t ipv6enable
  */
 int route_packet(const DHT *dht, const uint8_t *public_key, const uint8_t *packet, uint16_t length)
 {
-    uint32_t i;
+    int index = close_list_find(dht, public_key);
 
-    for (i = 0; i < LCLIENT_LIST; ++i) {
-        if (id_equal(public_key, dht->close_clientlist[i].public_key)) {
-            const Client_data *client = &dht->close_clientlist[i];
+    if (index == -1)
+        return -1;
 
-            if (ip_isset(&client->assoc6.ip_port.ip))
-                return sendpacket(dht->net, client->assoc6.ip_port, packet, length);
-            else if (ip_isset(&client->assoc4.ip_port.ip))
-                return sendpacket(dht->net, client->assoc4.ip_port, packet, length);
-            else
-                break;
-        }
-    }
+    const Client_data *client = &dht->close_clientlist[index];
+
+    if (ip_isset(&client->assoc6.ip_port.ip))
+        return sendpacket(dht->net, client->assoc6.ip_port, packet, length);
+    else if (ip_isset(&client->assoc4.ip_port.ip))
+        return sendpacket(dht->net, client->assoc4.ip_port, packet, length);
 
     return -1;
 }
@@ -2076,20 +2104,17 @@ static int send_hardening_getnode_res(const DHT *dht, const Node_format *sendto,
     return sendpacket(dht->net, sendto->ip_port, packet, len);
 }
 
-/* TODO: improve */
 static IPPTsPng *get_closelist_IPPTsPng(DHT *dht, const uint8_t *public_key, sa_family_t sa_family)
 {
-    uint32_t i;
+    int index = close_list_find(dht, public_key);
 
-    for (i = 0; i < LCLIENT_LIST; ++i) {
-        if (public_key_cmp(dht->close_clientlist[i].public_key, public_key) != 0)
-            continue;
+    if (index == -1)
+        return NULL;
 
-        if (sa_family == AF_INET)
-            return &dht->close_clientlist[i].assoc4;
-        else if (sa_family == AF_INET6)
-            return &dht->close_clientlist[i].assoc6;
-    }
+    if (sa_family == AF_INET)
+        return &dht->close_clientlist[index].assoc4;
+    else if (sa_family == AF_INET6)
+        return &dht->close_clientlist[index].assoc6;
 
     return NULL;
 }
@@ -2282,14 +2307,14 @@ uint16_t randfriends_nodes(DHT *dht, Node_format *nodes, uint16_t max_num)
  */
 uint16_t closelist_nodes(DHT *dht, Node_format *nodes, uint16_t max_num)
 {
-    return list_nodes(dht->close_clientlist, LCLIENT_LIST, nodes, max_num);
+    return list_nodes(dht->close_clientlist, dht->close_clientlist_length, nodes, max_num);
 }
 
 void do_hardening(DHT *dht)
 {
     uint32_t i;
 
-    for (i = 0; i < LCLIENT_LIST * 2; ++i) {
+    for (i = 0; i < dht->close_clientlist_length * 2; ++i) {
         IPPTsPng  *cur_iptspng;
         sa_family_t sa_family;
         uint8_t   *public_key = dht->close_clientlist[i / 2].public_key;
@@ -2393,6 +2418,24 @@ DHT *new_DHT(Networking_Core *net)
         return NULL;
 
     dht->net = net;
+    dht->close_clientlist = calloc(LCLIENT_LIST, sizeof(Client_data));
+    dht->close_clientlist_length = LCLIENT_LIST;
+    dht->close_bucket_size = LCLIENT_NODES;
+
+    if (dht->close_clientlist == NULL
+            || !hash_list_init(&dht->close_clientlist_index, crypto_box_PUBLICKEYBYTES, LCLIENT_LIST)
+            || !hash_list_init(&dht->friends_index, crypto_box_PUBLICKEYBYTES, DHT_FAKE_FRIEND_NUMBER)
+            || shared_keys_init(&dht->shared_keys_recv, SHARED_KEYS_DEFAULT_SIZE) == -1
+            || shared_keys_init(&dht->shared_keys_sent, SHARED_KEYS_DEFAULT_SIZE) == -1) {
+        hash_list_free(&dht->close_clientlist_index);
+        hash_list_free(&dht->friends_index);
+        shared_keys_free(&dht->shared_keys_recv);
+        shared_keys_free(&dht->shared_keys_sent);
+        free(dht->close_clientlist);
+        free(dht);
+        return NULL;
+    }
+
     dht->ping = new_ping(dht);
 
     if (dht->ping == NULL) {
@@ -2469,9 +2512,65 @@ void kill_DHT(DHT *dht)
     kill_ping(dht->ping);
     free(dht->friends_list);
     free(dht->loaded_nodes_list);
+    hash_list_free(&dht->close_clientlist_index);
+    hash_list_free(&dht->friends_index);
+    shared_keys_free(&dht->shared_keys_recv);
+    shared_keys_free(&dht->shared_keys_sent);
+    free(dht->close_clientlist);
+    free(dht->good_clients);
+    free(dht->good_assocs);
     free(dht);
 }
 
+int DHT_set_close_bucket_size(DHT *dht, uint16_t bucket_size)
+{
+    if (bucket_size == 0 || bucket_size > MAX_LCLIENT_NODES)
+        return -1;
+
+    if (bucket_size == dht->close_bucket_size)
+        return 0;
+
+    Client_data *list = calloc(LCLIENT_LENGTH * bucket_size, sizeof(Client_data));
+
+    if (list == NULL)
+        return -1;
+
+    uint16_t keep = MIN(bucket_size, dht->close_bucket_size);
+    uint32_t i;
+
+    for (i = 0; i < LCLIENT_LENGTH; ++i) {
+        memcpy(&list[i * bucket_size], &dht->close_clientlist[i * dht->close_bucket_size], keep * sizeof(Client_data));
+    }
+
+    free(dht->close_clientlist);
+    dht->close_clientlist = list;
+    dht->close_clientlist_length = LCLIENT_LENGTH * bucket_size;
+    dht->close_bucket_size = bucket_size;
+    close_list_reindex(dht);
+    return 0;
+}
+
+int DHT_copy_close_list(DHT *dht, const Client_data *list, uint32_t length)
+{
+    if (length == 0 || length % LCLIENT_LENGTH != 0 || length / LCLIENT_LENGTH > MAX_LCLIENT_NODES)
+        return -1;
+
+    if (length != dht->close_clientlist_length) {
+        Client_data *new_list = realloc(dht->close_clientlist, length * sizeof(Client_data));
+
+        if (new_list == NULL)
+            return -1;
+
+        dht->close_clientlist = new_list;
+        dht->close_clientlist_length = length;
+        dht->close_bucket_size = length / LCLIENT_LENGTH;
+    }
+
+    memcpy(dht->close_clientlist, list, length * sizeof(Client_data));
+    close_list_reindex(dht);
+    return 0;
+}
+
 /* new DHT format for load/save, more robust and forward compatible */
 //TODO: Move this closer to Messenger.
 #define DHT_STATE_COOKIE_GLOBAL 0x159000d
@@ -2479,16 +2578,21 @@ void kill_DHT(DHT *dht)
 #define DHT_STATE_COOKIE_TYPE      0x11ce
 #define DHT_STATE_TYPE_NODES       4
 
-#define MAX_SAVED_DHT_NODES (((DHT_FAKE_FRIEND_NUMBER * MAX_FRIEND_CLIENTS) + LCLIENT_LIST) * 2)
+/* Only the first MAX_SAVED_CLOSE_NODES nodes of close lists with bigger buckets are saved. */
+#define MAX_SAVED_CLOSE_NODES (LCLIENT_LIST * 2)
+#define MAX_SAVED_DHT_NODES ((DHT_FAKE_FRIEND_NUMBER * MAX_FRIEND_CLIENTS * 2) + MAX_SAVED_CLOSE_NODES)
 
 /* Get the size of the DHT (for saving). */
 uint32_t DHT_size(const DHT *dht)
 {
     uint32_t numv4 = 0, numv6 = 0, i, j;
 
-    for (i = 0; i < LCLIENT_LIST; ++i) {
-        numv4 += (dht->close_clientlist[i].assoc4.timestamp != 0);
-        numv6 += (dht->close_clientlist[i].assoc6.timestamp != 0);
+    for (i = 0; i < dht->close_clientlist_length; ++i) {
+        if (numv4 + numv6 < MAX_SAVED_CLOSE_NODES)
+            numv4 += (dht->close_clientlist[i].assoc4.timestamp != 0);
+
+        if (numv4 + numv6 < MAX_SAVED_CLOSE_NODES)
+            numv6 += (dht->close_clientlist[i].assoc6.timestamp != 0);
     }
 
     for (i = 0; i < DHT_FAKE_FRIEND_NUMBER && i < dht->num_friends; ++i) {
@@ -2530,14 +2634,14 @@ void DHT_save(DHT *dht, uint8_t *data)
 
     Node_format clients[MAX_SAVED_DHT_NODES];
 
-    for (num = 0, i = 0; i < LCLIENT_LIST; ++i) {
-        if (dht->close_clientlist[i].assoc4.timestamp != 0) {
+    for (num = 0, i = 0; i < dht->close_clientlist_length; ++i) {
+        if (num < MAX_SAVED_CLOSE_NODES && dht->close_clientlist[i].assoc4.timestamp != 0) {
             memcpy(clients[num].public_key, dht->close_clientlist[i].public_key, crypto_box_PUBLICKEYBYTES);
             clients[num].ip_port = dht->close_clientlist[i].assoc4.ip_port;
             ++num;
         }
 
-        if (dht->close_clientlist[i].assoc6.timestamp != 0) {
+        if (num < MAX_SAVED_CLOSE_NODES && dht->close_clientlist[i].assoc6.timestamp != 0) {
             memcpy(clients[num].public_key, dht->close_clientlist[i].public_key, crypto_box_PUBLICKEYBYTES);
             clients[num].ip_port = dht->close_clientlist[i].assoc6.ip_port;
             ++num;
@@ -2663,7 +2767,7 @@ int DHT_isconnected(const DHT *dht)
     uint32_t i;
     unix_time_update();
 
-    for (i = 0; i < LCLIENT_LIST; ++i) {
+    for (i = 0; i < dht->close_clientlist_length; ++i) {
         const Client_data *client = &dht->close_clientlist[i];
 
         if (!is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT) ||
@@ -2682,7 +2786,7 @@ int DHT_non_lan_connected(const DHT *dht)
     uint32_t i;
     unix_time_update();
 
-    for (i = 0; i < LCLIENT_LIST; ++i) {
+    for (i = 0; i < dht->close_clientlist_length; ++i) {
         const Client_data *client = &dht->close_clientlist[i];
 
         if (!is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT) && LAN_ip(client->assoc4.ip_port.ip) == -1)
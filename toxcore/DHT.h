@@ -27,16 +27,26 @@
 #include "crypto_core.h"
 #include "network.h"
 #include "ping_array.h"
+#include "hash_list.h"
+#include "distance.h"
+#include "shared_keys.h"
 
 /* Maximum number of clients stored per friend. */
 #define MAX_FRIEND_CLIENTS 8
 
+/* The close list is a table of LCLIENT_LENGTH buckets: bucket i holds the nodes whose public key
+ * has exactly its first i bits in common with ours (the last bucket also holds the closer ones).
+ * Buckets hold LCLIENT_NODES nodes unless changed with DHT_set_close_bucket_size().
+ */
 #define LCLIENT_NODES (MAX_FRIEND_CLIENTS)
 #define LCLIENT_LENGTH 128
 
-/* A list of the clients mathematically closest to ours. */
+/* Default size of the list of the clients mathematically closest to ours. */
 #define LCLIENT_LIST (LCLIENT_LENGTH * LCLIENT_NODES)
 
+/* Maximum number of nodes per bucket of the close list (the list is walked with arrays on the stack). */
+#define MAX_LCLIENT_NODES 64
+
 #define MAX_CLOSE_TO_BOOTSTRAP_NODES 8
 
 /* The max number of nodes to send with send nodes. */
@@ -180,20 +190,6 @@ int unpack_nodes(Node_format *nodes, uint16_t max_num_nodes, uint16_t *processed
                  uint16_t length, uint8_t tcp_enabled);
 
 
-/*----------------------------------------------------------------------------------*/
-/* struct to store some shared keys so we don't have to regenerate them for each request. */
-#define MAX_KEYS_PER_SLOT 4
-#define KEYS_TIMEOUT 600
-typedef struct {
-    struct {
-        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
-        uint8_t shared_key[crypto_box_BEFORENMBYTES];
-        uint32_t times_requested;
-        uint8_t  stored; /* 0 if not, 1 if is */
-        uint64_t time_last_requested;
-    } keys[256 * MAX_KEYS_PER_SLOT];
-} Shared_Keys;
-
 /*----------------------------------------------------------------------------------*/
 
 typedef int (*cryptopacket_handler_callback)(void *object, IP_Port ip_port, const uint8_t *source_pubkey,
@@ -207,10 +203,21 @@ typedef struct {
 typedef struct {
     Networking_Core *net;
 
-    Client_data    close_clientlist[LCLIENT_LIST];
+    Client_data    *close_clientlist;
+    uint32_t       close_clientlist_length; /* LCLIENT_LENGTH * close_bucket_size */
+    uint16_t       close_bucket_size;
+    uint16_t       close_buckets_used; /* 1 + the index of the last bucket with a node */
+    HASH_LIST      close_clientlist_index; /* public key -> index in close_clientlist */
     uint64_t       close_lastgetnodes;
     uint32_t       close_bootstrap_times;
 
+    /* Good nodes found by do_ping_and_sendnode_requests(), kept here since the close list is
+     * too big for them to go on the stack.
+     */
+    Client_data  **good_clients;
+    IPPTsPng     **good_assocs;
+    uint32_t       good_nodes_size;
+
     /* Note: this key should not be/is not used to transmit any sensitive materials */
     uint8_t      secret_symmetric_key[crypto_box_KEYBYTES];
     /* DHT keypair */
@@ -219,6 +226,7 @@ typedef struct {
 
     DHT_Friend    *friends_list;
     uint16_t       num_friends;
+    HASH_LIST      friends_index; /* public key -> index in friends_list */
 
     Node_format   *loaded_nodes_list;
     uint32_t       loaded_num_nodes;
@@ -242,14 +250,6 @@ typedef struct {
 } DHT;
 /*----------------------------------------------------------------------------------*/
 
-/* Shared key generations are costly, it is therefor smart to store commonly used
- * ones so that they can re used later without being computed again.
- *
- * If shared key is already in shared_keys, copy it to shared_key.
- * else generate it into shared_key and copy it to shared_keys
- */
-void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key,
-                    const uint8_t *public_key);
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
  * for packets that we receive.
@@ -316,6 +316,10 @@ _Bool add_to_list(Node_format *nodes_list, unsigned int length, const uint8_t *p
  */
 _Bool node_addable_to_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port);
 
+/* Return 1 if node is a good node of the close list at ip_port, 0 if it isn't.
+ */
+_Bool node_in_close_list(const DHT *dht, const uint8_t *public_key, IP_Port ip_port);
+
 /* Get the (maximum MAX_SENT_NODES) closest nodes to public_key we know
  * and put them in nodes_list (must be MAX_SENT_NODES big).
  *
@@ -411,6 +415,23 @@ DHT *new_DHT(Networking_Core *net);
 
 void kill_DHT(DHT *dht);
 
+/* Set the number of nodes (at most MAX_LCLIENT_NODES) each bucket of the close list can hold,
+ * so that it holds LCLIENT_LENGTH * bucket_size nodes. Bootstrap nodes use bigger buckets to
+ * know more of the network.
+ *
+ *  return -1 on failure.
+ *  return 0 on success.
+ */
+int DHT_set_close_bucket_size(DHT *dht, uint16_t bucket_size);
+
+/* Replace the close list of dht with a copy of list, the close list of another DHT with the same
+ * public key (for threads that answer requests for it). length is its close_clientlist_length.
+ *
+ *  return -1 on failure.
+ *  return 0 on success.
+ */
+int DHT_copy_close_list(DHT *dht, const Client_data *list, uint32_t length);
+
 /*  return 0 if we are not connected to the DHT.
  *  return 1 if we are.
  */
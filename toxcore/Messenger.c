@@ -78,15 +78,7 @@ int realloc_friendlist(Messenger *m, uint32_t num)
  */
 int32_t getfriend_id(const Messenger *m, const uint8_t *real_pk)
 {
-    uint32_t i;
-
-    for (i = 0; i < m->numfriends; ++i) {
-        if (m->friendlist[i].status > 0)
-            if (id_equal(real_pk, m->friendlist[i].real_pk))
-                return i;
-    }
-
-    return -1;
+    return hash_list_find(&m->friends_index, real_pk);
 }
 
 /* Copies the public key associated to that friend id into real_pk buffer.
@@ -182,6 +174,11 @@ static int32_t init_new_friend(Messenger *m, const uint8_t *real_pk, uint8_t sta
 
     for (i = 0; i <= m->numfriends; ++i) {
         if (m->friendlist[i].status == NOFRIEND) {
+            if (!hash_list_add(&m->friends_index, real_pk, i)) {
+                kill_friend_connection(m->fr_c, friendcon_id);
+                return FAERR_NOMEM;
+            }
+
             m->friendlist[i].status = status;
             m->friendlist[i].friendcon_id = friendcon_id;
             m->friendlist[i].friendrequest_lastsent = 0;
@@ -393,6 +390,7 @@ int m_delfriend(Messenger *m, int32_t friendnumber)
     }
 
     kill_friend_connection(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+    hash_list_remove(&m->friends_index, m->friendlist[friendnumber].real_pk, friendnumber);
     memset(&(m->friendlist[friendnumber]), 0, sizeof(Friend));
     uint32_t i;
 
@@ -434,6 +432,18 @@ int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber)
     }
 }
 
+int m_get_friend_transport_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats)
+{
+    if (friend_not_valid(m, friendnumber))
+        return -1;
+
+    if (crypto_connection_stats(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                                m->friendlist[friendnumber].friendcon_id), stats) == -1)
+        memset(stats, 0, sizeof(Crypto_Connection_Stats));
+
+    return 0;
+}
+
 int m_friend_exists(const Messenger *m, int32_t friendnumber)
 {
     if (friend_not_valid(m, friendnumber))
@@ -899,14 +909,18 @@ static int write_cryptpacket_id(const Messenger *m, int32_t friendnumber, uint8_
     if (length >= MAX_CRYPTO_DATA_SIZE || m->friendlist[friendnumber].status != FRIEND_ONLINE)
         return 0;
 
-    uint8_t packet[length + 1];
+    int crypt_connection_id = friend_connection_crypt_connection_id(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+    uint8_t *packet = reserve_cryptpacket(m->net_crypto, crypt_connection_id);
+
+    if (packet == NULL)
+        return 0;
+
     packet[0] = packet_id;
 
     if (length != 0)
         memcpy(packet + 1, data, length);
 
-    return write_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                             m->friendlist[friendnumber].friendcon_id), packet, length + 1, congestion_control) != -1;
+    return commit_cryptpacket(m->net_crypto, crypt_connection_id, packet, length + 1, congestion_control) != -1;
 }
 
 /**********GROUP CHATS************/
@@ -1290,7 +1304,16 @@ static int64_t send_file_data_packet(const Messenger *m, int32_t friendnumber, u
     if (friend_not_valid(m, friendnumber))
         return -1;
 
-    uint8_t packet[2 + length];
+    if (2 + length > MAX_CRYPTO_DATA_SIZE)
+        return -1;
+
+    /* Written straight into the send array of the connection, which is the only copy kept. */
+    int crypt_connection_id = friend_connection_crypt_connection_id(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+    uint8_t *packet = reserve_cryptpacket(m->net_crypto, crypt_connection_id);
+
+    if (packet == NULL)
+        return -1;
+
     packet[0] = PACKET_ID_FILE_DATA;
     packet[1] = filenumber;
 
@@ -1298,8 +1321,7 @@ static int64_t send_file_data_packet(const Messenger *m, int32_t friendnumber, u
         memcpy(packet + 2, data, length);
     }
 
-    return write_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                             m->friendlist[friendnumber].friendcon_id), packet, sizeof(packet), 1);
+    return commit_cryptpacket(m->net_crypto, crypt_connection_id, packet, 2 + length, 1);
 }
 
 #define MAX_FILE_DATA_SIZE (MAX_CRYPTO_DATA_SIZE - 2)
@@ -1789,6 +1811,11 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
 
     m->net_crypto = new_net_crypto(m->dht, &options->proxy_info);
 
+    if (m->net_crypto != NULL && net_crypto_set_congestion_control(m->net_crypto, options->congestion_control) != 0) {
+        kill_net_crypto(m->net_crypto);
+        m->net_crypto = NULL;
+    }
+
     if (m->net_crypto == NULL) {
         kill_networking(m->net);
         kill_DHT(m->dht);
@@ -1833,6 +1860,11 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
         }
     }
 
+    if (!hash_list_init(&m->friends_index, crypto_box_PUBLICKEYBYTES, 0)) {
+        kill_messenger(m);
+        return NULL;
+    }
+
     m->options = *options;
     friendreq_init(&(m->fr), m->fr_c);
     set_nospam(&(m->fr), random_int());
@@ -1868,6 +1900,8 @@ void kill_messenger(Messenger *m)
         clear_receipts(m, i);
     }
 
+    socket_wait_list_free(&m->wait_socks);
+    hash_list_free(&m->friends_index);
     free(m->friendlist);
     free(m);
 }
@@ -2281,6 +2315,35 @@ uint32_t messenger_run_interval(const Messenger *m)
     }
 }
 
+int messenger_wait(Messenger *m, uint32_t timeout_ms)
+{
+    /* net_crypto knows when its next packet is due. The DHT, onion and TCP timers have no
+     * deadline of their own, they are checked on each do_messenger() run and expect it at
+     * least every MIN_RUN_INTERVAL ms, which messenger_run_interval() also caps at. */
+    uint32_t run_interval = messenger_run_interval(m);
+
+    if (timeout_ms > run_interval)
+        timeout_ms = run_interval;
+
+    socket_wait_list_clear(&m->wait_socks);
+
+    if (networking_wait_socks(m->net, &m->wait_socks) == -1)
+        return -1;
+
+    if (crypto_wait_socks(m->net_crypto, &m->wait_socks) == -1)
+        return -1;
+
+    if (m->tcp_server && TCP_server_wait_socks(m->tcp_server, &m->wait_socks) == -1)
+        return -1;
+
+    int ret = socket_wait(&m->wait_socks, timeout_ms);
+
+    if (ret > 0)
+        return 1;
+
+    return ret;
+}
+
 /* The main loop that needs to be run at least 20 times per second. */
 void do_messenger(Messenger *m)
 {
@@ -2332,7 +2395,7 @@ void do_messenger(Messenger *m)
         lastdump = unix_time();
         uint32_t client, last_pinged;
 
-        for (client = 0; client < LCLIENT_LIST; client++) {
+        for (client = 0; client < m->dht->close_clientlist_length; client++) {
             Client_data *cptr = &m->dht->close_clientlist[client];
             IPPTsPng *assoc = NULL;
             uint32_t a;
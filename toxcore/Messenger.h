@@ -71,6 +71,7 @@ typedef struct {
     TCP_Proxy_Info proxy_info;
     uint16_t port_range[2];
     uint16_t tcp_server_port;
+    uint8_t congestion_control; /* CONGESTION_CONTROL_* algorithm of the friend connections. */
 } Messenger_Options;
 
 
@@ -232,11 +233,14 @@ struct Messenger {
 
     Friend *friendlist;
     uint32_t numfriends;
+    HASH_LIST friends_index; // real public key -> friend number
 
 #define NUM_SAVED_TCP_RELAYS 8
     uint8_t has_added_relays; // If the first connection has occurred in do_messenger
     Node_format loaded_relays[NUM_SAVED_TCP_RELAYS]; // Relays loaded from config
 
+    Socket_Wait_List wait_socks; // Reused by messenger_wait()
+
     void (*friend_message)(struct Messenger *m, uint32_t, unsigned int, const uint8_t *, size_t, void *);
     void *friend_message_userdata;
     void (*friend_namechange)(struct Messenger *m, uint32_t, const uint8_t *, size_t, void *);
@@ -350,6 +354,14 @@ int m_delfriend(Messenger *m, int32_t friendnumber);
  */
 int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber);
 
+/* Copy the transport figures of the connection to the friend to stats.
+ * If there is no connection to the friend, stats is zeroed.
+ *
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int m_get_friend_transport_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats);
+
 /* Checks if there exists a friend with given friendnumber.
  *
  *  return 1 if friend exists.
@@ -756,6 +768,17 @@ void do_messenger(Messenger *m);
  */
 uint32_t messenger_run_interval(const Messenger *m);
 
+/* Block until a packet arrives on one of the sockets used by the messenger
+ * (UDP, TCP relay connections and TCP server) or timeout_ms milliseconds passed.
+ * Never blocks longer than messenger_run_interval(), so that do_messenger() runs
+ * in time for the next internal deadline.
+ *
+ * return 1 if one of the sockets is ready.
+ * return 0 on timeout.
+ * return -1 on failure.
+ */
+int messenger_wait(Messenger *m, uint32_t timeout_ms);
+
 /* SAVING AND LOADING FUNCTIONS: */
 
 /* return size of the messenger data (for saving). */
@@ -84,15 +84,16 @@ static int proxy_http_generate_connection_request(TCP_Client_Connection *TCP_con
     }
 
     const uint16_t port = ntohs(TCP_conn->ip_port.port);
-    const int written = snprintf((char *)TCP_conn->last_packet, MAX_PACKET_SIZE, "%s%s:%hu%s%s:%hu%s", one, ip, port, two,
-                                 ip, port, three);
+    char request[MAX_PACKET_SIZE];
+    const int written = snprintf(request, sizeof(request), "%s%s:%hu%s%s:%hu%s", one, ip, port, two, ip, port, three);
 
     if (written < 0 || MAX_PACKET_SIZE < written) {
         return 0;
     }
 
-    TCP_conn->last_packet_length = written;
-    TCP_conn->last_packet_sent = 0;
+    if (send_queue_add(&TCP_conn->send_queue, (const uint8_t *)request, written) == -1) {
+        return 0;
+    }
 
     return 1;
 }
@@ -129,14 +130,17 @@ static int proxy_http_read_connection_response(TCP_Client_Connection *TCP_conn)
     return -1;
 }
 
-static void proxy_socks5_generate_handshake(TCP_Client_Connection *TCP_conn)
+/* return 1 on success.
+ * return 0 on failure.
+ */
+static int proxy_socks5_generate_handshake(TCP_Client_Connection *TCP_conn)
 {
-    TCP_conn->last_packet[0] = 5; /* SOCKSv5 */
-    TCP_conn->last_packet[1] = 1; /* number of authentication methods supported */
-    TCP_conn->last_packet[2] = 0; /* No authentication */
+    uint8_t packet[3];
+    packet[0] = 5; /* SOCKSv5 */
+    packet[1] = 1; /* number of authentication methods supported */
+    packet[2] = 0; /* No authentication */
 
-    TCP_conn->last_packet_length = 3;
-    TCP_conn->last_packet_sent = 0;
+    return send_queue_add(&TCP_conn->send_queue, packet, sizeof(packet)) == 0;
 }
 
 /* return 1 on success.
@@ -157,30 +161,33 @@ static int socks5_read_handshake_response(TCP_Client_Connection *TCP_conn)
     return -1;
 }
 
-static void proxy_socks5_generate_connection_request(TCP_Client_Connection *TCP_conn)
+/* return 1 on success.
+ * return 0 on failure.
+ */
+static int proxy_socks5_generate_connection_request(TCP_Client_Connection *TCP_conn)
 {
-    TCP_conn->last_packet[0] = 5; /* SOCKSv5 */
-    TCP_conn->last_packet[1] = 1; /* command code: establish a TCP/IP stream connection */
-    TCP_conn->last_packet[2] = 0; /* reserved, must be 0 */
+    uint8_t packet[4 + sizeof(IP6) + sizeof(uint16_t)];
+    packet[0] = 5; /* SOCKSv5 */
+    packet[1] = 1; /* command code: establish a TCP/IP stream connection */
+    packet[2] = 0; /* reserved, must be 0 */
     uint16_t length = 3;
 
     if (TCP_conn->ip_port.ip.family == AF_INET) {
-        TCP_conn->last_packet[3] = 1; /* IPv4 address */
+        packet[3] = 1; /* IPv4 address */
         ++length;
-        memcpy(TCP_conn->last_packet + length, TCP_conn->ip_port.ip.ip4.uint8, sizeof(IP4));
+        memcpy(packet + length, TCP_conn->ip_port.ip.ip4.uint8, sizeof(IP4));
         length += sizeof(IP4);
     } else {
-        TCP_conn->last_packet[3] = 4; /* IPv6 address */
+        packet[3] = 4; /* IPv6 address */
         ++length;
-        memcpy(TCP_conn->last_packet + length, TCP_conn->ip_port.ip.ip6.uint8, sizeof(IP6));
+        memcpy(packet + length, TCP_conn->ip_port.ip.ip6.uint8, sizeof(IP6));
         length += sizeof(IP6);
     }
 
-    memcpy(TCP_conn->last_packet + length, &TCP_conn->ip_port.port, sizeof(uint16_t));
+    memcpy(packet + length, &TCP_conn->ip_port.port, sizeof(uint16_t));
     length += sizeof(uint16_t);
 
-    TCP_conn->last_packet_length = length;
-    TCP_conn->last_packet_sent = 0;
+    return send_queue_add(&TCP_conn->send_queue, packet, length) == 0;
 }
 
 /* return 1 on success.
@@ -222,17 +229,16 @@ static int generate_handshake(TCP_Client_Connection *TCP_conn)
     crypto_box_keypair(plain, TCP_conn->temp_secret_key);
     random_nonce(TCP_conn->sent_nonce);
     memcpy(plain + crypto_box_PUBLICKEYBYTES, TCP_conn->sent_nonce, crypto_box_NONCEBYTES);
-    memcpy(TCP_conn->last_packet, TCP_conn->self_public_key, crypto_box_PUBLICKEYBYTES);
-    new_nonce(TCP_conn->last_packet + crypto_box_PUBLICKEYBYTES);
-    int len = encrypt_data_symmetric(TCP_conn->shared_key, TCP_conn->last_packet + crypto_box_PUBLICKEYBYTES, plain,
-                                     sizeof(plain), TCP_conn->last_packet + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES);
+    uint8_t packet[TCP_CLIENT_HANDSHAKE_SIZE];
+    memcpy(packet, TCP_conn->self_public_key, crypto_box_PUBLICKEYBYTES);
+    new_nonce(packet + crypto_box_PUBLICKEYBYTES);
+    int len = encrypt_data_symmetric(TCP_conn->shared_key, packet + crypto_box_PUBLICKEYBYTES, plain,
+                                     sizeof(plain), packet + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES);
 
     if (len != sizeof(plain) + crypto_box_MACBYTES)
         return -1;
 
-    TCP_conn->last_packet_length = crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + sizeof(plain) + crypto_box_MACBYTES;
-    TCP_conn->last_packet_sent = 0;
-    return 0;
+    return send_queue_add(&TCP_conn->send_queue, packet, sizeof(packet));
 }
 
 /* data must be of length TCP_SERVER_HANDSHAKE_SIZE
@@ -255,95 +261,12 @@ static int handle_handshake(TCP_Client_Connection *TCP_conn, const uint8_t *data
     return 0;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
- */
-static int send_pending_data_nonpriority(TCP_Client_Connection *con)
-{
-    if (con->last_packet_length == 0) {
-        return 0;
-    }
-
-    uint16_t left = con->last_packet_length - con->last_packet_sent;
-    int len = send(con->sock, con->last_packet + con->last_packet_sent, left, MSG_NOSIGNAL);
-
-    if (len <= 0)
-        return -1;
-
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
-        return 0;
-    }
-
-    con->last_packet_sent += len;
-    return -1;
-}
-
 /* return 0 if pending data was sent completely
  * return -1 if it wasn't
  */
 static int send_pending_data(TCP_Client_Connection *con)
 {
-    /* finish sending current non-priority packet */
-    if (send_pending_data_nonpriority(con) == -1) {
-        return -1;
-    }
-
-    TCP_Priority_List *p = con->priority_queue_start;
-
-    while (p) {
-        uint16_t left = p->size - p->sent;
-        int len = send(con->sock, p->data + p->sent, left, MSG_NOSIGNAL);
-
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
-
-            break;
-        }
-
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
-
-    con->priority_queue_start = p;
-
-    if (!p) {
-        con->priority_queue_end = NULL;
-        return 0;
-    }
-
-    return -1;
-}
-
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
- */
-static _Bool add_priority(TCP_Client_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
-{
-    TCP_Priority_List *p = con->priority_queue_end, *new;
-    new = malloc(sizeof(TCP_Priority_List) + size);
-
-    if (!new) {
-        return 0;
-    }
-
-    new->next = NULL;
-    new->size = size;
-    new->sent = sent;
-    memcpy(new->data, packet, size);
-
-    if (p) {
-        p->next = new;
-    } else {
-        con->priority_queue_start = new;
-    }
-
-    con->priority_queue_end = new;
-    return 1;
+    return send_queue_flush(&con->send_queue, con->sock);
 }
 
 /* return 1 on success.
@@ -368,6 +291,10 @@ static int write_packet_TCP_secure_connection(TCP_Client_Connection *con, const
 
     uint8_t packet[sizeof(uint16_t) + length + crypto_box_MACBYTES];
 
+    /* Whatever part of the packet send() doesn't take must fit in the queue. */
+    if (!send_queue_has_room(&con->send_queue, sizeof(packet)))
+        return 0;
+
     uint16_t c_length = htons(length + crypto_box_MACBYTES);
     memcpy(packet, &c_length, sizeof(uint16_t));
     int len = encrypt_data_symmetric(con->shared_key, con->sent_nonce, data, length, packet + sizeof(uint16_t));
@@ -375,35 +302,24 @@ static int write_packet_TCP_secure_connection(TCP_Client_Connection *con, const
     if ((unsigned int)len != (sizeof(packet) - sizeof(uint16_t)))
         return -1;
 
-    if (priority) {
-        len = sendpriority ? send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL) : 0;
+    len = sendpriority ? send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL) : 0;
 
-        if (len <= 0) {
-            len = 0;
-        }
-
-        increment_nonce(con->sent_nonce);
-
-        if ((unsigned int)len == sizeof(packet)) {
-            return 1;
-        }
+    if (len <= 0) {
+        if (!priority)
+            return 0;
 
-        return add_priority(con, packet, sizeof(packet), len);
+        len = 0;
     }
 
-    len = send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL);
-
-    if (len <= 0)
-        return 0;
-
     increment_nonce(con->sent_nonce);
 
     if ((unsigned int)len == sizeof(packet))
         return 1;
 
-    memcpy(con->last_packet, packet, sizeof(packet));
-    con->last_packet_length = sizeof(packet);
-    con->last_packet_sent = len;
+    /* Part of the packet is already on the wire, the rest can't be dropped anymore. */
+    if (send_queue_add(&con->send_queue, packet + len, sizeof(packet) - len) == -1)
+        return -1;
+
     return 1;
 }
 
@@ -643,6 +559,7 @@ TCP_Client_Connection *new_TCP_connection(IP_Port ip_port, const uint8_t *public
     }
 
     temp->sock = sock;
+    send_queue_init(&temp->send_queue, NULL);
     memcpy(temp->public_key, public_key, crypto_box_PUBLICKEYBYTES);
     memcpy(temp->self_public_key, self_public_key, crypto_box_PUBLICKEYBYTES);
     encrypt_precompute(temp->public_key, self_secret_key, temp->shared_key);
@@ -652,12 +569,24 @@ TCP_Client_Connection *new_TCP_connection(IP_Port ip_port, const uint8_t *public
     switch (proxy_info->proxy_type) {
         case TCP_PROXY_HTTP:
             temp->status = TCP_CLIENT_PROXY_HTTP_CONNECTING;
-            proxy_http_generate_connection_request(temp);
+
+            if (!proxy_http_generate_connection_request(temp)) {
+                kill_sock(sock);
+                free(temp);
+                return NULL;
+            }
+
             break;
 
         case TCP_PROXY_SOCKS5:
             temp->status = TCP_CLIENT_PROXY_SOCKS5_CONNECTING;
-            proxy_socks5_generate_handshake(temp);
+
+            if (!proxy_socks5_generate_handshake(temp)) {
+                kill_sock(sock);
+                free(temp);
+                return NULL;
+            }
+
             break;
 
         case TCP_PROXY_NONE:
@@ -837,7 +766,7 @@ static int do_confirmed_TCP(TCP_Client_Connection *conn)
         return 0;
     }
 
-    while ((len = read_packet_TCP_secure_connection(conn->sock, &conn->next_packet_length, conn->shared_key,
+    while ((len = read_packet_TCP_secure_connection(conn->sock, &conn->recv_buffer, conn->shared_key,
                   conn->recv_nonce, packet, sizeof(packet)))) {
         if (len == -1) {
             conn->status = TCP_CLIENT_DISCONNECTED;
@@ -941,6 +870,23 @@ void do_TCP_connection(TCP_Client_Connection *TCP_connection)
     }
 }
 
+int TCP_connection_wait_socks(const TCP_Client_Connection *TCP_connection, Socket_Wait_List *list)
+{
+    if (TCP_connection->status == TCP_CLIENT_DISCONNECTED) {
+        return 0;
+    }
+
+    uint8_t events = SOCKET_WAIT_READ;
+
+    if (TCP_connection->status == TCP_CLIENT_CONNECTING || TCP_connection->status == TCP_CLIENT_PROXY_HTTP_CONNECTING
+            || TCP_connection->status == TCP_CLIENT_PROXY_SOCKS5_CONNECTING
+            || !send_queue_empty(&TCP_connection->send_queue)) {
+        events |= SOCKET_WAIT_WRITE;
+    }
+
+    return socket_wait_list_add(list, TCP_connection->sock, events);
+}
+
 /* Kill the TCP connection
  */
 void kill_TCP_connection(TCP_Client_Connection *TCP_connection)
@@ -948,7 +894,7 @@ void kill_TCP_connection(TCP_Client_Connection *TCP_connection)
     if (TCP_connection == NULL)
         return;
 
-    wipe_priority_list(TCP_connection->priority_queue_start);
+    send_queue_wipe(&TCP_connection->send_queue);
     kill_sock(TCP_connection->sock);
     sodium_memzero(TCP_connection, sizeof(TCP_Client_Connection));
     free(TCP_connection);
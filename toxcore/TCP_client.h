@@ -60,15 +60,11 @@ typedef struct  {
     uint8_t recv_nonce[crypto_box_NONCEBYTES]; /* Nonce of received packets. */
     uint8_t sent_nonce[crypto_box_NONCEBYTES]; /* Nonce of sent packets. */
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    uint16_t next_packet_length;
+    TCP_Recv_Buffer recv_buffer;
 
     uint8_t temp_secret_key[crypto_box_SECRETKEYBYTES];
 
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
-
-    TCP_Priority_List *priority_queue_start, *priority_queue_end;
+    TCP_Send_Queue send_queue;
 
     uint64_t kill_at;
 
@@ -109,6 +105,14 @@ TCP_Client_Connection *new_TCP_connection(IP_Port ip_port, const uint8_t *public
  */
 void do_TCP_connection(TCP_Client_Connection *TCP_connection);
 
+/* Add the socket of the TCP connection to the list, waiting for writability too
+ * while connecting or when there is pending data to send.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int TCP_connection_wait_socks(const TCP_Client_Connection *TCP_connection, Socket_Wait_List *list);
+
 /* Kill the TCP connection
  */
 void kill_TCP_connection(TCP_Client_Connection *TCP_connection);
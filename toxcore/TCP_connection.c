@@ -1140,6 +1140,32 @@ unsigned int tcp_connection_to_online_tcp_relays(TCP_Connections *tcp_c, int con
     return online_tcp_connection_from_conn(con_to);
 }
 
+int tcp_connection_to_relay(TCP_Connections *tcp_c, int connections_number, uint8_t *public_key)
+{
+    TCP_Connection_to *con_to = get_connection(tcp_c, connections_number);
+
+    if (!con_to)
+        return -1;
+
+    unsigned int i;
+
+    for (i = 0; i < MAX_FRIEND_TCP_CONNECTIONS; ++i) {
+        uint32_t tcp_con_num = con_to->connections[i].tcp_connection;
+
+        if (tcp_con_num && con_to->connections[i].status == TCP_CONNECTIONS_STATUS_ONLINE) {
+            TCP_con *tcp_con = get_tcp_connection(tcp_c, tcp_con_num - 1);
+
+            if (!tcp_con || !tcp_con->connection)
+                continue;
+
+            memcpy(public_key, tcp_con->connection->public_key, crypto_box_PUBLICKEYBYTES);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
 /* Copy a maximum of max_num TCP relays we are connected to to tcp_relays.
  * NOTE that the family of the copied ip ports will be set to TCP_INET or TCP_INET6.
  *
@@ -1349,6 +1375,23 @@ void do_tcp_connections(TCP_Connections *tcp_c)
     kill_nonused_tcp(tcp_c);
 }
 
+int tcp_connections_wait_socks(const TCP_Connections *tcp_c, Socket_Wait_List *list)
+{
+    unsigned int i;
+
+    for (i = 0; i < tcp_c->tcp_connections_length; ++i) {
+        TCP_con *tcp_con = get_tcp_connection(tcp_c, i);
+
+        if (tcp_con && tcp_con->status != TCP_CONN_SLEEPING && tcp_con->connection) {
+            if (TCP_connection_wait_socks(tcp_con->connection, list) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
 void kill_tcp_connections(TCP_Connections *tcp_c)
 {
     unsigned int i;
@@ -196,6 +196,14 @@ int set_tcp_connection_to_status(TCP_Connections *tcp_c, int connections_number,
  */
 unsigned int tcp_connection_to_online_tcp_relays(TCP_Connections *tcp_c, int connections_number);
 
+/* Copy the public key of the relay packets to the connection are sent through,
+ * the first one the connection is online on, to public_key.
+ *
+ * return 0 on success.
+ * return -1 if the connection isn't online on any relay.
+ */
+int tcp_connection_to_relay(TCP_Connections *tcp_c, int connections_number, uint8_t *public_key);
+
 /* Add a TCP relay tied to a connection.
  *
  * NOTE: This can only be used during the tcp_oob_callback.
@@ -240,6 +248,14 @@ unsigned int tcp_copy_connected_relays(TCP_Connections *tcp_c, Node_format *tcp_
 TCP_Connections *new_tcp_connections(const uint8_t *secret_key, TCP_Proxy_Info *proxy_info);
 
 void do_tcp_connections(TCP_Connections *tcp_c);
+
+/* Add the sockets of all the TCP relay connections to the list.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int tcp_connections_wait_socks(const TCP_Connections *tcp_c, Socket_Wait_List *list);
+
 void kill_tcp_connections(TCP_Connections *tcp_c);
 
 #endif
@@ -28,6 +28,13 @@
 
 #if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef TCP_SERVER_USE_EPOLL
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #endif
 
 #include "util.h"
@@ -105,6 +112,255 @@ static int get_TCP_connection_index(const TCP_Server *TCP_server, const uint8_t
 
 static int kill_accepted(TCP_Server *TCP_server, int index);
 
+#ifdef TCP_SERVER_USE_EPOLL
+
+/* How long a shard waits for events before running its timers, in ms. */
+#define TCP_SHARD_POLL_TIMEOUT 1000
+
+enum {
+    /* Link the connection with public_key to the one in from, whose public key is in data. */
+    TCP_SHARD_MESSAGE_ROUTE,
+    /* The connection in from with public_key was linked to the connection in to. */
+    TCP_SHARD_MESSAGE_LINKED,
+    /* The connection in from linked to the one in to is gone. */
+    TCP_SHARD_MESSAGE_UNLINK,
+    /* Write the packet in data to the connection in to, linked to the one in from. */
+    TCP_SHARD_MESSAGE_DATA,
+    /* Write the TCP_PACKET_OOB_RECV packet in data to the connection with public_key. */
+    TCP_SHARD_MESSAGE_OOB,
+    /* Another shard accepted a connection with public_key, kill the old one. */
+    TCP_SHARD_MESSAGE_KILL,
+    /* Onion request of the connection in from, nonce first, for do_TCP_relay(). */
+    TCP_SHARD_MESSAGE_ONION_REQUEST,
+    /* Write the TCP_PACKET_ONION_RESPONSE packet in data to the connection in to. */
+    TCP_SHARD_MESSAGE_ONION_RESPONSE,
+};
+
+/* A connection id of a connection in a shard. */
+typedef struct {
+    uint32_t shard;
+    uint32_t index; /* in accepted_connection_array of the shard */
+    uint64_t identifier; /* to tell the connection apart from the ones later at index */
+    uint8_t id; /* in the connections array of the connection */
+} TCP_Link_End;
+
+typedef struct {
+    MPSC_Node node; /* Must be first. */
+    uint8_t type;
+    TCP_Link_End from, to;
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint16_t length;
+    uint8_t data[];
+} TCP_Shard_Message;
+
+static TCP_Shard_Message *new_shard_message(uint8_t type, const uint8_t *data, uint16_t length)
+{
+    TCP_Shard_Message *msg = calloc(1, sizeof(TCP_Shard_Message) + length);
+
+    if (msg == NULL)
+        return NULL;
+
+    msg->type = type;
+    msg->length = length;
+
+    if (length)
+        memcpy(msg->data, data, length);
+
+    return msg;
+}
+
+/* Put msg in queue and write to wake_fd if it is the first message since the
+ * consumer last cleared woken.
+ */
+static void push_message(MPSC_Queue *queue, int wake_fd, uint8_t *woken, TCP_Shard_Message *msg)
+{
+    mpsc_queue_push(queue, &msg->node);
+
+    if (__atomic_exchange_n(woken, 1, __ATOMIC_SEQ_CST) == 0) {
+        uint64_t one = 1;
+
+        if (write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            /* Only fails if the counter is full, in which case the shard will wake up anyway. */
+        }
+    }
+}
+
+/* Send msg to shard of the relay. Takes ownership of msg. */
+static void send_to_shard(TCP_Relay *relay, uint32_t shard, TCP_Shard_Message *msg)
+{
+    if (msg == NULL)
+        return;
+
+    if (shard >= relay->num_shards) {
+        free(msg);
+        return;
+    }
+
+    TCP_Server *TCP_server = relay->shards[shard];
+    push_message(&TCP_server->inbox, TCP_server->wake_fd, &TCP_server->woken, msg);
+}
+
+static TCP_Link_End link_end(const TCP_Server *TCP_server, uint32_t index, uint8_t id)
+{
+    TCP_Link_End end;
+    end.shard = TCP_server->shard;
+    end.index = index;
+    end.identifier = TCP_server->accepted_connection_array[index].identifier;
+    end.id = id;
+    return end;
+}
+
+/* return 1 if connection id of con is linked to end.
+ * return 0 if it isn't.
+ */
+static _Bool linked_to(const TCP_Secure_Connection *con, uint8_t id, const TCP_Link_End *end)
+{
+    return con->connections[id].status == 2 && con->connections[id].shard == end->shard
+           && con->connections[id].index == end->index && con->connections[id].other_id == end->id
+           && con->connections[id].identifier == end->identifier;
+}
+
+/* return shard the client with public_key is connected to.
+ * return -1 if it isn't connected.
+ */
+int TCP_relay_key_shard(TCP_Relay *relay, const uint8_t *public_key)
+{
+    pthread_mutex_lock(&relay->keys_mutex);
+    int shard = bs_list_find(&relay->keys, public_key);
+    pthread_mutex_unlock(&relay->keys_mutex);
+    return shard;
+}
+
+/* Record that the client with public_key is connected to the shard of TCP_server, and
+ * have the shard it was connected to before, if any, kill that connection.
+ */
+static void relay_add_key(TCP_Server *TCP_server, const uint8_t *public_key)
+{
+    TCP_Relay *relay = TCP_server->relay;
+
+    pthread_mutex_lock(&relay->keys_mutex);
+    int shard = bs_list_find(&relay->keys, public_key);
+
+    if (shard != -1) {
+        bs_list_remove(&relay->keys, public_key, shard);
+
+        if ((uint32_t)shard != TCP_server->shard) {
+            TCP_Shard_Message *msg = new_shard_message(TCP_SHARD_MESSAGE_KILL, NULL, 0);
+
+            if (msg) {
+                memcpy(msg->public_key, public_key, crypto_box_PUBLICKEYBYTES);
+                send_to_shard(relay, shard, msg);
+            }
+        }
+    }
+
+    bs_list_add(&relay->keys, public_key, TCP_server->shard);
+    pthread_mutex_unlock(&relay->keys_mutex);
+}
+
+/* Forget the client with public_key if it is connected to the shard of TCP_server. */
+static void relay_remove_key(TCP_Server *TCP_server, const uint8_t *public_key)
+{
+    TCP_Relay *relay = TCP_server->relay;
+
+    pthread_mutex_lock(&relay->keys_mutex);
+    bs_list_remove(&relay->keys, public_key, TCP_server->shard);
+    pthread_mutex_unlock(&relay->keys_mutex);
+}
+
+#endif
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+/* Entries of the ring of a server, fewer are tried if the kernel refuses that many. */
+#define TCP_URING_ENTRIES 4096
+#define TCP_URING_MIN_ENTRIES 64
+
+/* Operations posted for a connection, kept in the low bits of the user_data of their entries. */
+enum {
+    TCP_URING_RECV,
+    TCP_URING_SEND,
+    TCP_URING_POLL_IN,
+    TCP_URING_POLL_OUT,
+};
+
+#define TCP_URING_OP_MASK 3
+
+/* A confirmed connection doing its I/O on the ring of its server.
+ *
+ * The kernel reads and writes the buffers here until the operations complete,
+ * so it is allocated apart from accepted_connection_array, which moves.
+ */
+struct TCP_Uring_Conn {
+    TCP_Server *server;
+    uint32_t index; /* in accepted_connection_array of the server */
+    _Bool killed; /* The connection is gone, only waiting for its operations to complete. */
+
+    /* At most one operation is posted in each direction. */
+    _Bool recv_posted, send_posted;
+    /* The socket had nothing to receive or no room to send, poll it before trying again. */
+    _Bool recv_blocked, send_blocked;
+
+    /* In ring_pending of the server. */
+    _Bool pending;
+    struct TCP_Uring_Conn *next_pending;
+
+    TCP_Recv_Buffer recv_buffer;
+    struct msghdr recv_msg;
+    struct iovec recv_iov;
+
+    struct msghdr send_msg;
+    struct iovec send_iov[TCP_SEND_QUEUE_MAX_PAGES];
+
+    /* Once killed, the pages of the connection that may still be in a posted send. */
+    TCP_Send_Queue send_queue;
+};
+
+/* Post the operations io needs on the next submit. */
+static void uring_conn_pending(struct TCP_Uring_Conn *io)
+{
+    if (io->pending)
+        return;
+
+    io->pending = 1;
+    io->next_pending = io->server->ring_pending;
+    io->server->ring_pending = io;
+}
+
+/* Free io if it was killed and nothing refers to it anymore. */
+static void uring_conn_release(struct TCP_Uring_Conn *io)
+{
+    if (!io->killed || io->recv_posted || io->send_posted || io->pending)
+        return;
+
+    send_queue_wipe(&io->send_queue);
+    --io->server->ring_connections;
+    free(io);
+}
+
+/* Take the connection off the ring of the server before it is killed.
+ *
+ * Shutting down the socket makes the operations still posted complete, io is freed after that.
+ */
+static void uring_conn_detach(TCP_Secure_Connection *con)
+{
+    struct TCP_Uring_Conn *io = con->uring;
+
+    if (io == NULL)
+        return;
+
+    con->uring = NULL;
+    io->killed = 1;
+    io->send_queue = con->send_queue;
+    send_queue_init(&con->send_queue, io->send_queue.pool);
+    shutdown(con->sock, SHUT_RDWR);
+
+    /* Freed on the next submit if nothing is posted. */
+    uring_conn_pending(io);
+}
+
+#endif
+
 /* Add accepted TCP connection to the list.
  *
  * return index on success
@@ -150,6 +406,12 @@ static int add_accepted(TCP_Server *TCP_server, const TCP_Secure_Connection *con
     TCP_server->accepted_connection_array[index].last_pinged = unix_time();
     TCP_server->accepted_connection_array[index].ping_id = 0;
 
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (TCP_server->relay)
+        relay_add_key(TCP_server, con->public_key);
+
+#endif
     return index;
 }
 
@@ -169,7 +431,17 @@ static int del_accepted(TCP_Server *TCP_server, int index)
     if (!bs_list_remove(&TCP_server->accepted_key_list, TCP_server->accepted_connection_array[index].public_key, index))
         return -1;
 
-    wipe_priority_list(TCP_server->accepted_connection_array[index].priority_queue_start);
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (TCP_server->relay)
+        relay_remove_key(TCP_server, TCP_server->accepted_connection_array[index].public_key);
+
+#endif
+#ifdef TCP_SERVER_USE_IO_URING
+    uring_conn_detach(&TCP_server->accepted_connection_array[index]);
+#endif
+
+    send_queue_wipe(&TCP_server->accepted_connection_array[index].send_queue);
     sodium_memzero(&TCP_server->accepted_connection_array[index], sizeof(TCP_Secure_Connection));
     --TCP_server->num_accepted_connections;
 
@@ -195,38 +467,6 @@ unsigned int TCP_socket_data_recv_buffer(sock_t sock)
     return count;
 }
 
-/* Read the next two bytes in TCP stream then convert them to
- * length (host byte order).
- *
- * return length on success
- * return 0 if nothing has been read from socket.
- * return ~0 on failure.
- */
-uint16_t read_TCP_length(sock_t sock)
-{
-    unsigned int count = TCP_socket_data_recv_buffer(sock);
-
-    if (count >= sizeof(uint16_t)) {
-        uint16_t length;
-        int len = recv(sock, (uint8_t *)&length, sizeof(uint16_t), MSG_NOSIGNAL);
-
-        if (len != sizeof(uint16_t)) {
-            fprintf(stderr, "FAIL recv packet\n");
-            return 0;
-        }
-
-        length = ntohs(length);
-
-        if (length > MAX_PACKET_SIZE) {
-            return ~0;
-        }
-
-        return length;
-    }
-
-    return 0;
-}
-
 /* Read length bytes from socket.
  *
  * return length on success
@@ -250,233 +490,468 @@ int read_TCP_packet(sock_t sock, uint8_t *data, uint16_t length)
     return -1;
 }
 
-/* return length of received packet on success.
- * return 0 if could not read any packet.
- * return -1 on failure (connection must be killed).
+/* return length of the packet at the start of buffer, including its length, if all of it was received.
+ * return 0 if it wasn't.
+ * return -1 if its length is invalid.
  */
-int read_packet_TCP_secure_connection(sock_t sock, uint16_t *next_packet_length, const uint8_t *shared_key,
-                                      uint8_t *recv_nonce, uint8_t *data, uint16_t max_len)
+static int buffered_packet_length(const TCP_Recv_Buffer *buffer)
 {
-    if (*next_packet_length == 0) {
-        uint16_t len = read_TCP_length(sock);
+    if (buffer->end - buffer->start < sizeof(uint16_t))
+        return 0;
 
-        if (len == (uint16_t)~0)
-            return -1;
+    uint16_t length;
+    memcpy(&length, buffer->data + buffer->start, sizeof(uint16_t));
+    length = ntohs(length);
 
-        if (len == 0)
-            return 0;
+    if (length > MAX_PACKET_SIZE)
+        return -1;
+
+    if (buffer->end - buffer->start < sizeof(uint16_t) + length)
+        return 0;
+
+    return sizeof(uint16_t) + length;
+}
 
-        *next_packet_length = len;
+/* Move the part of the packet already received to the start of buffer to make room for the rest. */
+static void compact_recv_buffer(TCP_Recv_Buffer *buffer)
+{
+    if (buffer->start != 0) {
+        memmove(buffer->data, buffer->data + buffer->start, buffer->end - buffer->start);
+        buffer->end -= buffer->start;
+        buffer->start = 0;
     }
+}
 
-    if (max_len + crypto_box_MACBYTES < *next_packet_length)
-        return -1;
+/* Read the next packet of the connection from buffer into data, without reading from the socket.
+ *
+ * return length of received packet on success.
+ * return 0 if buffer doesn't hold a whole packet.
+ * return -1 on failure (connection must be killed).
+ */
+static int read_buffered_packet(TCP_Recv_Buffer *buffer, const uint8_t *shared_key, uint8_t *recv_nonce,
+                                uint8_t *data, uint16_t max_len)
+{
+    int packet_length = buffered_packet_length(buffer);
 
-    uint8_t data_encrypted[*next_packet_length];
-    int len_packet = read_TCP_packet(sock, data_encrypted, *next_packet_length);
+    if (packet_length == -1)
+        return -1;
 
-    if (len_packet != *next_packet_length)
+    if (packet_length == 0)
         return 0;
 
-    *next_packet_length = 0;
+    uint16_t len_packet = packet_length - sizeof(uint16_t);
+
+    if (max_len + crypto_box_MACBYTES < len_packet)
+        return -1;
 
-    int len = decrypt_data_symmetric(shared_key, recv_nonce, data_encrypted, len_packet, data);
+    int len = decrypt_data_symmetric(shared_key, recv_nonce, buffer->data + buffer->start + sizeof(uint16_t), len_packet,
+                                     data);
 
     if (len + crypto_box_MACBYTES != len_packet)
         return -1;
 
     increment_nonce(recv_nonce);
+    buffer->start += packet_length;
+
+    if (buffer->start == buffer->end) {
+        buffer->start = 0;
+        buffer->end = 0;
+    }
 
     return len;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
- */
-static int send_pending_data_nonpriority(TCP_Secure_Connection *con)
+int read_packet_TCP_secure_connection(sock_t sock, TCP_Recv_Buffer *buffer, const uint8_t *shared_key,
+                                      uint8_t *recv_nonce, uint8_t *data, uint16_t max_len)
 {
-    if (con->last_packet_length == 0) {
-        return 0;
-    }
+    if (buffered_packet_length(buffer) == 0) {
+        compact_recv_buffer(buffer);
 
-    uint16_t left = con->last_packet_length - con->last_packet_sent;
-    int len = send(con->sock, con->last_packet + con->last_packet_sent, left, MSG_NOSIGNAL);
+        int len = recv(sock, buffer->data + buffer->end, sizeof(buffer->data) - buffer->end, MSG_NOSIGNAL);
 
-    if (len <= 0)
-        return -1;
+        if (len <= 0)
+            return 0;
 
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
-        return 0;
+        buffer->end += len;
     }
 
-    con->last_packet_sent += len;
-    return -1;
+    return read_buffered_packet(buffer, shared_key, recv_nonce, data, max_len);
+}
+
+int send_pool_init(TCP_Send_Pool *pool, uint32_t max_pages)
+{
+    if (slab_pool_init(&pool->pages, sizeof(TCP_Send_Page), TCP_SEND_POOL_SLAB_LENGTH) != 0)
+        return -1;
 
+    pool->pages_used = 0;
+    pool->max_pages = max_pages;
+    return 0;
 }
 
-void wipe_priority_list(TCP_Priority_List *p)
+void send_pool_free(TCP_Send_Pool *pool)
 {
-    while (p) {
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
+    slab_pool_free(&pool->pages);
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
- */
-static int send_pending_data(TCP_Secure_Connection *con)
+void send_queue_init(TCP_Send_Queue *queue, TCP_Send_Pool *pool)
 {
-    /* finish sending current non-priority packet */
-    if (send_pending_data_nonpriority(con) == -1) {
-        return -1;
-    }
+    queue->first = NULL;
+    queue->last = NULL;
+    queue->num_pages = 0;
+    queue->pool = pool;
+}
 
-    TCP_Priority_List *p = con->priority_queue_start;
+_Bool send_queue_empty(const TCP_Send_Queue *queue)
+{
+    return queue->first == NULL;
+}
 
-    while (p) {
-        uint16_t left = p->size - p->sent;
-        int len = send(con->sock, p->data + p->sent, left, MSG_NOSIGNAL);
+/* return the number of pages that must be added to the queue to hold length more bytes. */
+static uint32_t send_queue_new_pages(const TCP_Send_Queue *queue, uint16_t length)
+{
+    uint32_t room = 0;
 
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
+    if (queue->last) {
+        room = TCP_SEND_PAGE_SIZE - queue->last->end;
+    }
 
-            break;
-        }
+    if (length <= room)
+        return 0;
 
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
+    return (length - room + TCP_SEND_PAGE_SIZE - 1) / TCP_SEND_PAGE_SIZE;
+}
 
-    con->priority_queue_start = p;
+_Bool send_queue_has_room(const TCP_Send_Queue *queue, uint16_t length)
+{
+    uint32_t pages = send_queue_new_pages(queue, length);
 
-    if (!p) {
-        con->priority_queue_end = NULL;
+    if (queue->num_pages + pages > TCP_SEND_QUEUE_MAX_PAGES)
         return 0;
-    }
 
-    return -1;
+    if (queue->pool && queue->pool->pages_used + pages > queue->pool->max_pages)
+        return 0;
+
+    return 1;
 }
 
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
- */
-static _Bool add_priority(TCP_Secure_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
+static TCP_Send_Page *alloc_send_page(TCP_Send_Queue *queue)
 {
-    TCP_Priority_List *p = con->priority_queue_end, *new;
-    new = malloc(sizeof(TCP_Priority_List) + size);
+    TCP_Send_Page *page;
 
-    if (!new) {
-        return 0;
+    if (queue->pool) {
+        page = slab_pool_alloc(&queue->pool->pages);
+    } else {
+        page = malloc(sizeof(TCP_Send_Page));
     }
 
-    new->next = NULL;
-    new->size = size;
-    new->sent = sent;
-    memcpy(new->data, packet, size);
+    if (page == NULL)
+        return NULL;
+
+    if (queue->pool)
+        ++queue->pool->pages_used;
 
-    if (p) {
-        p->next = new;
+    page->next = NULL;
+    page->start = 0;
+    page->end = 0;
+    return page;
+}
+
+static void release_send_page(TCP_Send_Queue *queue, TCP_Send_Page *page)
+{
+    if (queue->pool) {
+        slab_pool_release(&queue->pool->pages, page);
+        --queue->pool->pages_used;
     } else {
-        con->priority_queue_start = new;
+        free(page);
     }
-
-    con->priority_queue_end = new;
-    return 1;
 }
 
-/* return 1 on success.
- * return 0 if could not send packet.
- * return -1 on failure (connection must be killed).
- */
-static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
-        _Bool priority)
+int send_queue_add(TCP_Send_Queue *queue, const uint8_t *data, uint16_t length)
 {
-    if (length + crypto_box_MACBYTES > MAX_PACKET_SIZE)
+    if (!send_queue_has_room(queue, length))
         return -1;
 
-    _Bool sendpriority = 1;
-
-    if (send_pending_data(con) == -1) {
-        if (priority) {
-            sendpriority = 0;
-        } else {
-            return 0;
-        }
-    }
-
-    uint8_t packet[sizeof(uint16_t) + length + crypto_box_MACBYTES];
+    /* Allocate all the pages first so that nothing is added on failure. */
+    uint32_t num_new = send_queue_new_pages(queue, length);
+    TCP_Send_Page *new_pages = NULL, *new_last = NULL;
+    uint32_t i;
 
-    uint16_t c_length = htons(length + crypto_box_MACBYTES);
-    memcpy(packet, &c_length, sizeof(uint16_t));
-    int len = encrypt_data_symmetric(con->shared_key, con->sent_nonce, data, length, packet + sizeof(uint16_t));
+    for (i = 0; i < num_new; ++i) {
+        TCP_Send_Page *page = alloc_send_page(queue);
 
-    if ((unsigned int)len != (sizeof(packet) - sizeof(uint16_t)))
-        return -1;
+        if (page == NULL) {
+            while (new_pages) {
+                TCP_Send_Page *next = new_pages->next;
+                release_send_page(queue, new_pages);
+                new_pages = next;
+            }
 
-    if (priority) {
-        len = sendpriority ? send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL) : 0;
+            return -1;
+        }
 
-        if (len <= 0) {
-            len = 0;
+        if (new_last) {
+            new_last->next = page;
+        } else {
+            new_pages = page;
         }
 
-        increment_nonce(con->sent_nonce);
+        new_last = page;
+    }
 
-        if ((unsigned int)len == sizeof(packet)) {
-            return 1;
+    if (new_pages) {
+        if (queue->last) {
+            queue->last->next = new_pages;
+        } else {
+            queue->first = new_pages;
         }
-
-        return add_priority(con, packet, sizeof(packet), len);
     }
 
-    len = send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL);
+    TCP_Send_Page *page = queue->last ? queue->last : new_pages;
 
-    if (len <= 0)
-        return 0;
+    if (new_last)
+        queue->last = new_last;
 
-    increment_nonce(con->sent_nonce);
+    queue->num_pages += num_new;
 
-    if ((unsigned int)len == sizeof(packet))
-        return 1;
+    while (length) {
+        uint16_t room = TCP_SEND_PAGE_SIZE - page->end;
 
-    memcpy(con->last_packet, packet, sizeof(packet));
-    con->last_packet_length = sizeof(packet);
-    con->last_packet_sent = len;
-    return 1;
+        if (room == 0) {
+            page = page->next;
+            continue;
+        }
+
+        uint16_t copy = length < room ? length : room;
+        memcpy(page->data + page->end, data, copy);
+        page->end += copy;
+        data += copy;
+        length -= copy;
+    }
+
+    return 0;
 }
 
-/* Kill a TCP_Secure_Connection
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+/* Point iov, which has room for TCP_SEND_QUEUE_MAX_PAGES entries, at the unsent data of the queue.
+ *
+ * return the number of entries used.
  */
-static void kill_TCP_connection(TCP_Secure_Connection *con)
+static unsigned int send_queue_iovecs(const TCP_Send_Queue *queue, struct iovec *iov)
 {
-    wipe_priority_list(con->priority_queue_start);
-    kill_sock(con->sock);
-    sodium_memzero(con, sizeof(TCP_Secure_Connection));
-}
+    const TCP_Send_Page *page;
+    unsigned int num = 0;
 
-static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *con, uint8_t con_number);
+    for (page = queue->first; page && num < TCP_SEND_QUEUE_MAX_PAGES; page = page->next) {
+        iov[num].iov_base = (void *)(page->data + page->start);
+        iov[num].iov_len = page->end - page->start;
+        ++num;
+    }
 
-/* Kill an accepted TCP_Secure_Connection
+    return num;
+}
+#endif
+
+/* Send the pages of the queue on sock.
  *
+ * return the number of bytes sent.
  * return -1 on failure.
- * return 0 on success.
  */
-static int kill_accepted(TCP_Server *TCP_server, int index)
+static int send_pages(const TCP_Send_Queue *queue, sock_t sock)
 {
-    if ((uint32_t)index >= TCP_server->size_accepted_connections)
-        return -1;
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+    const TCP_Send_Page *page = queue->first;
+    int sent = 0;
 
-    uint32_t i;
+    while (page) {
+        int left = page->end - page->start;
+        int len = send(sock, (const char *)page->data + page->start, left, MSG_NOSIGNAL);
 
-    for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
-        rm_connection_index(TCP_server, &TCP_server->accepted_connection_array[index], i);
+        if (len <= 0)
+            return sent ? sent : -1;
+
+        sent += len;
+
+        if (len != left)
+            break;
+
+        page = page->next;
+    }
+
+    return sent;
+#else
+    struct iovec iov[TCP_SEND_QUEUE_MAX_PAGES];
+
+    /* Like writev() but without SIGPIPE when the other side is gone. */
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = send_queue_iovecs(queue, iov);
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL);
+#endif
+}
+
+/* Remove the first len bytes of the queue, which were sent. */
+static void send_queue_consume(TCP_Send_Queue *queue, unsigned int len)
+{
+    while (len) {
+        TCP_Send_Page *page = queue->first;
+        uint16_t left = page->end - page->start;
+
+        if (len < left) {
+            page->start += len;
+            break;
+        }
+
+        len -= left;
+        queue->first = page->next;
+        --queue->num_pages;
+        release_send_page(queue, page);
+    }
+
+    if (queue->first == NULL)
+        queue->last = NULL;
+}
+
+int send_queue_flush(TCP_Send_Queue *queue, sock_t sock)
+{
+    if (send_queue_empty(queue))
+        return 0;
+
+    int len = send_pages(queue, sock);
+
+    if (len <= 0)
+        return -1;
+
+    send_queue_consume(queue, len);
+
+    if (send_queue_empty(queue))
+        return 0;
+
+    return -1;
+}
+
+void send_queue_wipe(TCP_Send_Queue *queue)
+{
+    while (queue->first) {
+        TCP_Send_Page *page = queue->first;
+        queue->first = page->next;
+        release_send_page(queue, page);
+    }
+
+    queue->last = NULL;
+    queue->num_pages = 0;
+}
+
+/* return 0 if pending data was sent completely
+ * return -1 if it wasn't
+ */
+static int send_pending_data(TCP_Secure_Connection *con)
+{
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (con->uring) {
+        if (send_queue_empty(&con->send_queue))
+            return 0;
+
+        /* Sent by the ring after the next submit. */
+        uring_conn_pending(con->uring);
+        return -1;
+    }
+
+#endif
+    return send_queue_flush(&con->send_queue, con->sock);
+}
+
+/* return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
+ */
+static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
+        _Bool priority)
+{
+    if (length + crypto_box_MACBYTES > MAX_PACKET_SIZE)
+        return -1;
+
+    _Bool sendpriority = 1;
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (con->uring) {
+        /* Everything is sent from the queue by the ring, so the queue takes the place of the socket buffer. */
+        sendpriority = 0;
+        priority = 1;
+        uring_conn_pending(con->uring);
+    }
+
+#endif
+
+    if (sendpriority && send_pending_data(con) == -1) {
+        if (priority) {
+            sendpriority = 0;
+        } else {
+            return 0;
+        }
+    }
+
+    uint8_t packet[sizeof(uint16_t) + length + crypto_box_MACBYTES];
+
+    /* Whatever part of the packet send() doesn't take must fit in the queue. */
+    if (!send_queue_has_room(&con->send_queue, sizeof(packet)))
+        return 0;
+
+    uint16_t c_length = htons(length + crypto_box_MACBYTES);
+    memcpy(packet, &c_length, sizeof(uint16_t));
+    int len = encrypt_data_symmetric(con->shared_key, con->sent_nonce, data, length, packet + sizeof(uint16_t));
+
+    if ((unsigned int)len != (sizeof(packet) - sizeof(uint16_t)))
+        return -1;
+
+    len = sendpriority ? send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL) : 0;
+
+    if (len <= 0) {
+        if (!priority)
+            return 0;
+
+        len = 0;
+    }
+
+    increment_nonce(con->sent_nonce);
+
+    if ((unsigned int)len == sizeof(packet))
+        return 1;
+
+    /* Part of the packet is already on the wire, the rest can't be dropped anymore. */
+    if (send_queue_add(&con->send_queue, packet + len, sizeof(packet) - len) == -1)
+        return -1;
+
+    return 1;
+}
+
+/* Kill a TCP_Secure_Connection
+ */
+static void kill_TCP_connection(TCP_Secure_Connection *con)
+{
+    send_queue_wipe(&con->send_queue);
+    kill_sock(con->sock);
+    sodium_memzero(con, sizeof(TCP_Secure_Connection));
+}
+
+static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *con, uint8_t con_number);
+
+/* Kill an accepted TCP_Secure_Connection
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int kill_accepted(TCP_Server *TCP_server, int index)
+{
+    if ((uint32_t)index >= TCP_server->size_accepted_connections)
+        return -1;
+
+    uint32_t i;
+
+    for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+        rm_connection_index(TCP_server, &TCP_server->accepted_connection_array[index], i);
     }
 
     sock_t sock = TCP_server->accepted_connection_array[index].sock;
@@ -650,15 +1125,36 @@ static int handle_TCP_routing_req(TCP_Server *TCP_server, uint32_t con_id, const
             con->connections[index].status = 2;
             con->connections[index].index = other_index;
             con->connections[index].other_id = other_id;
+            con->connections[index].identifier = other_conn->identifier;
             other_conn->connections[other_id].status = 2;
             other_conn->connections[other_id].index = con_id;
             other_conn->connections[other_id].other_id = index;
+            other_conn->connections[other_id].identifier = con->identifier;
+            con->connections[index].shard = TCP_server->shard;
+            other_conn->connections[other_id].shard = TCP_server->shard;
             //TODO: return values?
             send_connect_notification(con, index);
             send_connect_notification(other_conn, other_id);
         }
     }
 
+#ifdef TCP_SERVER_USE_EPOLL
+    else if (TCP_server->relay) {
+        /* The other client may be in another shard, which links them if it asked for us too. */
+        int shard = TCP_relay_key_shard(TCP_server->relay, public_key);
+
+        if (shard != -1 && (uint32_t)shard != TCP_server->shard) {
+            TCP_Shard_Message *msg = new_shard_message(TCP_SHARD_MESSAGE_ROUTE, con->public_key, crypto_box_PUBLICKEYBYTES);
+
+            if (msg) {
+                msg->from = link_end(TCP_server, con_id, index);
+                memcpy(msg->public_key, public_key, crypto_box_PUBLICKEYBYTES);
+                send_to_shard(TCP_server->relay, shard, msg);
+            }
+        }
+    }
+
+#endif
     return 0;
 }
 
@@ -674,19 +1170,52 @@ static int handle_TCP_oob_send(TCP_Server *TCP_server, uint32_t con_id, const ui
     TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[con_id];
 
     int other_index = get_TCP_connection_index(TCP_server, public_key);
+    uint8_t resp_packet[1 + crypto_box_PUBLICKEYBYTES + length];
+    resp_packet[0] = TCP_PACKET_OOB_RECV;
+    memcpy(resp_packet + 1, con->public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(resp_packet + 1 + crypto_box_PUBLICKEYBYTES, data, length);
 
     if (other_index != -1) {
-        uint8_t resp_packet[1 + crypto_box_PUBLICKEYBYTES + length];
-        resp_packet[0] = TCP_PACKET_OOB_RECV;
-        memcpy(resp_packet + 1, con->public_key, crypto_box_PUBLICKEYBYTES);
-        memcpy(resp_packet + 1 + crypto_box_PUBLICKEYBYTES, data, length);
         write_packet_TCP_secure_connection(&TCP_server->accepted_connection_array[other_index], resp_packet,
                                            sizeof(resp_packet), 0);
     }
 
+#ifdef TCP_SERVER_USE_EPOLL
+    else if (TCP_server->relay) {
+        int shard = TCP_relay_key_shard(TCP_server->relay, public_key);
+
+        if (shard != -1 && (uint32_t)shard != TCP_server->shard) {
+            TCP_Shard_Message *msg = new_shard_message(TCP_SHARD_MESSAGE_OOB, resp_packet, sizeof(resp_packet));
+
+            if (msg) {
+                memcpy(msg->public_key, public_key, crypto_box_PUBLICKEYBYTES);
+                send_to_shard(TCP_server->relay, shard, msg);
+            }
+        }
+    }
+
+#endif
     return 0;
 }
 
+/* Tell the shard of the other connection linked to con_number of con that it is gone. */
+static void unlink_other_shard(TCP_Server *TCP_server, TCP_Secure_Connection *con, uint8_t con_number)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+    TCP_Shard_Message *msg = new_shard_message(TCP_SHARD_MESSAGE_UNLINK, NULL, 0);
+
+    if (msg == NULL)
+        return;
+
+    msg->from = link_end(TCP_server, con - TCP_server->accepted_connection_array, con_number);
+    msg->to.shard = con->connections[con_number].shard;
+    msg->to.index = con->connections[con_number].index;
+    msg->to.identifier = con->connections[con_number].identifier;
+    msg->to.id = con->connections[con_number].other_id;
+    send_to_shard(TCP_server->relay, msg->to.shard, msg);
+#endif
+}
+
 /* Remove connection with con_number from the connections array of con.
  *
  * return -1 on failure.
@@ -701,7 +1230,9 @@ static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *co
         uint32_t index = con->connections[con_number].index;
         uint8_t other_id = con->connections[con_number].other_id;
 
-        if (con->connections[con_number].status == 2) {
+        if (con->connections[con_number].status == 2 && con->connections[con_number].shard != TCP_server->shard) {
+            unlink_other_shard(TCP_server, con, con_number);
+        } else if (con->connections[con_number].status == 2) {
 
             if (index >= TCP_server->size_accepted_connections)
                 return -1;
@@ -815,6 +1346,25 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
         }
 
         case TCP_PACKET_ONION_REQUEST: {
+#ifdef TCP_SERVER_USE_EPOLL
+
+            if (TCP_server->relay && TCP_server->relay->onion) {
+                if (length <= 1 + crypto_box_NONCEBYTES + ONION_SEND_BASE * 2)
+                    return -1;
+
+                TCP_Shard_Message *msg = new_shard_message(TCP_SHARD_MESSAGE_ONION_REQUEST, data + 1, length - 1);
+
+                if (msg) {
+                    msg->from = link_end(TCP_server, con_id, 0);
+                    TCP_Relay *relay = TCP_server->relay;
+                    push_message(&relay->inbox, relay->wake_fd, &relay->woken, msg);
+                }
+
+                return 0;
+            }
+
+#endif
+
             if (TCP_server->onion) {
                 if (length <= 1 + crypto_box_NONCEBYTES + ONION_SEND_BASE * 2)
                     return -1;
@@ -856,6 +1406,28 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
             uint8_t new_data[length];
             memcpy(new_data, data, length);
             new_data[0] = other_c_id;
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+            if (con->connections[c_id].shard != TCP_server->shard) {
+                if (length + crypto_box_MACBYTES > MAX_PACKET_SIZE)
+                    return -1;
+
+                TCP_Shard_Message *msg = new_shard_message(TCP_SHARD_MESSAGE_DATA, new_data, length);
+
+                if (msg) {
+                    msg->from = link_end(TCP_server, con_id, c_id);
+                    msg->to.shard = con->connections[c_id].shard;
+                    msg->to.index = index;
+                    msg->to.identifier = con->connections[c_id].identifier;
+                    msg->to.id = con->connections[c_id].other_id;
+                    send_to_shard(TCP_server->relay, msg->to.shard, msg);
+                }
+
+                return 0;
+            }
+
+#endif
             int ret = write_packet_TCP_secure_connection(&TCP_server->accepted_connection_array[index], new_data, length, 0);
 
             if (ret == -1)
@@ -868,6 +1440,167 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
     return 0;
 }
 
+#ifdef TCP_SERVER_USE_EPOLL
+
+/* return the connection of end, which must be in this shard.
+ * return NULL if it is gone.
+ */
+static TCP_Secure_Connection *shard_connection(TCP_Server *TCP_server, const TCP_Link_End *end)
+{
+    if (end->index >= TCP_server->size_accepted_connections)
+        return NULL;
+
+    TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[end->index];
+
+    if (con->status != TCP_STATUS_CONFIRMED || con->identifier != end->identifier)
+        return NULL;
+
+    return con;
+}
+
+static void link_other_shard(TCP_Secure_Connection *con, uint8_t id, const TCP_Link_End *end)
+{
+    con->connections[id].status = 2;
+    con->connections[id].shard = end->shard;
+    con->connections[id].index = end->index;
+    con->connections[id].identifier = end->identifier;
+    con->connections[id].other_id = end->id;
+    send_connect_notification(con, id);
+}
+
+/* Do what msg from another shard or from do_TCP_relay() asks. */
+static void handle_shard_message(TCP_Server *TCP_server, const TCP_Shard_Message *msg)
+{
+    switch (msg->type) {
+        case TCP_SHARD_MESSAGE_ROUTE: {
+            int index = get_TCP_connection_index(TCP_server, msg->public_key);
+
+            if (index == -1)
+                return;
+
+            TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[index];
+            uint32_t i;
+
+            /* Like in handle_TCP_routing_req() they are only linked if both asked for it. */
+            for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+                if (con->connections[i].status == 1 && public_key_cmp(con->connections[i].public_key, msg->data) == 0)
+                    break;
+            }
+
+            if (i == NUM_CLIENT_CONNECTIONS)
+                return;
+
+            link_other_shard(con, i, &msg->from);
+
+            TCP_Shard_Message *reply = new_shard_message(TCP_SHARD_MESSAGE_LINKED, NULL, 0);
+
+            if (reply) {
+                reply->from = link_end(TCP_server, index, i);
+                reply->to = msg->from;
+                memcpy(reply->public_key, con->public_key, crypto_box_PUBLICKEYBYTES);
+                send_to_shard(TCP_server->relay, reply->to.shard, reply);
+            }
+
+            return;
+        }
+
+        case TCP_SHARD_MESSAGE_LINKED: {
+            TCP_Secure_Connection *con = shard_connection(TCP_server, &msg->to);
+
+            /* Both asked for the other at the same time, and both shards linked them. */
+            if (con && linked_to(con, msg->to.id, &msg->from))
+                return;
+
+            if (con && con->connections[msg->to.id].status == 1
+                    && public_key_cmp(con->connections[msg->to.id].public_key, msg->public_key) == 0) {
+                link_other_shard(con, msg->to.id, &msg->from);
+                return;
+            }
+
+            /* The connection that asked is gone or doesn't want the other one anymore. */
+            TCP_Shard_Message *reply = new_shard_message(TCP_SHARD_MESSAGE_UNLINK, NULL, 0);
+
+            if (reply) {
+                reply->from = msg->to;
+                reply->to = msg->from;
+                send_to_shard(TCP_server->relay, reply->to.shard, reply);
+            }
+
+            return;
+        }
+
+        case TCP_SHARD_MESSAGE_UNLINK: {
+            TCP_Secure_Connection *con = shard_connection(TCP_server, &msg->to);
+
+            if (con == NULL || !linked_to(con, msg->to.id, &msg->from))
+                return;
+
+            con->connections[msg->to.id].status = 1;
+            con->connections[msg->to.id].index = 0;
+            con->connections[msg->to.id].other_id = 0;
+            send_disconnect_notification(con, msg->to.id);
+            return;
+        }
+
+        case TCP_SHARD_MESSAGE_DATA: {
+            TCP_Secure_Connection *con = shard_connection(TCP_server, &msg->to);
+
+            if (con == NULL || !linked_to(con, msg->to.id, &msg->from))
+                return;
+
+            write_packet_TCP_secure_connection(con, msg->data, msg->length, 0);
+            return;
+        }
+
+        case TCP_SHARD_MESSAGE_OOB: {
+            int index = get_TCP_connection_index(TCP_server, msg->public_key);
+
+            if (index == -1)
+                return;
+
+            write_packet_TCP_secure_connection(&TCP_server->accepted_connection_array[index], msg->data, msg->length, 0);
+            return;
+        }
+
+        case TCP_SHARD_MESSAGE_KILL: {
+            /* The client may have connected to this shard again since. */
+            if (TCP_relay_key_shard(TCP_server->relay, msg->public_key) == (int)TCP_server->shard)
+                return;
+
+            int index = get_TCP_connection_index(TCP_server, msg->public_key);
+
+            if (index != -1)
+                kill_accepted(TCP_server, index);
+
+            return;
+        }
+
+        case TCP_SHARD_MESSAGE_ONION_RESPONSE: {
+            TCP_Secure_Connection *con = shard_connection(TCP_server, &msg->to);
+
+            if (con)
+                write_packet_TCP_secure_connection(con, msg->data, msg->length, 0);
+
+            return;
+        }
+    }
+}
+
+static void do_TCP_inbox(TCP_Server *TCP_server)
+{
+    /* Cleared first so that a message pushed while the inbox is emptied wakes the shard again. */
+    __atomic_store_n(&TCP_server->woken, 0, __ATOMIC_SEQ_CST);
+
+    MPSC_Node *node;
+
+    while ((node = mpsc_queue_pop(&TCP_server->inbox)) != NULL) {
+        TCP_Shard_Message *msg = (TCP_Shard_Message *)node;
+        handle_shard_message(TCP_server, msg);
+        free(msg);
+    }
+}
+
+#endif
 
 static int confirm_TCP_connection(TCP_Server *TCP_server, TCP_Secure_Connection *con, const uint8_t *data,
                                   uint16_t length)
@@ -879,50 +1612,378 @@ static int confirm_TCP_connection(TCP_Server *TCP_server, TCP_Secure_Connection
         return -1;
     }
 
-    sodium_memzero(con, sizeof(TCP_Secure_Connection));
+    sodium_memzero(con, sizeof(TCP_Secure_Connection));
+
+    if (handle_TCP_packet(TCP_server, index, data, length) == -1) {
+        kill_accepted(TCP_server, index);
+        return -1;
+    }
+
+    return index;
+}
+
+/* return index on success
+ * return -1 on failure
+ */
+static int accept_connection(TCP_Server *TCP_server, sock_t sock)
+{
+    if (!sock_valid(sock))
+        return -1;
+
+    if (!set_socket_nonblock(sock)) {
+        kill_sock(sock);
+        return -1;
+    }
+
+    if (!set_socket_nosigpipe(sock)) {
+        kill_sock(sock);
+        return -1;
+    }
+
+    uint16_t index = TCP_server->incomming_connection_queue_index % MAX_INCOMMING_CONNECTIONS;
+
+    TCP_Secure_Connection *conn = &TCP_server->incomming_connection_queue[index];
+
+    if (conn->status != TCP_STATUS_NO_STATUS)
+        kill_TCP_connection(conn);
+
+    conn->status = TCP_STATUS_CONNECTED;
+    conn->sock = sock;
+    conn->recv_buffer.start = 0;
+    conn->recv_buffer.end = 0;
+    send_queue_init(&conn->send_queue, &TCP_server->send_pool);
+
+    ++TCP_server->incomming_connection_queue_index;
+    return index;
+}
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+/* Move the I/O of the confirmed connection at index from epoll to the ring of the server,
+ * unless the ring is missing or full.
+ */
+static void uring_conn_attach(TCP_Server *TCP_server, uint32_t index)
+{
+    if (TCP_server->ring == NULL || TCP_server->ring_connections >= TCP_server->ring_max_connections)
+        return;
+
+    if (index >= TCP_server->size_accepted_connections)
+        return;
+
+    TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[index];
+
+    if (con->status != TCP_STATUS_CONFIRMED)
+        return;
+
+    struct TCP_Uring_Conn *io = calloc(1, sizeof(struct TCP_Uring_Conn));
+
+    if (io == NULL)
+        return;
+
+    if (epoll_ctl(TCP_server->efd, EPOLL_CTL_DEL, con->sock, NULL) == -1) {
+        free(io);
+        return;
+    }
+
+    io->server = TCP_server;
+    io->index = index;
+    io->recv_buffer = con->recv_buffer;
+    io->recv_msg.msg_iov = &io->recv_iov;
+    io->recv_msg.msg_iovlen = 1;
+    io->send_msg.msg_iov = io->send_iov;
+    send_queue_init(&io->send_queue, NULL);
+
+    con->uring = io;
+    ++TCP_server->ring_connections;
+    uring_conn_pending(io);
+}
+
+/* return a zeroed submission queue entry for operation op of io.
+ * return NULL if the submission queue is full.
+ */
+static struct io_uring_sqe *uring_conn_sqe(Uring *ring, struct TCP_Uring_Conn *io, uint8_t op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    if (sqe == NULL) {
+        /* Make room by passing what is already there to the kernel. */
+        if (uring_submit(ring) == -1)
+            return NULL;
+
+        sqe = uring_get_sqe(ring);
+
+        if (sqe == NULL)
+            return NULL;
+    }
+
+    sqe->user_data = (uint64_t)(uintptr_t)io | op;
+    return sqe;
+}
+
+/* Post the receive and send operations the connection of io needs.
+ *
+ * return 0 on success.
+ * return -1 if the submission queue is full.
+ */
+static int uring_conn_post(TCP_Server *TCP_server, struct TCP_Uring_Conn *io)
+{
+    const TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[io->index];
+    struct io_uring_sqe *sqe;
+
+    if (!io->recv_posted) {
+        sqe = uring_conn_sqe(TCP_server->ring, io, io->recv_blocked ? TCP_URING_POLL_IN : TCP_URING_RECV);
+
+        if (sqe == NULL)
+            return -1;
+
+        sqe->fd = con->sock;
+
+        if (io->recv_blocked) {
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll_events = POLLIN;
+        } else {
+            compact_recv_buffer(&io->recv_buffer);
+            io->recv_iov.iov_base = io->recv_buffer.data + io->recv_buffer.end;
+            io->recv_iov.iov_len = sizeof(io->recv_buffer.data) - io->recv_buffer.end;
+            io->recv_msg.msg_flags = 0;
+
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->addr = (uint64_t)(uintptr_t)&io->recv_msg;
+            sqe->len = 1;
+        }
+
+        io->recv_posted = 1;
+    }
+
+    if (!io->send_posted && (io->send_blocked || !send_queue_empty(&con->send_queue))) {
+        sqe = uring_conn_sqe(TCP_server->ring, io, io->send_blocked ? TCP_URING_POLL_OUT : TCP_URING_SEND);
+
+        if (sqe == NULL)
+            return -1;
+
+        sqe->fd = con->sock;
+
+        if (io->send_blocked) {
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll_events = POLLOUT;
+        } else {
+            /* Packets added to the queue meanwhile go in the next send. */
+            io->send_msg.msg_iovlen = send_queue_iovecs(&con->send_queue, io->send_iov);
+
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->addr = (uint64_t)(uintptr_t)&io->send_msg;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+        }
+
+        io->send_posted = 1;
+    }
+
+    return 0;
+}
+
+/* Post the operations of the pending connections of the server with a single system call. */
+static void submit_TCP_uring(TCP_Server *TCP_server)
+{
+    if (TCP_server->ring == NULL)
+        return;
+
+    struct TCP_Uring_Conn *io = TCP_server->ring_pending;
+    struct TCP_Uring_Conn *retry = NULL;
+    TCP_server->ring_pending = NULL;
+
+    while (io) {
+        struct TCP_Uring_Conn *next = io->next_pending;
+        io->pending = 0;
+
+        if (io->killed) {
+            uring_conn_release(io);
+        } else if (uring_conn_post(TCP_server, io) == -1) {
+            /* Tried again on the next submit. */
+            io->next_pending = retry;
+            io->pending = 1;
+            retry = io;
+        }
+
+        io = next;
+    }
+
+    TCP_server->ring_pending = retry;
+    uring_submit(TCP_server->ring);
+}
+
+/* Handle the result of the receive of io, res as returned by recvmsg(). */
+static void uring_conn_received(TCP_Server *TCP_server, struct TCP_Uring_Conn *io, int res)
+{
+    if (res == -EAGAIN) {
+        io->recv_blocked = 1;
+        return;
+    }
+
+    if (res == -EINTR)
+        return;
+
+    if (res <= 0) {
+        kill_accepted(TCP_server, io->index);
+        return;
+    }
+
+    io->recv_buffer.end += res;
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    int len;
+
+    while (!io->killed) {
+        TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[io->index];
+        len = read_buffered_packet(&io->recv_buffer, con->shared_key, con->recv_nonce, packet, sizeof(packet));
+
+        if (len == 0)
+            break;
+
+        if (len == -1 || handle_TCP_packet(TCP_server, io->index, packet, len) == -1) {
+            kill_accepted(TCP_server, io->index);
+            break;
+        }
+    }
+}
+
+/* Handle the result of the send of io, res as returned by sendmsg(). */
+static void uring_conn_sent(TCP_Server *TCP_server, struct TCP_Uring_Conn *io, int res)
+{
+    if (res == -EAGAIN || res == 0) {
+        io->send_blocked = 1;
+        return;
+    }
+
+    if (res == -EINTR)
+        return;
+
+    if (res < 0) {
+        kill_accepted(TCP_server, io->index);
+        return;
+    }
+
+    send_queue_consume(&TCP_server->accepted_connection_array[io->index].send_queue, res);
+}
+
+/* Handle the operations completed by the ring of the server and post the ones following them,
+ * until nothing more completes without waiting.
+ */
+static void do_TCP_uring(TCP_Server *TCP_server)
+{
+    struct io_uring_cqe *cqe;
+
+    while ((cqe = uring_peek_cqe(TCP_server->ring))) {
+        struct TCP_Uring_Conn *io = (struct TCP_Uring_Conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)TCP_URING_OP_MASK);
+        uint8_t op = cqe->user_data & TCP_URING_OP_MASK;
+        int res = cqe->res;
+        uring_cqe_seen(TCP_server->ring);
+
+        if (op == TCP_URING_RECV || op == TCP_URING_POLL_IN) {
+            io->recv_posted = 0;
+        } else {
+            io->send_posted = 0;
+        }
+
+        if (io->killed) {
+            uring_conn_release(io);
+            continue;
+        }
+
+        switch (op) {
+            case TCP_URING_RECV: {
+                uring_conn_received(TCP_server, io, res);
+                break;
+            }
+
+            case TCP_URING_SEND: {
+                uring_conn_sent(TCP_server, io, res);
+                break;
+            }
+
+            case TCP_URING_POLL_IN: {
+                io->recv_blocked = 0;
+                break;
+            }
+
+            case TCP_URING_POLL_OUT: {
+                io->send_blocked = 0;
+                break;
+            }
+        }
+
+        /* Killed connections are already pending, to be freed. */
+        uring_conn_pending(io);
+
+        /* Operations that can complete right away, like receives on a socket with data left,
+         * do so while being submitted.
+         */
+        if (uring_peek_cqe(TCP_server->ring) == NULL)
+            submit_TCP_uring(TCP_server);
+    }
+}
+
+/* Set up the ring of the server, left NULL if io_uring is not available. */
+static void new_TCP_uring(TCP_Server *TCP_server)
+{
+    unsigned int entries;
+
+    /* Older kernels count the ring against RLIMIT_MEMLOCK. */
+    for (entries = TCP_URING_ENTRIES; entries >= TCP_URING_MIN_ENTRIES; entries /= 2) {
+        TCP_server->ring = new_uring(entries);
+
+        if (TCP_server->ring)
+            break;
+    }
+
+    if (TCP_server->ring == NULL)
+        return;
 
-    if (handle_TCP_packet(TCP_server, index, data, length) == -1) {
-        kill_accepted(TCP_server, index);
-        return -1;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = TCP_server->ring->fd | ((uint64_t)TCP_SOCKET_URING << 32);
+
+    if (epoll_ctl(TCP_server->efd, EPOLL_CTL_ADD, TCP_server->ring->fd, &ev) == -1) {
+        kill_uring(TCP_server->ring);
+        TCP_server->ring = NULL;
+        return;
     }
 
-    return index;
+    /* Each connection has at most two operations posted, so with the completion queue
+     * twice as big as the submission queue their completions always fit.
+     */
+    TCP_server->ring_max_connections = entries;
 }
 
-/* return index on success
- * return -1 on failure
- */
-static int accept_connection(TCP_Server *TCP_server, sock_t sock)
+/* Take all the connections off the ring of the server and free it once their operations completed. */
+static void kill_TCP_uring(TCP_Server *TCP_server)
 {
-    if (!sock_valid(sock))
-        return -1;
+    if (TCP_server->ring == NULL)
+        return;
 
-    if (!set_socket_nonblock(sock)) {
-        kill_sock(sock);
-        return -1;
-    }
+    uint32_t i;
 
-    if (!set_socket_nosigpipe(sock)) {
-        kill_sock(sock);
-        return -1;
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        uring_conn_detach(&TCP_server->accepted_connection_array[i]);
     }
 
-    uint16_t index = TCP_server->incomming_connection_queue_index % MAX_INCOMMING_CONNECTIONS;
-
-    TCP_Secure_Connection *conn = &TCP_server->incomming_connection_queue[index];
+    submit_TCP_uring(TCP_server);
 
-    if (conn->status != TCP_STATUS_NO_STATUS)
-        kill_TCP_connection(conn);
+    while (TCP_server->ring_connections) {
+        if (uring_wait_cqe(TCP_server->ring) == -1)
+            break;
 
-    conn->status = TCP_STATUS_CONNECTED;
-    conn->sock = sock;
-    conn->next_packet_length = 0;
+        do_TCP_uring(TCP_server);
+    }
 
-    ++TCP_server->incomming_connection_queue_index;
-    return index;
+    kill_uring(TCP_server->ring);
+    TCP_server->ring = NULL;
 }
 
-static sock_t new_listening_TCP_socket(int family, uint16_t port)
+#endif
+
+/* If reuseport is set, SO_REUSEPORT is enabled on the socket before binding. */
+static sock_t new_listening_TCP_socket(int family, uint16_t port, uint8_t reuseport)
 {
     sock_t sock = socket(family, SOCK_STREAM, IPPROTO_TCP);
 
@@ -940,6 +2001,10 @@ static sock_t new_listening_TCP_socket(int family, uint16_t port)
         ok = set_socket_reuseaddr(sock);
     }
 
+    if (ok && reuseport) {
+        ok = set_socket_reuseport(sock);
+    }
+
     ok = ok && bind_to_port(sock, family, port) && (listen(sock, TCP_MAX_BACKLOG) == 0);
 
     if (!ok) {
@@ -950,8 +2015,8 @@ static sock_t new_listening_TCP_socket(int family, uint16_t port)
     return sock;
 }
 
-TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
-                           Onion *onion)
+static TCP_Server *new_TCP_server_internal(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
+        const uint8_t *secret_key, Onion *onion, uint8_t reuseport)
 {
     if (num_sockets == 0 || ports == NULL)
         return NULL;
@@ -972,15 +2037,27 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
         return NULL;
     }
 
+    if (send_pool_init(&temp->send_pool, TCP_SERVER_MAX_SEND_PAGES) != 0) {
+        free(temp->socks_listening);
+        free(temp);
+        return NULL;
+    }
+
 #ifdef TCP_SERVER_USE_EPOLL
+    /* Only created when the server becomes a shard of a TCP_Relay. */
+    temp->wake_fd = -1;
     temp->efd = epoll_create(8);
 
     if (temp->efd == -1) {
+        send_pool_free(&temp->send_pool);
         free(temp->socks_listening);
         free(temp);
         return NULL;
     }
 
+#endif
+#ifdef TCP_SERVER_USE_IO_URING
+    new_TCP_uring(temp);
 #endif
 
     uint8_t family;
@@ -997,7 +2074,7 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
 #endif
 
     for (i = 0; i < num_sockets; ++i) {
-        sock_t sock = new_listening_TCP_socket(family, ports[i]);
+        sock_t sock = new_listening_TCP_socket(family, ports[i], reuseport);
 
         if (sock_valid(sock)) {
 #ifdef TCP_SERVER_USE_EPOLL
@@ -1016,6 +2093,13 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     }
 
     if (temp->num_listening_socks == 0) {
+#ifdef TCP_SERVER_USE_IO_URING
+        kill_uring(temp->ring);
+#endif
+#ifdef TCP_SERVER_USE_EPOLL
+        close(temp->efd);
+#endif
+        send_pool_free(&temp->send_pool);
         free(temp->socks_listening);
         free(temp);
         return NULL;
@@ -1034,6 +2118,12 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     return temp;
 }
 
+TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
+                           Onion *onion)
+{
+    return new_TCP_server_internal(ipv6_enabled, num_sockets, ports, secret_key, onion, 0);
+}
+
 static void do_TCP_accept_new(TCP_Server *TCP_server)
 {
     uint32_t i;
@@ -1084,7 +2174,7 @@ static int do_unconfirmed(TCP_Server *TCP_server, uint32_t i)
         return -1;
 
     uint8_t packet[MAX_PACKET_SIZE];
-    int len = read_packet_TCP_secure_connection(conn->sock, &conn->next_packet_length, conn->shared_key, conn->recv_nonce,
+    int len = read_packet_TCP_secure_connection(conn->sock, &conn->recv_buffer, conn->shared_key, conn->recv_nonce,
               packet, sizeof(packet));
 
     if (len == 0) {
@@ -1104,7 +2194,7 @@ static void do_confirmed_recv(TCP_Server *TCP_server, uint32_t i)
     uint8_t packet[MAX_PACKET_SIZE];
     int len;
 
-    while ((len = read_packet_TCP_secure_connection(conn->sock, &conn->next_packet_length, conn->shared_key,
+    while ((len = read_packet_TCP_secure_connection(conn->sock, &conn->recv_buffer, conn->shared_key,
                   conn->recv_nonce, packet, sizeof(packet)))) {
         if (len == -1) {
             kill_accepted(TCP_server, i);
@@ -1197,6 +2287,13 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
     struct epoll_event events[MAX_EVENTS];
     int nfds;
 
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (TCP_server->ring)
+        do_TCP_uring(TCP_server);
+
+#endif
+
     while ((nfds = epoll_wait(TCP_server->efd, events, MAX_EVENTS, 0)) > 0) {
         int n;
 
@@ -1231,6 +2328,15 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
             }
 
 
+            if ((events[n].events & EPOLLOUT) && status == TCP_SOCKET_CONFIRMED
+                    && (uint32_t)index < TCP_server->size_accepted_connections) {
+                /* Room was made in the socket buffer, send what is queued now instead of on the next write. */
+                TCP_Secure_Connection *conn = &TCP_server->accepted_connection_array[index];
+
+                if (conn->status == TCP_STATUS_CONFIRMED)
+                    send_pending_data(conn);
+            }
+
             if (!(events[n].events & EPOLLIN)) {
                 continue;
             }
@@ -1288,7 +2394,7 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
                     int index_new;
 
                     if ((index_new = do_unconfirmed(TCP_server, index)) != -1) {
-                        events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+                        events[n].events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
                         events[n].data.u64 = sock | ((uint64_t)TCP_SOCKET_CONFIRMED << 32) | ((uint64_t)index_new << 40);
 
                         if (epoll_ctl(TCP_server->efd, EPOLL_CTL_MOD, sock, &events[n]) == -1) {
@@ -1296,6 +2402,12 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
                             kill_accepted(TCP_server, index_new);
                             break;
                         }
+
+                        /* Packets received with the first one are already out of the socket. */
+                        do_confirmed_recv(TCP_server, index_new);
+#ifdef TCP_SERVER_USE_IO_URING
+                        uring_conn_attach(TCP_server, index_new);
+#endif
                     }
 
                     break;
@@ -1305,6 +2417,26 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
                     do_confirmed_recv(TCP_server, index);
                     break;
                 }
+
+                case TCP_SOCKET_WAKE: {
+                    /* Reset the eventfd, the inbox is emptied by the shard after this. */
+                    uint64_t count;
+
+                    if (read(sock, &count, sizeof(count)) != sizeof(count)) {
+                        /* Nothing was written since the last read. */
+                    }
+
+                    break;
+                }
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+                case TCP_SOCKET_URING: {
+                    do_TCP_uring(TCP_server);
+                    break;
+                }
+
+#endif
             }
         }
     }
@@ -1327,6 +2459,79 @@ void do_TCP_server(TCP_Server *TCP_server)
 #endif
 
     do_TCP_confirmed(TCP_server);
+
+#ifdef TCP_SERVER_USE_IO_URING
+    submit_TCP_uring(TCP_server);
+#endif
+}
+
+static int wait_socks_secure_connection(const TCP_Secure_Connection *con, Socket_Wait_List *list, uint8_t events)
+{
+#ifdef TCP_SERVER_USE_IO_URING
+
+    /* Its completions wake the ring in the epoll set instead. */
+    if (con->uring)
+        return 0;
+
+#endif
+
+    if (!send_queue_empty(&con->send_queue)) {
+        events |= SOCKET_WAIT_WRITE;
+    }
+
+    if (events == 0) {
+        return 0;
+    }
+
+    return socket_wait_list_add(list, con->sock, events);
+}
+
+int TCP_server_wait_socks(const TCP_Server *TCP_server, Socket_Wait_List *list)
+{
+    uint32_t i;
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    /* The epoll fd becomes readable when one of the sockets in it does. */
+    if (socket_wait_list_add(list, TCP_server->efd, SOCKET_WAIT_READ) == -1) {
+        return -1;
+    }
+
+    uint8_t events = 0;
+#else
+
+    for (i = 0; i < TCP_server->num_listening_socks; ++i) {
+        if (socket_wait_list_add(list, TCP_server->socks_listening[i], SOCKET_WAIT_READ) == -1) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < MAX_INCOMMING_CONNECTIONS; ++i) {
+        if (TCP_server->incomming_connection_queue[i].status == TCP_STATUS_CONNECTED) {
+            if (wait_socks_secure_connection(&TCP_server->incomming_connection_queue[i], list, SOCKET_WAIT_READ) == -1) {
+                return -1;
+            }
+        }
+
+        if (TCP_server->unconfirmed_connection_queue[i].status == TCP_STATUS_UNCONFIRMED) {
+            if (wait_socks_secure_connection(&TCP_server->unconfirmed_connection_queue[i], list, SOCKET_WAIT_READ) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    uint8_t events = SOCKET_WAIT_READ;
+#endif
+
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        if (TCP_server->accepted_connection_array[i].status == TCP_STATUS_CONFIRMED) {
+            if (wait_socks_secure_connection(&TCP_server->accepted_connection_array[i], list, events) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
 }
 
 void kill_TCP_server(TCP_Server *TCP_server)
@@ -1343,11 +2548,268 @@ void kill_TCP_server(TCP_Server *TCP_server)
 
     bs_list_free(&TCP_server->accepted_key_list);
 
+#ifdef TCP_SERVER_USE_IO_URING
+    kill_TCP_uring(TCP_server);
+#endif
+
+    for (i = 0; i < MAX_INCOMMING_CONNECTIONS; ++i) {
+        send_queue_wipe(&TCP_server->incomming_connection_queue[i].send_queue);
+        send_queue_wipe(&TCP_server->unconfirmed_connection_queue[i].send_queue);
+    }
+
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        send_queue_wipe(&TCP_server->accepted_connection_array[i].send_queue);
+    }
+
+    send_pool_free(&TCP_server->send_pool);
+
 #ifdef TCP_SERVER_USE_EPOLL
     close(TCP_server->efd);
+
+    if (TCP_server->relay) {
+        MPSC_Node *node;
+
+        while ((node = mpsc_queue_pop(&TCP_server->inbox)) != NULL) {
+            free(node);
+        }
+    }
+
+    if (TCP_server->wake_fd != -1)
+        close(TCP_server->wake_fd);
+
 #endif
 
     free(TCP_server->socks_listening);
     free(TCP_server->accepted_connection_array);
     free(TCP_server);
 }
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+static int handle_relay_onion_recv_1(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
+{
+    TCP_Relay *relay = object;
+    uint32_t shard = dest.ip.ip6.uint32[1];
+
+    if (shard >= relay->num_shards || length >= MAX_PACKET_SIZE)
+        return 1;
+
+    TCP_Shard_Message *msg = new_shard_message(TCP_SHARD_MESSAGE_ONION_RESPONSE, NULL, 1 + length);
+
+    if (msg == NULL)
+        return 1;
+
+    msg->data[0] = TCP_PACKET_ONION_RESPONSE;
+    memcpy(msg->data + 1, data, length);
+    msg->to.shard = shard;
+    msg->to.index = dest.ip.ip6.uint32[0];
+    msg->to.identifier = dest.ip.ip6.uint64[1];
+    send_to_shard(relay, shard, msg);
+    return 0;
+}
+
+static void *run_TCP_shard(void *arg)
+{
+    TCP_Server *TCP_server = arg;
+
+    /* The time is updated by do_TCP_relay(). */
+    while (!__atomic_load_n(&TCP_server->relay->stop, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = {TCP_server->efd, POLLIN, 0};
+        poll(&pfd, 1, TCP_SHARD_POLL_TIMEOUT);
+
+        do_TCP_epoll(TCP_server);
+        do_TCP_inbox(TCP_server);
+        do_TCP_confirmed(TCP_server);
+#ifdef TCP_SERVER_USE_IO_URING
+        submit_TCP_uring(TCP_server);
+#endif
+    }
+
+    return NULL;
+}
+
+static void wake_shards(TCP_Relay *relay)
+{
+    uint32_t i;
+
+    for (i = 0; i < relay->num_shards; ++i) {
+        uint64_t one = 1;
+
+        /* Shards that failed to be made shards have no eventfd, nor a thread to wake. */
+        if (relay->shards[i]->wake_fd == -1)
+            continue;
+
+        if (write(relay->shards[i]->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            /* Only fails if the counter is full, in which case the shard will wake up anyway. */
+        }
+    }
+}
+
+/* Stop the num_threads first threads of the relay and free it. */
+static void free_TCP_relay(TCP_Relay *relay, uint32_t num_threads)
+{
+    uint32_t i;
+
+    __atomic_store_n(&relay->stop, 1, __ATOMIC_RELEASE);
+    wake_shards(relay);
+
+    for (i = 0; i < num_threads; ++i) {
+        pthread_join(relay->threads[i], NULL);
+    }
+
+    if (relay->onion) {
+        set_callback_handle_recv_1(relay->onion, NULL, NULL);
+    }
+
+    for (i = 0; i < relay->num_shards; ++i) {
+        kill_TCP_server(relay->shards[i]);
+    }
+
+    MPSC_Node *node;
+
+    while ((node = mpsc_queue_pop(&relay->inbox)) != NULL) {
+        free(node);
+    }
+
+    close(relay->wake_fd);
+    bs_list_free(&relay->keys);
+    pthread_mutex_destroy(&relay->keys_mutex);
+    free(relay->threads);
+    free(relay->shards);
+    free(relay);
+}
+
+/* Make TCP_server shard number shard of relay.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int init_TCP_shard(TCP_Relay *relay, TCP_Server *TCP_server, uint32_t shard)
+{
+    TCP_server->wake_fd = eventfd(0, EFD_NONBLOCK);
+
+    if (TCP_server->wake_fd == -1)
+        return -1;
+
+    TCP_server->relay = relay;
+    TCP_server->shard = shard;
+    mpsc_queue_init(&TCP_server->inbox);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = TCP_server->wake_fd | ((uint64_t)TCP_SOCKET_WAKE << 32);
+
+    if (epoll_ctl(TCP_server->efd, EPOLL_CTL_ADD, TCP_server->wake_fd, &ev) == -1)
+        return -1;
+
+    return 0;
+}
+
+TCP_Relay *new_TCP_relay(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
+                         Onion *onion, uint16_t num_shards)
+{
+    if (num_shards == 0 || num_shards > TCP_RELAY_MAX_SHARDS)
+        return NULL;
+
+    TCP_Relay *relay = calloc(1, sizeof(TCP_Relay));
+
+    if (relay == NULL)
+        return NULL;
+
+    relay->shards = calloc(num_shards, sizeof(TCP_Server *));
+    relay->threads = calloc(num_shards, sizeof(pthread_t));
+    relay->wake_fd = eventfd(0, EFD_NONBLOCK);
+
+    if (relay->shards == NULL || relay->threads == NULL || relay->wake_fd == -1
+            || !bs_list_init(&relay->keys, crypto_box_PUBLICKEYBYTES, 8)
+            || pthread_mutex_init(&relay->keys_mutex, NULL) != 0) {
+        if (relay->wake_fd != -1)
+            close(relay->wake_fd);
+
+        bs_list_free(&relay->keys);
+        free(relay->threads);
+        free(relay->shards);
+        free(relay);
+        return NULL;
+    }
+
+    mpsc_queue_init(&relay->inbox);
+
+    uint32_t i;
+
+    for (i = 0; i < num_shards; ++i) {
+        TCP_Server *TCP_server = new_TCP_server_internal(ipv6_enabled, num_sockets, ports, secret_key, NULL, 1);
+
+        if (TCP_server == NULL) {
+            free_TCP_relay(relay, 0);
+            return NULL;
+        }
+
+        relay->shards[relay->num_shards] = TCP_server;
+        ++relay->num_shards;
+
+        if (init_TCP_shard(relay, TCP_server, i) == -1) {
+            free_TCP_relay(relay, 0);
+            return NULL;
+        }
+    }
+
+    if (onion) {
+        relay->onion = onion;
+        set_callback_handle_recv_1(onion, &handle_relay_onion_recv_1, relay);
+    }
+
+    for (i = 0; i < num_shards; ++i) {
+        if (pthread_create(&relay->threads[i], NULL, &run_TCP_shard, relay->shards[i]) != 0) {
+            free_TCP_relay(relay, i);
+            return NULL;
+        }
+    }
+
+    return relay;
+}
+
+void do_TCP_relay(TCP_Relay *relay)
+{
+    unix_time_update();
+
+    uint64_t count;
+
+    if (read(relay->wake_fd, &count, sizeof(count)) != sizeof(count)) {
+        /* Nothing was written since the last read. */
+    }
+
+    /* Cleared after resetting the eventfd so that a message pushed after this wakes us again. */
+    __atomic_store_n(&relay->woken, 0, __ATOMIC_SEQ_CST);
+
+    MPSC_Node *node;
+
+    while ((node = mpsc_queue_pop(&relay->inbox)) != NULL) {
+        TCP_Shard_Message *msg = (TCP_Shard_Message *)node;
+
+        if (msg->type == TCP_SHARD_MESSAGE_ONION_REQUEST && relay->onion) {
+            IP_Port source;
+            source.port = 0;  // dummy initialise
+            source.ip.family = TCP_ONION_FAMILY;
+            source.ip.ip6.uint32[0] = msg->from.index;
+            source.ip.ip6.uint32[1] = msg->from.shard;
+            source.ip.ip6.uint64[1] = msg->from.identifier;
+            onion_send_1(relay->onion, msg->data + crypto_box_NONCEBYTES, msg->length - crypto_box_NONCEBYTES, source,
+                         msg->data);
+        }
+
+        free(msg);
+    }
+}
+
+int TCP_relay_wait_socks(const TCP_Relay *relay, Socket_Wait_List *list)
+{
+    return socket_wait_list_add(list, relay->wake_fd, SOCKET_WAIT_READ);
+}
+
+void kill_TCP_relay(TCP_Relay *relay)
+{
+    free_TCP_relay(relay, relay->num_shards);
+}
+
+#endif
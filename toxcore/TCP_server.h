@@ -26,9 +26,18 @@
 #include "crypto_core.h"
 #include "onion.h"
 #include "list.h"
+#include "slab_pool.h"
 
 #ifdef TCP_SERVER_USE_EPOLL
 #include "sys/epoll.h"
+#include "mpsc_queue.h"
+#include <pthread.h>
+#endif
+
+/* With io_uring, the epoll server moves the I/O of its confirmed connections to a ring. */
+#if defined(TCP_SERVER_USE_EPOLL) && defined(NETWORK_USE_IO_URING)
+#define TCP_SERVER_USE_IO_URING
+#include "uring.h"
 #endif
 
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32) || defined(__MACH__)
@@ -71,6 +80,11 @@
 #define TCP_SOCKET_INCOMING 1
 #define TCP_SOCKET_UNCONFIRMED 2
 #define TCP_SOCKET_CONFIRMED 3
+#define TCP_SOCKET_WAKE 4
+#define TCP_SOCKET_URING 5
+
+/* Maximum number of shards of a TCP_Relay. */
+#define TCP_RELAY_MAX_SHARDS 64
 #endif
 
 enum {
@@ -80,14 +94,51 @@ enum {
     TCP_STATUS_CONFIRMED,
 };
 
-typedef struct TCP_Priority_List TCP_Priority_List;
+/* Size of the buffer the data received on a connection is read into, at least one packet of MAX_PACKET_SIZE
+ * with its length.
+ */
+#define TCP_RECV_BUFFER_SIZE 4096
 
-struct TCP_Priority_List {
-    TCP_Priority_List *next;
-    uint16_t size, sent;
-    uint8_t data[];
+/* Data received on a connection that wasn't read as packets yet. */
+typedef struct {
+    uint8_t data[TCP_RECV_BUFFER_SIZE];
+    uint16_t start, end; /* data[start] to data[end - 1] are received but not read yet. */
+} TCP_Recv_Buffer;
+
+/* Queued data is kept in pages of TCP_SEND_PAGE_SIZE bytes. */
+#define TCP_SEND_PAGE_SIZE 4096
+/* Most pages the send queue of a connection can hold. */
+#define TCP_SEND_QUEUE_MAX_PAGES 16
+/* Most pages the send queues of all the connections of a TCP_Server can hold. */
+#define TCP_SERVER_MAX_SEND_PAGES 16384
+/* Number of pages allocated at a time by a TCP_Send_Pool. */
+#define TCP_SEND_POOL_SLAB_LENGTH 64
+
+typedef struct TCP_Send_Page TCP_Send_Page;
+
+struct TCP_Send_Page {
+    TCP_Send_Page *next;
+    uint16_t start, end; /* data[start] to data[end - 1] are not sent yet. */
+    uint8_t data[TCP_SEND_PAGE_SIZE];
 };
 
+/* Pages shared by the send queues of the connections of a server. */
+typedef struct {
+    Slab_Pool pages;
+    uint32_t pages_used;
+    uint32_t max_pages;
+} TCP_Send_Pool;
+
+/* Data that couldn't be sent yet on a connection, in the order it must be sent. */
+typedef struct {
+    TCP_Send_Page *first, *last;
+    uint32_t num_pages;
+    TCP_Send_Pool *pool; /* NULL if the pages are allocated with malloc. */
+} TCP_Send_Queue;
+
+/* Defined in TCP_server.c, only used when built with TCP_SERVER_USE_IO_URING. */
+struct TCP_Uring_Conn;
+
 typedef struct TCP_Secure_Connection {
     uint8_t status;
     sock_t  sock;
@@ -95,18 +146,20 @@ typedef struct TCP_Secure_Connection {
     uint8_t recv_nonce[crypto_box_NONCEBYTES]; /* Nonce of received packets. */
     uint8_t sent_nonce[crypto_box_NONCEBYTES]; /* Nonce of sent packets. */
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    uint16_t next_packet_length;
+    TCP_Recv_Buffer recv_buffer;
     struct {
         uint8_t status; /* 0 if not used, 1 if other is offline, 2 if other is online. */
         uint8_t public_key[crypto_box_PUBLICKEYBYTES];
         uint32_t index;
         uint8_t other_id;
+        uint32_t shard; /* Shard of the other connection, the one of this connection if it isn't in a TCP_Relay. */
+        uint64_t identifier; /* identifier of the other connection. */
     } connections[NUM_CLIENT_CONNECTIONS];
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
-
-    TCP_Priority_List *priority_queue_start, *priority_queue_end;
+    TCP_Send_Queue send_queue;
+#ifdef TCP_SERVER_USE_IO_URING
+    /* Receives and sends of the connection posted on the ring of the server, NULL if it uses epoll. */
+    struct TCP_Uring_Conn *uring;
+#endif
 
     uint64_t identifier;
 
@@ -115,12 +168,32 @@ typedef struct TCP_Secure_Connection {
 } TCP_Secure_Connection;
 
 
+typedef struct TCP_Relay TCP_Relay;
+
 typedef struct {
     Onion *onion;
 
+    /* Set when the server is one of the shards of a TCP_Relay. */
+    TCP_Relay *relay;
+    uint32_t shard;
+
 #ifdef TCP_SERVER_USE_EPOLL
     int efd;
     uint64_t last_run_pinged;
+
+    /* Messages from the other shards and from the thread running do_TCP_relay(). */
+    MPSC_Queue inbox;
+    /* eventfd in efd written to when a message is put in an empty inbox. */
+    int wake_fd;
+    uint8_t woken; /* Changed atomically. */
+#endif
+#ifdef TCP_SERVER_USE_IO_URING
+    /* Ring the confirmed connections do their I/O on, NULL if io_uring is not available. */
+    Uring *ring;
+    uint32_t ring_max_connections;
+    uint32_t ring_connections; /* Including killed ones with operations still posted. */
+    /* Connections with operations to post on the next submit. */
+    struct TCP_Uring_Conn *ring_pending;
 #endif
     sock_t *socks_listening;
     unsigned int num_listening_socks;
@@ -139,6 +212,8 @@ typedef struct {
     uint64_t counter;
 
     BS_LIST accepted_key_list;
+
+    TCP_Send_Pool send_pool;
 } TCP_Server;
 
 /* Create new TCP server instance.
@@ -146,29 +221,117 @@ typedef struct {
 TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
                            Onion *onion);
 
-void wipe_priority_list(TCP_Priority_List *p);
+/* Initialize a pool of at most max_pages pages for send queues.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int send_pool_init(TCP_Send_Pool *pool, uint32_t max_pages);
+
+/* Free a pool once all the queues using it were wiped. */
+void send_pool_free(TCP_Send_Pool *pool);
+
+/* Initialize an empty send queue taking its pages from pool, or from malloc if pool is NULL. */
+void send_queue_init(TCP_Send_Queue *queue, TCP_Send_Pool *pool);
+
+/* return 1 if nothing is waiting to be sent in the queue.
+ * return 0 if something is.
+ */
+_Bool send_queue_empty(const TCP_Send_Queue *queue);
+
+/* return 1 if length bytes can be added to the queue without going over the limits of the queue or its pool.
+ * return 0 if they can't.
+ */
+_Bool send_queue_has_room(const TCP_Send_Queue *queue, uint16_t length);
+
+/* Add length bytes of data to the end of the queue.
+ *
+ * return 0 on success.
+ * return -1 on failure (no room or allocation failed), nothing is added.
+ */
+int send_queue_add(TCP_Send_Queue *queue, const uint8_t *data, uint16_t length);
+
+/* Send as much of the queue on sock as it takes, in one system call where possible.
+ *
+ * return 0 if the queue was sent completely.
+ * return -1 if some of it is left.
+ */
+int send_queue_flush(TCP_Send_Queue *queue, sock_t sock);
+
+/* Give back the pages of the queue, leaving it empty. */
+void send_queue_wipe(TCP_Send_Queue *queue);
 
 /* Run the TCP_server
  */
 void do_TCP_server(TCP_Server *TCP_server);
 
+/* Add the sockets of the TCP server to the list.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int TCP_server_wait_socks(const TCP_Server *TCP_server, Socket_Wait_List *list);
+
 /* Kill the TCP server
  */
 void kill_TCP_server(TCP_Server *TCP_server);
 
-/* return the amount of data in the tcp recv buffer.
- * return 0 on failure.
+#ifdef TCP_SERVER_USE_EPOLL
+/* A TCP relay server split in shards, each a TCP_Server running on its own thread with its own
+ * epoll set and listening sockets bound with SO_REUSEPORT to the same ports. The kernel spreads
+ * new connections between the shards and a connection stays in the shard that accepted it.
+ *
+ * Packets between clients of different shards are passed through the lock-free inboxes of the
+ * shards. Which shard each client is in is kept in keys, the only state the shards share.
  */
-unsigned int TCP_socket_data_recv_buffer(sock_t sock);
+struct TCP_Relay {
+    TCP_Server **shards;
+    uint32_t num_shards;
+    pthread_t *threads;
+    uint8_t stop; /* Changed atomically. */
 
-/* Read the next two bytes in TCP stream then convert them to
- * length (host byte order).
+    /* Public key of each client -> shard it is connected to. */
+    BS_LIST keys;
+    pthread_mutex_t keys_mutex;
+
+    /* Onion requests from the shards, sent by do_TCP_relay() since onion isn't thread safe. */
+    Onion *onion;
+    MPSC_Queue inbox;
+    int wake_fd;
+    uint8_t woken; /* Changed atomically. */
+};
+
+/* Create a TCP relay server with num_shards shards listening on the same ports and start their threads.
  *
- * return length on success
- * return 0 if nothing has been read from socket.
- * return ~0 on failure.
+ * do_TCP_relay() must then be called regularly by the thread that runs onion.
  */
-uint16_t read_TCP_length(sock_t sock);
+TCP_Relay *new_TCP_relay(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
+                         Onion *onion, uint16_t num_shards);
+
+/* Send the onion requests of the clients of the relay and update the time the shards use. */
+void do_TCP_relay(TCP_Relay *relay);
+
+/* Add the socket that becomes readable when do_TCP_relay() has something to do to the list.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int TCP_relay_wait_socks(const TCP_Relay *relay, Socket_Wait_List *list);
+
+/* return the shard the client with public_key is connected to.
+ * return -1 if it isn't connected.
+ */
+int TCP_relay_key_shard(TCP_Relay *relay, const uint8_t *public_key);
+
+/* Stop the threads of the relay and kill it.
+ */
+void kill_TCP_relay(TCP_Relay *relay);
+#endif
+
+/* return the amount of data in the tcp recv buffer.
+ * return 0 on failure.
+ */
+unsigned int TCP_socket_data_recv_buffer(sock_t sock);
 
 /* Read length bytes from socket.
  *
@@ -177,11 +340,14 @@ uint16_t read_TCP_length(sock_t sock);
  */
 int read_TCP_packet(sock_t sock, uint8_t *data, uint16_t length);
 
-/* return length of received packet on success.
+/* Read the next packet of the connection from buffer into data.
+ * If buffer doesn't hold a whole packet, it is first filled with as much as sock has in one recv().
+ *
+ * return length of received packet on success.
  * return 0 if could not read any packet.
  * return -1 on failure (connection must be killed).
  */
-int read_packet_TCP_secure_connection(sock_t sock, uint16_t *next_packet_length, const uint8_t *shared_key,
+int read_packet_TCP_secure_connection(sock_t sock, TCP_Recv_Buffer *buffer, const uint8_t *shared_key,
                                       uint8_t *recv_nonce, uint8_t *data, uint16_t max_len);
 
 
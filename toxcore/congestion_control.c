@@ -0,0 +1,308 @@
+/* congestion_control.c
+ *
+ * Algorithms that decide how fast the lossless packets of a net_crypto
+ * connection are sent.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "congestion_control.h"
+#include "net_crypto.h"
+
+/** START: Legacy **/
+
+/* If the send queue is SEND_QUEUE_RATIO times larger than the
+ * calculated link speed the packet send speed will be reduced
+ * by a value depending on this number.
+ */
+#define SEND_QUEUE_RATIO 2.0
+
+static void legacy_init(Congestion_Control *cc)
+{
+    memset(&cc->state.legacy, 0, sizeof(Congestion_Legacy));
+}
+
+static void legacy_rtt_sample(Congestion_Control *cc, uint64_t rtt, uint64_t time)
+{
+}
+
+static void legacy_update(Congestion_Control *cc, const Congestion_Sample *sample, Congestion_Rates *rates)
+{
+    Congestion_Legacy *legacy = &cc->state.legacy;
+
+    unsigned int pos = legacy->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
+    legacy->last_sendqueue_size[pos] = sample->send_queue_size;
+    ++legacy->last_sendqueue_counter;
+
+    unsigned int j;
+    long signed int sum = 0;
+    sum = (long signed int)legacy->last_sendqueue_size[(pos) % CONGESTION_QUEUE_ARRAY_SIZE] -
+          (long signed int)legacy->last_sendqueue_size[(pos - (CONGESTION_QUEUE_ARRAY_SIZE - 1)) % CONGESTION_QUEUE_ARRAY_SIZE];
+
+    unsigned int n_p_pos = legacy->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
+    legacy->last_num_packets_sent[n_p_pos] = sample->packets_sent;
+    legacy->last_num_packets_resent[n_p_pos] = sample->packets_resent;
+
+    if (sample->hold_rate)
+        return;
+
+    long signed int total_sent = 0, total_resent = 0;
+
+    //TODO use real delay
+    unsigned int delay = (unsigned int)((sample->min_rtt / sample->interval) + 0.5);
+    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
+
+    if (delay > packets_set_rem_array) {
+        delay = packets_set_rem_array;
+    }
+
+    for (j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
+        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
+        total_sent += legacy->last_num_packets_sent[ind];
+        total_resent += legacy->last_num_packets_resent[ind];
+    }
+
+    if (sum > 0) {
+        total_sent -= sum;
+    } else {
+        if (total_resent > -sum)
+            total_resent = -sum;
+    }
+
+    /* if queue is too big only allow resending packets. */
+    uint32_t npackets = sample->send_queue_size;
+    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
+                                 sample->interval));
+
+    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
+            CONGESTION_QUEUE_ARRAY_SIZE) * sample->interval));
+
+    if (min_speed < CRYPTO_PACKET_MIN_RATE)
+        min_speed = CRYPTO_PACKET_MIN_RATE;
+
+    double send_array_ratio = (((double)npackets) / min_speed);
+
+    //TODO: Improve formula?
+    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
+        rates->send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
+    } else if (sample->last_congestion_event + CONGESTION_EVENT_TIMEOUT < sample->time) {
+        rates->send_rate = min_speed * 1.2;
+    } else {
+        rates->send_rate = min_speed * 0.9;
+    }
+
+    rates->send_rate_requested = min_speed_request * 1.2;
+
+    if (rates->send_rate < CRYPTO_PACKET_MIN_RATE) {
+        rates->send_rate = CRYPTO_PACKET_MIN_RATE;
+    }
+
+    if (rates->send_rate_requested < rates->send_rate) {
+        rates->send_rate_requested = rates->send_rate;
+    }
+}
+
+static const Congestion_Control_Algorithm legacy_algorithm = {
+    legacy_init,
+    legacy_rtt_sample,
+    legacy_update,
+};
+
+/** END: Legacy **/
+
+/** START: LEDBAT **/
+
+/* Queueing delay in ms the algorithm aims for. */
+#define LEDBAT_TARGET 100
+
+/* Maximum fraction by which the rate changes each round trip once out of slow start. */
+#define LEDBAT_GAIN 0.1
+
+/* Weight of each update in the moving average of the rate packets are sent at. */
+#define LEDBAT_SENT_RATE_WEIGHT 0.125
+
+#define LEDBAT_NO_DELAY UINT64_MAX
+
+/* The round trip time of the connection without queueing delay is estimated as the lowest
+ * one measured in the last LEDBAT_BASE_HISTORY intervals. The difference with the lowest one
+ * measured since the last update that had any is the queueing delay.
+ *
+ * The connection starts in slow start, doubling its rate each round trip, until the queueing
+ * delay first goes over the target. The rate is then halved, since it overshot while the
+ * delay took a round trip to show, and from there each round trip moves it by up to
+ * LEDBAT_GAIN of itself in proportion to how far the queueing delay is from the target: up
+ * when below, down when above.
+ *
+ * Unlike in RFC 6817 resent packets aren't taken as a sign of congestion, since net_crypto
+ * also resends packets that take longer than the lowest round trip time to be received.
+ */
+
+static void ledbat_init(Congestion_Control *cc)
+{
+    Congestion_Ledbat *ledbat = &cc->state.ledbat;
+    unsigned int i;
+
+    for (i = 0; i < LEDBAT_BASE_HISTORY; ++i) {
+        ledbat->base_delays[i] = LEDBAT_NO_DELAY;
+    }
+
+    ledbat->base_delays_pos = 0;
+    ledbat->base_delays_set = 0;
+    ledbat->current_delay = LEDBAT_NO_DELAY;
+    ledbat->delay = LEDBAT_NO_DELAY;
+    ledbat->last_sample = 0;
+    ledbat->sample_gap = 0;
+    ledbat->sent_rate = 0;
+    ledbat->slow_start = 1;
+}
+
+static void ledbat_rtt_sample(Congestion_Control *cc, uint64_t rtt, uint64_t time)
+{
+    Congestion_Ledbat *ledbat = &cc->state.ledbat;
+
+    if (ledbat->base_delays_set == 0) {
+        ledbat->base_delays_set = time;
+    } else if (time - ledbat->base_delays_set >= LEDBAT_BASE_INTERVAL) {
+        ledbat->base_delays_pos = (ledbat->base_delays_pos + 1) % LEDBAT_BASE_HISTORY;
+        ledbat->base_delays[ledbat->base_delays_pos] = LEDBAT_NO_DELAY;
+        ledbat->base_delays_set = time;
+    }
+
+    if (rtt < ledbat->base_delays[ledbat->base_delays_pos])
+        ledbat->base_delays[ledbat->base_delays_pos] = rtt;
+
+    if (rtt < ledbat->current_delay)
+        ledbat->current_delay = rtt;
+
+    if (ledbat->last_sample != 0)
+        ledbat->sample_gap = time - ledbat->last_sample;
+
+    ledbat->last_sample = time;
+}
+
+static void ledbat_update(Congestion_Control *cc, const Congestion_Sample *sample, Congestion_Rates *rates)
+{
+    Congestion_Ledbat *ledbat = &cc->state.ledbat;
+
+    if (ledbat->current_delay != LEDBAT_NO_DELAY) {
+        ledbat->delay = ledbat->current_delay;
+        ledbat->current_delay = LEDBAT_NO_DELAY;
+    }
+
+    double sent_rate = 1000.0 * (sample->packets_sent + sample->packets_resent) / sample->interval;
+    ledbat->sent_rate += (sent_rate - ledbat->sent_rate) * LEDBAT_SENT_RATE_WEIGHT;
+
+    if (sample->hold_rate)
+        return;
+
+    /* Nothing was acknowledged yet. */
+    if (ledbat->delay == LEDBAT_NO_DELAY)
+        return;
+
+    uint64_t base_delay = LEDBAT_NO_DELAY;
+    unsigned int i;
+
+    for (i = 0; i < LEDBAT_BASE_HISTORY; ++i) {
+        if (ledbat->base_delays[i] < base_delay)
+            base_delay = ledbat->base_delays[i];
+    }
+
+    double queueing_delay = ledbat->delay - base_delay;
+    double off_target = (LEDBAT_TARGET - queueing_delay) / LEDBAT_TARGET;
+
+    if (off_target < -1.0)
+        off_target = -1.0;
+
+    /* Fraction of a round trip without queueing since the last update. */
+    double round_trip = 1.0;
+
+    if (base_delay > sample->interval)
+        round_trip = (double)sample->interval / base_delay;
+
+    double rate = rates->send_rate;
+
+    if (ledbat->slow_start) {
+        /* When acknowledgements are far apart the round trip times include waiting for them. */
+        if (queueing_delay >= LEDBAT_TARGET + ledbat->sample_gap) {
+            ledbat->slow_start = 0;
+            rate /= 2.0;
+        } else {
+            off_target = 1.0;
+        }
+    }
+
+    double gain = ledbat->slow_start ? 1.0 : LEDBAT_GAIN;
+
+    if (off_target > 0) {
+        /* Don't go much faster than what the connection actually sends. */
+        double max_rate = 2.0 * ledbat->sent_rate;
+
+        if (rate < max_rate) {
+            rate *= 1.0 + gain * off_target * round_trip;
+
+            if (rate > max_rate)
+                rate = max_rate;
+        }
+    } else {
+        rate *= 1.0 + gain * off_target * round_trip;
+    }
+
+    if (rate < CRYPTO_PACKET_MIN_RATE)
+        rate = CRYPTO_PACKET_MIN_RATE;
+
+    rates->send_rate = rate;
+    rates->send_rate_requested = rate;
+}
+
+static const Congestion_Control_Algorithm ledbat_algorithm = {
+    ledbat_init,
+    ledbat_rtt_sample,
+    ledbat_update,
+};
+
+/** END: LEDBAT **/
+
+static const Congestion_Control_Algorithm *const algorithms[CONGESTION_CONTROL_NUM_ALGORITHMS] = {
+    &legacy_algorithm,
+    &ledbat_algorithm,
+};
+
+int congestion_control_init(Congestion_Control *cc, uint8_t algorithm)
+{
+    if (algorithm >= CONGESTION_CONTROL_NUM_ALGORITHMS)
+        return -1;
+
+    cc->algorithm = algorithms[algorithm];
+    cc->algorithm->init(cc);
+    return 0;
+}
+
+void congestion_control_rtt_sample(Congestion_Control *cc, uint64_t rtt, uint64_t time)
+{
+    cc->algorithm->rtt_sample(cc, rtt, time);
+}
+
+void congestion_control_update(Congestion_Control *cc, const Congestion_Sample *sample, Congestion_Rates *rates)
+{
+    cc->algorithm->update(cc, sample, rates);
+}
@@ -0,0 +1,124 @@
+/* congestion_control.h
+ *
+ * Algorithms that decide how fast the lossless packets of a net_crypto
+ * connection are sent.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CONGESTION_CONTROL_H
+#define CONGESTION_CONTROL_H
+
+#include <stdint.h>
+
+/* The original net_crypto algorithm, based on how the size of the send queue changes. */
+#define CONGESTION_CONTROL_LEGACY 0
+/* Delay based algorithm in the style of LEDBAT (RFC 6817): keep the queueing delay
+ * added to the round trip time around a target.
+ */
+#define CONGESTION_CONTROL_LEDBAT 1
+
+#define CONGESTION_CONTROL_NUM_ALGORITHMS 2
+
+/* Base current transfer speed on last CONGESTION_QUEUE_ARRAY_SIZE number of points taken
+   at the dT defined in net_crypto.c */
+#define CONGESTION_QUEUE_ARRAY_SIZE 12
+#define CONGESTION_LAST_SENT_ARRAY_SIZE (CONGESTION_QUEUE_ARRAY_SIZE * 2)
+
+/* Timeout for increasing speed after congestion event (in ms). */
+#define CONGESTION_EVENT_TIMEOUT 1000
+
+/* Number of minimum round trip times the LEDBAT base delay is the minimum of,
+ * each over LEDBAT_BASE_INTERVAL ms.
+ */
+#define LEDBAT_BASE_HISTORY 10
+#define LEDBAT_BASE_INTERVAL 60000
+
+/* What the connection did since the last update. */
+typedef struct {
+    uint64_t time; /* current_time_monotonic() */
+    uint32_t interval; /* Nominal time between updates in ms. */
+    uint32_t send_queue_size; /* Packets in the send array, sent or not. */
+    uint32_t packets_sent; /* New packets sent since the last update. */
+    uint32_t packets_resent; /* Packets sent again since the last update. */
+    uint64_t min_rtt; /* Lowest round trip time measured on the connection in ms. */
+    uint64_t last_congestion_event; /* Last time the connection ran out of packets to send. */
+    _Bool hold_rate; /* Only record the sample, don't change the rates. */
+} Congestion_Sample;
+
+/* Packets per second the connection may send. */
+typedef struct {
+    double send_rate; /* New packets. */
+    double send_rate_requested; /* All packets, including the ones the peer requested again. */
+} Congestion_Rates;
+
+typedef struct {
+    uint32_t last_sendqueue_size[CONGESTION_QUEUE_ARRAY_SIZE], last_sendqueue_counter;
+    long signed int last_num_packets_sent[CONGESTION_LAST_SENT_ARRAY_SIZE],
+         last_num_packets_resent[CONGESTION_LAST_SENT_ARRAY_SIZE];
+} Congestion_Legacy;
+
+typedef struct {
+    uint64_t base_delays[LEDBAT_BASE_HISTORY]; /* Lowest round trip time of each interval. */
+    uint32_t base_delays_pos; /* Index of the current interval in base_delays. */
+    uint64_t base_delays_set; /* Time the current interval started. */
+    uint64_t current_delay; /* Lowest round trip time since the last update. */
+    uint64_t delay; /* Last current_delay measured. */
+    uint64_t last_sample; /* Time of the last round trip time measured. */
+    uint64_t sample_gap; /* Time between the last two round trip times measured. */
+    double sent_rate; /* Moving average of the packets sent per second. */
+    _Bool slow_start; /* Doubling the rate each round trip until the queueing delay first grows. */
+} Congestion_Ledbat;
+
+typedef struct Congestion_Control Congestion_Control;
+
+/* The functions of an algorithm. */
+typedef struct {
+    void (*init)(Congestion_Control *cc);
+    /* Called with each round trip time measured on the connection. */
+    void (*rtt_sample)(Congestion_Control *cc, uint64_t rtt, uint64_t time);
+    /* Called every sample->interval ms, with the current rates in rates to be replaced by the new ones. */
+    void (*update)(Congestion_Control *cc, const Congestion_Sample *sample, Congestion_Rates *rates);
+} Congestion_Control_Algorithm;
+
+struct Congestion_Control {
+    const Congestion_Control_Algorithm *algorithm;
+
+    union {
+        Congestion_Legacy legacy;
+        Congestion_Ledbat ledbat;
+    } state;
+};
+
+/* Start congestion control of a connection with algorithm, one of the CONGESTION_CONTROL_* values.
+ *
+ * return 0 on success.
+ * return -1 if algorithm is not a known algorithm.
+ */
+int congestion_control_init(Congestion_Control *cc, uint8_t algorithm);
+
+/* Give a round trip time in ms measured on the connection at time to the algorithm. */
+void congestion_control_rtt_sample(Congestion_Control *cc, uint64_t rtt, uint64_t time);
+
+/* Compute the new send rates of the connection from sample.
+ * rates contains the current rates and is set to the new ones.
+ */
+void congestion_control_update(Congestion_Control *cc, const Congestion_Sample *sample, Congestion_Rates *rates);
+
+#endif
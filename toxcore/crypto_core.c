@@ -101,6 +101,21 @@ int encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, cons
     return length + crypto_box_MACBYTES;
 }
 
+int encrypt_data_symmetric_nocopy(const uint8_t *secret_key, const uint8_t *nonce, uint8_t *plain, uint32_t length,
+                                  uint8_t *encrypted)
+{
+    if (length == 0 || !secret_key || !nonce || !plain || !encrypted)
+        return -1;
+
+    memset(plain - crypto_box_ZEROBYTES, 0, crypto_box_ZEROBYTES);
+
+    if (crypto_box_afternm(encrypted - crypto_box_BOXZEROBYTES, plain - crypto_box_ZEROBYTES,
+                           length + crypto_box_ZEROBYTES, nonce, secret_key) != 0)
+        return -1;
+
+    return length + crypto_box_MACBYTES;
+}
+
 int decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *encrypted, uint32_t length,
                            uint8_t *plain)
 {
@@ -98,6 +98,16 @@ void encrypt_precompute(const uint8_t *public_key, const uint8_t *secret_key, ui
 int encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *plain, uint32_t length,
                            uint8_t *encrypted);
 
+/* Same as encrypt_data_symmetric() but without copying plain and encrypted to padded buffers:
+ * the crypto_box_ZEROBYTES bytes before plain and the crypto_box_BOXZEROBYTES bytes before
+ * encrypted must be part of their buffers and are overwritten.
+ *
+ *  return -1 if there was a problem.
+ *  return length of encrypted data if everything was fine.
+ */
+int encrypt_data_symmetric_nocopy(const uint8_t *secret_key, const uint8_t *nonce, uint8_t *plain, uint32_t length,
+                                  uint8_t *encrypted);
+
 /* Decrypts encrypted of length length to plain of length length - 16 using a
  * secret key crypto_box_KEYBYTES big and a 24 byte nonce.
  *
@@ -0,0 +1,408 @@
+/* crypto_pool.c
+ *
+ * Threads that compute the shared keys of received packets from peers we don't
+ * have a shared key with yet, so that the thread polling the socket doesn't.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "crypto_pool.h"
+#include "util.h"
+
+#include <pthread.h>
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+#include <unistd.h>
+#define CRYPTO_POOL_WAKE_PIPE
+#endif
+
+/* Each thread has a ring of jobs shared with the thread polling the socket (the main thread):
+ *
+ * - the main thread puts packets at tail,
+ * - the pool thread computes the shared keys of the packets from done to tail,
+ * - the main thread handles the packets from head to done.
+ *
+ * Only the main thread writes head and tail and only the pool thread writes done, so the
+ * ring needs no lock. A pool thread only takes its mutex to sleep when it has nothing to do.
+ */
+
+#define LOAD_ACQUIRE(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+#define LOAD_SEQ_CST(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define STORE_SEQ_CST(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_SEQ_CST)
+
+typedef struct {
+    IP_Port source;
+    uint16_t length;
+    uint16_t key_offset;
+    const uint8_t *secret_key;
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+} Crypto_Job;
+
+typedef struct {
+    Crypto_Pool *pool;
+    pthread_t thread;
+
+    Crypto_Job *jobs;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t done;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint8_t sleeping;
+    uint8_t running; /* only changed with mutex locked */
+} Crypto_Thread;
+
+typedef struct {
+    Crypto_Pool *pool;
+    uint8_t registered;
+    Packet_Handles handler;
+    Shared_Keys *shared_keys;
+    const uint8_t *secret_key;
+    uint16_t key_offset;
+} Crypto_Route;
+
+struct Crypto_Pool {
+    Networking_Core *net;
+    Crypto_Route routes[256];
+
+    Crypto_Thread *threads;
+    unsigned int num_threads;
+
+#ifdef CRYPTO_POOL_WAKE_PIPE
+    /* Written to by the pool threads when do_crypto_pool() has packets to handle. */
+    int wake_pipe[2];
+    uint8_t wake_pending;
+#endif
+
+    Crypto_Pool_Stats stats;
+};
+
+static void wake_main_thread(Crypto_Pool *pool)
+{
+#ifdef CRYPTO_POOL_WAKE_PIPE
+
+    if (__atomic_exchange_n(&pool->wake_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        uint8_t byte = 0;
+
+        if (write(pool->wake_pipe[1], &byte, 1) != 1) {
+            /* Full pipe: it is readable anyway. */
+        }
+    }
+
+#endif
+}
+
+static void *crypto_thread(void *arg)
+{
+    Crypto_Thread *thread = arg;
+
+    while (1) {
+        uint32_t done = thread->done;
+
+        if (done != LOAD_ACQUIRE(&thread->tail)) {
+            Crypto_Job *job = &thread->jobs[done % CRYPTO_POOL_QUEUE_SIZE];
+            encrypt_precompute(job->data + job->key_offset, job->secret_key, job->shared_key);
+            STORE_RELEASE(&thread->done, done + 1);
+            wake_main_thread(thread->pool);
+            continue;
+        }
+
+        pthread_mutex_lock(&thread->mutex);
+        STORE_SEQ_CST(&thread->sleeping, 1);
+
+        while (LOAD_SEQ_CST(&thread->tail) == thread->done && thread->running) {
+            pthread_cond_wait(&thread->cond, &thread->mutex);
+        }
+
+        STORE_SEQ_CST(&thread->sleeping, 0);
+        uint8_t running = thread->running;
+        pthread_mutex_unlock(&thread->mutex);
+
+        if (!running)
+            break;
+    }
+
+    return NULL;
+}
+
+/* Hand a packet to a pool thread.
+ *
+ * return 0 on success.
+ * return -1 if the queue of the thread is full.
+ */
+static int submit_packet(Crypto_Pool *pool, const Crypto_Route *route, IP_Port source, const uint8_t *packet,
+                         uint16_t length)
+{
+    /* The same thread gets all the packets of a public key so its shared key isn't computed
+     * by several threads at once. */
+    const uint8_t *public_key = packet + route->key_offset;
+    uint32_t key_hash;
+    memcpy(&key_hash, public_key, sizeof(key_hash));
+    Crypto_Thread *thread = &pool->threads[key_hash % pool->num_threads];
+
+    uint32_t tail = thread->tail;
+
+    if (tail - thread->head == CRYPTO_POOL_QUEUE_SIZE)
+        return -1;
+
+    Crypto_Job *job = &thread->jobs[tail % CRYPTO_POOL_QUEUE_SIZE];
+    job->source = source;
+    job->length = length;
+    job->key_offset = route->key_offset;
+    job->secret_key = route->secret_key;
+    memcpy(job->data, packet, length);
+
+    STORE_SEQ_CST(&thread->tail, tail + 1);
+
+    if (LOAD_SEQ_CST(&thread->sleeping)) {
+        pthread_mutex_lock(&thread->mutex);
+        pthread_cond_signal(&thread->cond);
+        pthread_mutex_unlock(&thread->mutex);
+    }
+
+    return 0;
+}
+
+static int handle_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    Crypto_Route *route = object;
+    Crypto_Pool *pool = route->pool;
+
+    if (length >= route->key_offset + crypto_box_PUBLICKEYBYTES && length <= MAX_UDP_PACKET_SIZE
+            && !shared_keys_contains(route->shared_keys, packet + route->key_offset)) {
+        if (submit_packet(pool, route, source, packet, length) == 0) {
+            ++pool->stats.packets_offloaded;
+            return 0;
+        }
+
+        ++pool->stats.packets_inline;
+    }
+
+    return route->handler.function(route->handler.object, source, packet, length);
+}
+
+Crypto_Pool *new_crypto_pool(Networking_Core *net, unsigned int num_threads)
+{
+    if (net == NULL || num_threads == 0 || num_threads > CRYPTO_POOL_MAX_THREADS)
+        return NULL;
+
+    Crypto_Pool *pool = calloc(1, sizeof(Crypto_Pool));
+
+    if (pool == NULL)
+        return NULL;
+
+    pool->net = net;
+    pool->threads = calloc(num_threads, sizeof(Crypto_Thread));
+
+    if (pool->threads == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+#ifdef CRYPTO_POOL_WAKE_PIPE
+
+    if (pipe(pool->wake_pipe) != 0) {
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    set_socket_nonblock(pool->wake_pipe[0]);
+    set_socket_nonblock(pool->wake_pipe[1]);
+#endif
+
+    unsigned int i;
+
+    for (i = 0; i < 256; ++i) {
+        pool->routes[i].pool = pool;
+    }
+
+    for (i = 0; i < num_threads; ++i) {
+        Crypto_Thread *thread = &pool->threads[i];
+        thread->pool = pool;
+        thread->running = 1;
+        thread->jobs = malloc(CRYPTO_POOL_QUEUE_SIZE * sizeof(Crypto_Job));
+
+        if (thread->jobs == NULL) {
+            kill_crypto_pool(pool);
+            return NULL;
+        }
+
+        if (pthread_mutex_init(&thread->mutex, NULL) != 0) {
+            free(thread->jobs);
+            kill_crypto_pool(pool);
+            return NULL;
+        }
+
+        if (pthread_cond_init(&thread->cond, NULL) != 0) {
+            pthread_mutex_destroy(&thread->mutex);
+            free(thread->jobs);
+            kill_crypto_pool(pool);
+            return NULL;
+        }
+
+        if (pthread_create(&thread->thread, NULL, crypto_thread, thread) != 0) {
+            pthread_cond_destroy(&thread->cond);
+            pthread_mutex_destroy(&thread->mutex);
+            free(thread->jobs);
+            kill_crypto_pool(pool);
+            return NULL;
+        }
+
+        ++pool->num_threads;
+    }
+
+    return pool;
+}
+
+int crypto_pool_register(Crypto_Pool *pool, uint8_t packet_id, Shared_Keys *shared_keys, const uint8_t *secret_key,
+                         uint16_t key_offset)
+{
+    Crypto_Route *route = &pool->routes[packet_id];
+
+    if (route->registered || pool->net->packethandlers[packet_id].function == NULL)
+        return -1;
+
+    route->handler = pool->net->packethandlers[packet_id];
+    route->shared_keys = shared_keys;
+    route->secret_key = secret_key;
+    route->key_offset = key_offset;
+    route->registered = 1;
+    networking_registerhandler(pool->net, packet_id, &handle_packet, route);
+    return 0;
+}
+
+int crypto_pool_register_dht(Crypto_Pool *pool, DHT *dht)
+{
+    if (crypto_pool_register(pool, NET_PACKET_PING_REQUEST, &dht->shared_keys_recv, dht->self_secret_key, 1) == -1
+            || crypto_pool_register(pool, NET_PACKET_GET_NODES, &dht->shared_keys_recv, dht->self_secret_key, 1) == -1
+            || crypto_pool_register(pool, NET_PACKET_PING_RESPONSE, &dht->shared_keys_sent, dht->self_secret_key, 1) == -1
+            || crypto_pool_register(pool, NET_PACKET_SEND_NODES_IPV6, &dht->shared_keys_sent, dht->self_secret_key, 1) == -1)
+        return -1;
+
+    return 0;
+}
+
+int crypto_pool_register_onion(Crypto_Pool *pool, Onion *onion)
+{
+    uint8_t *secret_key = onion->dht->self_secret_key;
+
+    if (crypto_pool_register(pool, NET_PACKET_ONION_SEND_INITIAL, &onion->shared_keys_1, secret_key,
+                             1 + crypto_box_NONCEBYTES) == -1
+            || crypto_pool_register(pool, NET_PACKET_ONION_SEND_1, &onion->shared_keys_2, secret_key,
+                                    1 + crypto_box_NONCEBYTES) == -1
+            || crypto_pool_register(pool, NET_PACKET_ONION_SEND_2, &onion->shared_keys_3, secret_key,
+                                    1 + crypto_box_NONCEBYTES) == -1)
+        return -1;
+
+    return 0;
+}
+
+int crypto_pool_register_onion_announce(Crypto_Pool *pool, Onion_Announce *onion_a)
+{
+    return crypto_pool_register(pool, NET_PACKET_ANNOUNCE_REQUEST, &onion_a->shared_keys_recv,
+                                onion_a->dht->self_secret_key, 1 + crypto_box_NONCEBYTES);
+}
+
+void do_crypto_pool(Crypto_Pool *pool)
+{
+#ifdef CRYPTO_POOL_WAKE_PIPE
+    /* Clear the flag before looking at the rings, so a thread finishing a job after this wakes us again. */
+    __atomic_store_n(&pool->wake_pending, 0, __ATOMIC_SEQ_CST);
+    uint8_t buffer[64];
+
+    while (read(pool->wake_pipe[0], buffer, sizeof(buffer)) > 0) {
+        /* Empty the pipe. */
+    }
+
+#endif
+
+    unsigned int i;
+
+    for (i = 0; i < pool->num_threads; ++i) {
+        Crypto_Thread *thread = &pool->threads[i];
+        uint32_t done = LOAD_ACQUIRE(&thread->done);
+
+        while (thread->head != done) {
+            Crypto_Job *job = &thread->jobs[thread->head % CRYPTO_POOL_QUEUE_SIZE];
+            const Crypto_Route *route = &pool->routes[job->data[0]];
+            shared_keys_add(route->shared_keys, job->data + job->key_offset, job->shared_key);
+            route->handler.function(route->handler.object, job->source, job->data, job->length);
+            ++thread->head;
+        }
+    }
+}
+
+int crypto_pool_wait_socks(const Crypto_Pool *pool, Socket_Wait_List *list)
+{
+#ifdef CRYPTO_POOL_WAKE_PIPE
+    return socket_wait_list_add(list, pool->wake_pipe[0], SOCKET_WAIT_READ);
+#else
+    return 0;
+#endif
+}
+
+void crypto_pool_get_stats(const Crypto_Pool *pool, Crypto_Pool_Stats *stats)
+{
+    *stats = pool->stats;
+}
+
+void kill_crypto_pool(Crypto_Pool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    unsigned int i;
+
+    for (i = 0; i < pool->num_threads; ++i) {
+        Crypto_Thread *thread = &pool->threads[i];
+        pthread_mutex_lock(&thread->mutex);
+        thread->running = 0;
+        pthread_cond_signal(&thread->cond);
+        pthread_mutex_unlock(&thread->mutex);
+    }
+
+    for (i = 0; i < pool->num_threads; ++i) {
+        Crypto_Thread *thread = &pool->threads[i];
+        pthread_join(thread->thread, NULL);
+        pthread_cond_destroy(&thread->cond);
+        pthread_mutex_destroy(&thread->mutex);
+        free(thread->jobs);
+    }
+
+    for (i = 0; i < 256; ++i) {
+        if (pool->routes[i].registered)
+            networking_registerhandler(pool->net, i, pool->routes[i].handler.function, pool->routes[i].handler.object);
+    }
+
+#ifdef CRYPTO_POOL_WAKE_PIPE
+    close(pool->wake_pipe[0]);
+    close(pool->wake_pipe[1]);
+#endif
+
+    free(pool->threads);
+    free(pool);
+}
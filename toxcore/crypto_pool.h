@@ -0,0 +1,109 @@
+/* crypto_pool.h
+ *
+ * Threads that compute the shared keys of received packets from peers we don't
+ * have a shared key with yet, so that the thread polling the socket doesn't.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CRYPTO_POOL_H
+#define CRYPTO_POOL_H
+
+#include "DHT.h"
+#include "onion.h"
+#include "onion_announce.h"
+
+/* Maximum number of threads in a pool. */
+#define CRYPTO_POOL_MAX_THREADS 64
+
+/* Number of packets each thread can have waiting for their shared key or to be handled.
+ * When a thread has this many, the shared keys of the packets for it are computed inline.
+ * Must be a power of 2.
+ */
+#define CRYPTO_POOL_QUEUE_SIZE 256
+
+typedef struct {
+    uint64_t packets_offloaded; /* packets whose shared key was computed by a pool thread */
+    uint64_t packets_inline; /* packets handled right away because a thread queue was full */
+} Crypto_Pool_Stats;
+
+typedef struct Crypto_Pool Crypto_Pool;
+
+/* Start a pool of num_threads threads for the packets received on net.
+ *
+ * Packets of the ids registered with crypto_pool_register() whose shared key is not in their
+ * Shared_Keys are put aside while a thread computes it. do_crypto_pool() then adds the key to
+ * the Shared_Keys and calls the handler of the packet, which finds it there. Handlers and the
+ * Shared_Keys are only ever used by the thread that polls net.
+ *
+ * Packets are not always handled in the order they were received: one whose shared key is
+ * known, or that found the queue of its thread full, is handled right away, before the
+ * packets still waiting for a thread. Only register packets that, like all UDP packets,
+ * may arrive in any order.
+ *
+ * return the new pool on success.
+ * return NULL on failure.
+ */
+Crypto_Pool *new_crypto_pool(Networking_Core *net, unsigned int num_threads);
+
+/* Compute the shared keys of packet_id packets with the pool threads.
+ * The handler of packet_id must already be registered on net, the pool calls it for the packets.
+ *
+ * shared_keys is the cache the handler gets the shared key from, secret_key the key it
+ * computes it with, and key_offset the position of the public key of the sender in the packet.
+ * secret_key must stay valid and not change while the pool runs.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int crypto_pool_register(Crypto_Pool *pool, uint8_t packet_id, Shared_Keys *shared_keys, const uint8_t *secret_key,
+                         uint16_t key_offset);
+
+/* Register the DHT requests and responses, the onion packets and the announce requests
+ * (everything that uses a Shared_Keys) with crypto_pool_register().
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int crypto_pool_register_dht(Crypto_Pool *pool, DHT *dht);
+int crypto_pool_register_onion(Crypto_Pool *pool, Onion *onion);
+int crypto_pool_register_onion_announce(Crypto_Pool *pool, Onion_Announce *onion_a);
+
+/* Handle the packets whose shared key was computed.
+ * Call it from the thread that polls net, for example after each networking_poll().
+ */
+void do_crypto_pool(Crypto_Pool *pool);
+
+/* Add a descriptor that becomes readable when do_crypto_pool() has packets to handle to the list,
+ * so that socket_wait() returns for them.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int crypto_pool_wait_socks(const Crypto_Pool *pool, Socket_Wait_List *list);
+
+/* Copy the counters of the pool into stats. */
+void crypto_pool_get_stats(const Crypto_Pool *pool, Crypto_Pool_Stats *stats);
+
+/* Stop the threads and give back the handlers of the registered packets to net.
+ * Packets still waiting for their shared key are dropped.
+ */
+void kill_crypto_pool(Crypto_Pool *pool);
+
+#endif
@@ -0,0 +1,229 @@
+/* distance.c
+ *
+ * XOR distance between public keys, compared a whole key at a time.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "distance.h"
+#include "crypto_core.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Keys are compared as big numbers: the first byte of a key is the most significant. */
+static uint64_t load_big_endian64(const uint8_t *data)
+{
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+#ifndef WORDS_BIGENDIAN
+    word = ((word & 0x00000000FFFFFFFFULL) << 32) | ((word & 0xFFFFFFFF00000000ULL) >> 32);
+    word = ((word & 0x0000FFFF0000FFFFULL) << 16) | ((word & 0xFFFF0000FFFF0000ULL) >> 16);
+    word = ((word & 0x00FF00FF00FF00FFULL) << 8)  | ((word & 0xFF00FF00FF00FF00ULL) >> 8);
+#endif
+    return word;
+}
+
+static unsigned int leading_zeros64(uint64_t word)
+{
+#if defined(__GNUC__)
+    return __builtin_clzll(word);
+#else
+    unsigned int n = 0;
+
+    while (!(word & 0x8000000000000000ULL)) {
+        word <<= 1;
+        ++n;
+    }
+
+    return n;
+#endif
+}
+
+#if defined(__SSE2__)
+
+/* return a mask with bit i set if byte i of the keys differ. */
+static uint32_t differing_bytes(const uint8_t *pk1, const uint8_t *pk2)
+{
+    __m128i low = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)pk1), _mm_loadu_si128((const __m128i *)pk2));
+    __m128i high = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pk1 + 16)),
+                                  _mm_loadu_si128((const __m128i *)(pk2 + 16)));
+    return ~((uint32_t)_mm_movemask_epi8(low) | ((uint32_t)_mm_movemask_epi8(high) << 16));
+}
+
+int pk_distance_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
+{
+    /* pk ^ pk1 and pk ^ pk2 first differ where pk1 and pk2 do. */
+    uint32_t mask = differing_bytes(pk1, pk2);
+
+    if (mask == 0)
+        return 0;
+
+    unsigned int i = __builtin_ctz(mask);
+    return (uint8_t)(pk[i] ^ pk1[i]) < (uint8_t)(pk[i] ^ pk2[i]) ? 1 : 2;
+}
+
+unsigned int pk_common_bits(const uint8_t *pk1, const uint8_t *pk2)
+{
+    uint32_t mask = differing_bytes(pk1, pk2);
+
+    if (mask == 0)
+        return crypto_box_PUBLICKEYBYTES * 8;
+
+    unsigned int i = __builtin_ctz(mask);
+    return i * 8 + leading_zeros64((uint64_t)(uint8_t)(pk1[i] ^ pk2[i]) << 56);
+}
+
+#else
+
+int pk_distance_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
+{
+    unsigned int i;
+
+    for (i = 0; i < crypto_box_PUBLICKEYBYTES; i += sizeof(uint64_t)) {
+        uint64_t key = load_big_endian64(pk + i);
+        uint64_t distance1 = key ^ load_big_endian64(pk1 + i);
+        uint64_t distance2 = key ^ load_big_endian64(pk2 + i);
+
+        if (distance1 < distance2)
+            return 1;
+
+        if (distance1 > distance2)
+            return 2;
+    }
+
+    return 0;
+}
+
+unsigned int pk_common_bits(const uint8_t *pk1, const uint8_t *pk2)
+{
+    unsigned int i;
+
+    for (i = 0; i < crypto_box_PUBLICKEYBYTES; i += sizeof(uint64_t)) {
+        uint64_t distance = load_big_endian64(pk1 + i) ^ load_big_endian64(pk2 + i);
+
+        if (distance)
+            return i * 8 + leading_zeros64(distance);
+    }
+
+    return crypto_box_PUBLICKEYBYTES * 8;
+}
+
+#endif
+
+void pk_distance(PK_Distance *distance, const uint8_t *pk1, const uint8_t *pk2)
+{
+    unsigned int i;
+
+    for (i = 0; i < PK_DISTANCE_WORDS; ++i) {
+        distance->words[i] = load_big_endian64(pk1 + i * sizeof(uint64_t)) ^ load_big_endian64(pk2 + i * sizeof(uint64_t));
+    }
+}
+
+int pk_distance_cmp(const PK_Distance *distance1, const PK_Distance *distance2)
+{
+    unsigned int i;
+
+    for (i = 0; i < PK_DISTANCE_WORDS; ++i) {
+        if (distance1->words[i] != distance2->words[i])
+            return distance1->words[i] < distance2->words[i] ? -1 : 1;
+    }
+
+    return 0;
+}
+
+typedef struct {
+    unsigned int rank;
+    PK_Distance distance;
+    uint16_t index;
+} Sort_Key;
+
+/* return 1 if the entry of key1 goes after the one of key2, 0 if not. */
+static int sorts_after(const Sort_Key *key1, const Sort_Key *key2)
+{
+    if (key1->rank != key2->rank)
+        return key1->rank > key2->rank;
+
+    if (key1->rank == 0)
+        return 0;
+
+    /* The furthest go first. */
+    return pk_distance_cmp(&key1->distance, &key2->distance) < 0;
+}
+
+int sort_by_distance(void *list, unsigned int length, size_t entry_size, size_t key_offset, const uint8_t *cmp_pk,
+                     unsigned int (*rank)(const void *entry))
+{
+    if (length > MAX_DISTANCE_SORT_LENGTH)
+        return -1;
+
+    uint8_t *entries = list;
+    Sort_Key keys[MAX_DISTANCE_SORT_LENGTH];
+    unsigned int i, j;
+
+    for (i = 0; i < length; ++i) {
+        const uint8_t *entry = entries + i * entry_size;
+        keys[i].rank = rank(entry);
+        keys[i].index = i;
+
+        if (keys[i].rank != 0)
+            pk_distance(&keys[i].distance, entry + key_offset, cmp_pk);
+    }
+
+    /* Insertion sort: the lists are short and usually only have one entry out of place. */
+    for (i = 1; i < length; ++i) {
+        Sort_Key key = keys[i];
+
+        for (j = i; j > 0 && sorts_after(&keys[j - 1], &key); --j) {
+            keys[j] = keys[j - 1];
+        }
+
+        keys[j] = key;
+    }
+
+    /* Move every entry to its place, following the cycles of the permutation. */
+    uint8_t done[MAX_DISTANCE_SORT_LENGTH] = {0};
+    uint8_t temp[entry_size];
+
+    for (i = 0; i < length; ++i) {
+        if (done[i] || keys[i].index == i)
+            continue;
+
+        memcpy(temp, entries + i * entry_size, entry_size);
+        j = i;
+
+        while (keys[j].index != i) {
+            memcpy(entries + j * entry_size, entries + keys[j].index * entry_size, entry_size);
+            done[j] = 1;
+            j = keys[j].index;
+        }
+
+        memcpy(entries + j * entry_size, temp, entry_size);
+        done[j] = 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+/* distance.h
+ *
+ * XOR distance between public keys, compared a whole key at a time.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DISTANCE_H
+#define DISTANCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PK_DISTANCE_WORDS 4
+
+/* XOR distance between two public keys as a big number, most significant word first. */
+typedef struct {
+    uint64_t words[PK_DISTANCE_WORDS];
+} PK_Distance;
+
+/* Compare the distances of pk1 and pk2 to pk.
+ *
+ *  return 0 if both are same distance.
+ *  return 1 if pk1 is closer.
+ *  return 2 if pk2 is closer.
+ */
+int pk_distance_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2);
+
+/* return the number of leading bits pk1 and pk2 have in common (crypto_box_PUBLICKEYBYTES * 8 if equal). */
+unsigned int pk_common_bits(const uint8_t *pk1, const uint8_t *pk2);
+
+/* Put the distance between pk1 and pk2 in distance. */
+void pk_distance(PK_Distance *distance, const uint8_t *pk1, const uint8_t *pk2);
+
+/* return -1, 0 or 1 if distance1 is smaller, equal or bigger than distance2. */
+int pk_distance_cmp(const PK_Distance *distance1, const PK_Distance *distance2);
+
+/* Sort a list of length entries of entry_size bytes, whose public key is at key_offset in them,
+ * the way the DHT and onion client lists are kept: by rank(entry) (lowest first, e.g. 0 for a
+ * timed out entry, 1 for a good one) then from the furthest to the closest to cmp_pk.
+ * Entries of rank 0 are not sorted by distance. Entries of equal rank and distance keep their order.
+ *
+ * The distances are computed once per entry, and the list is only moved in memory once.
+ *
+ * return -1 if length is bigger than MAX_DISTANCE_SORT_LENGTH.
+ * return 0 on success.
+ */
+#define MAX_DISTANCE_SORT_LENGTH 256
+
+int sort_by_distance(void *list, unsigned int length, size_t entry_size, size_t key_offset, const uint8_t *cmp_pk,
+                     unsigned int (*rank)(const void *entry));
+
+#endif
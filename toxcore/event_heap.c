@@ -0,0 +1,195 @@
+/* event_heap.c
+ *
+ * Binary min-heap of ids keyed by the time of their next event, for running
+ * only the objects that have something due instead of scanning all of them.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+
+#include "event_heap.h"
+
+static void place_entry(Event_Heap *heap, uint32_t pos, Event_Heap_Entry entry)
+{
+    heap->entries[pos] = entry;
+    heap->positions[entry.id] = pos;
+}
+
+static void sift_up(Event_Heap *heap, uint32_t pos)
+{
+    Event_Heap_Entry entry = heap->entries[pos];
+
+    while (pos != 0) {
+        uint32_t parent = (pos - 1) / 2;
+
+        if (heap->entries[parent].time <= entry.time)
+            break;
+
+        place_entry(heap, pos, heap->entries[parent]);
+        pos = parent;
+    }
+
+    place_entry(heap, pos, entry);
+}
+
+static void sift_down(Event_Heap *heap, uint32_t pos)
+{
+    Event_Heap_Entry entry = heap->entries[pos];
+
+    while (1) {
+        uint32_t child = pos * 2 + 1;
+
+        if (child >= heap->length)
+            break;
+
+        if (child + 1 < heap->length && heap->entries[child + 1].time < heap->entries[child].time)
+            ++child;
+
+        if (entry.time <= heap->entries[child].time)
+            break;
+
+        place_entry(heap, pos, heap->entries[child]);
+        pos = child;
+    }
+
+    place_entry(heap, pos, entry);
+}
+
+void event_heap_init(Event_Heap *heap)
+{
+    heap->entries = NULL;
+    heap->length = 0;
+    heap->positions = NULL;
+    heap->size = 0;
+}
+
+void event_heap_free(Event_Heap *heap)
+{
+    free(heap->entries);
+    free(heap->positions);
+    event_heap_init(heap);
+}
+
+int event_heap_reserve(Event_Heap *heap, uint32_t size)
+{
+    if (size <= heap->size)
+        return 0;
+
+    Event_Heap_Entry *entries = realloc(heap->entries, size * sizeof(Event_Heap_Entry));
+
+    if (entries == NULL)
+        return -1;
+
+    heap->entries = entries;
+
+    uint32_t *positions = realloc(heap->positions, size * sizeof(uint32_t));
+
+    if (positions == NULL)
+        return -1;
+
+    uint32_t i;
+
+    for (i = heap->size; i < size; ++i) {
+        positions[i] = EVENT_HEAP_NONE;
+    }
+
+    heap->positions = positions;
+    heap->size = size;
+    return 0;
+}
+
+int event_heap_set(Event_Heap *heap, uint32_t id, uint64_t time)
+{
+    if (id >= heap->size)
+        return -1;
+
+    uint32_t pos = heap->positions[id];
+
+    if (pos == EVENT_HEAP_NONE) {
+        pos = heap->length;
+        ++heap->length;
+        heap->entries[pos].id = id;
+        heap->entries[pos].time = time;
+        sift_up(heap, pos);
+        return 0;
+    }
+
+    uint64_t old_time = heap->entries[pos].time;
+    heap->entries[pos].time = time;
+
+    if (time < old_time) {
+        sift_up(heap, pos);
+    } else {
+        sift_down(heap, pos);
+    }
+
+    return 0;
+}
+
+void event_heap_remove(Event_Heap *heap, uint32_t id)
+{
+    if (!event_heap_contains(heap, id))
+        return;
+
+    uint32_t pos = heap->positions[id];
+    heap->positions[id] = EVENT_HEAP_NONE;
+    --heap->length;
+
+    if (pos == heap->length)
+        return;
+
+    /* Put the last entry in the hole and move it where it belongs. */
+    uint64_t old_time = heap->entries[pos].time;
+    place_entry(heap, pos, heap->entries[heap->length]);
+
+    if (heap->entries[pos].time < old_time) {
+        sift_up(heap, pos);
+    } else {
+        sift_down(heap, pos);
+    }
+}
+
+_Bool event_heap_contains(const Event_Heap *heap, uint32_t id)
+{
+    return id < heap->size && heap->positions[id] != EVENT_HEAP_NONE;
+}
+
+int event_heap_next_time(const Event_Heap *heap, uint64_t *time)
+{
+    if (heap->length == 0)
+        return -1;
+
+    *time = heap->entries[0].time;
+    return 0;
+}
+
+int64_t event_heap_pop(Event_Heap *heap, uint64_t time)
+{
+    if (heap->length == 0 || heap->entries[0].time > time)
+        return -1;
+
+    uint32_t id = heap->entries[0].id;
+    event_heap_remove(heap, id);
+    return id;
+}
@@ -0,0 +1,86 @@
+/* event_heap.h
+ *
+ * Binary min-heap of ids keyed by the time of their next event, for running
+ * only the objects that have something due instead of scanning all of them.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EVENT_HEAP_H
+#define EVENT_HEAP_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint64_t time;
+    uint32_t id;
+} Event_Heap_Entry;
+
+typedef struct {
+    Event_Heap_Entry *entries; /* the heap, earliest time first */
+    uint32_t length; /* number of ids in the heap */
+    uint32_t *positions; /* index of each id in entries, or EVENT_HEAP_NONE */
+    uint32_t size; /* number of ids entries and positions have room for */
+} Event_Heap;
+
+#define EVENT_HEAP_NONE UINT32_MAX
+
+/* Initialize an empty heap with room for no ids. */
+void event_heap_init(Event_Heap *heap);
+
+/* Free the memory of a heap. */
+void event_heap_free(Event_Heap *heap);
+
+/* Make room for the ids below size, so that setting their time can't fail.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int event_heap_reserve(Event_Heap *heap, uint32_t size);
+
+/* Set the time of the next event of id, adding it to the heap if it isn't in it.
+ *
+ * return 0 on success.
+ * return -1 if there is no room for id.
+ */
+int event_heap_set(Event_Heap *heap, uint32_t id, uint64_t time);
+
+/* Take id out of the heap, if it is in it. */
+void event_heap_remove(Event_Heap *heap, uint32_t id);
+
+/* return 1 if id is in the heap.
+ * return 0 if it isn't.
+ */
+_Bool event_heap_contains(const Event_Heap *heap, uint32_t id);
+
+/* Put the earliest time in the heap in time.
+ *
+ * return 0 on success.
+ * return -1 if the heap is empty.
+ */
+int event_heap_next_time(const Event_Heap *heap, uint64_t *time);
+
+/* Take the id with the earliest time out of the heap, if that time is not after time.
+ *
+ * return the id.
+ * return -1 if no event is due at time.
+ */
+int64_t event_heap_pop(Event_Heap *heap, uint64_t time);
+
+#endif
@@ -132,18 +132,7 @@ static Friend_Conn *get_conn(const Friend_Connections *fr_c, int friendcon_id)
  */
 int getfriend_conn_id_pk(Friend_Connections *fr_c, const uint8_t *real_pk)
 {
-    uint32_t i;
-
-    for (i = 0; i < fr_c->num_cons; ++i) {
-        Friend_Conn *friend_con = get_conn(fr_c, i);
-
-        if (friend_con) {
-            if (public_key_cmp(friend_con->real_public_key, real_pk) == 0)
-                return i;
-        }
-    }
-
-    return -1;
+    return hash_list_find(&fr_c->conns_index, real_pk);
 }
 
 /* Add a TCP relay associated to the friend.
@@ -669,6 +658,11 @@ int new_friend_connection(Friend_Connections *fr_c, const uint8_t *real_public_k
     if (onion_friendnum == -1)
         return -1;
 
+    if (!hash_list_add(&fr_c->conns_index, real_public_key, friendcon_id)) {
+        onion_delfriend(fr_c->onion_c, onion_friendnum);
+        return -1;
+    }
+
     Friend_Conn *friend_con = &fr_c->conns[friendcon_id];
 
     friend_con->crypt_connection_id = -1;
@@ -706,6 +700,7 @@ int kill_friend_connection(Friend_Connections *fr_c, int friendcon_id)
         DHT_delfriend(fr_c->dht, friend_con->dht_temp_pk, friend_con->dht_lock);
     }
 
+    hash_list_remove(&fr_c->conns_index, friend_con->real_public_key, friendcon_id);
     return wipe_friend_conn(fr_c, friendcon_id);
 }
 
@@ -768,6 +763,11 @@ Friend_Connections *new_friend_connections(Onion_Client *onion_c)
     if (temp == NULL)
         return NULL;
 
+    if (!hash_list_init(&temp->conns_index, crypto_box_PUBLICKEYBYTES, 0)) {
+        free(temp);
+        return NULL;
+    }
+
     temp->dht = onion_c->dht;
     temp->net_crypto = onion_c->c;
     temp->onion_c = onion_c;
@@ -851,5 +851,6 @@ void kill_friend_connections(Friend_Connections *fr_c)
     }
 
     LANdiscovery_kill(fr_c->dht);
+    hash_list_free(&fr_c->conns_index);
     free(fr_c);
 }
@@ -108,6 +108,7 @@ typedef struct {
 
     Friend_Conn *conns;
     uint32_t num_cons;
+    HASH_LIST conns_index; // real public key -> friendcon_id
 
     int (*fr_request_callback)(void *object, const uint8_t *source_pubkey, const uint8_t *data, uint16_t len);
     void *fr_request_object;
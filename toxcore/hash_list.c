@@ -0,0 +1,220 @@
+/* hash_list.c
+ *
+ * Open addressing hash table which associates ids with data of a fixed size,
+ * like BS_LIST but with O(1) add/remove/find, for large lists of public keys.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "hash_list.h"
+#include "crypto_core.h"
+
+/* Linear probing: an element is in the first empty or matching slot after the slot of its hash.
+ * The list is kept at most 3/4 full, and removals shift the following elements back so that
+ * no tombstones are needed.
+ */
+
+#define EMPTY_SLOT (-1)
+
+static uint32_t hash(const HASH_LIST *list, const uint8_t *data)
+{
+    uint64_t h = list->seed;
+    uint32_t i;
+
+    for (i = 0; i + sizeof(uint64_t) <= list->element_size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        h = (h ^ word) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+
+    for (; i < list->element_size; ++i) {
+        h = (h ^ data[i]) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+
+    h ^= h >> 32;
+    return h;
+}
+
+static uint8_t *slot_data(const HASH_LIST *list, uint32_t slot)
+{
+    return list->data + (size_t)list->element_size * slot;
+}
+
+/* return the slot of data if it is in the list, else the empty slot where it would go. */
+static uint32_t find_slot(const HASH_LIST *list, const uint8_t *data)
+{
+    uint32_t mask = list->capacity - 1;
+    uint32_t slot = hash(list, data) & mask;
+
+    while (list->ids[slot] != EMPTY_SLOT && memcmp(slot_data(list, slot), data, list->element_size) != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+/* Resize the list to new_capacity slots, which must be a power of 2 bigger than n.
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure
+ */
+static int resize(HASH_LIST *list, uint32_t new_capacity)
+{
+    HASH_LIST bigger = *list;
+    bigger.capacity = new_capacity;
+    bigger.n = 0;
+    bigger.data = malloc((size_t)list->element_size * new_capacity);
+    bigger.ids = malloc(sizeof(int) * new_capacity);
+
+    if (!bigger.data || !bigger.ids) {
+        free(bigger.data);
+        free(bigger.ids);
+        return 0;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < new_capacity; ++i) {
+        bigger.ids[i] = EMPTY_SLOT;
+    }
+
+    for (i = 0; i < list->capacity; ++i) {
+        if (list->ids[i] == EMPTY_SLOT)
+            continue;
+
+        uint32_t slot = find_slot(&bigger, slot_data(list, i));
+        memcpy(slot_data(&bigger, slot), slot_data(list, i), list->element_size);
+        bigger.ids[slot] = list->ids[i];
+        ++bigger.n;
+    }
+
+    free(list->data);
+    free(list->ids);
+    *list = bigger;
+    return 1;
+}
+
+int hash_list_init(HASH_LIST *list, uint32_t element_size, uint32_t initial_capacity)
+{
+    uint32_t capacity = 8;
+
+    while (capacity / 4 * 3 < initial_capacity) {
+        capacity *= 2;
+    }
+
+    list->n = 0;
+    list->capacity = 0;
+    list->element_size = element_size;
+    list->seed = random_64b();
+    list->data = NULL;
+    list->ids = NULL;
+
+    return resize(list, capacity);
+}
+
+void hash_list_free(HASH_LIST *list)
+{
+    free(list->data);
+    free(list->ids);
+    list->data = NULL;
+    list->ids = NULL;
+    list->n = 0;
+    list->capacity = 0;
+}
+
+int hash_list_find(const HASH_LIST *list, const uint8_t *data)
+{
+    if (list->n == 0)
+        return -1;
+
+    return list->ids[find_slot(list, data)];
+}
+
+int hash_list_add(HASH_LIST *list, const uint8_t *data, int id)
+{
+    if (id < 0)
+        return 0;
+
+    if ((list->n + 1) > list->capacity / 4 * 3 && !resize(list, list->capacity * 2))
+        return 0;
+
+    uint32_t slot = find_slot(list, data);
+
+    if (list->ids[slot] != EMPTY_SLOT)
+        return 0;
+
+    memcpy(slot_data(list, slot), data, list->element_size);
+    list->ids[slot] = id;
+    ++list->n;
+    return 1;
+}
+
+int hash_list_remove(HASH_LIST *list, const uint8_t *data, int id)
+{
+    if (list->n == 0)
+        return 0;
+
+    uint32_t mask = list->capacity - 1;
+    uint32_t slot = find_slot(list, data);
+
+    if (list->ids[slot] == EMPTY_SLOT || list->ids[slot] != id)
+        return 0;
+
+    /* Move back the following elements that can't be found anymore once slot is empty. */
+    uint32_t next = slot;
+
+    while (1) {
+        next = (next + 1) & mask;
+
+        if (list->ids[next] == EMPTY_SLOT)
+            break;
+
+        uint32_t home = hash(list, slot_data(list, next)) & mask;
+
+        /* Leave the element where it is if its home slot is cyclically in (slot, next]. */
+        if (slot <= next ? (slot < home && home <= next) : (slot < home || home <= next))
+            continue;
+
+        memcpy(slot_data(list, slot), slot_data(list, next), list->element_size);
+        list->ids[slot] = list->ids[next];
+        slot = next;
+    }
+
+    list->ids[slot] = EMPTY_SLOT;
+    --list->n;
+    return 1;
+}
+
+void hash_list_clear(HASH_LIST *list)
+{
+    uint32_t i;
+
+    for (i = 0; i < list->capacity; ++i) {
+        list->ids[i] = EMPTY_SLOT;
+    }
+
+    list->n = 0;
+}
@@ -0,0 +1,80 @@
+/* hash_list.h
+ *
+ * Open addressing hash table which associates ids with data of a fixed size,
+ * like BS_LIST but with O(1) add/remove/find, for large lists of public keys.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HASH_LIST_H
+#define HASH_LIST_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct {
+    uint32_t n; //number of elements
+    uint32_t capacity; //number of slots, always a power of 2
+    uint32_t element_size; //size of the elements
+    uint64_t seed; //random hash seed, so that nobody can pick keys that collide
+    uint8_t *data; //array of capacity slots
+    int *ids; //id of the element in each slot, -1 for empty slots
+} HASH_LIST;
+
+/* Initialize a list, element_size is the size of the elements in the list and
+ * initial_capacity is the number of elements the memory will be initially allocated for
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure
+ */
+int hash_list_init(HASH_LIST *list, uint32_t element_size, uint32_t initial_capacity);
+
+/* Free a list initiated with hash_list_init */
+void hash_list_free(HASH_LIST *list);
+
+/* Retrieve the id of an element in the list
+ *
+ * return value:
+ *  >= 0 : id associated with data
+ *  -1   : failure
+ */
+int hash_list_find(const HASH_LIST *list, const uint8_t *data);
+
+/* Add an element with associated id (>= 0) to the list
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure (data already in list or out of memory)
+ */
+int hash_list_add(HASH_LIST *list, const uint8_t *data, int id);
+
+/* Remove element from the list
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure (element not found or id does not match)
+ */
+int hash_list_remove(HASH_LIST *list, const uint8_t *data, int id);
+
+/* Remove all the elements from the list, keeping its memory. */
+void hash_list_clear(HASH_LIST *list);
+
+#endif
@@ -0,0 +1,89 @@
+/* mpsc_queue.c
+ *
+ * Unbounded queue that any number of threads can add to without locks or
+ * waiting on each other, and that one thread takes from.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+
+#include "mpsc_queue.h"
+
+/* The nodes form a list from head to tail linked by their next pointers (Vyukov's
+ * intrusive MPSC queue). A producer swaps tail with its node and only then links the
+ * previous tail to it, so between the two steps the list is cut and pop() stops there
+ * until the link is made. The stub node is put back in when the last node is popped,
+ * so that the list is never empty and pushing never has to touch head.
+ */
+
+#define LOAD_ACQUIRE(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+
+void mpsc_queue_init(MPSC_Queue *queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+void mpsc_queue_push(MPSC_Queue *queue, MPSC_Node *node)
+{
+    node->next = NULL;
+    MPSC_Node *prev = __atomic_exchange_n(&queue->tail, node, __ATOMIC_ACQ_REL);
+    STORE_RELEASE(&prev->next, node);
+}
+
+MPSC_Node *mpsc_queue_pop(MPSC_Queue *queue)
+{
+    MPSC_Node *head = queue->head;
+    MPSC_Node *next = LOAD_ACQUIRE(&head->next);
+
+    if (head == &queue->stub) {
+        if (next == NULL)
+            return NULL;
+
+        queue->head = next;
+        head = next;
+        next = LOAD_ACQUIRE(&next->next);
+    }
+
+    if (next) {
+        queue->head = next;
+        return head;
+    }
+
+    /* head is the last node linked, take it only if it is also the last node pushed. */
+    if (head != LOAD_ACQUIRE(&queue->tail))
+        return NULL;
+
+    mpsc_queue_push(queue, &queue->stub);
+    next = LOAD_ACQUIRE(&head->next);
+
+    if (next) {
+        queue->head = next;
+        return head;
+    }
+
+    return NULL;
+}
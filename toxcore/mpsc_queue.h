@@ -0,0 +1,59 @@
+/* mpsc_queue.h
+ *
+ * Unbounded queue that any number of threads can add to without locks or
+ * waiting on each other, and that one thread takes from.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+/* Put an MPSC_Node in the elements to queue, and get the element back from the node
+ * popped, for example by making it the first member.
+ */
+typedef struct MPSC_Node {
+    struct MPSC_Node *next;
+} MPSC_Node;
+
+typedef struct {
+    MPSC_Node *tail; /* last node pushed, changed by the producers */
+    MPSC_Node *head; /* next node to pop, only used by the consumer */
+    MPSC_Node stub; /* kept in the list so that it is never empty */
+} MPSC_Queue;
+
+/* Initialize an empty queue.
+ * The queue must not move in memory once initialized.
+ */
+void mpsc_queue_init(MPSC_Queue *queue);
+
+/* Add node at the end of queue.
+ * Safe to call from any number of threads at once, it doesn't take locks.
+ */
+void mpsc_queue_push(MPSC_Queue *queue, MPSC_Node *node);
+
+/* Take the node at the start of queue.
+ * Only call from one thread at a time.
+ *
+ * return the node.
+ * return NULL if the queue is empty, or while the next node is still being pushed.
+ */
+MPSC_Node *mpsc_queue_pop(MPSC_Queue *queue);
+
+#endif
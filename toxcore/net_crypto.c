@@ -32,6 +32,9 @@
 #include "math.h"
 #include "logger.h"
 
+#include <sched.h>
+#include <stddef.h>
+
 static uint8_t crypt_connection_id_not_valid(const Net_Crypto *c, int crypt_connection_id)
 {
     if ((uint32_t)crypt_connection_id >= c->crypto_connections_length)
@@ -384,6 +387,53 @@ static Crypto_Connection *get_crypto_connection(const Net_Crypto *c, int crypt_c
     return &c->crypto_connections[crypt_connection_id];
 }
 
+/* Make send_crypto_packets() run the connection once time is reached.
+ * Only call from the thread running do_net_crypto(), other threads use wake_connection().
+ */
+static void schedule_connection(Net_Crypto *c, int crypt_connection_id, uint64_t time)
+{
+    if (get_crypto_connection(c, crypt_connection_id) == 0)
+        return;
+
+    event_heap_set(&c->schedule, crypt_connection_id, time);
+}
+
+
+/* Put the canonical form of ip_port used as key of ip_port_index in key, which must be
+ * SIZE_IPPORT bytes. Unlike the IP_Port struct it has no padding or unused address bytes,
+ * so IP_Ports that are equal always have the same key.
+ */
+static void ip_port_key(uint8_t *key, IP_Port ip_port)
+{
+    memset(key, 0, SIZE_IPPORT);
+    key[0] = ip_port.ip.family;
+
+    if (ip_port.ip.family == AF_INET) {
+        memcpy(key + 1, ip_port.ip.ip4.uint8, SIZE_IP4);
+    } else if (ip_port.ip.family == AF_INET6) {
+        memcpy(key + 1, ip_port.ip.ip6.uint8, SIZE_IP6);
+    }
+
+    memcpy(key + SIZE_IP, &ip_port.port, SIZE_PORT);
+}
+
+/* Replace old_ip_port with ip_port in the ip_port_index entries of the connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int replace_ip_port_index(Net_Crypto *c, int crypt_connection_id, IP_Port old_ip_port, IP_Port ip_port)
+{
+    uint8_t key[SIZE_IPPORT];
+    ip_port_key(key, ip_port);
+
+    if (!hash_list_add(&c->ip_port_index, key, crypt_connection_id))
+        return -1;
+
+    ip_port_key(key, old_ip_port);
+    hash_list_remove(&c->ip_port_index, key, crypt_connection_id);
+    return 0;
+}
 
 /* Associate an ip_port to a connection.
  *
@@ -399,19 +449,17 @@ static int add_ip_port_connection(Net_Crypto *c, int crypt_connection_id, IP_Por
 
     if (ip_port.ip.family == AF_INET) {
         if (!ipport_equal(&ip_port, &conn->ip_portv4) && LAN_ip(conn->ip_portv4.ip) != 0) {
-            if (!bs_list_add(&c->ip_port_list, (uint8_t *)&ip_port, crypt_connection_id))
+            if (replace_ip_port_index(c, crypt_connection_id, conn->ip_portv4, ip_port) != 0)
                 return -1;
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
             conn->ip_portv4 = ip_port;
             return 0;
         }
     } else if (ip_port.ip.family == AF_INET6) {
         if (!ipport_equal(&ip_port, &conn->ip_portv6)) {
-            if (!bs_list_add(&c->ip_port_list, (uint8_t *)&ip_port, crypt_connection_id))
+            if (replace_ip_port_index(c, crypt_connection_id, conn->ip_portv6, ip_port) != 0)
                 return -1;
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
             conn->ip_portv6 = ip_port;
             return 0;
         }
@@ -522,8 +570,51 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
     return -1;
 }
 
+/* Sends count packets, packet i being data[i] of length[i], to the peer using the fastest route.
+ * Packets sent directly go out in one batch.
+ *
+ * return -1 on failure.
+ * return number of packets sent, starting with the first, on success.
+ */
+static int send_packets_to(Net_Crypto *c, int crypt_connection_id, const uint8_t *const *data, const uint16_t *length,
+                           unsigned int count)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    pthread_mutex_lock(&conn->mutex);
+    IP_Port ip_port = return_ip_port_connection(c, crypt_connection_id);
+    _Bool direct_connected = 0;
+
+    if (ip_port.ip.family != 0)
+        crypto_connection_status(c, crypt_connection_id, &direct_connected, NULL);
+
+    if (direct_connected) {
+        int ret = sendpacket_batch(c->dht->net, ip_port, data, length, count);
+        pthread_mutex_unlock(&conn->mutex);
+        return ret;
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
+
+    unsigned int i;
+
+    for (i = 0; i < count; ++i) {
+        if (send_packet_to(c, crypt_connection_id, data[i], length[i]) != 0)
+            break;
+    }
+
+    return i;
+}
+
 /** START: Array Related functions **/
 
+/* Adding packets can reallocate the buffer of an array, and packets are added to send_array
+ * from whatever thread sends them, so the buffer of send_array is only used with the mutex of
+ * its connection locked.
+ */
 
 /* Return number of packets in array
  * Note that holes are counted too.
@@ -533,28 +624,160 @@ static uint32_t num_packets_array(const Packets_Array *array)
     return array->buffer_end - array->buffer_start;
 }
 
+/* Put data, or NULL to empty it, in the spot of packet number in array. */
+static void set_packet(Packets_Array *array, uint32_t number, Packet_Data *data)
+{
+    uint32_t num = number % array->capacity;
+    uint64_t bit = (uint64_t)1 << (num % 64);
+
+    array->buffer[num] = data;
+
+    if (data) {
+        array->present[num / 64] |= bit;
+    } else {
+        array->present[num / 64] &= ~bit;
+    }
+}
+
+/* return the index of the lowest set bit of word, which must not be 0. */
+static unsigned int lowest_bit(uint64_t word)
+{
+    static const uint8_t debruijn_index[64] = {
+        0,  1, 48,  2, 57, 49, 28,  3, 61, 58, 50, 42, 38, 29, 17,  4,
+        62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12,  5,
+        63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+        46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19,  9, 13,  8,  7,  6
+    };
+
+    return debruijn_index[((word & -word) * UINT64_C(0x03f79d71b4cb0a89)) >> 58];
+}
+
+/* Find the first packet number from number up to end (but not end) whose spot in array
+ * holds a packet if present is 1, or is empty if present is 0.
+ * Spots are checked 64 at a time so runs of packets are skipped quickly.
+ *
+ * return that packet number.
+ * return end if there is none.
+ */
+static uint32_t find_packet_spot(const Packets_Array *array, uint32_t number, uint32_t end, _Bool present)
+{
+    while (number != end) {
+        uint32_t num = number % array->capacity;
+        uint32_t bit = num % 64;
+        uint32_t span = 64 - bit;
+        uint64_t word = array->present[num / 64];
+
+        if (!present)
+            word = ~word;
+
+        word >>= bit;
+
+        if (span > end - number) {
+            span = end - number;
+            word &= ((uint64_t)1 << span) - 1;
+        }
+
+        if (word)
+            return number + lowest_bit(word);
+
+        number += span;
+    }
+
+    return end;
+}
+
+/* Move the packets in array to a new buffer of capacity spots.
+ * capacity must be a power of 2 and at least the number of packets in array.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int resize_packets_array(Packets_Array *array, uint32_t capacity)
+{
+    Packet_Data **buffer = calloc(capacity, sizeof(Packet_Data *));
+    uint64_t *present = calloc(capacity / 64, sizeof(uint64_t));
+
+    if (buffer == NULL || present == NULL) {
+        free(buffer);
+        free(present);
+        return -1;
+    }
+
+    Packet_Data **old_buffer = array->buffer;
+    uint32_t old_capacity = array->capacity;
+    free(array->present);
+    array->buffer = buffer;
+    array->present = present;
+    array->capacity = capacity;
+
+    uint32_t i;
+
+    for (i = array->buffer_start; i != array->buffer_end; ++i) {
+        Packet_Data *data = old_buffer[i % old_capacity];
+
+        if (data)
+            set_packet(array, i, data);
+    }
+
+    free(old_buffer);
+    return 0;
+}
+
+/* Grow the buffer of array if needed so that it fits length packets starting at buffer_start.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int reserve_packets_array(Packets_Array *array, uint32_t length)
+{
+    if (length <= array->capacity)
+        return 0;
+
+    if (length > CRYPTO_PACKET_BUFFER_SIZE)
+        return -1;
+
+    uint32_t capacity = array->capacity ? array->capacity : CRYPTO_MIN_PACKET_BUFFER_SIZE;
+
+    while (capacity < length)
+        capacity *= 2;
+
+    return resize_packets_array(array, capacity);
+}
+
+/* Halve the buffer of array if it is at most a quarter full.
+ * Called periodically so that a buffer that grew during a burst goes back down afterwards.
+ */
+static void shrink_packets_array(Packets_Array *array)
+{
+    if (array->capacity <= CRYPTO_MIN_PACKET_BUFFER_SIZE)
+        return;
+
+    if (num_packets_array(array) > array->capacity / 4)
+        return;
+
+    resize_packets_array(array, array->capacity / 2);
+}
+
 /* Add data with packet number to array.
+ * On success the array owns data, which must come from the packet pool.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int add_data_to_buffer(Packets_Array *array, uint32_t number, const Packet_Data *data)
+static int add_data_to_buffer(Packets_Array *array, uint32_t number, Packet_Data *data)
 {
     if (number - array->buffer_start > CRYPTO_PACKET_BUFFER_SIZE)
         return -1;
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
-
-    if (array->buffer[num])
+    if (reserve_packets_array(array, number - array->buffer_start + 1) != 0)
         return -1;
 
-    Packet_Data *new_d = malloc(sizeof(Packet_Data));
+    uint32_t num = number % array->capacity;
 
-    if (new_d == NULL)
+    if (array->buffer[num])
         return -1;
 
-    memcpy(new_d, data, sizeof(Packet_Data));
-    array->buffer[num] = new_d;
+    set_packet(array, number, data);
 
     if ((number - array->buffer_start) >= (array->buffer_end - array->buffer_start))
         array->buffer_end = number + 1;
@@ -575,7 +798,7 @@ static int get_data_pointer(const Packets_Array *array, Packet_Data **data, uint
     if (array->buffer_end - number > num_spots || number - array->buffer_start >= num_spots)
         return -1;
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    uint32_t num = number % array->capacity;
 
     if (!array->buffer[num])
         return 0;
@@ -585,47 +808,45 @@ static int get_data_pointer(const Packets_Array *array, Packet_Data **data, uint
 }
 
 /* Add data to end of array.
+ * On success the array owns data, which must come from the packet pool.
  *
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t add_data_end_of_buffer(Packets_Array *array, const Packet_Data *data)
+static int64_t add_data_end_of_buffer(Packets_Array *array, Packet_Data *data)
 {
     if (num_packets_array(array) >= CRYPTO_PACKET_BUFFER_SIZE)
         return -1;
 
-    Packet_Data *new_d = malloc(sizeof(Packet_Data));
-
-    if (new_d == NULL)
+    if (reserve_packets_array(array, num_packets_array(array) + 1) != 0)
         return -1;
 
-    memcpy(new_d, data, sizeof(Packet_Data));
     uint32_t id = array->buffer_end;
-    array->buffer[id % CRYPTO_PACKET_BUFFER_SIZE] = new_d;
+    set_packet(array, id, data);
     ++array->buffer_end;
     return id;
 }
 
-/* Read data from begginning of array.
+/* Take the data at the beginning of array out of it and put it in data.
+ * The caller must give it back to the packet pool.
  *
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t read_data_beg_buffer(Packets_Array *array, Packet_Data *data)
+static int64_t read_data_beg_buffer(Packets_Array *array, Packet_Data **data)
 {
     if (array->buffer_end == array->buffer_start)
         return -1;
 
-    uint32_t num = array->buffer_start % CRYPTO_PACKET_BUFFER_SIZE;
+    uint32_t num = array->buffer_start % array->capacity;
 
     if (!array->buffer[num])
         return -1;
 
-    memcpy(data, array->buffer[num], sizeof(Packet_Data));
+    *data = array->buffer[num];
     uint32_t id = array->buffer_start;
+    set_packet(array, id, NULL);
     ++array->buffer_start;
-    free(array->buffer[num]);
-    array->buffer[num] = NULL;
     return id;
 }
 
@@ -634,7 +855,7 @@ static int64_t read_data_beg_buffer(Packets_Array *array, Packet_Data *data)
  * return -1 on failure.
  * return 0 on success
  */
-static int clear_buffer_until(Packets_Array *array, uint32_t number)
+static int clear_buffer_until(Slab_Pool *pool, Packets_Array *array, uint32_t number)
 {
     uint32_t num_spots = array->buffer_end - array->buffer_start;
 
@@ -643,33 +864,35 @@ static int clear_buffer_until(Packets_Array *array, uint32_t number)
 
     uint32_t i;
 
-    for (i = array->buffer_start; i != number; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
-
-        if (array->buffer[num]) {
-            free(array->buffer[num]);
-            array->buffer[num] = NULL;
-        }
+    for (i = find_packet_spot(array, array->buffer_start, number, 1); i != number;
+            i = find_packet_spot(array, i + 1, number, 1)) {
+        slab_pool_release(pool, array->buffer[i % array->capacity]);
+        set_packet(array, i, NULL);
     }
 
-    array->buffer_start = i;
+    array->buffer_start = number;
     return 0;
 }
 
-static int clear_buffer(Packets_Array *array)
+/* Delete all packets in array and free its buffer.
+ *
+ * return 0 on success.
+ */
+static int clear_buffer(Slab_Pool *pool, Packets_Array *array)
 {
     uint32_t i;
 
-    for (i = array->buffer_start; i != array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
-
-        if (array->buffer[num]) {
-            free(array->buffer[num]);
-            array->buffer[num] = NULL;
-        }
+    for (i = find_packet_spot(array, array->buffer_start, array->buffer_end, 1); i != array->buffer_end;
+            i = find_packet_spot(array, i + 1, array->buffer_end, 1)) {
+        slab_pool_release(pool, array->buffer[i % array->capacity]);
     }
 
-    array->buffer_start = i;
+    array->buffer_start = array->buffer_end;
+    free(array->buffer);
+    free(array->present);
+    array->buffer = NULL;
+    array->present = NULL;
+    array->capacity = 0;
     return 0;
 }
 
@@ -686,6 +909,9 @@ static int set_buffer_end(Packets_Array *array, uint32_t number)
     if ((number - array->buffer_end) > CRYPTO_PACKET_BUFFER_SIZE)
         return -1;
 
+    if (reserve_packets_array(array, number - array->buffer_start) != 0)
+        return -1;
+
     array->buffer_end = number;
     return 0;
 }
@@ -714,7 +940,7 @@ static int generate_request_packet(uint8_t *data, uint16_t length, const Packets
     uint32_t i, n = 1;
 
     for (i = recv_array->buffer_start; i != recv_array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        uint32_t num = i % recv_array->capacity;
 
         if (!recv_array->buffer[num]) {
             data[cur_len] = n;
@@ -745,7 +971,7 @@ static int generate_request_packet(uint8_t *data, uint16_t length, const Packets
  * return -1 on failure.
  * return number of requested packets on success.
  */
-static int handle_request_packet(Packets_Array *send_array, const uint8_t *data, uint16_t length,
+static int handle_request_packet(Slab_Pool *pool, Packets_Array *send_array, const uint8_t *data, uint16_t length,
                                  uint64_t *latest_send_time, uint64_t rtt_time)
 {
     if (length < 1)
@@ -770,7 +996,7 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
         if (length == 0)
             break;
 
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        uint32_t num = i % send_array->capacity;
 
         if (n == data[0]) {
             if (send_array->buffer[num]) {
@@ -792,8 +1018,8 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
                 if (l_sent_time < sent_time)
                     l_sent_time = sent_time;
 
-                free(send_array->buffer[num]);
-                send_array->buffer[num] = NULL;
+                slab_pool_release(pool, send_array->buffer[num]);
+                set_packet(send_array, i, NULL);
             }
         }
 
@@ -816,178 +1042,460 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
     return requested;
 }
 
-/** END: Array Related functions **/
-
-#define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + crypto_box_MACBYTES))
+/* Maximum length of a number in a PACKET_ID_REQUEST_RANGES packet. */
+#define REQUEST_RANGES_MAX_VARINT_LENGTH 5
 
-/* Creates and sends a data packet to the peer using the fastest route.
+/* Write value into data 7 bits at a time, lowest first, with the high bit set on all bytes
+ * but the last.
  *
- * return -1 on failure.
- * return 0 on success.
+ * return number of bytes written.
  */
-static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+static uint16_t write_request_varint(uint8_t *data, uint32_t value)
 {
-    if (length == 0 || length + (1 + sizeof(uint16_t) + crypto_box_MACBYTES) > MAX_CRYPTO_PACKET_SIZE)
-        return -1;
-
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-
-    if (conn == 0)
-        return -1;
+    uint16_t len = 0;
 
-    pthread_mutex_lock(&conn->mutex);
-    uint8_t packet[1 + sizeof(uint16_t) + length + crypto_box_MACBYTES];
-    packet[0] = NET_PACKET_CRYPTO_DATA;
-    memcpy(packet + 1, conn->sent_nonce + (crypto_box_NONCEBYTES - sizeof(uint16_t)), sizeof(uint16_t));
-    int len = encrypt_data_symmetric(conn->shared_key, conn->sent_nonce, data, length, packet + 1 + sizeof(uint16_t));
-
-    if (len + 1 + sizeof(uint16_t) != sizeof(packet)) {
-        pthread_mutex_unlock(&conn->mutex);
-        return -1;
+    while (value >= 0x80) {
+        data[len] = (value & 0x7F) | 0x80;
+        value >>= 7;
+        ++len;
     }
 
-    increment_nonce(conn->sent_nonce);
-    pthread_mutex_unlock(&conn->mutex);
-
-    return send_packet_to(c, crypt_connection_id, packet, sizeof(packet));
+    data[len] = value;
+    return len + 1;
 }
 
-/* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
+/* Read a number written with write_request_varint from data of length into value.
  *
  * return -1 on failure.
- * return 0 on success.
+ * return number of bytes read on success.
  */
-static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
-                                   const uint8_t *data, uint16_t length)
+static int read_request_varint(const uint8_t *data, uint16_t length, uint32_t *value)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE)
-        return -1;
+    uint16_t len;
+    *value = 0;
 
-    num = htonl(num);
-    buffer_start = htonl(buffer_start);
-    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
-    uint8_t packet[sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length];
-    memcpy(packet, &buffer_start, sizeof(uint32_t));
-    memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
-    memset(packet + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
-    memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, data, length);
+    for (len = 0; len < length && len < REQUEST_RANGES_MAX_VARINT_LENGTH; ++len) {
+        *value |= (uint32_t)(data[len] & 0x7F) << (7 * len);
+
+        if (!(data[len] & 0x80))
+            return len + 1;
+    }
 
-    return send_data_packet(c, crypt_connection_id, packet, sizeof(packet));
+    return -1;
 }
 
-static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
-{
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+/* Unreceived runs up to this long are stored in the low bits of the number of their entry. */
+#define REQUEST_RANGES_SHORT_RUN 7
+#define REQUEST_RANGES_SHORT_BITS 3
 
-    if (conn == 0)
+/* Create a PACKET_ID_REQUEST_RANGES packet from recv_array into data of length.
+ *
+ * After the packet id each run of unreceived packets, starting from buffer_start, is written
+ * as one entry: a number holding the length of the run of received packets before it shifted
+ * left by REQUEST_RANGES_SHORT_BITS, with the length of the unreceived run in the low bits.
+ * Unreceived runs of REQUEST_RANGES_SHORT_RUN or more set all the low bits and are followed
+ * by a second number with the rest of their length. An entry with an unreceived run of 0
+ * gives the received packets after the last unreceived one. Entries that don't fit in the
+ * packet are left out.
+ *
+ * return -1 on failure.
+ * return length of packet on success.
+ */
+static int generate_request_ranges_packet(uint8_t *data, uint16_t length, const Packets_Array *recv_array)
+{
+    if (length == 0)
         return -1;
 
-    /* If last packet send failed, try to send packet again.
-       If sending it fails we won't be able to send the new packet. */
-    if (conn->maximum_speed_reached) {
-        Packet_Data *dt = NULL;
-        uint32_t packet_num = conn->send_array.buffer_end - 1;
-        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+    data[0] = PACKET_ID_REQUEST_RANGES;
 
-        uint8_t send_failed = 0;
+    uint16_t cur_len = 1;
+    uint32_t i = recv_array->buffer_start;
 
-        if (ret == 1) {
-            if (!dt->sent_time) {
-                if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                            dt->length) != 0) {
-                    send_failed = 1;
-                } else {
-                    dt->sent_time = current_time_monotonic();
-                }
-            }
-        }
+    while (i != recv_array->buffer_end && cur_len + REQUEST_RANGES_MAX_VARINT_LENGTH * 2 <= length) {
+        uint32_t received_end = find_packet_spot(recv_array, i, recv_array->buffer_end, 0);
+        uint32_t missing_end = find_packet_spot(recv_array, received_end, recv_array->buffer_end, 1);
+        uint32_t received = received_end - i, missing = missing_end - received_end;
 
-        if (!send_failed) {
-            conn->maximum_speed_reached = 0;
+        if (missing < REQUEST_RANGES_SHORT_RUN) {
+            cur_len += write_request_varint(data + cur_len, (received << REQUEST_RANGES_SHORT_BITS) | missing);
         } else {
-            return -1;
+            cur_len += write_request_varint(data + cur_len, (received << REQUEST_RANGES_SHORT_BITS) | REQUEST_RANGES_SHORT_RUN);
+            cur_len += write_request_varint(data + cur_len, missing - REQUEST_RANGES_SHORT_RUN);
         }
+
+        i = missing_end;
     }
 
-    return 0;
+    return cur_len;
 }
 
-/*  return -1 if data could not be put in packet queue.
- *  return positive packet number if data was put into the queue.
+/* Read the next entry of a PACKET_ID_REQUEST_RANGES packet from data of length, and move
+ * data and length past it.
+ *
+ * return -1 on failure.
+ * return 0 on success.
  */
-static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
-                                    uint8_t congestion_control)
+static int read_request_range(const uint8_t **data, uint16_t *length, uint32_t *received, uint32_t *missing)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE)
-        return -1;
-
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-
-    if (conn == 0)
-        return -1;
-
-    /* If last packet send failed, try to send packet again.
-       If sending it fails we won't be able to send the new packet. */
-    reset_max_speed_reached(c, crypt_connection_id);
+    uint32_t entry;
+    int len = read_request_varint(*data, *length, &entry);
 
-    if (conn->maximum_speed_reached && congestion_control) {
+    if (len == -1)
         return -1;
-    }
-
-    Packet_Data dt;
-    dt.sent_time = 0;
-    dt.length = length;
-    memcpy(dt.data, data, length);
-    pthread_mutex_lock(&conn->mutex);
-    int64_t packet_num = add_data_end_of_buffer(&conn->send_array, &dt);
-    pthread_mutex_unlock(&conn->mutex);
 
-    if (packet_num == -1)
-        return -1;
+    *data += len;
+    *length -= len;
+    *received = entry >> REQUEST_RANGES_SHORT_BITS;
+    *missing = entry & REQUEST_RANGES_SHORT_RUN;
 
-    if (!congestion_control && conn->maximum_speed_reached) {
-        return packet_num;
-    }
+    if (*missing == REQUEST_RANGES_SHORT_RUN) {
+        len = read_request_varint(*data, *length, missing);
 
-    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
-        Packet_Data *dt1 = NULL;
+        if (len == -1)
+            return -1;
 
-        if (get_data_pointer(&conn->send_array, &dt1, packet_num) == 1)
-            dt1->sent_time = current_time_monotonic();
-    } else {
-        conn->maximum_speed_reached = 1;
-        LOGGER_ERROR("send_data_packet failed\n");
+        *data += len;
+        *length -= len;
+        *missing += REQUEST_RANGES_SHORT_RUN;
     }
 
-    return packet_num;
+    return 0;
 }
 
-/* Get the lowest 2 bytes from the nonce and convert
- * them to host byte format before returning them.
+/* Update latest_received_time, the latest time a packet the other received was sent at, with
+ * dt which the other just acknowledged.
+ * A resent packet acknowledged sooner than rtt_time after being resent was probably received
+ * the first time it was sent instead.
  */
-static uint16_t get_nonce_uint16(const uint8_t *nonce)
+static void update_latest_received_time(uint64_t *latest_received_time, const Packet_Data *dt, uint64_t rtt_time,
+                                        uint64_t temp_time)
 {
-    uint16_t num;
-    memcpy(&num, nonce + (crypto_box_NONCEBYTES - sizeof(uint16_t)), sizeof(uint16_t));
-    return ntohs(num);
-}
+    if (dt->resent && dt->sent_time + rtt_time > temp_time)
+        return;
 
-#define DATA_NUM_THRESHOLD 21845
+    if (*latest_received_time < dt->sent_time)
+        *latest_received_time = dt->sent_time;
+}
 
-/* Handle a data packet.
- * Decrypt packet of length and put it into data.
- * data must be at least MAX_DATA_DATA_PACKET_SIZE big.
+/* Handle a PACKET_ID_REQUEST_RANGES packet.
+ * Remove all the packets the other received from the array.
+ *
+ * An unreceived packet is only sent again once a packet sent after it was received (and
+ * rtt_time passed), or once rtt_time + CRYPTO_SEND_PACKET_INTERVAL passed, since the
+ * unreceived packets at the end might still be on their way. latest_received_time is the
+ * latest time a packet the other received was sent at, and is updated with this packet.
  *
  * return -1 on failure.
- * return length of data on success.
+ * return number of requested packets on success.
  */
-static int handle_data_packet(const Net_Crypto *c, int crypt_connection_id, uint8_t *data, const uint8_t *packet,
-                              uint16_t length)
+static int handle_request_ranges_packet(Slab_Pool *pool, Packets_Array *send_array, const uint8_t *data,
+                                        uint16_t length, uint64_t *latest_received_time, uint64_t rtt_time)
 {
-    if (length <= (1 + sizeof(uint16_t) + crypto_box_MACBYTES) || length > MAX_CRYPTO_PACKET_SIZE)
+    if (length < 1)
         return -1;
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    if (data[0] != PACKET_ID_REQUEST_RANGES)
+        return -1;
+
+    ++data;
+    --length;
+
+    const uint8_t *ranges = data;
+    uint16_t ranges_length = length;
+    uint64_t temp_time = current_time_monotonic();
+    uint32_t i = send_array->buffer_start;
+    uint32_t received, missing, num;
+
+    while (length != 0) {
+        if (read_request_range(&data, &length, &received, &missing) == -1)
+            return -1;
+
+        if (received > send_array->buffer_end - i || missing > send_array->buffer_end - i - received)
+            return -1;
+
+        for (num = find_packet_spot(send_array, i, i + received, 1); num != i + received;
+                num = find_packet_spot(send_array, num + 1, i + received, 1)) {
+            Packet_Data *dt = send_array->buffer[num % send_array->capacity];
+
+            update_latest_received_time(latest_received_time, dt, rtt_time, temp_time);
+            slab_pool_release(pool, dt);
+            set_packet(send_array, num, NULL);
+        }
+
+        i += received + missing;
+    }
+
+    uint32_t requested = 0;
+    i = send_array->buffer_start;
+
+    while (ranges_length != 0) {
+        read_request_range(&ranges, &ranges_length, &received, &missing);
+        i += received;
+
+        for (num = find_packet_spot(send_array, i, i + missing, 1); num != i + missing;
+                num = find_packet_spot(send_array, num + 1, i + missing, 1)) {
+            Packet_Data *dt = send_array->buffer[num % send_array->capacity];
+
+            if (dt->sent_time == 0 || (dt->sent_time + rtt_time) >= temp_time)
+                continue;
+
+            if (dt->sent_time < *latest_received_time
+                    || (dt->sent_time + rtt_time + CRYPTO_SEND_PACKET_INTERVAL) < temp_time)
+                dt->sent_time = 0;
+        }
+
+        requested += missing;
+        i += missing;
+    }
+
+    return requested;
+}
+
+/** END: Array Related functions **/
+
+#define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + crypto_box_MACBYTES))
+
+/* Creates a data packet with buffer_start and num containing data of length in packet,
+ * encrypted with the next nonce of the connection.
+ *
+ * The plaintext is built in the CRYPTO_DATA_HEADROOM bytes before data, which must be part of its
+ * buffer, and encrypted straight into packet. packet must have room for MAX_CRYPTO_PACKET_SIZE bytes
+ * and CRYPTO_PACKET_HEADROOM bytes before it.
+ *
+ * Must be called with the mutex of the connection locked.
+ *
+ * return -1 on failure.
+ * return length of the packet on success.
+ */
+static int create_data_packet_nocopy(Crypto_Connection *conn, uint8_t *packet, uint32_t buffer_start, uint32_t num,
+                                     uint8_t *data, uint16_t length)
+{
+    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE)
+        return -1;
+
+    num = htonl(num);
+    buffer_start = htonl(buffer_start);
+    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
+    uint16_t plain_length = sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length;
+    uint8_t *plain = data + length - plain_length;
+
+    memcpy(plain, &buffer_start, sizeof(uint32_t));
+    memcpy(plain + sizeof(uint32_t), &num, sizeof(uint32_t));
+    memset(plain + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
+    int len = encrypt_data_symmetric_nocopy(conn->shared_key, conn->sent_nonce, plain, plain_length,
+                                            packet + 1 + sizeof(uint16_t));
+
+    if (len != plain_length + crypto_box_MACBYTES)
+        return -1;
+
+    /* Written after encrypting since it overwrites the bytes before the encrypted data. */
+    packet[0] = NET_PACKET_CRYPTO_DATA;
+    memcpy(packet + 1, conn->sent_nonce + (crypto_box_NONCEBYTES - sizeof(uint16_t)), sizeof(uint16_t));
+    increment_nonce(conn->sent_nonce);
+
+    return 1 + sizeof(uint16_t) + len;
+}
+
+/* Creates a data packet with buffer_start and num containing data of length in packet,
+ * encrypted with the next nonce of the connection.
+ * packet must have room for MAX_CRYPTO_PACKET_SIZE bytes and CRYPTO_PACKET_HEADROOM bytes before it.
+ *
+ * return -1 on failure.
+ * return length of the packet on success.
+ */
+static int create_data_packet_helper(Crypto_Connection *conn, uint8_t *packet, uint32_t buffer_start, uint32_t num,
+                                     const uint8_t *data, uint16_t length)
+{
+    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE)
+        return -1;
+
+    uint8_t plain[CRYPTO_DATA_HEADROOM + MAX_CRYPTO_DATA_SIZE];
+    memcpy(plain + CRYPTO_DATA_HEADROOM, data, length);
+
+    pthread_mutex_lock(&conn->mutex);
+    int len = create_data_packet_nocopy(conn, packet, buffer_start, num, plain + CRYPTO_DATA_HEADROOM, length);
+    pthread_mutex_unlock(&conn->mutex);
+
+    return len;
+}
+
+/* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                   const uint8_t *data, uint16_t length)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    uint8_t buffer[CRYPTO_PACKET_HEADROOM + MAX_CRYPTO_PACKET_SIZE];
+    uint8_t *packet = buffer + CRYPTO_PACKET_HEADROOM;
+    int len = create_data_packet_helper(conn, packet, buffer_start, num, data, length);
+
+    if (len == -1)
+        return -1;
+
+    return send_packet_to(c, crypt_connection_id, packet, len);
+}
+
+/* Creates and sends the data packet of packet number num in the send array with buffer_start to the
+ * peer using the fastest route, encrypting it straight from the send array.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_data_packet_nocopy(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    uint8_t buffer[CRYPTO_PACKET_HEADROOM + MAX_CRYPTO_PACKET_SIZE];
+    uint8_t *packet = buffer + CRYPTO_PACKET_HEADROOM;
+    Packet_Data *dt = NULL;
+    int len = -1;
+
+    /* Locked for the whole encryption since the packet can be removed from the send array by
+       another thread, and its headroom is written by every thread sending it. */
+    pthread_mutex_lock(&conn->mutex);
+
+    if (get_data_pointer(&conn->send_array, &dt, num) == 1)
+        len = create_data_packet_nocopy(conn, packet, buffer_start, num, dt->data, dt->length);
+
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (len == -1)
+        return -1;
+
+    return send_packet_to(c, crypt_connection_id, packet, len);
+}
+
+static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    /* If last packet send failed, try to send packet again.
+       If sending it fails we won't be able to send the new packet. */
+    if (conn->maximum_speed_reached) {
+        Packet_Data *dt = NULL;
+        pthread_mutex_lock(&conn->mutex);
+        uint32_t packet_num = conn->send_array.buffer_end - 1;
+        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+        pthread_mutex_unlock(&conn->mutex);
+
+        uint8_t send_failed = 0;
+
+        if (ret == 1) {
+            if (!dt->sent_time) {
+                if (send_data_packet_nocopy(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num) != 0) {
+                    send_failed = 1;
+                } else {
+                    dt->sent_time = current_time_monotonic();
+                }
+            }
+        }
+
+        if (!send_failed) {
+            conn->maximum_speed_reached = 0;
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Put dt, with its data and length set, at the end of the send array and send it.
+ * dt is released if it can't be put in the send array.
+ *
+ *  return -1 if data could not be put in packet queue.
+ *  return positive packet number if data was put into the queue.
+ */
+static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, Packet_Data *dt,
+                                    uint8_t congestion_control)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0 || dt->length == 0 || dt->length > MAX_CRYPTO_DATA_SIZE) {
+        slab_pool_release(&c->packet_pool, dt);
+        return -1;
+    }
+
+    /* If last packet send failed, try to send packet again.
+       If sending it fails we won't be able to send the new packet. */
+    reset_max_speed_reached(c, crypt_connection_id);
+
+    if (conn->maximum_speed_reached && congestion_control) {
+        slab_pool_release(&c->packet_pool, dt);
+        return -1;
+    }
+
+    dt->sent_time = 0;
+    dt->resent = 0;
+    pthread_mutex_lock(&conn->mutex);
+    int64_t packet_num = add_data_end_of_buffer(&conn->send_array, dt);
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (packet_num == -1) {
+        slab_pool_release(&c->packet_pool, dt);
+        return -1;
+    }
+
+    if (!congestion_control && conn->maximum_speed_reached) {
+        return packet_num;
+    }
+
+    if (send_data_packet_nocopy(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num) == 0) {
+        Packet_Data *dt1 = NULL;
+
+        pthread_mutex_lock(&conn->mutex);
+
+        if (get_data_pointer(&conn->send_array, &dt1, packet_num) == 1)
+            dt1->sent_time = current_time_monotonic();
+
+        pthread_mutex_unlock(&conn->mutex);
+    } else {
+        conn->maximum_speed_reached = 1;
+        LOGGER_ERROR("send_data_packet failed\n");
+    }
+
+    return packet_num;
+}
+
+/* Get the lowest 2 bytes from the nonce and convert
+ * them to host byte format before returning them.
+ */
+static uint16_t get_nonce_uint16(const uint8_t *nonce)
+{
+    uint16_t num;
+    memcpy(&num, nonce + (crypto_box_NONCEBYTES - sizeof(uint16_t)), sizeof(uint16_t));
+    return ntohs(num);
+}
+
+#define DATA_NUM_THRESHOLD 21845
+
+/* Handle a data packet.
+ * Decrypt packet of length and put it into data.
+ * data must be at least MAX_DATA_DATA_PACKET_SIZE big.
+ *
+ * return -1 on failure.
+ * return length of data on success.
+ */
+static int handle_data_packet(const Net_Crypto *c, int crypt_connection_id, uint8_t *data, const uint8_t *packet,
+                              uint16_t length)
+{
+    if (length <= (1 + sizeof(uint16_t) + crypto_box_MACBYTES) || length > MAX_CRYPTO_PACKET_SIZE)
+        return -1;
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     if (conn == 0)
         return -1;
@@ -1026,7 +1534,25 @@ static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
         return -1;
 
     uint8_t data[MAX_CRYPTO_DATA_SIZE];
-    int len = generate_request_packet(data, sizeof(data), &conn->recv_array);
+    int len;
+
+    /* Until the peer shows it understands PACKET_ID_REQUEST_RANGES both kinds are sent. */
+    if (conn->request_ranges || conn->request_ranges_probes < CRYPTO_REQUEST_RANGES_PROBES) {
+        len = generate_request_ranges_packet(data, sizeof(data), &conn->recv_array);
+
+        if (len == -1)
+            return -1;
+
+        int ret = send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start,
+                                          conn->send_array.buffer_end, data, len);
+
+        if (conn->request_ranges)
+            return ret;
+
+        ++conn->request_ranges_probes;
+    }
+
+    len = generate_request_packet(data, sizeof(data), &conn->recv_array);
 
     if (len == -1)
         return -1;
@@ -1035,7 +1561,36 @@ static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
                                    len);
 }
 
+/* Send the packets of batch, count of them, whose data packets are in c->send_batch.
+ * Set the sent time of the packets that were sent.
+ *
+ * return number of packets sent.
+ */
+static uint32_t send_packet_batch(Net_Crypto *c, int crypt_connection_id, Packet_Data *const *batch,
+                                  const uint16_t *length, unsigned int count, uint64_t temp_time)
+{
+    const uint8_t *data[NET_BATCH_SIZE];
+    unsigned int i;
+
+    for (i = 0; i < count; ++i) {
+        data[i] = c->send_batch[i] + CRYPTO_PACKET_HEADROOM;
+    }
+
+    int sent = send_packets_to(c, crypt_connection_id, data, length, count);
+
+    if (sent == -1)
+        return 0;
+
+    for (i = 0; i < (unsigned int)sent; ++i) {
+        batch[i]->sent_time = temp_time;
+        batch[i]->resent = 1;
+    }
+
+    return sent;
+}
+
 /* Send up to max num previously requested data packets.
+ * They are encrypted in order into c->send_batch and sent NET_BATCH_SIZE at a time.
  *
  * return -1 on failure.
  * return number of packets sent on success.
@@ -1052,32 +1607,50 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
 
     uint64_t temp_time = current_time_monotonic();
     uint32_t i, num_sent = 0, array_size = num_packets_array(&conn->send_array);
+    Packet_Data *batch[NET_BATCH_SIZE];
+    uint16_t length[NET_BATCH_SIZE];
+    unsigned int count = 0;
 
-    for (i = 0; i < array_size; ++i) {
+    for (i = 0; i < array_size && num_sent + count < max_num; ++i) {
         Packet_Data *dt;
         uint32_t packet_num = (i + conn->send_array.buffer_start);
+        int len = -1;
+        pthread_mutex_lock(&conn->mutex);
         int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
 
+        if (ret == 1 && !dt->sent_time) {
+            len = create_data_packet_nocopy(conn, c->send_batch[count] + CRYPTO_PACKET_HEADROOM,
+                                            conn->recv_array.buffer_start, packet_num, dt->data, dt->length);
+        }
+
+        pthread_mutex_unlock(&conn->mutex);
+
         if (ret == -1) {
             return -1;
-        } else if (ret == 0) {
-            continue;
         }
 
-        if (dt->sent_time) {
+        if (len == -1)
             continue;
-        }
 
-        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                    dt->length) == 0) {
-            dt->sent_time = temp_time;
-            ++num_sent;
-        }
+        batch[count] = dt;
+        length[count] = len;
+        ++count;
 
-        if (num_sent >= max_num)
-            break;
+        if (count == NET_BATCH_SIZE) {
+            uint32_t sent = send_packet_batch(c, crypt_connection_id, batch, length, count, temp_time);
+            num_sent += sent;
+
+            /* Don't go on if the socket is full. */
+            if (sent != count)
+                return num_sent;
+
+            count = 0;
+        }
     }
 
+    if (count != 0)
+        num_sent += send_packet_batch(c, crypt_connection_id, batch, length, count, temp_time);
+
     return num_sent;
 }
 
@@ -1245,16 +1818,30 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
     buffer_start = ntohl(buffer_start);
     num = ntohl(num);
 
-    uint64_t rtt_calc_time = 0;
+    uint64_t rtt_calc_time = 0, ack_sent_time = 0;
 
     if (buffer_start != conn->send_array.buffer_start) {
         Packet_Data *packet_time;
 
-        if (get_data_pointer(&conn->send_array, &packet_time, conn->send_array.buffer_start) == 1) {
+        pthread_mutex_lock(&conn->mutex);
+
+        if (get_data_pointer(&conn->send_array, &packet_time, conn->send_array.buffer_start) == 1 && !packet_time->resent) {
             rtt_calc_time = packet_time->sent_time;
         }
 
-        if (clear_buffer_until(&conn->send_array, buffer_start) != 0) {
+        /* The last packet acknowledged is the one received closest to when the peer sent this
+           packet, its round trip time includes the least time waiting for the acknowledgement. */
+        if (get_data_pointer(&conn->send_array, &packet_time, buffer_start - 1) == 1) {
+            if (!packet_time->resent)
+                ack_sent_time = packet_time->sent_time;
+
+            update_latest_received_time(&conn->latest_received_time, packet_time, conn->rtt_time, current_time_monotonic());
+        }
+
+        int ret = clear_buffer_until(&c->packet_pool, &conn->send_array, buffer_start);
+        pthread_mutex_unlock(&conn->mutex);
+
+        if (ret != 0) {
             return -1;
         }
     }
@@ -1283,7 +1870,7 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
             conn->connection_status_callback(conn->connection_status_callback_object, conn->connection_status_callback_id, 1);
     }
 
-    if (real_data[0] == PACKET_ID_REQUEST) {
+    if (real_data[0] == PACKET_ID_REQUEST || real_data[0] == PACKET_ID_REQUEST_RANGES) {
         uint64_t rtt_time;
 
         if (udp) {
@@ -1292,7 +1879,19 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
             rtt_time = DEFAULT_TCP_PING_CONNECTION;
         }
 
-        int requested = handle_request_packet(&conn->send_array, real_data, real_length, &rtt_calc_time, rtt_time);
+        int requested;
+        pthread_mutex_lock(&conn->mutex);
+
+        if (real_data[0] == PACKET_ID_REQUEST_RANGES) {
+            conn->request_ranges = 1;
+            requested = handle_request_ranges_packet(&c->packet_pool, &conn->send_array, real_data, real_length,
+                        &conn->latest_received_time, rtt_time);
+        } else {
+            requested = handle_request_packet(&c->packet_pool, &conn->send_array, real_data, real_length, &rtt_calc_time,
+                                              rtt_time);
+        }
+
+        pthread_mutex_unlock(&conn->mutex);
 
         if (requested == -1) {
             return -1;
@@ -1302,13 +1901,18 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
 
         set_buffer_end(&conn->recv_array, num);
     } else if (real_data[0] >= CRYPTO_RESERVED_PACKETS && real_data[0] < PACKET_ID_LOSSY_RANGE_START) {
-        Packet_Data dt;
-        dt.length = real_length;
-        memcpy(dt.data, real_data, real_length);
+        Packet_Data *dt = slab_pool_alloc(&c->packet_pool);
 
-        if (add_data_to_buffer(&conn->recv_array, num, &dt) != 0)
+        if (dt == NULL)
             return -1;
 
+        dt->length = real_length;
+        memcpy(dt->data, real_data, real_length);
+
+        if (add_data_to_buffer(&conn->recv_array, num, dt) != 0) {
+            slab_pool_release(&c->packet_pool, dt);
+            return -1;
+        }
 
         while (1) {
             pthread_mutex_lock(&conn->mutex);
@@ -1319,8 +1923,10 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
                 break;
 
             if (conn->connection_data_callback)
-                conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, dt.data,
-                                               dt.length);
+                conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, dt->data,
+                                               dt->length);
+
+            slab_pool_release(&c->packet_pool, dt);
 
             /* conn might get killed in callback. */
             conn = get_crypto_connection(c, crypt_connection_id);
@@ -1331,6 +1937,7 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
 
         /* Packet counter. */
         ++conn->packet_counter;
+        ++conn->total_packets_received;
     } else if (real_data[0] >= PACKET_ID_LOSSY_RANGE_START &&
                real_data[0] < (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE)) {
 
@@ -1351,6 +1958,11 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
             conn->rtt_time = rtt_time;
     }
 
+    if (ack_sent_time != 0) {
+        uint64_t temp_time = current_time_monotonic();
+        congestion_control_rtt_sample(&conn->congestion_control, temp_time - ack_sent_time, temp_time);
+    }
+
     return 0;
 }
 
@@ -1370,6 +1982,9 @@ static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, cons
     if (conn == 0)
         return -1;
 
+    /* Whatever the packet changed is handled by the next send_crypto_packets(). */
+    schedule_connection(c, crypt_connection_id, 0);
+
     switch (packet[0]) {
         case NET_PACKET_COOKIE_RESPONSE: {
             if (conn->status != CRYPTO_CONN_COOKIE_REQUESTING)
@@ -1441,6 +2056,123 @@ static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, cons
     return 0;
 }
 
+/* Start using the connections from a thread other than the one running do_net_crypto().
+ * Only waits while another thread holds connections_lock().
+ */
+static void connections_enter(Net_Crypto *c)
+{
+    while (1) {
+        __atomic_add_fetch(&c->connection_use_counter, 1, __ATOMIC_SEQ_CST);
+
+        if (!__atomic_load_n(&c->connections_busy, __ATOMIC_SEQ_CST))
+            return;
+
+        __atomic_sub_fetch(&c->connection_use_counter, 1, __ATOMIC_SEQ_CST);
+
+        /* Give the CPU to the locking thread, which may be waiting for this core. */
+        while (__atomic_load_n(&c->connections_busy, __ATOMIC_SEQ_CST)) {
+            sched_yield();
+        }
+    }
+}
+
+static void connections_leave(Net_Crypto *c)
+{
+    __atomic_sub_fetch(&c->connection_use_counter, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Wait until no other thread uses the connections and keep them out until connections_unlock(),
+ * to reallocate the connections array or wipe a connection.
+ */
+static void connections_lock(Net_Crypto *c)
+{
+    pthread_mutex_lock(&c->connections_mutex);
+    __atomic_store_n(&c->connections_busy, 1, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&c->connection_use_counter, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+}
+
+static void connections_unlock(Net_Crypto *c)
+{
+    __atomic_store_n(&c->connections_busy, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&c->connections_mutex);
+}
+
+static Crypto_Send_Queue *new_send_queue(void)
+{
+    Crypto_Send_Queue *queue = calloc(1, sizeof(Crypto_Send_Queue));
+
+    if (queue)
+        mpsc_queue_init(&queue->queue);
+
+    return queue;
+}
+
+/* Free the packets in queue.
+ * No other thread may be queueing packets.
+ */
+static void clear_send_queue(Crypto_Send_Queue *queue)
+{
+    MPSC_Node *node;
+
+    while ((node = mpsc_queue_pop(&queue->queue))) {
+        free(node);
+    }
+
+    free(queue->pending);
+    queue->pending = NULL;
+    queue->length = 0;
+}
+
+static void kill_send_queue(Crypto_Send_Queue *queue)
+{
+    if (queue == NULL)
+        return;
+
+    clear_send_queue(queue);
+    free(queue);
+}
+
+/* Put the connection of queue in woken_connections, unless it already is.
+ * Call between connections_enter() and connections_leave().
+ */
+static void wake_send_queue(Net_Crypto *c, Crypto_Send_Queue *queue)
+{
+    if (!__atomic_exchange_n(&queue->woken, 1, __ATOMIC_SEQ_CST))
+        mpsc_queue_push(&c->woken_connections, &queue->wake_node);
+}
+
+/* Make the next do_net_crypto() run the connection.
+ * Can be called from any thread.
+ */
+static void wake_connection(Net_Crypto *c, int crypt_connection_id)
+{
+    connections_enter(c);
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn)
+        wake_send_queue(c, conn->send_queue);
+
+    connections_leave(c);
+}
+
+/* Schedule the connections woken up with wake_connection() to run now.
+ * Once connections_lock() returned none are left, so their send queues can be freed.
+ */
+static void take_woken_connections(Net_Crypto *c)
+{
+    MPSC_Node *node;
+
+    while ((node = mpsc_queue_pop(&c->woken_connections))) {
+        Crypto_Send_Queue *queue = (Crypto_Send_Queue *)((uint8_t *)node - offsetof(Crypto_Send_Queue, wake_node));
+        __atomic_store_n(&queue->woken, 0, __ATOMIC_SEQ_CST);
+        schedule_connection(c, queue->connection_id, 0);
+    }
+}
+
 /* Set the size of the friend list to numfriends.
  *
  *  return -1 if realloc fails.
@@ -1478,15 +2210,15 @@ static int create_crypto_connection(Net_Crypto *c)
             return i;
     }
 
-    while (1) { /* TODO: is this really the best way to do this? */
-        pthread_mutex_lock(&c->connections_mutex);
+    if (event_heap_reserve(&c->schedule, c->crypto_connections_length + 1) != 0)
+        return -1;
 
-        if (!c->connection_use_counter) {
-            break;
-        }
+    Crypto_Send_Queue *queue = new_send_queue();
 
-        pthread_mutex_unlock(&c->connections_mutex);
-    }
+    if (queue == NULL)
+        return -1;
+
+    connections_lock(c);
 
     int id = -1;
 
@@ -1496,12 +2228,18 @@ static int create_crypto_connection(Net_Crypto *c)
         memset(&(c->crypto_connections[id]), 0, sizeof(Crypto_Connection));
 
         if (pthread_mutex_init(&c->crypto_connections[id].mutex, NULL) != 0) {
-            pthread_mutex_unlock(&c->connections_mutex);
+            connections_unlock(c);
+            kill_send_queue(queue);
             return -1;
         }
+
+        queue->connection_id = id;
+        c->crypto_connections[id].send_queue = queue;
+    } else {
+        kill_send_queue(queue);
     }
 
-    pthread_mutex_unlock(&c->connections_mutex);
+    connections_unlock(c);
     return id;
 }
 
@@ -1517,14 +2255,22 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
 
     uint32_t i;
 
-    /* Keep mutex, only destroy it when connection is realloced out. */
+    /* Keep mutex and send queue, only destroy them when connection is realloced out. */
     pthread_mutex_t mutex = c->crypto_connections[crypt_connection_id].mutex;
+    Crypto_Send_Queue *send_queue = c->crypto_connections[crypt_connection_id].send_queue;
     sodium_memzero(&(c->crypto_connections[crypt_connection_id]), sizeof(Crypto_Connection));
     c->crypto_connections[crypt_connection_id].mutex = mutex;
+    c->crypto_connections[crypt_connection_id].send_queue = send_queue;
+    event_heap_remove(&c->schedule, crypt_connection_id);
+
+    /* The send queues about to be freed must not be left in woken_connections. */
+    if (c->crypto_connections[c->crypto_connections_length - 1].status == CRYPTO_CONN_NO_CONNECTION)
+        take_woken_connections(c);
 
     for (i = c->crypto_connections_length; i != 0; --i) {
         if (c->crypto_connections[i - 1].status == CRYPTO_CONN_NO_CONNECTION) {
             pthread_mutex_destroy(&c->crypto_connections[i - 1].mutex);
+            kill_send_queue(c->crypto_connections[i - 1].send_queue);
         } else {
             break;
         }
@@ -1545,15 +2291,7 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
  */
 static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
 {
-    uint32_t i;
-
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status != CRYPTO_CONN_NO_CONNECTION)
-            if (public_key_cmp(public_key, c->crypto_connections[i].public_key) == 0)
-                return i;
-    }
-
-    return -1;
+    return hash_list_find(&c->public_key_index, public_key);
 }
 
 /* Add a source to the crypto connection.
@@ -1708,7 +2446,19 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
     conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
     conn->rtt_time = DEFAULT_PING_CONNECTION;
+    congestion_control_init(&conn->congestion_control, c->congestion_control);
+
+    if (!hash_list_add(&c->public_key_index, conn->public_key, crypt_connection_id)) {
+        pthread_mutex_lock(&c->tcp_mutex);
+        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
+        pthread_mutex_unlock(&c->tcp_mutex);
+        clear_temp_packet(c, crypt_connection_id);
+        conn->status = CRYPTO_CONN_NO_CONNECTION;
+        return -1;
+    }
+
     crypto_connection_add_source(c, crypt_connection_id, n_c->source);
+    schedule_connection(c, crypt_connection_id, 0);
     return crypt_connection_id;
 }
 
@@ -1751,6 +2501,7 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
     conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
     conn->rtt_time = DEFAULT_PING_CONNECTION;
+    congestion_control_init(&conn->congestion_control, c->congestion_control);
     memcpy(conn->dht_public_key, dht_public_key, crypto_box_PUBLICKEYBYTES);
 
     conn->cookie_request_number = random_64b();
@@ -1758,14 +2509,17 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
 
     if (create_cookie_request(c, cookie_request, conn->dht_public_key, conn->cookie_request_number,
                               conn->shared_key) != sizeof(cookie_request)
-            || new_temp_packet(c, crypt_connection_id, cookie_request, sizeof(cookie_request)) != 0) {
+            || new_temp_packet(c, crypt_connection_id, cookie_request, sizeof(cookie_request)) != 0
+            || !hash_list_add(&c->public_key_index, conn->public_key, crypt_connection_id)) {
         pthread_mutex_lock(&c->tcp_mutex);
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
+        clear_temp_packet(c, crypt_connection_id);
         conn->status = CRYPTO_CONN_NO_CONNECTION;
         return -1;
     }
 
+    schedule_connection(c, crypt_connection_id, 0);
     return crypt_connection_id;
 }
 
@@ -1942,30 +2696,6 @@ static void do_tcp(Net_Crypto *c)
     pthread_mutex_lock(&c->tcp_mutex);
     do_tcp_connections(c->tcp_c);
     pthread_mutex_unlock(&c->tcp_mutex);
-
-    uint32_t i;
-
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        Crypto_Connection *conn = get_crypto_connection(c, i);
-
-        if (conn == 0)
-            return;
-
-        if (conn->status == CRYPTO_CONN_ESTABLISHED) {
-            _Bool direct_connected = 0;
-            crypto_connection_status(c, i, &direct_connected, NULL);
-
-            if (direct_connected) {
-                pthread_mutex_lock(&c->tcp_mutex);
-                set_tcp_connection_to_status(c->tcp_c, conn->connection_number_tcp, 0);
-                pthread_mutex_unlock(&c->tcp_mutex);
-            } else {
-                pthread_mutex_lock(&c->tcp_mutex);
-                set_tcp_connection_to_status(c->tcp_c, conn->connection_number_tcp, 1);
-                pthread_mutex_unlock(&c->tcp_mutex);
-            }
-        }
-    }
 }
 
 /* Set function to be called when connection with crypt_connection_id goes connects/disconnects.
@@ -2068,7 +2798,9 @@ int nc_dht_pk_callback(Net_Crypto *c, int crypt_connection_id, void (*function)(
  */
 static int crypto_id_ip_port(const Net_Crypto *c, IP_Port ip_port)
 {
-    return bs_list_find(&c->ip_port_list, (uint8_t *)&ip_port);
+    uint8_t key[SIZE_IPPORT];
+    ip_port_key(key, ip_port);
+    return hash_list_find(&c->ip_port_index, key);
 }
 
 #define CRYPTO_MIN_PACKET_SIZE (1 + sizeof(uint16_t) + crypto_box_MACBYTES)
@@ -2119,6 +2851,40 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
     return 0;
 }
 
+/* Send the packets queued with queue_cryptpacket() on the connection, until one can't be sent. */
+static void send_queued_packets(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return;
+
+    Crypto_Send_Queue *queue = conn->send_queue;
+
+    while (1) {
+        Crypto_Queued_Packet *packet = queue->pending;
+
+        if (packet == NULL)
+            packet = (Crypto_Queued_Packet *)mpsc_queue_pop(&queue->queue);
+
+        if (packet == NULL)
+            break;
+
+        if (packet->data[0] < PACKET_ID_LOSSY_RANGE_START) {
+            if (write_cryptpacket(c, crypt_connection_id, packet->data, packet->length, packet->congestion_control) == -1) {
+                queue->pending = packet;
+                break;
+            }
+        } else {
+            send_lossy_cryptpacket(c, crypt_connection_id, packet->data, packet->length);
+        }
+
+        queue->pending = NULL;
+        free(packet);
+        __atomic_sub_fetch(&queue->length, 1, __ATOMIC_RELAXED);
+    }
+}
+
 /* The dT for the average packet receiving rate calculations.
    Also used as the */
 #define PACKET_COUNTER_AVERAGE_INTERVAL 50
@@ -2128,241 +2894,285 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
  */
 #define REQUEST_PACKETS_COMPARE_CONSTANT (0.125 * 100.0)
 
-/* Timeout for increasing speed after congestion event (in ms). */
-#define CONGESTION_EVENT_TIMEOUT 1000
-
-/* If the send queue is SEND_QUEUE_RATIO times larger than the
- * calculated link speed the packet send speed will be reduced
- * by a value depending on this number.
+/* return 1 if the established connection has packets in flight, data to send or measurements to
+ * make, so it has to run more often than once per request packet.
  */
-#define SEND_QUEUE_RATIO 2.0
+static _Bool connection_busy(const Crypto_Connection *conn)
+{
+    if (num_packets_array(&conn->send_array) != 0 || num_packets_array(&conn->recv_array) != 0)
+        return 1;
 
-static void send_crypto_packets(Net_Crypto *c)
+    /* Let the arrays shrink back. */
+    if (conn->send_array.capacity > CRYPTO_MIN_PACKET_BUFFER_SIZE
+            || conn->recv_array.capacity > CRYPTO_MIN_PACKET_BUFFER_SIZE)
+        return 1;
+
+    if (conn->packet_counter != 0 || conn->packets_sent != 0 || conn->packets_resent != 0)
+        return 1;
+
+    if (conn->packet_recv_rate > CRYPTO_PACKET_MIN_RATE)
+        return 1;
+
+    /* Refill what write_cryptpacket() can send right away. */
+    if (conn->packets_left < CRYPTO_MIN_QUEUE_LENGTH)
+        return 1;
+
+    return __atomic_load_n(&conn->send_queue->length, __ATOMIC_RELAXED) != 0;
+}
+
+/* Do what is due at temp_time on the connection and schedule it for the next time it has
+ * something to do.
+ */
+static void do_crypto_connection(Net_Crypto *c, int crypt_connection_id, uint64_t temp_time)
 {
-    uint32_t i;
-    uint64_t temp_time = current_time_monotonic();
-    double total_send_rate = 0;
-    uint32_t peak_request_packet_interval = ~0;
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        Crypto_Connection *conn = get_crypto_connection(c, i);
+    if (conn == 0)
+        return;
 
-        if (conn == 0)
+    if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT
+            || conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
+        if (conn->temp_packet_num_sent >= MAX_NUM_SENDPACKET_TRIES) {
+            connection_kill(c, crypt_connection_id);
             return;
-
-        if (CRYPTO_SEND_PACKET_INTERVAL + conn->temp_packet_sent_time < temp_time) {
-            send_temp_packet(c, i);
         }
+    }
 
-        if ((conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED)
-                && ((CRYPTO_SEND_PACKET_INTERVAL) + conn->last_request_packet_sent) < temp_time) {
-            if (send_request_packet(c, i) == 0) {
-                conn->last_request_packet_sent = temp_time;
-            }
+    pthread_mutex_lock(&conn->mutex);
+    shrink_packets_array(&conn->send_array);
+    shrink_packets_array(&conn->recv_array);
+    pthread_mutex_unlock(&conn->mutex);
 
+    if (CRYPTO_SEND_PACKET_INTERVAL + conn->temp_packet_sent_time < temp_time) {
+        send_temp_packet(c, crypt_connection_id);
+    }
+
+    if ((conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED)
+            && ((CRYPTO_SEND_PACKET_INTERVAL) + conn->last_request_packet_sent) < temp_time) {
+        if (send_request_packet(c, crypt_connection_id) == 0) {
+            conn->last_request_packet_sent = temp_time;
         }
 
-        if (conn->status == CRYPTO_CONN_ESTABLISHED) {
-            if (conn->packet_recv_rate > CRYPTO_PACKET_MIN_RATE) {
-                double request_packet_interval = (REQUEST_PACKETS_COMPARE_CONSTANT / (((double)num_packets_array(
-                                                      &conn->recv_array) + 1.0) / (conn->packet_recv_rate + 1.0)));
+    }
 
-                double request_packet_interval2 = ((CRYPTO_PACKET_MIN_RATE / conn->packet_recv_rate) *
-                                                   (double)CRYPTO_SEND_PACKET_INTERVAL) + (double)PACKET_COUNTER_AVERAGE_INTERVAL;
+    /* Next time something is due, or a send that failed is tried again. */
+    uint64_t next_time = ~0;
 
-                if (request_packet_interval2 < request_packet_interval)
-                    request_packet_interval = request_packet_interval2;
+    if (conn->temp_packet) {
+        next_time = CRYPTO_SEND_PACKET_INTERVAL + conn->temp_packet_sent_time + 1;
 
-                if (request_packet_interval < PACKET_COUNTER_AVERAGE_INTERVAL)
-                    request_packet_interval = PACKET_COUNTER_AVERAGE_INTERVAL;
+        if (conn->temp_packet_num_sent >= MAX_NUM_SENDPACKET_TRIES)
+            next_time = temp_time;
+    }
 
-                if (request_packet_interval > CRYPTO_SEND_PACKET_INTERVAL)
-                    request_packet_interval = CRYPTO_SEND_PACKET_INTERVAL;
+    if (conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED) {
+        uint64_t request_time = CRYPTO_SEND_PACKET_INTERVAL + conn->last_request_packet_sent + 1;
 
-                if (temp_time - conn->last_request_packet_sent > (uint64_t)request_packet_interval) {
-                    if (send_request_packet(c, i) == 0) {
-                        conn->last_request_packet_sent = temp_time;
-                    }
-                }
+        if (request_time < next_time)
+            next_time = request_time;
+    }
 
-                if (request_packet_interval < peak_request_packet_interval) {
-                    peak_request_packet_interval = request_packet_interval;
-                }
-            }
+    if (next_time <= temp_time)
+        next_time = temp_time + PACKET_COUNTER_AVERAGE_INTERVAL;
 
-            if ((PACKET_COUNTER_AVERAGE_INTERVAL + conn->packet_counter_set) < temp_time) {
+    if (conn->status == CRYPTO_CONN_ESTABLISHED) {
+        _Bool direct_connected = 0;
+        crypto_connection_status(c, crypt_connection_id, &direct_connected, NULL);
 
-                double dt = temp_time - conn->packet_counter_set;
+        pthread_mutex_lock(&c->tcp_mutex);
 
-                conn->packet_recv_rate = (double)conn->packet_counter / (dt / 1000.0);
-                conn->packet_counter = 0;
-                conn->packet_counter_set = temp_time;
+        if (direct_connected) {
+            set_tcp_connection_to_status(c->tcp_c, conn->connection_number_tcp, 0);
+        } else {
+            set_tcp_connection_to_status(c->tcp_c, conn->connection_number_tcp, 1);
+        }
 
-                uint32_t packets_sent = conn->packets_sent;
-                conn->packets_sent = 0;
+        pthread_mutex_unlock(&c->tcp_mutex);
 
-                uint32_t packets_resent = conn->packets_resent;
-                conn->packets_resent = 0;
+        uint64_t request_time = ~0;
 
-                /* conjestion control
-                    calculate a new value of conn->packet_send_rate based on some data
-                 */
+        if (conn->packet_recv_rate > CRYPTO_PACKET_MIN_RATE) {
+            double request_packet_interval = (REQUEST_PACKETS_COMPARE_CONSTANT / (((double)num_packets_array(
+                                                  &conn->recv_array) + 1.0) / (conn->packet_recv_rate + 1.0)));
 
-                unsigned int pos = conn->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
-                conn->last_sendqueue_size[pos] = num_packets_array(&conn->send_array);
-                ++conn->last_sendqueue_counter;
+            double request_packet_interval2 = ((CRYPTO_PACKET_MIN_RATE / conn->packet_recv_rate) *
+                                               (double)CRYPTO_SEND_PACKET_INTERVAL) + (double)PACKET_COUNTER_AVERAGE_INTERVAL;
 
-                unsigned int j;
-                long signed int sum = 0;
-                sum = (long signed int)conn->last_sendqueue_size[(pos) % CONGESTION_QUEUE_ARRAY_SIZE] -
-                      (long signed int)conn->last_sendqueue_size[(pos - (CONGESTION_QUEUE_ARRAY_SIZE - 1)) % CONGESTION_QUEUE_ARRAY_SIZE];
+            if (request_packet_interval2 < request_packet_interval)
+                request_packet_interval = request_packet_interval2;
 
-                unsigned int n_p_pos = conn->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                conn->last_num_packets_sent[n_p_pos] = packets_sent;
-                conn->last_num_packets_resent[n_p_pos] = packets_resent;
+            if (request_packet_interval < PACKET_COUNTER_AVERAGE_INTERVAL)
+                request_packet_interval = PACKET_COUNTER_AVERAGE_INTERVAL;
 
-                _Bool direct_connected = 0;
-                crypto_connection_status(c, i, &direct_connected, NULL);
+            if (request_packet_interval > CRYPTO_SEND_PACKET_INTERVAL)
+                request_packet_interval = CRYPTO_SEND_PACKET_INTERVAL;
 
-                if (direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time) {
-                    /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
-                } else {
-                    long signed int total_sent = 0, total_resent = 0;
+            if (temp_time - conn->last_request_packet_sent > (uint64_t)request_packet_interval) {
+                if (send_request_packet(c, crypt_connection_id) == 0) {
+                    conn->last_request_packet_sent = temp_time;
+                }
+            }
 
-                    //TODO use real delay
-                    unsigned int delay = (unsigned int)((conn->rtt_time / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
-                    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
+            request_time = conn->last_request_packet_sent + (uint64_t)request_packet_interval + 1;
 
-                    if (delay > packets_set_rem_array) {
-                        delay = packets_set_rem_array;
-                    }
+            if (request_time <= temp_time)
+                request_time = temp_time + PACKET_COUNTER_AVERAGE_INTERVAL;
+        }
 
-                    for (j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
-                        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                        total_sent += conn->last_num_packets_sent[ind];
-                        total_resent += conn->last_num_packets_resent[ind];
-                    }
+        if ((PACKET_COUNTER_AVERAGE_INTERVAL + conn->packet_counter_set) < temp_time) {
 
-                    if (sum > 0) {
-                        total_sent -= sum;
-                    } else {
-                        if (total_resent > -sum)
-                            total_resent = -sum;
-                    }
+            double dt = temp_time - conn->packet_counter_set;
 
-                    /* if queue is too big only allow resending packets. */
-                    uint32_t npackets = num_packets_array(&conn->send_array);
-                    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
-                                                 PACKET_COUNTER_AVERAGE_INTERVAL));
+            conn->packet_recv_rate = (double)conn->packet_counter / (dt / 1000.0);
+            conn->packet_counter = 0;
+            conn->packet_counter_set = temp_time;
 
-                    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
-                            CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
+            uint32_t packets_sent = conn->packets_sent;
+            conn->packets_sent = 0;
 
-                    if (min_speed < CRYPTO_PACKET_MIN_RATE)
-                        min_speed = CRYPTO_PACKET_MIN_RATE;
+            uint32_t packets_resent = conn->packets_resent;
+            conn->packets_resent = 0;
 
-                    double send_array_ratio = (((double)npackets) / min_speed);
+            /* conjestion control
+                calculate a new value of conn->packet_send_rate based on some data
+             */
 
-                    //TODO: Improve formula?
-                    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
-                        conn->packet_send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
-                    } else if (conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < temp_time) {
-                        conn->packet_send_rate = min_speed * 1.2;
-                    } else {
-                        conn->packet_send_rate = min_speed * 0.9;
-                    }
+            Congestion_Sample sample;
+            sample.time = temp_time;
+            sample.interval = PACKET_COUNTER_AVERAGE_INTERVAL;
+            sample.send_queue_size = num_packets_array(&conn->send_array);
+            sample.packets_sent = 0;
+            sample.packets_resent = 0;
+            sample.min_rtt = conn->rtt_time;
+            sample.last_congestion_event = conn->last_congestion_event;
+            /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
+            sample.hold_rate = direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time;
 
-                    conn->packet_send_rate_requested = min_speed_request * 1.2;
+            Congestion_Rates rates;
+            rates.send_rate = conn->packet_send_rate;
+            rates.send_rate_requested = conn->packet_send_rate_requested;
 
-                    if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
-                        conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-                    }
+            /* Idle connections aren't run every interval, the ones they skipped had nothing sent. */
+            uint64_t skipped = dt / PACKET_COUNTER_AVERAGE_INTERVAL;
 
-                    if (conn->packet_send_rate_requested < conn->packet_send_rate) {
-                        conn->packet_send_rate_requested = conn->packet_send_rate;
-                    }
-                }
+            if (skipped > CONGESTION_LAST_SENT_ARRAY_SIZE)
+                skipped = CONGESTION_LAST_SENT_ARRAY_SIZE;
 
+            for (; skipped > 1; --skipped) {
+                congestion_control_update(&conn->congestion_control, &sample, &rates);
             }
 
-            if (conn->last_packets_left_set == 0 || conn->last_packets_left_requested_set == 0) {
-                conn->last_packets_left_requested_set = conn->last_packets_left_set = temp_time;
-                conn->packets_left_requested = conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
-            } else {
-                if (((uint64_t)((1000.0 / conn->packet_send_rate) + 0.5) + conn->last_packets_left_set) <= temp_time) {
-                    double n_packets = conn->packet_send_rate * (((double)(temp_time - conn->last_packets_left_set)) / 1000.0);
-                    n_packets += conn->last_packets_left_rem;
+            sample.packets_sent = packets_sent;
+            sample.packets_resent = packets_resent;
+            congestion_control_update(&conn->congestion_control, &sample, &rates);
+            conn->packet_send_rate = rates.send_rate;
+            conn->packet_send_rate_requested = rates.send_rate_requested;
+        }
 
-                    uint32_t num_packets = n_packets;
-                    double rem = n_packets - (double)num_packets;
+        if (conn->last_packets_left_set == 0 || conn->last_packets_left_requested_set == 0) {
+            conn->last_packets_left_requested_set = conn->last_packets_left_set = temp_time;
+            conn->packets_left_requested = conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
+        } else {
+            if (((uint64_t)((1000.0 / conn->packet_send_rate) + 0.5) + conn->last_packets_left_set) <= temp_time) {
+                double n_packets = conn->packet_send_rate * (((double)(temp_time - conn->last_packets_left_set)) / 1000.0);
+                n_packets += conn->last_packets_left_rem;
 
-                    if (conn->packets_left > num_packets * 4 + CRYPTO_MIN_QUEUE_LENGTH) {
-                        conn->packets_left = num_packets * 4 + CRYPTO_MIN_QUEUE_LENGTH;
-                    } else {
-                        conn->packets_left += num_packets;
-                    }
+                uint32_t num_packets = n_packets;
+                double rem = n_packets - (double)num_packets;
 
-                    conn->last_packets_left_set = temp_time;
-                    conn->last_packets_left_rem = rem;
+                if (conn->packets_left > num_packets * 4 + CRYPTO_MIN_QUEUE_LENGTH) {
+                    conn->packets_left = num_packets * 4 + CRYPTO_MIN_QUEUE_LENGTH;
+                } else {
+                    conn->packets_left += num_packets;
                 }
 
-                if (((uint64_t)((1000.0 / conn->packet_send_rate_requested) + 0.5) + conn->last_packets_left_requested_set) <=
-                        temp_time) {
-                    double n_packets = conn->packet_send_rate_requested * (((double)(temp_time - conn->last_packets_left_requested_set)) /
-                                       1000.0);
-                    n_packets += conn->last_packets_left_requested_rem;
+                conn->last_packets_left_set = temp_time;
+                conn->last_packets_left_rem = rem;
+            }
 
-                    uint32_t num_packets = n_packets;
-                    double rem = n_packets - (double)num_packets;
-                    conn->packets_left_requested = num_packets;
+            if (((uint64_t)((1000.0 / conn->packet_send_rate_requested) + 0.5) + conn->last_packets_left_requested_set) <=
+                    temp_time) {
+                double n_packets = conn->packet_send_rate_requested * (((double)(temp_time - conn->last_packets_left_requested_set)) /
+                                   1000.0);
+                n_packets += conn->last_packets_left_requested_rem;
 
-                    conn->last_packets_left_requested_set = temp_time;
-                    conn->last_packets_left_requested_rem = rem;
-                }
+                uint32_t num_packets = n_packets;
+                double rem = n_packets - (double)num_packets;
+                conn->packets_left_requested = num_packets;
 
-                if (conn->packets_left > conn->packets_left_requested)
-                    conn->packets_left_requested = conn->packets_left;
+                conn->last_packets_left_requested_set = temp_time;
+                conn->last_packets_left_requested_rem = rem;
             }
 
-            int ret = send_requested_packets(c, i, conn->packets_left_requested);
+            if (conn->packets_left > conn->packets_left_requested)
+                conn->packets_left_requested = conn->packets_left;
+        }
 
-            if (ret != -1) {
-                conn->packets_left_requested -= ret;
-                conn->packets_resent += ret;
+        int ret = send_requested_packets(c, crypt_connection_id, conn->packets_left_requested);
 
-                if ((unsigned int)ret < conn->packets_left) {
-                    conn->packets_left -= ret;
-                } else {
-                    conn->last_congestion_event = temp_time;
-                    conn->packets_left = 0;
-                }
-            }
+        if (ret != -1) {
+            conn->packets_left_requested -= ret;
+            conn->packets_resent += ret;
+            conn->total_packets_resent += ret;
 
-            if (conn->packet_send_rate > CRYPTO_PACKET_MIN_RATE * 1.5) {
-                total_send_rate += conn->packet_send_rate;
+            if ((unsigned int)ret < conn->packets_left) {
+                conn->packets_left -= ret;
+            } else {
+                conn->last_congestion_event = temp_time;
+                conn->packets_left = 0;
             }
         }
-    }
 
-    c->current_sleep_time = ~0;
-    uint32_t sleep_time = peak_request_packet_interval;
+        send_queued_packets(c, crypt_connection_id);
 
-    if (c->current_sleep_time > sleep_time) {
-        c->current_sleep_time = sleep_time;
-    }
+        if (connection_busy(conn)) {
+            uint64_t busy_time = PACKET_COUNTER_AVERAGE_INTERVAL + conn->packet_counter_set + 1;
+
+            if (request_time < busy_time)
+                busy_time = request_time;
+
+            uint64_t refill_time = (uint64_t)((1000.0 / conn->packet_send_rate) + 0.5) + conn->last_packets_left_set;
+
+            if (refill_time < busy_time)
+                busy_time = refill_time;
 
-    if (total_send_rate > CRYPTO_PACKET_MIN_RATE) {
-        sleep_time = (1000.0 / total_send_rate);
+            refill_time = (uint64_t)((1000.0 / conn->packet_send_rate_requested) + 0.5) + conn->last_packets_left_requested_set;
 
-        if (c->current_sleep_time > sleep_time) {
-            c->current_sleep_time = sleep_time + 1;
+            if (refill_time < busy_time)
+                busy_time = refill_time;
+
+            if (busy_time <= temp_time)
+                busy_time = temp_time + 1;
+
+            if (busy_time < next_time)
+                next_time = busy_time;
         }
     }
 
-    sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
+    event_heap_set(&c->schedule, crypt_connection_id, next_time);
+}
+
+static void send_crypto_packets(Net_Crypto *c)
+{
+    uint64_t temp_time = current_time_monotonic();
+    int64_t id;
+
+    take_woken_connections(c);
+
+    /* Connections run are scheduled after temp_time so this ends. */
+    while ((id = event_heap_pop(&c->schedule, temp_time)) != -1) {
+        do_crypto_connection(c, id, temp_time);
+    }
+
+    c->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
+    uint64_t next_time;
 
-    if (c->current_sleep_time > sleep_time) {
-        c->current_sleep_time = sleep_time;
+    if (event_heap_next_time(&c->schedule, &next_time) == 0 && next_time < temp_time + c->current_sleep_time) {
+        if (next_time > temp_time) {
+            c->current_sleep_time = next_time - temp_time;
+        } else {
+            c->current_sleep_time = 1;
+        }
     }
 }
 
@@ -2403,27 +3213,72 @@ uint32_t crypto_num_free_sendqueue_slots(const Net_Crypto *c, int crypt_connecti
 int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
                           uint8_t congestion_control)
 {
-    if (length == 0)
+    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE)
         return -1;
 
-    if (data[0] < CRYPTO_RESERVED_PACKETS)
-        return -1;
+    uint8_t *room = reserve_cryptpacket(c, crypt_connection_id);
 
-    if (data[0] >= PACKET_ID_LOSSY_RANGE_START)
+    if (room == NULL)
         return -1;
 
+    memcpy(room, data, length);
+    return commit_cryptpacket(c, crypt_connection_id, room, length, congestion_control);
+}
+
+/* Reserve room for a lossless cryptopacket of up to MAX_CRYPTO_DATA_SIZE bytes on the connection.
+ *
+ * return NULL on failure.
+ * return the room on success.
+ */
+uint8_t *reserve_cryptpacket(Net_Crypto *c, int crypt_connection_id)
+{
+    if (get_crypto_connection(c, crypt_connection_id) == 0)
+        return NULL;
+
+    Packet_Data *dt = slab_pool_alloc(&c->packet_pool);
+
+    if (dt == NULL)
+        return NULL;
+
+    return dt->data;
+}
+
+static Packet_Data *reserved_packet_data(uint8_t *data)
+{
+    return (Packet_Data *)(data - offsetof(Packet_Data, data));
+}
+
+/* Sends the lossless cryptopacket of length written in data, a room returned by reserve_cryptpacket().
+ *
+ * return -1 if data could not be put in packet queue.
+ * return positive packet number if data was put into the queue.
+ *
+ * congestion_control: should congestion control apply to this packet?
+ */
+int64_t commit_cryptpacket(Net_Crypto *c, int crypt_connection_id, uint8_t *data, uint16_t length,
+                           uint8_t congestion_control)
+{
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-    if (conn == 0)
+    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE || data[0] < CRYPTO_RESERVED_PACKETS
+            || data[0] >= PACKET_ID_LOSSY_RANGE_START || conn == 0 || conn->status != CRYPTO_CONN_ESTABLISHED) {
+        cancel_cryptpacket(c, data);
         return -1;
+    }
 
-    if (conn->status != CRYPTO_CONN_ESTABLISHED)
+    /* Idle connections don't run every do_net_crypto(), so wake them up to send the packet
+       again if needed, or to refill packets_left. */
+    if (congestion_control && conn->packets_left == 0) {
+        wake_connection(c, crypt_connection_id);
+        cancel_cryptpacket(c, data);
         return -1;
+    }
 
-    if (congestion_control && conn->packets_left == 0)
-        return -1;
+    Packet_Data *dt = reserved_packet_data(data);
+    dt->length = length;
+    int64_t ret = send_lossless_packet(c, crypt_connection_id, dt, congestion_control);
 
-    int64_t ret = send_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
+    wake_connection(c, crypt_connection_id);
 
     if (ret == -1)
         return -1;
@@ -2434,9 +3289,16 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         conn->packets_sent++;
     }
 
+    ++conn->total_packets_sent;
     return ret;
 }
 
+/* Give back data, a room returned by reserve_cryptpacket(), without sending it. */
+void cancel_cryptpacket(Net_Crypto *c, uint8_t *data)
+{
+    slab_pool_release(&c->packet_pool, reserved_packet_data(data));
+}
+
 /* Check if packet_number was received by the other side.
  *
  * packet_number must be a valid packet number of a packet sent on this connection.
@@ -2477,9 +3339,7 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
     if (data[0] >= (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE))
         return -1;
 
-    pthread_mutex_lock(&c->connections_mutex);
-    ++c->connection_use_counter;
-    pthread_mutex_unlock(&c->connections_mutex);
+    connections_enter(c);
 
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
@@ -2493,9 +3353,53 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         ret = send_data_packet_helper(c, crypt_connection_id, buffer_start, buffer_end, data, length);
     }
 
-    pthread_mutex_lock(&c->connections_mutex);
-    --c->connection_use_counter;
-    pthread_mutex_unlock(&c->connections_mutex);
+    connections_leave(c);
+
+    return ret;
+}
+
+int queue_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                      uint8_t congestion_control)
+{
+    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE)
+        return -1;
+
+    if (data[0] < CRYPTO_RESERVED_PACKETS)
+        return -1;
+
+    if (data[0] >= (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE))
+        return -1;
+
+    Crypto_Queued_Packet *packet = malloc(sizeof(Crypto_Queued_Packet) - MAX_CRYPTO_DATA_SIZE + length);
+
+    if (packet == NULL)
+        return -1;
+
+    packet->congestion_control = congestion_control;
+    packet->length = length;
+    memcpy(packet->data, data, length);
+
+    connections_enter(c);
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    int ret = -1;
+
+    if (conn && __atomic_load_n(&conn->status, __ATOMIC_RELAXED) == CRYPTO_CONN_ESTABLISHED) {
+        Crypto_Send_Queue *queue = conn->send_queue;
+
+        if (__atomic_add_fetch(&queue->length, 1, __ATOMIC_RELAXED) <= CRYPTO_SEND_QUEUE_SIZE) {
+            mpsc_queue_push(&queue->queue, &packet->node);
+            wake_send_queue(c, queue);
+            ret = 0;
+        } else {
+            __atomic_sub_fetch(&queue->length, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    connections_leave(c);
+
+    if (ret == -1)
+        free(packet);
 
     return ret;
 }
@@ -2507,15 +3411,7 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
  */
 int crypto_kill(Net_Crypto *c, int crypt_connection_id)
 {
-    while (1) { /* TODO: is this really the best way to do this? */
-        pthread_mutex_lock(&c->connections_mutex);
-
-        if (!c->connection_use_counter) {
-            break;
-        }
-
-        pthread_mutex_unlock(&c->connections_mutex);
-    }
+    connections_lock(c);
 
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
@@ -2529,15 +3425,22 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id)
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
 
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
+        uint8_t key[SIZE_IPPORT];
+        ip_port_key(key, conn->ip_portv4);
+        hash_list_remove(&c->ip_port_index, key, crypt_connection_id);
+        ip_port_key(key, conn->ip_portv6);
+        hash_list_remove(&c->ip_port_index, key, crypt_connection_id);
+        hash_list_remove(&c->public_key_index, conn->public_key, crypt_connection_id);
         clear_temp_packet(c, crypt_connection_id);
-        clear_buffer(&conn->send_array);
-        clear_buffer(&conn->recv_array);
+        pthread_mutex_lock(&conn->mutex);
+        clear_buffer(&c->packet_pool, &conn->send_array);
+        clear_buffer(&c->packet_pool, &conn->recv_array);
+        pthread_mutex_unlock(&conn->mutex);
+        clear_send_queue(conn->send_queue);
         ret = wipe_crypto_connection(c, crypt_connection_id);
     }
 
-    pthread_mutex_unlock(&c->connections_mutex);
+    connections_unlock(c);
 
     return ret;
 }
@@ -2574,6 +3477,38 @@ unsigned int crypto_connection_status(const Net_Crypto *c, int crypt_connection_
     return conn->status;
 }
 
+int crypto_connection_stats(Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return -1;
+
+    memset(stats, 0, sizeof(Crypto_Connection_Stats));
+    stats->status = crypto_connection_status(c, crypt_connection_id, &stats->direct_connected, NULL);
+
+    pthread_mutex_lock(&c->tcp_mutex);
+    stats->online_tcp_relays = tcp_connection_to_online_tcp_relays(c->tcp_c, conn->connection_number_tcp);
+    stats->relay_set = tcp_connection_to_relay(c->tcp_c, conn->connection_number_tcp, stats->relay_public_key) == 0;
+    pthread_mutex_unlock(&c->tcp_mutex);
+
+    if (conn->status != CRYPTO_CONN_ESTABLISHED)
+        return 0;
+
+    stats->rtt = conn->rtt_time;
+    stats->packet_send_rate = conn->packet_send_rate;
+    stats->packet_recv_rate = conn->packet_recv_rate;
+    stats->packets_sent = conn->total_packets_sent;
+    stats->packets_resent = conn->total_packets_resent;
+    stats->packets_received = conn->total_packets_received;
+
+    pthread_mutex_lock(&conn->mutex);
+    stats->send_queue_size = num_packets_array(&conn->send_array);
+    stats->recv_queue_size = num_packets_array(&conn->recv_array);
+    pthread_mutex_unlock(&conn->mutex);
+    return 0;
+}
+
 void new_keys(Net_Crypto *c)
 {
     crypto_box_keypair(c->self_public_key, c->self_secret_key);
@@ -2631,64 +3566,76 @@ Net_Crypto *new_net_crypto(DHT *dht, TCP_Proxy_Info *proxy_info)
         return NULL;
     }
 
+    if (slab_pool_init(&temp->packet_pool, sizeof(Packet_Data), PACKET_POOL_SLAB_LENGTH) != 0) {
+        pthread_mutex_destroy(&temp->tcp_mutex);
+        pthread_mutex_destroy(&temp->connections_mutex);
+        kill_tcp_connections(temp->tcp_c);
+        free(temp);
+        return NULL;
+    }
+
+    if (!hash_list_init(&temp->ip_port_index, SIZE_IPPORT, 0)
+            || !hash_list_init(&temp->public_key_index, crypto_box_PUBLICKEYBYTES, 0)) {
+        hash_list_free(&temp->ip_port_index);
+        hash_list_free(&temp->public_key_index);
+        slab_pool_free(&temp->packet_pool);
+        pthread_mutex_destroy(&temp->tcp_mutex);
+        pthread_mutex_destroy(&temp->connections_mutex);
+        kill_tcp_connections(temp->tcp_c);
+        free(temp);
+        return NULL;
+    }
+
     temp->dht = dht;
 
     new_keys(temp);
     new_symmetric_key(temp->secret_symmetric_key);
 
     temp->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
+    event_heap_init(&temp->schedule);
+    mpsc_queue_init(&temp->woken_connections);
 
     networking_registerhandler(dht->net, NET_PACKET_COOKIE_REQUEST, &udp_handle_cookie_request, temp);
     networking_registerhandler(dht->net, NET_PACKET_COOKIE_RESPONSE, &udp_handle_packet, temp);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO_HS, &udp_handle_packet, temp);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO_DATA, &udp_handle_packet, temp);
 
-    bs_list_init(&temp->ip_port_list, sizeof(IP_Port), 8);
-
     return temp;
 }
 
-static void kill_timedout(Net_Crypto *c)
+/* return the optimal interval in ms for running do_net_crypto.
+ */
+uint32_t crypto_run_interval(const Net_Crypto *c)
 {
-    uint32_t i;
-    //uint64_t temp_time = current_time_monotonic();
-
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        Crypto_Connection *conn = get_crypto_connection(c, i);
-
-        if (conn == 0)
-            return;
-
-        if (conn->status == CRYPTO_CONN_NO_CONNECTION)
-            continue;
-
-        if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT
-                || conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
-            if (conn->temp_packet_num_sent < MAX_NUM_SENDPACKET_TRIES)
-                continue;
+    return c->current_sleep_time;
+}
 
-            connection_kill(c, i);
+int net_crypto_set_congestion_control(Net_Crypto *c, uint8_t algorithm)
+{
+    if (algorithm >= CONGESTION_CONTROL_NUM_ALGORITHMS)
+        return -1;
 
-        }
+    c->congestion_control = algorithm;
+    return 0;
+}
 
-        if (conn->status == CRYPTO_CONN_ESTABLISHED) {
-            //TODO: add a timeout here?
-        }
-    }
+void crypto_packet_pool_stats(Net_Crypto *c, Slab_Pool_Stats *stats)
+{
+    slab_pool_get_stats(&c->packet_pool, stats);
 }
 
-/* return the optimal interval in ms for running do_net_crypto.
- */
-uint32_t crypto_run_interval(const Net_Crypto *c)
+int crypto_wait_socks(Net_Crypto *c, Socket_Wait_List *list)
 {
-    return c->current_sleep_time;
+    pthread_mutex_lock(&c->tcp_mutex);
+    int ret = tcp_connections_wait_socks(c->tcp_c, list);
+    pthread_mutex_unlock(&c->tcp_mutex);
+    return ret;
 }
 
 /* Main loop. */
 void do_net_crypto(Net_Crypto *c)
 {
     unix_time_update();
-    kill_timedout(c);
     do_tcp(c);
     send_crypto_packets(c);
 }
@@ -2701,11 +3648,21 @@ void kill_net_crypto(Net_Crypto *c)
         crypto_kill(c, i);
     }
 
+    take_woken_connections(c);
+
+    for (i = 0; i < c->crypto_connections_length; ++i) {
+        kill_send_queue(c->crypto_connections[i].send_queue);
+    }
+
+    event_heap_free(&c->schedule);
+
     pthread_mutex_destroy(&c->tcp_mutex);
     pthread_mutex_destroy(&c->connections_mutex);
+    slab_pool_free(&c->packet_pool);
 
     kill_tcp_connections(c->tcp_c);
-    bs_list_free(&c->ip_port_list);
+    hash_list_free(&c->ip_port_index);
+    hash_list_free(&c->public_key_index);
     networking_registerhandler(c->dht->net, NET_PACKET_COOKIE_REQUEST, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_COOKIE_RESPONSE, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_CRYPTO_HS, NULL, NULL);
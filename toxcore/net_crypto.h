@@ -27,6 +27,10 @@
 #include "DHT.h"
 #include "LAN_discovery.h"
 #include "TCP_connection.h"
+#include "congestion_control.h"
+#include "event_heap.h"
+#include "mpsc_queue.h"
+#include "slab_pool.h"
 #include <pthread.h>
 
 #define CRYPTO_CONN_NO_CONNECTION 0
@@ -38,6 +42,14 @@
 /* Maximum size of receiving and sending packet buffers. */
 #define CRYPTO_PACKET_BUFFER_SIZE 32768 /* Must be a power of 2 */
 
+/* Size the packet buffers start at. They grow and shrink in powers of 2 between this and
+ * CRYPTO_PACKET_BUFFER_SIZE as packets get queued and removed.
+ */
+#define CRYPTO_MIN_PACKET_BUFFER_SIZE 64 /* Must be a power of 2, at least 64 */
+
+/* Number of Packet_Data allocated at once by the packet pool. */
+#define PACKET_POOL_SLAB_LENGTH 64
+
 /* Minimum packet rate per second. */
 #define CRYPTO_PACKET_MIN_RATE 4.0
 
@@ -65,6 +77,11 @@
 #define PACKET_ID_PADDING 0 /* Denotes padding */
 #define PACKET_ID_REQUEST 1 /* Used to request unreceived packets */
 #define PACKET_ID_KILL    2 /* Used to kill connection */
+#define PACKET_ID_REQUEST_RANGES 3 /* Used to request unreceived packets, as runs of received and unreceived ones */
+
+/* Number of request packets sent in both formats before deciding the peer doesn't understand
+   PACKET_ID_REQUEST_RANGES, if it didn't send any. */
+#define CRYPTO_REQUEST_RANGES_PROBES 8
 
 /* Packet ids 0 to CRYPTO_RESERVED_PACKETS - 1 are reserved for use by net_crypto. */
 #define CRYPTO_RESERVED_PACKETS 16
@@ -78,23 +95,54 @@
 
 #define CRYPTO_MAX_PADDING 8 /* All packets will be padded a number of bytes based on this number. */
 
-/* Base current transfer speed on last CONGESTION_QUEUE_ARRAY_SIZE number of points taken
-   at the dT defined in net_crypto.c */
-#define CONGESTION_QUEUE_ARRAY_SIZE 12
-#define CONGESTION_LAST_SENT_ARRAY_SIZE (CONGESTION_QUEUE_ARRAY_SIZE * 2)
+/* Maximum number of packets waiting in the queue of a connection filled by queue_cryptpacket(). */
+#define CRYPTO_SEND_QUEUE_SIZE 1024
 
 /* Default connection ping in ms. */
 #define DEFAULT_PING_CONNECTION 1000
 #define DEFAULT_TCP_PING_CONNECTION 500
 
+/* Bytes before the data of a Packet_Data in which the plaintext of the data packet is built
+ * before being encrypted: the zero bytes crypto_box wants, buffer_start, the packet number
+ * and the padding.
+ */
+#define CRYPTO_DATA_HEADROOM (crypto_box_ZEROBYTES + sizeof(uint32_t) + sizeof(uint32_t) + CRYPTO_MAX_PADDING)
+
+/* Bytes before a data packet that encrypting into it overwrites. */
+#define CRYPTO_PACKET_HEADROOM (crypto_box_BOXZEROBYTES - (1 + sizeof(uint16_t)))
+
 typedef struct {
     uint64_t sent_time;
+    _Bool resent; /* sent again after the peer requested it, so its round trip time is ambiguous */
     uint16_t length;
+    uint8_t headroom[CRYPTO_DATA_HEADROOM]; /* Must be right before data. */
     uint8_t data[MAX_CRYPTO_DATA_SIZE];
 } Packet_Data;
 
+/* A packet queued with queue_cryptpacket(). */
 typedef struct {
-    Packet_Data *buffer[CRYPTO_PACKET_BUFFER_SIZE];
+    MPSC_Node node; /* Must be first. */
+    uint8_t congestion_control;
+    uint16_t length;
+    uint8_t data[MAX_CRYPTO_DATA_SIZE];
+} Crypto_Queued_Packet;
+
+typedef struct {
+    MPSC_Queue queue;
+    uint32_t length; /* Number of packets queued, changed atomically. */
+    Crypto_Queued_Packet *pending; /* Taken from the queue but the connection couldn't send it yet. */
+
+    /* Put in Net_Crypto.woken_connections by other threads so that do_net_crypto() runs the
+       connection, only once until it is taken out since woken is set. */
+    MPSC_Node wake_node;
+    uint32_t connection_id;
+    uint8_t woken;
+} Crypto_Send_Queue;
+
+typedef struct {
+    Packet_Data **buffer; /* packet number n is at buffer[n % capacity] */
+    uint64_t *present; /* bit n % capacity is set if buffer[n % capacity] holds a packet */
+    uint32_t  capacity; /* 0 (buffer not allocated) or a power of 2, at least buffer_end - buffer_start */
     uint32_t  buffer_start;
     uint32_t  buffer_end; /* packet numbers in array: {buffer_start, buffer_end) */
 } Packets_Array;
@@ -130,6 +178,13 @@ typedef struct {
     Packets_Array send_array;
     Packets_Array recv_array;
 
+    /* Packets queued by any thread with queue_cryptpacket(), sent by do_net_crypto(). */
+    Crypto_Send_Queue *send_queue;
+
+    _Bool request_ranges; /* The peer sent a PACKET_ID_REQUEST_RANGES so it understands them. */
+    uint8_t request_ranges_probes; /* Number of PACKET_ID_REQUEST_RANGES sent before knowing that. */
+    uint64_t latest_received_time; /* Latest time a packet the peer received was sent at. */
+
     int (*connection_status_callback)(void *object, int id, uint8_t status);
     void *connection_status_callback_object;
     int connection_status_callback_id;
@@ -159,10 +214,9 @@ typedef struct {
     uint64_t last_packets_left_requested_set;
     double last_packets_left_requested_rem;
 
-    uint32_t last_sendqueue_size[CONGESTION_QUEUE_ARRAY_SIZE], last_sendqueue_counter;
-    long signed int last_num_packets_sent[CONGESTION_LAST_SENT_ARRAY_SIZE],
-         last_num_packets_resent[CONGESTION_LAST_SENT_ARRAY_SIZE];
+    Congestion_Control congestion_control;
     uint32_t packets_sent, packets_resent;
+    uint64_t total_packets_sent, total_packets_resent, total_packets_received; /* For crypto_connection_stats(). */
     uint64_t last_congestion_event;
     uint64_t rtt_time;
 
@@ -178,6 +232,24 @@ typedef struct {
     uint32_t dht_pk_callback_number;
 } Crypto_Connection;
 
+/* What crypto_connection_stats() reports about a connection. */
+typedef struct {
+    uint8_t status; /* CRYPTO_CONN_* */
+    _Bool direct_connected; /* Packets are sent over UDP. */
+    unsigned int online_tcp_relays;
+    _Bool relay_set; /* relay_public_key is set. */
+    uint8_t relay_public_key[crypto_box_PUBLICKEYBYTES]; /* Relay TCP packets are sent through. */
+
+    uint64_t rtt; /* Lowest round trip time measured, in ms. */
+    double packet_send_rate; /* Lossless packets per second congestion control lets the connection send. */
+    double packet_recv_rate; /* Lossless packets per second received. */
+    uint64_t packets_sent; /* Lossless packets written to the connection. */
+    uint64_t packets_resent; /* Lossless packets sent again since the peer didn't get them. */
+    uint64_t packets_received; /* Lossless packets delivered by the connection. */
+    uint32_t send_queue_size; /* Lossless packets not acknowledged by the peer yet. */
+    uint32_t recv_queue_size; /* Lossless packets received out of order, waiting for the missing ones. */
+} Crypto_Connection_Stats;
+
 typedef struct {
     IP_Port source;
     uint8_t public_key[crypto_box_PUBLICKEYBYTES]; /* The real public key of the peer. */
@@ -195,8 +267,12 @@ typedef struct {
     Crypto_Connection *crypto_connections;
     pthread_mutex_t tcp_mutex;
 
+    /* Other threads using the connections increment connection_use_counter. Reallocating the
+       array or wiping a connection sets connections_busy and waits for it to go back to 0, with
+       connections_mutex locked. */
     pthread_mutex_t connections_mutex;
     unsigned int connection_use_counter;
+    uint8_t connections_busy;
 
     uint32_t crypto_connections_length; /* Length of connections array. */
 
@@ -213,7 +289,27 @@ typedef struct {
     /* The current optimal sleep time */
     uint32_t current_sleep_time;
 
-    BS_LIST ip_port_list;
+    /* Connections that aren't killed, keyed by the next time send_crypto_packets() has
+       something to do for them. */
+    Event_Heap schedule;
+    /* Connections other threads wrote packets to, scheduled by the next do_net_crypto(). */
+    MPSC_Queue woken_connections;
+
+    /* ip_port_key() of the IP_Ports of the connections -> connection id */
+    HASH_LIST ip_port_index;
+    /* real public key of the connections -> connection id */
+    HASH_LIST public_key_index;
+
+    /* CONGESTION_CONTROL_* algorithm of new connections. */
+    uint8_t congestion_control;
+
+    /* The Packet_Data in the send and receive arrays of all connections. */
+    Slab_Pool packet_pool;
+
+    /* Packets encrypted by send_requested_packets() to be sent in one batch,
+     * each CRYPTO_PACKET_HEADROOM bytes into its buffer.
+     */
+    uint8_t send_batch[NET_BATCH_SIZE][CRYPTO_PACKET_HEADROOM + MAX_CRYPTO_PACKET_SIZE];
 } Net_Crypto;
 
 
@@ -322,6 +418,34 @@ _Bool max_speed_reached(Net_Crypto *c, int crypt_connection_id);
 int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
                           uint8_t congestion_control);
 
+/* Reserve room for a lossless cryptopacket of up to MAX_CRYPTO_DATA_SIZE bytes on the connection.
+ *
+ * The caller writes the packet in the room and sends it with commit_cryptpacket(), or gives the
+ * room back with cancel_cryptpacket(). The packet is then encrypted straight from the room to the
+ * wire and kept there until the peer received it, so unlike with write_cryptpacket() it is never
+ * copied.
+ *
+ * return NULL on failure.
+ * return the room on success.
+ */
+uint8_t *reserve_cryptpacket(Net_Crypto *c, int crypt_connection_id);
+
+/* Sends the lossless cryptopacket of length written in data, a room returned by reserve_cryptpacket().
+ * The room belongs to net_crypto again after this, whether it fails or not.
+ *
+ * return -1 if data could not be put in packet queue.
+ * return positive packet number if data was put into the queue.
+ *
+ * The first byte of data must be in the CRYPTO_RESERVED_PACKETS to PACKET_ID_LOSSY_RANGE_START range.
+ *
+ * congestion_control: should congestion control apply to this packet?
+ */
+int64_t commit_cryptpacket(Net_Crypto *c, int crypt_connection_id, uint8_t *data, uint16_t length,
+                           uint8_t congestion_control);
+
+/* Give back data, a room returned by reserve_cryptpacket(), without sending it. */
+void cancel_cryptpacket(Net_Crypto *c, uint8_t *data);
+
 /* Check if packet_number was received by the other side.
  *
  * packet_number must be a valid packet number of a packet sent on this connection.
@@ -335,9 +459,28 @@ int cryptpacket_received(Net_Crypto *c, int crypt_connection_id, uint32_t packet
  * return 0 on success.
  *
  * Sends a lossy cryptopacket. (first byte must in the PACKET_ID_LOSSY_RANGE_*)
+ *
+ * Can be called from any thread.
  */
 int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length);
 
+/* Queue a lossless or lossy cryptopacket to be sent by the next do_net_crypto().
+ *
+ * Unlike the other functions this one can be called from any number of threads at once
+ * while another runs do_net_crypto(): threads queueing packets don't wait for each
+ * other or for do_net_crypto(). The packets queued by one thread are sent in order.
+ *
+ * Lossless packets (first byte in the CRYPTO_RESERVED_PACKETS to PACKET_ID_LOSSY_RANGE_START
+ * range) stay queued while the connection can't send them, for example because of congestion
+ * control if congestion_control is set. Their packet numbers aren't reported, use
+ * write_cryptpacket() from the thread running do_net_crypto() when they are needed.
+ *
+ * return -1 on failure (connection not established or CRYPTO_SEND_QUEUE_SIZE packets queued).
+ * return 0 on success.
+ */
+int queue_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                      uint8_t congestion_control);
+
 /* Add a tcp relay, associating it to a crypt_connection_id.
  *
  * return 0 if it was added.
@@ -389,6 +532,13 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id);
 unsigned int crypto_connection_status(const Net_Crypto *c, int crypt_connection_id, _Bool *direct_connected,
                                       unsigned int *online_tcp_relays);
 
+/* Copy the transport figures of the connection to stats.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int crypto_connection_stats(Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats);
+
 /* Generate our public and private keys.
  *  Only call this function the first time the program starts.
  */
@@ -413,6 +563,26 @@ Net_Crypto *new_net_crypto(DHT *dht, TCP_Proxy_Info *proxy_info);
  */
 uint32_t crypto_run_interval(const Net_Crypto *c);
 
+/* Set the congestion control algorithm (one of the CONGESTION_CONTROL_* values) used by the
+ * connections created after this call.
+ *
+ * return 0 on success.
+ * return -1 if algorithm is not a known algorithm.
+ */
+int net_crypto_set_congestion_control(Net_Crypto *c, uint8_t algorithm);
+
+/* Copy the number of queued packets (elements_used) and of packets allocated
+ * but not used (elements_free) of all the connections into stats.
+ */
+void crypto_packet_pool_stats(Net_Crypto *c, Slab_Pool_Stats *stats);
+
+/* Add the sockets of the TCP relay connections to the list.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int crypto_wait_socks(Net_Crypto *c, Socket_Wait_List *list);
+
 /* Main loop. */
 void do_net_crypto(Net_Crypto *c);
 
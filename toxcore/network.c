@@ -29,19 +29,34 @@
 #include "config.h"
 #endif
 
+#if defined(NETWORK_USE_MMSG) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* recvmmsg() and sendmmsg() */
+#endif
+
 #include "logger.h"
 
 #if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
 #include <errno.h>
+#include <poll.h>
+#endif
+
+#ifdef NETWORK_USE_MMSG
+#include <netinet/udp.h> /* UDP_SEGMENT */
+#endif
+
+#ifdef NETWORK_USE_IO_URING
+#include <sys/mman.h>
 #endif
 
 #ifdef __APPLE__
 #include <mach/clock.h>
 #include <mach/mach.h>
+#include <mach/mach_time.h>
 #endif
 
 #include "network.h"
 #include "util.h"
+#include "uring.h"
 
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
 
@@ -183,6 +198,21 @@ int set_socket_reuseaddr(sock_t sock)
     return (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&set, sizeof(set)) == 0);
 }
 
+/* Enable SO_REUSEPORT on socket.
+ *
+ * return 1 on success
+ * return 0 on failure
+ */
+int set_socket_reuseport(sock_t sock)
+{
+#ifdef SO_REUSEPORT
+    int set = 1;
+    return (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *)&set, sizeof(set)) == 0);
+#else
+    return 0;
+#endif
+}
+
 /* Set socket to dual (IPv4 + IPv6 socket)
  *
  * return 1 on success
@@ -229,9 +259,19 @@ static uint64_t last_monotime;
 static uint64_t add_monotime;
 #endif
 
+static uint64_t (*monotonic_time_function)(void);
+
+void set_monotonic_time_function(uint64_t (*function)(void))
+{
+    monotonic_time_function = function;
+}
+
 /* return current monotonic time in milliseconds (ms). */
 uint64_t current_time_monotonic(void)
 {
+    if (monotonic_time_function)
+        return monotonic_time_function();
+
     uint64_t time;
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
     time = (uint64_t)GetTickCount() + add_monotime;
@@ -265,6 +305,84 @@ uint64_t current_time_monotonic(void)
     return time;
 }
 
+/* return monotonic time in nanoseconds, only used to time packet handlers. */
+static uint64_t current_time_ns(void)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000ULL
+           + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#elif defined(__APPLE__)
+    static mach_timebase_info_data_t timebase;
+
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec monotime;
+    clock_gettime(CLOCK_MONOTONIC, &monotime);
+    return 1000000000ULL * monotime.tv_sec + monotime.tv_nsec;
+#endif
+}
+
+/* send_lossy_cryptpacket() and write_cryptpacket() send on the UDP socket from whatever
+ * thread calls them (toxav sends audio and video from its own threads) while another runs
+ * do_net_crypto(), so the counters are incremented atomically. Relaxed ordering is enough
+ * since they order nothing else.
+ */
+#if defined(__GNUC__)
+#define NET_STATS_ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#define NET_STATS_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#else
+#define NET_STATS_ADD(counter, value) ((counter) += (value))
+#define NET_STATS_READ(counter) (counter)
+#endif
+
+static unsigned int handler_time_bucket(uint64_t time_ns)
+{
+    uint64_t time_us = time_ns / 1000;
+    unsigned int bucket = 0;
+
+    while (time_us) {
+        time_us >>= 1;
+        ++bucket;
+    }
+
+    if (bucket >= NET_STATS_HISTOGRAM_SIZE)
+        return NET_STATS_HISTOGRAM_SIZE - 1;
+
+    return bucket;
+}
+
+static void stats_packet_sent(Networking_Core *net, const uint8_t *data, int length)
+{
+    if (length <= 0)
+        return;
+
+    Net_Packet_Stats *stats = &net->stats[data[0]];
+    NET_STATS_ADD(stats->packets_sent, 1);
+    NET_STATS_ADD(stats->bytes_sent, length);
+}
+
+void networking_get_packet_stats(const Networking_Core *net, uint8_t packet_id, Net_Packet_Stats *stats)
+{
+    const Net_Packet_Stats *src = &net->stats[packet_id];
+    stats->packets_recv = NET_STATS_READ(src->packets_recv);
+    stats->bytes_recv = NET_STATS_READ(src->bytes_recv);
+    stats->packets_sent = NET_STATS_READ(src->packets_sent);
+    stats->bytes_sent = NET_STATS_READ(src->bytes_sent);
+    stats->packets_dropped = NET_STATS_READ(src->packets_dropped);
+
+    unsigned int i;
+
+    for (i = 0; i < NET_STATS_HISTOGRAM_SIZE; ++i) {
+        stats->handler_time[i] = NET_STATS_READ(src->handler_time[i]);
+    }
+}
+
 /* In case no logging */
 #ifndef TOX_LOGGER
 #define loglogdata(__message__, __buffer__, __buflen__, __ip_port__, __res__)
@@ -289,25 +407,26 @@ uint64_t current_time_monotonic(void)
 
 #endif /* TOX_LOGGER */
 
-/* Basic network functions:
- * Function to send packet(data) of length length to ip_port.
+/* Convert ip_port to a sockaddr usable with our socket.
+ *
+ * return size of the address written to addr.
+ * return 0 if ip_port can't be sent to from our socket.
  */
-int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+static size_t ip_port_to_sockaddr(const Networking_Core *net, IP_Port ip_port, struct sockaddr_storage *addr)
 {
     if (net->family == 0) /* Socket not initialized */
-        return -1;
+        return 0;
 
     /* socket AF_INET, but target IP NOT: can't send */
     if ((net->family == AF_INET) && (ip_port.ip.family != AF_INET))
-        return -1;
+        return 0;
 
-    struct sockaddr_storage addr;
     size_t addrsize = 0;
 
     if (ip_port.ip.family == AF_INET) {
         if (net->family == AF_INET6) {
             /* must convert to IPV4-in-IPV6 address */
-            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
 
             addrsize = sizeof(struct sockaddr_in6);
             addr6->sin6_family = AF_INET6;
@@ -326,7 +445,7 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
             addr6->sin6_flowinfo = 0;
             addr6->sin6_scope_id = 0;
         } else {
-            struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+            struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
 
             addrsize = sizeof(struct sockaddr_in);
             addr4->sin_family = AF_INET;
@@ -334,7 +453,7 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
             addr4->sin_port = ip_port.port;
         }
     } else if (ip_port.ip.family == AF_INET6) {
-        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
 
         addrsize = sizeof(struct sockaddr_in6);
         addr6->sin6_family = AF_INET6;
@@ -345,51 +464,29 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
         addr6->sin6_scope_id = 0;
     } else {
         /* unknown address type*/
-        return -1;
+        return 0;
     }
 
-    int res = sendto(net->sock, (char *) data, length, 0, (struct sockaddr *)&addr, addrsize);
-
-    loglogdata("O=>", data, length, ip_port, res);
-
-    return res;
+    return addrsize;
 }
 
-/* Function to receive data
- *  ip and port of sender is put into ip_port.
- *  Packet data is put into data.
- *  Packet length is put into length.
+/* Convert a received sockaddr to ip_port.
+ *
+ * return 0 on success.
+ * return -1 if the address family is not supported.
  */
-static int receivepacket(sock_t sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+static int sockaddr_to_ip_port(const struct sockaddr_storage *addr, IP_Port *ip_port)
 {
     memset(ip_port, 0, sizeof(IP_Port));
-    struct sockaddr_storage addr;
-#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
-    int addrlen = sizeof(addr);
-#else
-    socklen_t addrlen = sizeof(addr);
-#endif
-    *length = 0;
-    int fail_or_len = recvfrom(sock, (char *) data, MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
-
-    if (fail_or_len < 0) {
-
-        LOGGER_SCOPE( if ((fail_or_len < 0) && (errno != EWOULDBLOCK))
-                      LOGGER_ERROR("Unexpected error reading from socket: %u, %s\n", errno, strerror(errno)); );
-
-        return -1; /* Nothing received. */
-    }
-
-    *length = (uint32_t)fail_or_len;
 
-    if (addr.ss_family == AF_INET) {
-        struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *addr_in = (const struct sockaddr_in *)addr;
 
         ip_port->ip.family = addr_in->sin_family;
         ip_port->ip.ip4.in_addr = addr_in->sin_addr;
         ip_port->port = addr_in->sin_port;
-    } else if (addr.ss_family == AF_INET6) {
-        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)&addr;
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr_in6 = (const struct sockaddr_in6 *)addr;
         ip_port->ip.family = addr_in6->sin6_family;
         ip_port->ip.ip6.in6_addr = addr_in6->sin6_addr;
         ip_port->port = addr_in6->sin6_port;
@@ -401,181 +498,1185 @@ static int receivepacket(sock_t sock, IP_Port *ip_port, uint8_t *data, uint32_t
     } else
         return -1;
 
-    loglogdata("=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
-
     return 0;
 }
 
-void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object)
-{
-    net->packethandlers[byte].function = cb;
-    net->packethandlers[byte].object = object;
-}
+#ifdef NETWORK_USE_MMSG
 
-void networking_poll(Networking_Core *net)
-{
-    if (net->family == 0) /* Socket not initialized */
-        return;
+struct Net_Recv_Batch {
+    struct mmsghdr msgs[NET_BATCH_SIZE];
+    struct iovec iovecs[NET_BATCH_SIZE];
+    struct sockaddr_storage addrs[NET_BATCH_SIZE];
+    uint8_t data[NET_BATCH_SIZE][MAX_UDP_PACKET_SIZE];
+};
 
-    unix_time_update();
+struct Net_Send_Queue {
+    struct mmsghdr msgs[NET_BATCH_SIZE];
+    struct iovec iovecs[NET_BATCH_SIZE];
+    struct sockaddr_storage addrs[NET_BATCH_SIZE];
+    uint8_t data[NET_BATCH_SIZE][MAX_UDP_PACKET_SIZE];
+    unsigned int count;
+};
 
-    IP_Port ip_port;
-    uint8_t data[MAX_UDP_PACKET_SIZE];
-    uint32_t length;
+#endif /* NETWORK_USE_MMSG */
 
-    while (receivepacket(net->sock, &ip_port, data, &length) != -1) {
-        if (length < 1) continue;
+#ifdef NETWORK_USE_IO_URING
 
-        if (!(net->packethandlers[data[0]].function)) {
-            LOGGER_WARNING("[%02u] -- Packet has no handler", data[0]);
-            continue;
-        }
+#ifdef IORING_RECV_MULTISHOT
+/* Buffers the multishot receive picks from, as many as fit in the completion queue. */
+#define NET_URING_BUFS (NET_BATCH_SIZE * 2)
+/* Each buffer holds a struct io_uring_recvmsg_out, the address and then the packet. */
+#define NET_URING_BUF_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + MAX_UDP_PACKET_SIZE)
+#endif
 
-        net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length);
-    }
-}
+/* user_data of the multishot receive, the single receives use their index. */
+#define NET_URING_MULTISHOT NET_BATCH_SIZE
 
-#ifndef VANILLA_NACL
-/* Used for sodium_init() */
-#include <sodium.h>
+/* NET_BATCH_SIZE receives are kept posted on the socket, entry i receives into data[i].
+ * On kernels with multishot receives (linux 6.0+), a single one is posted instead,
+ * which keeps receiving into the buffers of buf_ring until it is stopped.
+ */
+struct Net_Uring_Recv {
+    Uring *ring;
+    struct msghdr msgs[NET_BATCH_SIZE];
+    struct iovec iovecs[NET_BATCH_SIZE];
+    struct sockaddr_storage addrs[NET_BATCH_SIZE];
+    uint8_t data[NET_BATCH_SIZE][MAX_UDP_PACKET_SIZE];
+
+#ifdef IORING_RECV_MULTISHOT
+    _Bool multishot;
+    struct msghdr multishot_msg;
+    struct io_uring_buf_ring *buf_ring; /* NULL if not registered with the ring. */
+    uint16_t buf_tail;
+    uint8_t *bufs;
 #endif
+};
 
-uint8_t at_startup_ran = 0;
-int networking_at_startup(void)
+#endif /* NETWORK_USE_IO_URING */
+
+/* Basic network functions:
+ * Function to send packet(data) of length length to ip_port.
+ */
+int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
 {
-    if (at_startup_ran != 0)
-        return 0;
+    struct sockaddr_storage addr;
+    size_t addrsize = ip_port_to_sockaddr(net, ip_port, &addr);
 
-#ifndef VANILLA_NACL
+    if (addrsize == 0)
+        return -1;
 
-#ifdef USE_RANDOMBYTES_STIR
-    randombytes_stir();
-#else
-    sodium_init();
-#endif /*USE_RANDOMBYTES_STIR*/
+    if (net->send_hook) {
+        int res = net->send_hook(net->send_hook_object, ip_port, data, length);
+        loglogdata("O=>", data, length, ip_port, res);
+        stats_packet_sent(net, data, res);
+        return res;
+    }
 
-#endif/*VANILLA_NACL*/
+#ifdef NETWORK_USE_MMSG
 
-#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
-    WSADATA wsaData;
+    if (net->send_queue && length <= MAX_UDP_PACKET_SIZE) {
+        struct Net_Send_Queue *queue = net->send_queue;
 
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != NO_ERROR)
-        return -1;
+        if (queue->count == NET_BATCH_SIZE)
+            networking_flush(net);
 
-#endif
-    srand((uint32_t)current_time_actual());
-    at_startup_ran = 1;
-    return 0;
-}
+        if (queue->count == NET_BATCH_SIZE) {
+            /* Still full: the socket buffer is too, drop the packet like sendto() would. */
+            loglogdata("O=>", data, length, ip_port, -1);
+            return -1;
+        }
 
-/* TODO: Put this somewhere
-static void at_shutdown(void)
-{
-#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
-    WSACleanup();
-#endif
-}
-*/
+        unsigned int i = queue->count;
+        memcpy(&queue->addrs[i], &addr, addrsize);
+        memcpy(queue->data[i], data, length);
+        queue->iovecs[i].iov_len = length;
+        queue->msgs[i].msg_hdr.msg_namelen = addrsize;
+        ++queue->count;
 
-/* Initialize networking.
- * Added for reverse compatibility with old new_networking calls.
- */
-Networking_Core *new_networking(IP ip, uint16_t port)
-{
-    return new_networking_ex(ip, port, port + (TOX_PORTRANGE_TO - TOX_PORTRANGE_FROM), 0);
+        loglogdata("O=>", data, length, ip_port, length);
+        stats_packet_sent(net, data, length);
+        return length;
+    }
+
+#endif /* NETWORK_USE_MMSG */
+
+    int res = sendto(net->sock, (char *) data, length, 0, (struct sockaddr *)&addr, addrsize);
+
+    loglogdata("O=>", data, length, ip_port, res);
+    stats_packet_sent(net, data, res);
+
+    return res;
 }
 
-/* Initialize networking.
- * Bind to ip and port.
- * ip must be in network order EX: 127.0.0.1 = (7F000001).
- * port is in host byte order (this means don't worry about it).
- *
- *  return Networking_Core object if no problems
- *  return NULL if there are problems.
+#ifdef NETWORK_USE_MMSG
+
+/* Maximum number of packets, and of bytes, sent as one buffer with UDP GSO. */
+#define NET_GSO_MAX_SEGMENTS 64
+#define NET_GSO_MAX_SIZE 65000
+
+/* Send count packets to addr with sendmmsg(), NET_BATCH_SIZE at a time.
+ * With UDP GSO each run of packets of the same length (the last one can be shorter)
+ * is sent as one buffer that the kernel splits.
  *
- * If error is non NULL it is set to 0 if no issues, 1 if socket related error, 2 if other.
+ * return number of packets sent, starting with the first.
  */
-Networking_Core *new_networking_ex(IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error)
+static unsigned int send_batch_mmsg(Networking_Core *net, struct sockaddr_storage *addr, size_t addrsize,
+                                    const uint8_t *const *data, const uint16_t *length, unsigned int count)
 {
-    /* If both from and to are 0, use default port range
-     * If one is 0 and the other is non-0, use the non-0 value as only port
-     * If from > to, swap
-     */
-    if (port_from == 0 && port_to == 0) {
-        port_from = TOX_PORTRANGE_FROM;
-        port_to = TOX_PORTRANGE_TO;
-    } else if (port_from == 0 && port_to != 0) {
-        port_from = port_to;
-    } else if (port_from != 0 && port_to == 0) {
-        port_to = port_from;
-    } else if (port_from > port_to) {
-        uint16_t temp = port_from;
-        port_from = port_to;
-        port_to = temp;
-    }
+    struct mmsghdr msgs[NET_BATCH_SIZE];
+    struct iovec iovecs[NET_BATCH_SIZE];
+    unsigned int segments[NET_BATCH_SIZE];
+#ifdef UDP_SEGMENT
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } controls[NET_BATCH_SIZE];
+#endif
+    unsigned int sent = 0;
 
-    if (error)
-        *error = 2;
+    while (sent < count) {
+        unsigned int num_msgs = 0, i = sent;
 
-    /* maybe check for invalid IPs like 224+.x.y.z? if there is any IP set ever */
-    if (ip.family != AF_INET && ip.family != AF_INET6) {
-#ifdef DEBUG
-        fprintf(stderr, "Invalid address family: %u\n", ip.family);
-#endif
-        return NULL;
-    }
+        while (i < count && i - sent < NET_BATCH_SIZE) {
+            struct msghdr *hdr = &msgs[num_msgs].msg_hdr;
+            memset(hdr, 0, sizeof(struct msghdr));
+            hdr->msg_name = addr;
+            hdr->msg_namelen = addrsize;
+            hdr->msg_iov = &iovecs[i - sent];
 
-    if (networking_at_startup() != 0)
-        return NULL;
+            unsigned int n = 1;
+#ifdef UDP_SEGMENT
 
-    Networking_Core *temp = calloc(1, sizeof(Networking_Core));
+            if (net->udp_gso) {
+                size_t total = length[i];
 
-    if (temp == NULL)
-        return NULL;
+                while (i + n < count && i + n - sent < NET_BATCH_SIZE && n < NET_GSO_MAX_SEGMENTS
+                        && length[i + n] <= length[i] && total + length[i + n] <= NET_GSO_MAX_SIZE) {
+                    total += length[i + n];
+                    ++n;
 
-    temp->family = ip.family;
-    temp->port = 0;
+                    if (length[i + n - 1] < length[i])
+                        break;
+                }
 
-    /* Initialize our socket. */
-    /* add log message what we're creating */
-    temp->sock = socket(temp->family, SOCK_DGRAM, IPPROTO_UDP);
+                if (n > 1) {
+                    hdr->msg_control = controls[num_msgs].buf;
+                    hdr->msg_controllen = sizeof(controls[num_msgs].buf);
+
+                    struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+                    cmsg->cmsg_level = IPPROTO_UDP;
+                    cmsg->cmsg_type = UDP_SEGMENT;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                    uint16_t gso_size = length[i];
+                    memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(uint16_t));
+                }
+            }
 
-    /* Check for socket error. */
-    if (!sock_valid(temp->sock)) {
-#ifdef DEBUG
-        fprintf(stderr, "Failed to get a socket?! %u, %s\n", errno, strerror(errno));
 #endif
-        free(temp);
+            unsigned int j;
 
-        if (error)
-            *error = 1;
+            for (j = 0; j < n; ++j) {
+                iovecs[i - sent + j].iov_base = (void *)data[i + j];
+                iovecs[i - sent + j].iov_len = length[i + j];
+            }
 
-        return NULL;
-    }
+            hdr->msg_iovlen = n;
+            segments[num_msgs] = n;
+            ++num_msgs;
+            i += n;
+        }
 
-    /* Functions to increase the size of the send and receive UDP buffers.
-     */
-    int n = 1024 * 1024 * 2;
-    setsockopt(temp->sock, SOL_SOCKET, SO_RCVBUF, (char *)&n, sizeof(n));
-    setsockopt(temp->sock, SOL_SOCKET, SO_SNDBUF, (char *)&n, sizeof(n));
+        int res = sendmmsg(net->sock, msgs, num_msgs, 0);
 
-    /* Enable broadcast on socket */
-    int broadcast = 1;
-    setsockopt(temp->sock, SOL_SOCKET, SO_BROADCAST, (char *)&broadcast, sizeof(broadcast));
+        if (res > 0) {
+            int j;
 
-    /* iOS UDP sockets are weird and apparently can SIGPIPE */
-    if (!set_socket_nosigpipe(temp->sock)) {
-        kill_networking(temp);
+            for (j = 0; j < res; ++j) {
+                sent += segments[j];
+            }
 
-        if (error)
-            *error = 1;
+            continue;
+        }
 
-        return NULL;
-    }
+        if (res < 0 && errno == ENOSYS) {
+            /* Kernel without sendmmsg(), send the rest one by one. */
+            for (; sent < count; ++sent) {
+                if (sendto(net->sock, (const char *) data[sent], length[sent], 0, (struct sockaddr *)addr,
+                           addrsize) != length[sent])
+                    break;
+            }
 
-    /* Set socket nonblocking. */
-    if (!set_socket_nonblock(temp->sock)) {
-        kill_networking(temp);
+            break;
+        }
+
+#ifdef UDP_SEGMENT
+
+        if (res < 0 && segments[0] > 1 && (errno == EIO || errno == EINVAL)) {
+            /* The route can't do segmentation (EIO when the device has no checksum offload). */
+            LOGGER_WARNING("Disabling UDP GSO: %u, %s\n", errno, strerror(errno));
+            net->udp_gso = 0;
+            continue;
+        }
+
+#endif
+        LOGGER_SCOPE( if (errno != EWOULDBLOCK)
+                      LOGGER_ERROR("Unexpected error sending batch: %u, %s\n", errno, strerror(errno)); );
+        break;
+    }
+
+    return sent;
+}
+
+#endif /* NETWORK_USE_MMSG */
+
+/* Send count packets to ip_port, packet i being data[i] of length[i].
+ *
+ * return -1 if ip_port is invalid.
+ * return number of packets sent, starting with the first.
+ */
+int sendpacket_batch(Networking_Core *net, IP_Port ip_port, const uint8_t *const *data, const uint16_t *length,
+                     unsigned int count)
+{
+    struct sockaddr_storage addr;
+    size_t addrsize = ip_port_to_sockaddr(net, ip_port, &addr);
+
+    if (addrsize == 0)
+        return -1;
+
+    unsigned int sent = 0;
+
+#ifdef NETWORK_USE_MMSG
+
+    if (!net->send_hook && !net->send_queue) {
+        sent = send_batch_mmsg(net, &addr, addrsize, data, length, count);
+
+        unsigned int i;
+
+        for (i = 0; i < sent; ++i) {
+            loglogdata("O=>", data[i], length[i], ip_port, length[i]);
+            stats_packet_sent(net, data[i], length[i]);
+        }
+
+        return sent;
+    }
+
+#endif /* NETWORK_USE_MMSG */
+
+    for (; sent < count; ++sent) {
+        if (sendpacket(net, ip_port, data[sent], length[sent]) != length[sent])
+            break;
+    }
+
+    return sent;
+}
+
+/* Send all packets in the outgoing packet queue. */
+void networking_flush(Networking_Core *net)
+{
+#ifdef NETWORK_USE_MMSG
+    struct Net_Send_Queue *queue = net->send_queue;
+
+    if (!queue)
+        return;
+
+    unsigned int sent = 0;
+
+    while (sent < queue->count) {
+        int res = sendmmsg(net->sock, queue->msgs + sent, queue->count - sent, 0);
+
+        if (res > 0) {
+            sent += res;
+            continue;
+        }
+
+        if (res == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* The socket buffer is full, keep the rest queued for the next flush. */
+            unsigned int left = queue->count - sent;
+            unsigned int i;
+
+            for (i = 0; sent != 0 && i < left; ++i) {
+                memcpy(queue->data[i], queue->data[sent + i], queue->iovecs[sent + i].iov_len);
+                queue->addrs[i] = queue->addrs[sent + i];
+                queue->iovecs[i].iov_len = queue->iovecs[sent + i].iov_len;
+                queue->msgs[i].msg_hdr.msg_namelen = queue->msgs[sent + i].msg_hdr.msg_namelen;
+            }
+
+            queue->count = left;
+            return;
+        }
+
+        if (errno == ENOSYS) {
+            /* Kernel without sendmmsg(), send the rest one by one. */
+            for (; sent < queue->count; ++sent) {
+                sendto(net->sock, (char *) queue->data[sent], queue->iovecs[sent].iov_len, 0,
+                       (struct sockaddr *)&queue->addrs[sent], queue->msgs[sent].msg_hdr.msg_namelen);
+            }
+
+            break;
+        }
+
+        /* Drop the packet that failed (like sendto() would) and go on with the rest. */
+        LOGGER_ERROR("Unexpected error sending batch: %u, %s\n", errno, strerror(errno));
+        ++sent;
+    }
+
+    queue->count = 0;
+#endif /* NETWORK_USE_MMSG */
+}
+
+/* Enable or disable the outgoing packet queue.
+ *
+ * return 0 on success.
+ * return -1 on failure (batched sending not supported on this platform).
+ */
+int networking_set_send_queue(Networking_Core *net, uint8_t enabled)
+{
+#ifdef NETWORK_USE_MMSG
+
+    if (!enabled) {
+        networking_flush(net);
+        free(net->send_queue);
+        net->send_queue = NULL;
+        return 0;
+    }
+
+    if (net->send_queue)
+        return 0;
+
+    struct Net_Send_Queue *queue = calloc(1, sizeof(struct Net_Send_Queue));
+
+    if (!queue)
+        return -1;
+
+    unsigned int i;
+
+    for (i = 0; i < NET_BATCH_SIZE; ++i) {
+        queue->iovecs[i].iov_base = queue->data[i];
+        queue->msgs[i].msg_hdr.msg_iov = &queue->iovecs[i];
+        queue->msgs[i].msg_hdr.msg_iovlen = 1;
+        queue->msgs[i].msg_hdr.msg_name = &queue->addrs[i];
+    }
+
+    net->send_queue = queue;
+    return 0;
+#else
+
+    if (!enabled)
+        return 0;
+
+    return -1;
+#endif /* NETWORK_USE_MMSG */
+}
+
+/* Function to receive data
+ *  ip and port of sender is put into ip_port.
+ *  Packet data is put into data.
+ *  Packet length is put into length.
+ */
+static int receivepacket(sock_t sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+{
+    memset(ip_port, 0, sizeof(IP_Port));
+    struct sockaddr_storage addr;
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+    int addrlen = sizeof(addr);
+#else
+    socklen_t addrlen = sizeof(addr);
+#endif
+    *length = 0;
+    int fail_or_len = recvfrom(sock, (char *) data, MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
+
+    if (fail_or_len < 0) {
+
+        LOGGER_SCOPE( if ((fail_or_len < 0) && (errno != EWOULDBLOCK))
+                      LOGGER_ERROR("Unexpected error reading from socket: %u, %s\n", errno, strerror(errno)); );
+
+        return -1; /* Nothing received. */
+    }
+
+    *length = (uint32_t)fail_or_len;
+
+    if (sockaddr_to_ip_port(&addr, ip_port) == -1)
+        return -1;
+
+    loglogdata("=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
+
+    return 0;
+}
+
+#ifdef NETWORK_USE_MMSG
+
+static struct Net_Recv_Batch *new_recv_batch(void)
+{
+    struct Net_Recv_Batch *batch = calloc(1, sizeof(struct Net_Recv_Batch));
+
+    if (!batch)
+        return NULL;
+
+    unsigned int i;
+
+    for (i = 0; i < NET_BATCH_SIZE; ++i) {
+        batch->iovecs[i].iov_base = batch->data[i];
+        batch->iovecs[i].iov_len = MAX_UDP_PACKET_SIZE;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+    }
+
+    return batch;
+}
+
+/* Receive up to NET_BATCH_SIZE packets with one recvmmsg() call.
+ *
+ * return number of packets received.
+ * return -1 if nothing was received.
+ */
+static int receivepacket_batch(sock_t sock, struct Net_Recv_Batch *batch)
+{
+    unsigned int i;
+
+    for (i = 0; i < NET_BATCH_SIZE; ++i) {
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        batch->msgs[i].msg_hdr.msg_flags = 0;
+    }
+
+    int res = recvmmsg(sock, batch->msgs, NET_BATCH_SIZE, MSG_DONTWAIT, NULL);
+
+    if (res <= 0) {
+
+        LOGGER_SCOPE( if ((res < 0) && (errno != EWOULDBLOCK))
+                      LOGGER_ERROR("Unexpected error reading from socket: %u, %s\n", errno, strerror(errno)); );
+
+        return -1;
+    }
+
+    return res;
+}
+
+#endif /* NETWORK_USE_MMSG */
+
+#ifdef NETWORK_USE_IO_URING
+
+/* return 0 on success.
+ * return -1 if the submission queue is full.
+ */
+static int uring_post_recv(struct Net_Uring_Recv *urecv, sock_t sock, unsigned int i)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(urecv->ring);
+
+    if (sqe == NULL)
+        return -1;
+
+    urecv->msgs[i].msg_namelen = sizeof(struct sockaddr_storage);
+    urecv->msgs[i].msg_flags = 0;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)&urecv->msgs[i];
+    sqe->len = 1;
+    sqe->user_data = i;
+    return 0;
+}
+
+#ifdef IORING_RECV_MULTISHOT
+
+/* return 0 on success.
+ * return -1 if the submission queue is full.
+ */
+static int uring_post_multishot(struct Net_Uring_Recv *urecv, sock_t sock)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(urecv->ring);
+
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)&urecv->multishot_msg;
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = NET_URING_MULTISHOT;
+    return 0;
+}
+
+/* Give buffer bid back to the kernel. */
+static void uring_recycle_buf(struct Net_Uring_Recv *urecv, uint16_t bid)
+{
+    /* The tail of the ring overlays the resv field of the first entry, leave it alone. */
+    struct io_uring_buf *buf = &urecv->buf_ring->bufs[urecv->buf_tail & (NET_URING_BUFS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(urecv->bufs + bid * NET_URING_BUF_SIZE);
+    buf->len = NET_URING_BUF_SIZE;
+    buf->bid = bid;
+
+    ++urecv->buf_tail;
+    __atomic_store_n(&urecv->buf_ring->tail, urecv->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_multishot_free(struct Net_Uring_Recv *urecv)
+{
+    if (urecv->buf_ring != NULL)
+        munmap(urecv->buf_ring, NET_URING_BUFS * sizeof(struct io_uring_buf));
+
+    free(urecv->bufs);
+    urecv->buf_ring = NULL;
+    urecv->bufs = NULL;
+}
+
+/* Register NET_URING_BUFS buffers with the ring and post a multishot receive on sock.
+ *
+ * return 0 on success.
+ * return -1 if the kernel doesn't support it.
+ */
+static int uring_multishot_init(struct Net_Uring_Recv *urecv, sock_t sock)
+{
+    /* The buffer ring must be page aligned. */
+    void *buf_ring = mmap(NULL, NET_URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (buf_ring == MAP_FAILED)
+        return -1;
+
+    urecv->buf_ring = buf_ring;
+    urecv->bufs = malloc(NET_URING_BUFS * NET_URING_BUF_SIZE);
+
+    if (urecv->bufs == NULL) {
+        uring_multishot_free(urecv);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = NET_URING_BUFS;
+    reg.bgid = 0;
+
+    if (uring_register(urecv->ring, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        uring_multishot_free(urecv);
+        return -1;
+    }
+
+    uint16_t bid;
+
+    for (bid = 0; bid < NET_URING_BUFS; ++bid) {
+        uring_recycle_buf(urecv, bid);
+    }
+
+    urecv->multishot_msg.msg_namelen = sizeof(struct sockaddr_storage);
+
+    if (uring_post_multishot(urecv, sock) == -1 || uring_get_events(urecv->ring) == -1) {
+        uring_register(urecv->ring, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        uring_multishot_free(urecv);
+        return -1;
+    }
+
+    /* Kernels with buffer rings but without multishot receives (linux 5.19) fail it right away. */
+    struct io_uring_cqe *cqe = uring_peek_cqe(urecv->ring);
+
+    if (cqe && cqe->user_data == NET_URING_MULTISHOT && cqe->res < 0) {
+        uring_cqe_seen(urecv->ring);
+        uring_register(urecv->ring, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        uring_multishot_free(urecv);
+        return -1;
+    }
+
+    urecv->multishot = 1;
+    return 0;
+}
+
+#endif /* IORING_RECV_MULTISHOT */
+
+static void kill_uring_recv(struct Net_Uring_Recv *urecv)
+{
+    if (urecv == NULL)
+        return;
+
+    /* Closing the ring cancels the receives still posted. */
+    kill_uring(urecv->ring);
+#ifdef IORING_RECV_MULTISHOT
+    uring_multishot_free(urecv);
+#endif
+    free(urecv);
+}
+
+/* Set up an io_uring with a multishot receive or NET_BATCH_SIZE receives posted on sock.
+ *
+ * return NULL if io_uring is not available.
+ */
+static struct Net_Uring_Recv *new_uring_recv(sock_t sock)
+{
+    struct Net_Uring_Recv *urecv = calloc(1, sizeof(struct Net_Uring_Recv));
+
+    if (!urecv)
+        return NULL;
+
+    urecv->ring = new_uring(NET_BATCH_SIZE);
+
+    if (!urecv->ring) {
+        free(urecv);
+        return NULL;
+    }
+
+#ifdef IORING_RECV_MULTISHOT
+
+    if (uring_multishot_init(urecv, sock) == 0)
+        return urecv;
+
+#endif
+
+    unsigned int i;
+
+    for (i = 0; i < NET_BATCH_SIZE; ++i) {
+        urecv->iovecs[i].iov_base = urecv->data[i];
+        urecv->iovecs[i].iov_len = MAX_UDP_PACKET_SIZE;
+        urecv->msgs[i].msg_iov = &urecv->iovecs[i];
+        urecv->msgs[i].msg_iovlen = 1;
+        urecv->msgs[i].msg_name = &urecv->addrs[i];
+
+        if (uring_post_recv(urecv, sock, i) == -1) {
+            kill_uring_recv(urecv);
+            return NULL;
+        }
+    }
+
+    if (uring_submit(urecv->ring) != NET_BATCH_SIZE) {
+        kill_uring_recv(urecv);
+        return NULL;
+    }
+
+    return urecv;
+}
+
+#ifdef IORING_RECV_MULTISHOT
+
+/* Handle the packets the multishot receive put in our buffers and give the buffers
+ * back, until the socket is empty.
+ *
+ * return 0 on success.
+ * return -1 if the receive could not be posted again.
+ */
+static int networking_poll_uring_multishot(Networking_Core *net)
+{
+    struct Net_Uring_Recv *urecv = net->uring_recv;
+    struct io_uring_cqe *cqe;
+    IP_Port ip_port;
+    unsigned int handled;
+
+    /* The kernel posts what it received meanwhile when asked for events,
+     * so keep going until a round finds nothing.
+     */
+    do {
+        _Bool stopped = 0;
+        handled = 0;
+
+        while ((cqe = uring_peek_cqe(urecv->ring))) {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            uint32_t flags = cqe->flags;
+            uring_cqe_seen(urecv->ring);
+
+            if (user_data != NET_URING_MULTISHOT)
+                continue;
+
+            ++handled;
+
+            /* The kernel stops the receive, for example when it runs out of buffers. */
+            if (!(flags & IORING_CQE_F_MORE))
+                stopped = 1;
+
+            if (res < 0 || !(flags & IORING_CQE_F_BUFFER)) {
+                LOGGER_SCOPE( if (res < 0 && res != -ENOBUFS)
+                              LOGGER_ERROR("Unexpected error reading from socket: %u, %s\n", -res, strerror(-res)); );
+                continue;
+            }
+
+            uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            uint8_t *buf = urecv->bufs + bid * NET_URING_BUF_SIZE;
+            struct io_uring_recvmsg_out out;
+            struct sockaddr_storage addr;
+            memcpy(&out, buf, sizeof(out));
+            memcpy(&addr, buf + sizeof(out), sizeof(addr));
+            uint8_t *data = buf + sizeof(out) + sizeof(addr);
+
+            if (!(out.flags & MSG_TRUNC) && out.namelen <= sizeof(addr)
+                    && sockaddr_to_ip_port(&addr, &ip_port) != -1) {
+                loglogdata("=>O", data, MAX_UDP_PACKET_SIZE, ip_port, out.payloadlen);
+                networking_handle_packet(net, ip_port, data, out.payloadlen);
+            }
+
+            uring_recycle_buf(urecv, bid);
+        }
+
+        if (stopped && uring_post_multishot(urecv, net->sock) == -1)
+            return -1;
+
+        if (uring_get_events(urecv->ring) == -1)
+            return -1;
+    } while (handled != 0);
+
+    return 0;
+}
+
+#endif /* IORING_RECV_MULTISHOT */
+
+/* Handle the packets the kernel received into our buffers and post the receives
+ * again, until the socket is empty.
+ *
+ * return 0 on success.
+ * return -1 if the receives could not be posted again.
+ */
+static int networking_poll_uring(Networking_Core *net)
+{
+    struct Net_Uring_Recv *urecv = net->uring_recv;
+    struct io_uring_cqe *cqe;
+    IP_Port ip_port;
+    unsigned int handled;
+    _Bool empty = 0;
+
+#ifdef IORING_RECV_MULTISHOT
+
+    if (urecv->multishot)
+        return networking_poll_uring_multishot(net);
+
+#endif
+
+    /* Receives posted again complete inside uring_submit() when the socket
+     * still has packets waiting, so keep going until a round finds none.
+     */
+    do {
+        handled = 0;
+
+        while ((cqe = uring_peek_cqe(urecv->ring))) {
+            unsigned int i = cqe->user_data;
+            int res = cqe->res;
+            uring_cqe_seen(urecv->ring);
+
+            if (i >= NET_BATCH_SIZE)
+                continue;
+
+            if (res < 0) {
+                if (res == -EAGAIN)
+                    empty = 1;
+
+                LOGGER_SCOPE( if (res != -EAGAIN)
+                              LOGGER_ERROR("Unexpected error reading from socket: %u, %s\n", -res, strerror(-res)); );
+            } else if (sockaddr_to_ip_port(&urecv->addrs[i], &ip_port) != -1) {
+                loglogdata("=>O", urecv->data[i], MAX_UDP_PACKET_SIZE, ip_port, res);
+                networking_handle_packet(net, ip_port, urecv->data[i], res);
+            }
+
+            if (uring_post_recv(urecv, net->sock, i) == -1)
+                return -1;
+
+            ++handled;
+        }
+
+        if (uring_submit(urecv->ring) == -1)
+            return -1;
+    } while (handled != 0 && !empty);
+
+    return 0;
+}
+
+#endif /* NETWORK_USE_IO_URING */
+
+void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object)
+{
+    net->packethandlers[byte].function = cb;
+    net->packethandlers[byte].object = object;
+}
+
+/* Call the handler registered for the packet as if it was received on our socket.
+ */
+void networking_handle_packet(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint32_t length)
+{
+    if (length < 1)
+        return;
+
+    Net_Packet_Stats *stats = &net->stats[data[0]];
+    NET_STATS_ADD(stats->packets_recv, 1);
+    NET_STATS_ADD(stats->bytes_recv, length);
+
+    if (net->recv_hook)
+        net->recv_hook(net->recv_hook_object, ip_port, data, length);
+
+    if (!(net->packethandlers[data[0]].function)) {
+        LOGGER_WARNING("[%02u] -- Packet has no handler", data[0]);
+        NET_STATS_ADD(stats->packets_dropped, 1);
+        return;
+    }
+
+    uint64_t start = current_time_ns();
+    net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length);
+    NET_STATS_ADD(stats->handler_time[handler_time_bucket(current_time_ns() - start)], 1);
+}
+
+void networking_set_recv_hook(Networking_Core *net, packet_handler_callback cb, void *object)
+{
+    net->recv_hook = cb;
+    net->recv_hook_object = object;
+}
+
+void networking_set_send_hook(Networking_Core *net, packet_handler_callback cb, void *object)
+{
+    net->send_hook = cb;
+    net->send_hook_object = object;
+}
+
+void networking_poll(Networking_Core *net)
+{
+    unix_time_update();
+    networking_poll_packets(net);
+}
+
+void networking_poll_packets(Networking_Core *net)
+{
+    if (net->family == 0 || !sock_valid(net->sock)) /* Socket not initialized */
+        return;
+
+    networking_flush(net);
+
+#ifdef NETWORK_USE_IO_URING
+
+    if (net->uring_recv) {
+        if (networking_poll_uring(net) == 0) {
+            networking_flush(net);
+            return;
+        }
+
+        /* Ring broken, use the other receive paths from now on. */
+        kill_uring_recv(net->uring_recv);
+        net->uring_recv = NULL;
+    }
+
+#endif /* NETWORK_USE_IO_URING */
+
+    IP_Port ip_port;
+
+#ifdef NETWORK_USE_MMSG
+
+    if (net->recv_batch) {
+        struct Net_Recv_Batch *batch = net->recv_batch;
+        int count;
+
+        do {
+            count = receivepacket_batch(net->sock, batch);
+
+            if (count == -1 && errno == ENOSYS) {
+                /* Kernel without recvmmsg(), use the per packet path from now on. */
+                free(net->recv_batch);
+                net->recv_batch = NULL;
+                break;
+            }
+
+            int i;
+
+            for (i = 0; i < count; ++i) {
+                if (sockaddr_to_ip_port(&batch->addrs[i], &ip_port) == -1)
+                    continue;
+
+                loglogdata("=>O", batch->data[i], MAX_UDP_PACKET_SIZE, ip_port, batch->msgs[i].msg_len);
+                networking_handle_packet(net, ip_port, batch->data[i], batch->msgs[i].msg_len);
+            }
+        } while (count == NET_BATCH_SIZE);
+
+        if (net->recv_batch) {
+            networking_flush(net);
+            return;
+        }
+    }
+
+#endif /* NETWORK_USE_MMSG */
+
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+    uint32_t length;
+
+    while (receivepacket(net->sock, &ip_port, data, &length) != -1) {
+        networking_handle_packet(net, ip_port, data, length);
+    }
+
+    networking_flush(net);
+}
+
+int socket_wait_list_add(Socket_Wait_List *list, sock_t sock, uint8_t events)
+{
+    if (!sock_valid(sock))
+        return -1;
+
+    if (list->length == list->capacity) {
+        unsigned int capacity = list->capacity ? list->capacity * 2 : 8;
+        Wait_Socket *temp = realloc(list->socks, capacity * sizeof(Wait_Socket));
+
+        if (temp == NULL)
+            return -1;
+
+        list->socks = temp;
+        list->capacity = capacity;
+    }
+
+    list->socks[list->length].sock = sock;
+    list->socks[list->length].events = events;
+    ++list->length;
+    return 0;
+}
+
+void socket_wait_list_clear(Socket_Wait_List *list)
+{
+    list->length = 0;
+}
+
+void socket_wait_list_free(Socket_Wait_List *list)
+{
+    free(list->socks);
+    list->socks = NULL;
+    list->length = 0;
+    list->capacity = 0;
+}
+
+int networking_wait_socks(const Networking_Core *net, Socket_Wait_List *list)
+{
+    if (net->family == 0 || !sock_valid(net->sock)) /* Socket not initialized */
+        return 0;
+
+#ifdef NETWORK_USE_IO_URING
+
+    /* The kernel reads the packets itself, the ring becomes readable when it completed a receive. */
+    if (net->uring_recv)
+        return socket_wait_list_add(list, net->uring_recv->ring->fd, SOCKET_WAIT_READ);
+
+#endif /* NETWORK_USE_IO_URING */
+
+    return socket_wait_list_add(list, net->sock, SOCKET_WAIT_READ);
+}
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+
+int socket_wait(const Socket_Wait_List *list, uint32_t timeout_ms)
+{
+    if (list->length == 0) {
+        Sleep(timeout_ms);
+        return 0;
+    }
+
+    /* WSAPoll() needs Vista so use select(), which only takes the first FD_SETSIZE sockets. */
+    fd_set readfds, writefds;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    unsigned int i;
+
+    for (i = 0; i < list->length && i < FD_SETSIZE; ++i) {
+        if (list->socks[i].events & SOCKET_WAIT_READ)
+            FD_SET(list->socks[i].sock, &readfds);
+
+        if (list->socks[i].events & SOCKET_WAIT_WRITE)
+            FD_SET(list->socks[i].sock, &writefds);
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+    int res = select(0, &readfds, &writefds, NULL, &timeout);
+
+    if (res == SOCKET_ERROR)
+        return -1;
+
+    return res;
+}
+
+#else
+
+int socket_wait(const Socket_Wait_List *list, uint32_t timeout_ms)
+{
+    struct pollfd stack_fds[64];
+    struct pollfd *fds = stack_fds;
+
+    if (list->length > sizeof(stack_fds) / sizeof(struct pollfd)) {
+        fds = malloc(list->length * sizeof(struct pollfd));
+
+        if (fds == NULL)
+            return -1;
+    }
+
+    unsigned int i;
+
+    for (i = 0; i < list->length; ++i) {
+        fds[i].fd = list->socks[i].sock;
+        fds[i].events = 0;
+        fds[i].revents = 0;
+
+        if (list->socks[i].events & SOCKET_WAIT_READ)
+            fds[i].events |= POLLIN;
+
+        if (list->socks[i].events & SOCKET_WAIT_WRITE)
+            fds[i].events |= POLLOUT;
+    }
+
+    int res = poll(fds, list->length, timeout_ms > INT32_MAX ? INT32_MAX : (int)timeout_ms);
+
+    if (fds != stack_fds)
+        free(fds);
+
+    if (res == -1 && errno == EINTR)
+        return 0;
+
+    return res;
+}
+
+#endif
+
+#ifndef VANILLA_NACL
+/* Used for sodium_init() */
+#include <sodium.h>
+#endif
+
+uint8_t at_startup_ran = 0;
+int networking_at_startup(void)
+{
+    if (at_startup_ran != 0)
+        return 0;
+
+#ifndef VANILLA_NACL
+
+#ifdef USE_RANDOMBYTES_STIR
+    randombytes_stir();
+#else
+    sodium_init();
+#endif /*USE_RANDOMBYTES_STIR*/
+
+#endif/*VANILLA_NACL*/
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+    WSADATA wsaData;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != NO_ERROR)
+        return -1;
+
+#endif
+    srand((uint32_t)current_time_actual());
+    at_startup_ran = 1;
+    return 0;
+}
+
+/* TODO: Put this somewhere
+static void at_shutdown(void)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+    WSACleanup();
+#endif
+}
+*/
+
+/* Initialize networking.
+ * Added for reverse compatibility with old new_networking calls.
+ */
+Networking_Core *new_networking(IP ip, uint16_t port)
+{
+    return new_networking_ex(ip, port, port + (TOX_PORTRANGE_TO - TOX_PORTRANGE_FROM), 0);
+}
+
+/* Initialize networking.
+ * Bind to ip and port.
+ * ip must be in network order EX: 127.0.0.1 = (7F000001).
+ * port is in host byte order (this means don't worry about it).
+ * If reuseport is set, SO_REUSEPORT is enabled on the socket before binding.
+ *
+ *  return Networking_Core object if no problems
+ *  return NULL if there are problems.
+ *
+ * If error is non NULL it is set to 0 if no issues, 1 if socket related error, 2 if other.
+ */
+static Networking_Core *new_networking_internal(IP ip, uint16_t port_from, uint16_t port_to, uint8_t reuseport,
+        unsigned int *error)
+{
+    /* If both from and to are 0, use default port range
+     * If one is 0 and the other is non-0, use the non-0 value as only port
+     * If from > to, swap
+     */
+    if (port_from == 0 && port_to == 0) {
+        port_from = TOX_PORTRANGE_FROM;
+        port_to = TOX_PORTRANGE_TO;
+    } else if (port_from == 0 && port_to != 0) {
+        port_from = port_to;
+    } else if (port_from != 0 && port_to == 0) {
+        port_to = port_from;
+    } else if (port_from > port_to) {
+        uint16_t temp = port_from;
+        port_from = port_to;
+        port_to = temp;
+    }
+
+    if (error)
+        *error = 2;
+
+    /* maybe check for invalid IPs like 224+.x.y.z? if there is any IP set ever */
+    if (ip.family != AF_INET && ip.family != AF_INET6) {
+#ifdef DEBUG
+        fprintf(stderr, "Invalid address family: %u\n", ip.family);
+#endif
+        return NULL;
+    }
+
+    if (networking_at_startup() != 0)
+        return NULL;
+
+    Networking_Core *temp = calloc(1, sizeof(Networking_Core));
+
+    if (temp == NULL)
+        return NULL;
+
+    temp->family = ip.family;
+    temp->port = 0;
+
+    /* Initialize our socket. */
+    /* add log message what we're creating */
+    temp->sock = socket(temp->family, SOCK_DGRAM, IPPROTO_UDP);
+
+    /* Check for socket error. */
+    if (!sock_valid(temp->sock)) {
+#ifdef DEBUG
+        fprintf(stderr, "Failed to get a socket?! %u, %s\n", errno, strerror(errno));
+#endif
+        free(temp);
+
+        if (error)
+            *error = 1;
+
+        return NULL;
+    }
+
+    /* Functions to increase the size of the send and receive UDP buffers.
+     */
+    int n = 1024 * 1024 * 2;
+    setsockopt(temp->sock, SOL_SOCKET, SO_RCVBUF, (char *)&n, sizeof(n));
+    setsockopt(temp->sock, SOL_SOCKET, SO_SNDBUF, (char *)&n, sizeof(n));
+
+    /* Enable broadcast on socket */
+    int broadcast = 1;
+    setsockopt(temp->sock, SOL_SOCKET, SO_BROADCAST, (char *)&broadcast, sizeof(broadcast));
+
+    /* iOS UDP sockets are weird and apparently can SIGPIPE */
+    if (!set_socket_nosigpipe(temp->sock)) {
+        kill_networking(temp);
+
+        if (error)
+            *error = 1;
+
+        return NULL;
+    }
+
+    /* Set socket nonblocking. */
+    if (!set_socket_nonblock(temp->sock)) {
+        kill_networking(temp);
+
+        if (error)
+            *error = 1;
+
+        return NULL;
+    }
+
+    if (reuseport && !set_socket_reuseport(temp->sock)) {
+        kill_networking(temp);
 
         if (error)
             *error = 1;
@@ -583,6 +1684,18 @@ Networking_Core *new_networking_ex(IP ip, uint16_t port_from, uint16_t port_to,
         return NULL;
     }
 
+#ifdef NETWORK_USE_MMSG
+    /* Batched receiving is optional, networking_poll() falls back to recvfrom() without it. */
+    temp->recv_batch = new_recv_batch();
+
+#ifdef UDP_SEGMENT
+    /* Kernels before 4.18 don't have UDP GSO. */
+    int gso_size = 0;
+    socklen_t gso_size_length = sizeof(gso_size);
+    temp->udp_gso = getsockopt(temp->sock, IPPROTO_UDP, UDP_SEGMENT, (char *)&gso_size, &gso_size_length) == 0;
+#endif
+#endif
+
     /* Bind our socket to port PORT and the given IP address (usually 0.0.0.0 or ::) */
     uint16_t *portptr = NULL;
     struct sockaddr_storage addr;
@@ -610,7 +1723,7 @@ Networking_Core *new_networking_ex(IP ip, uint16_t port_from, uint16_t port_to,
 
         portptr = &addr6->sin6_port;
     } else {
-        free(temp);
+        kill_networking(temp);
         return NULL;
     }
 
@@ -671,6 +1784,11 @@ Networking_Core *new_networking_ex(IP ip, uint16_t port_from, uint16_t port_to,
             if (tries > 0)
                 errno = 0;
 
+#ifdef NETWORK_USE_IO_URING
+            /* Optional too, not available on older kernels or when disabled by the admin. */
+            temp->uring_recv = new_uring_recv(temp->sock);
+#endif
+
             if (error)
                 *error = 0;
 
@@ -696,15 +1814,63 @@ Networking_Core *new_networking_ex(IP ip, uint16_t port_from, uint16_t port_to,
     return NULL;
 }
 
+Networking_Core *new_networking_ex(IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error)
+{
+    return new_networking_internal(ip, port_from, port_to, 0, error);
+}
+
+/* Initialize networking with SO_REUSEPORT set on the socket.
+ * Bind to exactly ip and port so that several Networking_Core objects can share
+ * the same port, the kernel then spreads incoming packets over their sockets.
+ *
+ *  return Networking_Core object if no problems
+ *  return NULL if there are problems.
+ *
+ * If error is non NULL it is set to 0 if no issues, 1 if socket related error, 2 if other.
+ */
+Networking_Core *new_networking_reuseport(IP ip, uint16_t port, unsigned int *error)
+{
+    if (port == 0) {
+        if (error)
+            *error = 2;
+
+        return NULL;
+    }
+
+    return new_networking_internal(ip, port, port, 1, error);
+}
+
+Networking_Core *new_networking_no_socket(IP ip, uint16_t port)
+{
+    if (ip.family != AF_INET && ip.family != AF_INET6)
+        return NULL;
+
+    Networking_Core *temp = calloc(1, sizeof(Networking_Core));
+
+    if (temp == NULL)
+        return NULL;
+
+    temp->family = ip.family;
+    temp->port = htons(port);
+    temp->sock = ~(sock_t)0;
+    return temp;
+}
+
 /* Function to cleanup networking stuff. */
 void kill_networking(Networking_Core *net)
 {
     if (!net)
         return;
 
-    if (net->family != 0) /* Socket not initialized */
+#ifdef NETWORK_USE_IO_URING
+    kill_uring_recv(net->uring_recv);
+#endif
+
+    if (net->family != 0 && sock_valid(net->sock)) /* Socket not initialized */
         kill_sock(net->sock);
 
+    free(net->recv_batch);
+    free(net->send_queue);
     free(net);
     return;
 }
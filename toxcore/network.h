@@ -297,6 +297,34 @@ typedef struct {
     void *object;
 } Packet_Handles;
 
+/* Buckets of the packet handler time histogram: bucket 0 counts handlers that took
+ * less than 1 microsecond, bucket i those that took [2^(i-1), 2^i) microseconds
+ * and the last one everything slower.
+ */
+#define NET_STATS_HISTOGRAM_SIZE 16
+
+/* Traffic counters of one packet id.
+ * Only the thread that polls the socket writes them, other threads can read them
+ * with networking_get_packet_stats().
+ */
+typedef struct {
+    uint64_t packets_recv;
+    uint64_t bytes_recv;
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+    uint64_t packets_dropped; /* Received without a handler. */
+    uint64_t handler_time[NET_STATS_HISTOGRAM_SIZE];
+} Net_Packet_Stats;
+
+/* Maximum number of datagrams moved per recvmmsg()/sendmmsg() call. */
+#define NET_BATCH_SIZE 32
+
+/* Defined in network.c, only used when built with NETWORK_USE_MMSG. */
+struct Net_Recv_Batch;
+struct Net_Send_Queue;
+/* Defined in network.c, only used when built with NETWORK_USE_IO_URING. */
+struct Net_Uring_Recv;
+
 typedef struct {
     Packet_Handles packethandlers[256];
 
@@ -304,8 +332,43 @@ typedef struct {
     uint16_t port;
     /* Our UDP socket. */
     sock_t sock;
+
+    /* Reusable buffers for batched receiving, NULL if not available. */
+    struct Net_Recv_Batch *recv_batch;
+    /* Queue of outgoing packets, NULL unless enabled with networking_set_send_queue(). */
+    struct Net_Send_Queue *send_queue;
+    /* Receives posted on our socket with io_uring, NULL if not available. */
+    struct Net_Uring_Recv *uring_recv;
+    /* Set if the socket can send several packets to the same address as one buffer
+       with UDP generic segmentation offload (NETWORK_USE_MMSG and Linux 4.18+). */
+    uint8_t udp_gso;
+
+    /* Indexed by the first byte of the packet. */
+    Net_Packet_Stats stats[256];
+
+    /* If set, called with every received packet before it is handled. */
+    packet_handler_callback recv_hook;
+    void *recv_hook_object;
+    /* If set, called with every packet to send instead of sending it on the socket. */
+    packet_handler_callback send_hook;
+    void *send_hook_object;
 } Networking_Core;
 
+#define SOCKET_WAIT_READ  1
+#define SOCKET_WAIT_WRITE 2
+
+typedef struct {
+    sock_t sock;
+    uint8_t events; /* SOCKET_WAIT_READ and/or SOCKET_WAIT_WRITE */
+} Wait_Socket;
+
+/* Growable list of sockets to wait on with socket_wait(). */
+typedef struct {
+    Wait_Socket *socks;
+    unsigned int length;
+    unsigned int capacity;
+} Socket_Wait_List;
+
 /* Run this before creating sockets.
  *
  * return 0 on success
@@ -345,6 +408,13 @@ int set_socket_nosigpipe(sock_t sock);
  */
 int set_socket_reuseaddr(sock_t sock);
 
+/* Enable SO_REUSEPORT on socket.
+ *
+ * return 1 on success
+ * return 0 on failure
+ */
+int set_socket_reuseport(sock_t sock);
+
 /* Set socket to dual (IPv4 + IPv6 socket)
  *
  * return 1 on success
@@ -355,17 +425,108 @@ int set_socket_dualstack(sock_t sock);
 /* return current monotonic time in milliseconds (ms). */
 uint64_t current_time_monotonic(void);
 
+/* Make current_time_monotonic() return the value of function instead of the
+ * system clock, or use the system clock again if function is NULL.
+ *
+ * Only meant for tests and replaying captured traffic, it affects every instance.
+ */
+void set_monotonic_time_function(uint64_t (*function)(void));
+
 /* Basic network functions: */
 
 /* Function to send packet(data) of length length to ip_port. */
 int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
 
+/* Send count packets to ip_port, packet i being data[i] of length[i].
+ *
+ * With NETWORK_USE_MMSG they are sent with one sendmmsg() call per NET_BATCH_SIZE packets,
+ * using UDP GSO for packets of the same length when the kernel supports it.
+ * Otherwise (or with a send hook or the outgoing packet queue) they go through sendpacket().
+ *
+ * return -1 if ip_port is invalid.
+ * return number of packets sent, starting with the first.
+ */
+int sendpacket_batch(Networking_Core *net, IP_Port ip_port, const uint8_t *const *data, const uint16_t *length,
+                     unsigned int count);
+
 /* Function to call when packet beginning with byte is received. */
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object);
 
 /* Call this several times a second. */
 void networking_poll(Networking_Core *net);
 
+/* Same as networking_poll() but without updating unix_time().
+ * For threads other than the one that owns the clock.
+ */
+void networking_poll_packets(Networking_Core *net);
+
+/* Call the handler registered for the packet as if it was received on our socket.
+ */
+void networking_handle_packet(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint32_t length);
+
+/* Enable or disable the outgoing packet queue.
+ *
+ * When enabled, sendpacket() only queues the packet and returns its length;
+ * queued packets are sent in batches with sendmmsg() by networking_flush(),
+ * which networking_poll() calls, or when the queue is full.
+ * Packets the socket buffer has no room for stay queued for the next flush;
+ * sendpacket() fails like sendto() would while the queue stays full.
+ * Packets still queued when the queue is disabled are sent first, those the
+ * socket buffer has no room for then are dropped.
+ *
+ * return 0 on success.
+ * return -1 on failure (batched sending not supported on this platform).
+ */
+int networking_set_send_queue(Networking_Core *net, uint8_t enabled);
+
+/* Send the packets in the outgoing packet queue, keeping those the socket buffer has no room for. */
+void networking_flush(Networking_Core *net);
+
+/* Set the function called with every received packet before it is handled,
+ * for example to capture the traffic. Pass NULL to unset.
+ */
+void networking_set_recv_hook(Networking_Core *net, packet_handler_callback cb, void *object);
+
+/* Set the function that sendpacket() passes packets to instead of sending them
+ * on the socket, its return value is returned by sendpacket(). Pass NULL to unset.
+ */
+void networking_set_send_hook(Networking_Core *net, packet_handler_callback cb, void *object);
+
+/* Copy the traffic counters of packet_id into stats.
+ *
+ * Safe to call from any thread, each counter is read atomically but they are
+ * not read all at once so they can be slightly out of sync.
+ */
+void networking_get_packet_stats(const Networking_Core *net, uint8_t packet_id, Net_Packet_Stats *stats);
+
+/* Add sock to the list, to wait until it is ready for events.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int socket_wait_list_add(Socket_Wait_List *list, sock_t sock, uint8_t events);
+
+/* Remove all sockets from the list, keeping its memory for reuse. */
+void socket_wait_list_clear(Socket_Wait_List *list);
+
+/* Free the memory used by the list. */
+void socket_wait_list_free(Socket_Wait_List *list);
+
+/* Add the UDP socket of net to the list.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_wait_socks(const Networking_Core *net, Socket_Wait_List *list);
+
+/* Block until one of the sockets in the list is ready or timeout_ms milliseconds passed.
+ *
+ * return the number of ready sockets.
+ * return 0 on timeout or if interrupted by a signal.
+ * return -1 on failure.
+ */
+int socket_wait(const Socket_Wait_List *list, uint32_t timeout_ms);
+
 /* Initialize networking.
  * bind to ip and port.
  * ip must be in network order EX: 127.0.0.1 = (7F000001).
@@ -379,6 +540,27 @@ void networking_poll(Networking_Core *net);
 Networking_Core *new_networking(IP ip, uint16_t port);
 Networking_Core *new_networking_ex(IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error);
 
+/* Initialize networking with SO_REUSEPORT set on the socket.
+ * Bind to exactly ip and port so that several Networking_Core objects can share
+ * the same port, the kernel then spreads incoming packets over their sockets.
+ *
+ * return Networking_Core object if no problems
+ * return NULL if there are problems.
+ *
+ * If error is non NULL it is set to 0 if no issues, 1 if socket related error, 2 if other.
+ */
+Networking_Core *new_networking_reuseport(IP ip, uint16_t port, unsigned int *error);
+
+/* Initialize networking without a socket, as if bound to ip and port.
+ *
+ * Packets are only received when passed to networking_handle_packet() and
+ * packets sent are passed to the send hook, or dropped if there is none.
+ *
+ * return Networking_Core object if no problems
+ * return NULL if there are problems.
+ */
+Networking_Core *new_networking_no_socket(IP ip, uint16_t port);
+
 /* Function to cleanup networking stuff (doesn't do much right now). */
 void kill_networking(Networking_Core *net);
 
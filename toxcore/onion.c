@@ -613,6 +613,16 @@ Onion *new_onion(DHT *dht)
     if (onion == NULL)
         return NULL;
 
+    if (shared_keys_init(&onion->shared_keys_1, SHARED_KEYS_DEFAULT_SIZE) == -1
+            || shared_keys_init(&onion->shared_keys_2, SHARED_KEYS_DEFAULT_SIZE) == -1
+            || shared_keys_init(&onion->shared_keys_3, SHARED_KEYS_DEFAULT_SIZE) == -1) {
+        shared_keys_free(&onion->shared_keys_1);
+        shared_keys_free(&onion->shared_keys_2);
+        shared_keys_free(&onion->shared_keys_3);
+        free(onion);
+        return NULL;
+    }
+
     onion->dht = dht;
     onion->net = dht->net;
     new_symmetric_key(onion->secret_symmetric_key);
@@ -642,5 +652,8 @@ void kill_onion(Onion *onion)
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_2, NULL, NULL);
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_1, NULL, NULL);
 
+    shared_keys_free(&onion->shared_keys_1);
+    shared_keys_free(&onion->shared_keys_2);
+    shared_keys_free(&onion->shared_keys_3);
     free(onion);
 }
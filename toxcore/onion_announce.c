@@ -218,33 +218,10 @@ static int in_entries(const Onion_Announce *onion_a, const uint8_t *public_key)
     return -1;
 }
 
-static uint8_t cmp_public_key[crypto_box_PUBLICKEYBYTES];
-static int cmp_entry(const void *a, const void *b)
+/* Sort rank of an entry: timed out entries go first. */
+static unsigned int entry_rank(const void *entry)
 {
-    Onion_Announce_Entry entry1, entry2;
-    memcpy(&entry1, a, sizeof(Onion_Announce_Entry));
-    memcpy(&entry2, b, sizeof(Onion_Announce_Entry));
-    int t1 = is_timeout(entry1.time, ONION_ANNOUNCE_TIMEOUT);
-    int t2 = is_timeout(entry2.time, ONION_ANNOUNCE_TIMEOUT);
-
-    if (t1 && t2)
-        return 0;
-
-    if (t1)
-        return -1;
-
-    if (t2)
-        return 1;
-
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
-
-    if (close == 1)
-        return 1;
-
-    if (close == 2)
-        return -1;
-
-    return 0;
+    return !is_timeout(((const Onion_Announce_Entry *)entry)->time, ONION_ANNOUNCE_TIMEOUT);
 }
 
 /* add entry to entries list
@@ -281,8 +258,8 @@ static int add_to_entries(Onion_Announce *onion_a, IP_Port ret_ip_port, const ui
     memcpy(onion_a->entries[pos].data_public_key, data_public_key, crypto_box_PUBLICKEYBYTES);
     onion_a->entries[pos].time = unix_time();
 
-    memcpy(cmp_public_key, onion_a->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
-    qsort(onion_a->entries, ONION_ANNOUNCE_MAX_ENTRIES, sizeof(Onion_Announce_Entry), cmp_entry);
+    sort_by_distance(onion_a->entries, ONION_ANNOUNCE_MAX_ENTRIES, sizeof(Onion_Announce_Entry),
+                     offsetof(Onion_Announce_Entry, public_key), onion_a->dht->self_public_key, entry_rank);
     return in_entries(onion_a, public_key);
 }
 
@@ -416,6 +393,11 @@ Onion_Announce *new_onion_announce(DHT *dht)
     if (onion_a == NULL)
         return NULL;
 
+    if (shared_keys_init(&onion_a->shared_keys_recv, SHARED_KEYS_DEFAULT_SIZE) == -1) {
+        free(onion_a);
+        return NULL;
+    }
+
     onion_a->dht = dht;
     onion_a->net = dht->net;
     new_symmetric_key(onion_a->secret_bytes);
@@ -433,5 +415,6 @@ void kill_onion_announce(Onion_Announce *onion_a)
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, NULL, NULL);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, NULL, NULL);
+    shared_keys_free(&onion_a->shared_keys_recv);
     free(onion_a);
 }
@@ -441,33 +441,10 @@ static int client_send_announce_request(Onion_Client *onion_c, uint32_t num, IP_
     return send_onion_packet_tcp_udp(onion_c, &path, dest, request, len);
 }
 
-static uint8_t cmp_public_key[crypto_box_PUBLICKEYBYTES];
-static int cmp_entry(const void *a, const void *b)
+/* Sort rank of a node: timed out nodes go first. */
+static unsigned int entry_rank(const void *entry)
 {
-    Onion_Node entry1, entry2;
-    memcpy(&entry1, a, sizeof(Onion_Node));
-    memcpy(&entry2, b, sizeof(Onion_Node));
-    int t1 = is_timeout(entry1.timestamp, ONION_NODE_TIMEOUT);
-    int t2 = is_timeout(entry2.timestamp, ONION_NODE_TIMEOUT);
-
-    if (t1 && t2)
-        return 0;
-
-    if (t1)
-        return -1;
-
-    if (t2)
-        return 1;
-
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
-
-    if (close == 1)
-        return 1;
-
-    if (close == 2)
-        return -1;
-
-    return 0;
+    return !is_timeout(((const Onion_Node *)entry)->timestamp, ONION_NODE_TIMEOUT);
 }
 
 static int client_add_to_list(Onion_Client *onion_c, uint32_t num, const uint8_t *public_key, IP_Port ip_port,
@@ -498,8 +475,8 @@ static int client_add_to_list(Onion_Client *onion_c, uint32_t num, const uint8_t
         list_length = MAX_ONION_CLIENTS;
     }
 
-    memcpy(cmp_public_key, reference_id, crypto_box_PUBLICKEYBYTES);
-    qsort(list_nodes, list_length, sizeof(Onion_Node), cmp_entry);
+    sort_by_distance(list_nodes, list_length, sizeof(Onion_Node), offsetof(Onion_Node, public_key), reference_id,
+                     entry_rank);
 
     int index = -1, stored = 0;
     unsigned int i;
@@ -976,17 +953,7 @@ static int send_dhtpk_announce(Onion_Client *onion_c, uint16_t friend_num, uint8
  */
 int onion_friend_num(const Onion_Client *onion_c, const uint8_t *public_key)
 {
-    unsigned int i;
-
-    for (i = 0; i < onion_c->num_friends; ++i) {
-        if (onion_c->friends_list[i].status == 0)
-            continue;
-
-        if (public_key_cmp(public_key, onion_c->friends_list[i].real_public_key) == 0)
-            return i;
-    }
-
-    return -1;
+    return hash_list_find(&onion_c->friends_index, public_key);
 }
 
 /* Set the size of the friend list to num.
@@ -1041,6 +1008,9 @@ int onion_addfriend(Onion_Client *onion_c, const uint8_t *public_key)
         ++onion_c->num_friends;
     }
 
+    if (!hash_list_add(&onion_c->friends_index, public_key, index))
+        return -1;
+
     onion_c->friends_list[index].status = 1;
     memcpy(onion_c->friends_list[index].real_public_key, public_key, crypto_box_PUBLICKEYBYTES);
     crypto_box_keypair(onion_c->friends_list[index].temp_public_key, onion_c->friends_list[index].temp_secret_key);
@@ -1060,6 +1030,7 @@ int onion_delfriend(Onion_Client *onion_c, int friend_num)
     //if (onion_c->friends_list[friend_num].know_dht_public_key)
     //    DHT_delfriend(onion_c->dht, onion_c->friends_list[friend_num].dht_public_key, 0);
 
+    hash_list_remove(&onion_c->friends_index, onion_c->friends_list[friend_num].real_public_key, friend_num);
     sodium_memzero(&(onion_c->friends_list[friend_num]), sizeof(Onion_Friend));
     unsigned int i;
 
@@ -1497,6 +1468,12 @@ Onion_Client *new_onion_client(Net_Crypto *c)
         return NULL;
     }
 
+    if (!hash_list_init(&onion_c->friends_index, crypto_box_PUBLICKEYBYTES, 0)) {
+        ping_array_free_all(&onion_c->announce_ping_array);
+        free(onion_c);
+        return NULL;
+    }
+
     onion_c->dht = c->dht;
     onion_c->net = c->dht->net;
     onion_c->c = c;
@@ -1518,6 +1495,7 @@ void kill_onion_client(Onion_Client *onion_c)
 
     ping_array_free_all(&onion_c->announce_ping_array);
     realloc_onion_friends(onion_c, 0);
+    hash_list_free(&onion_c->friends_index);
     networking_registerhandler(onion_c->net, NET_PACKET_ANNOUNCE_RESPONSE, NULL, NULL);
     networking_registerhandler(onion_c->net, NET_PACKET_ONION_DATA_RESPONSE, NULL, NULL);
     oniondata_registerhandler(onion_c, ONION_DATA_DHTPK, NULL, NULL);
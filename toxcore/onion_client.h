@@ -130,6 +130,7 @@ typedef struct {
     Networking_Core *net;
     Onion_Friend    *friends_list;
     uint16_t       num_friends;
+    HASH_LIST      friends_index; /* real public key -> friend number */
 
     Onion_Node clients_announce_list[MAX_ONION_CLIENTS_ANNOUNCE];
 
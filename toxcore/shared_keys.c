@@ -0,0 +1,211 @@
+/* shared_keys.c
+ *
+ * Least recently used cache of the shared keys computed with our secret key
+ * and the public keys of other peers.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "shared_keys.h"
+#include "util.h"
+
+/* The keys are kept in a list from the most to the least recently used one, linked
+ * by their indexes in the keys array. A hash list finds the index of a public key.
+ */
+
+#define NO_KEY ((uint32_t)~0)
+
+int shared_keys_init(Shared_Keys *shared_keys, uint32_t size)
+{
+    memset(shared_keys, 0, sizeof(Shared_Keys));
+    shared_keys->newest = NO_KEY;
+    shared_keys->oldest = NO_KEY;
+
+    if (size == 0 || size > INT32_MAX)
+        return -1;
+
+    shared_keys->keys = malloc(sizeof(Shared_Key_Entry) * size);
+
+    if (shared_keys->keys == NULL)
+        return -1;
+
+    if (!hash_list_init(&shared_keys->index, crypto_box_PUBLICKEYBYTES, size)) {
+        free(shared_keys->keys);
+        shared_keys->keys = NULL;
+        return -1;
+    }
+
+    shared_keys->size = size;
+    return 0;
+}
+
+void shared_keys_free(Shared_Keys *shared_keys)
+{
+    hash_list_free(&shared_keys->index);
+    free(shared_keys->keys);
+    shared_keys->keys = NULL;
+    shared_keys->size = 0;
+    shared_keys->num = 0;
+    shared_keys->newest = NO_KEY;
+    shared_keys->oldest = NO_KEY;
+}
+
+static void unlink_key(Shared_Keys *shared_keys, uint32_t i)
+{
+    Shared_Key_Entry *entry = &shared_keys->keys[i];
+
+    if (entry->newer == NO_KEY) {
+        shared_keys->newest = entry->older;
+    } else {
+        shared_keys->keys[entry->newer].older = entry->older;
+    }
+
+    if (entry->older == NO_KEY) {
+        shared_keys->oldest = entry->newer;
+    } else {
+        shared_keys->keys[entry->older].newer = entry->newer;
+    }
+}
+
+static void link_newest(Shared_Keys *shared_keys, uint32_t i)
+{
+    Shared_Key_Entry *entry = &shared_keys->keys[i];
+    entry->newer = NO_KEY;
+    entry->older = shared_keys->newest;
+
+    if (shared_keys->newest == NO_KEY) {
+        shared_keys->oldest = i;
+    } else {
+        shared_keys->keys[shared_keys->newest].newer = i;
+    }
+
+    shared_keys->newest = i;
+}
+
+/* Put a key in entry i of the cache as the most recently used one.
+ * The index is allocated for size keys by shared_keys_init so this only fails on duplicates.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int store_key(Shared_Keys *shared_keys, uint32_t i, const uint8_t *public_key, const uint8_t *shared_key)
+{
+    if (!hash_list_add(&shared_keys->index, public_key, i))
+        return -1;
+
+    memcpy(shared_keys->keys[i].public_key, public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(shared_keys->keys[i].shared_key, shared_key, crypto_box_BEFORENMBYTES);
+    link_newest(shared_keys, i);
+    return 0;
+}
+
+int shared_keys_set_size(Shared_Keys *shared_keys, uint32_t size)
+{
+    Shared_Keys resized;
+
+    if (shared_keys_init(&resized, size) == -1)
+        return -1;
+
+    /* Add the keys that fit from the oldest to the newest so that they keep their order. */
+    uint32_t keep = MIN(size, shared_keys->num);
+    uint32_t i = shared_keys->newest, j;
+
+    for (j = 1; j < keep; ++j) {
+        i = shared_keys->keys[i].older;
+    }
+
+    for (j = 0; j < keep; ++j, i = shared_keys->keys[i].newer) {
+        if (store_key(&resized, j, shared_keys->keys[i].public_key, shared_keys->keys[i].shared_key) == -1) {
+            shared_keys_free(&resized);
+            return -1;
+        }
+    }
+
+    resized.num = keep;
+    resized.stats = shared_keys->stats;
+    shared_keys_free(shared_keys);
+    *shared_keys = resized;
+    return 0;
+}
+
+int shared_keys_contains(const Shared_Keys *shared_keys, const uint8_t *public_key)
+{
+    return hash_list_find(&shared_keys->index, public_key) != -1;
+}
+
+/* Mark entry i as the most recently used one. */
+static void use_key(Shared_Keys *shared_keys, uint32_t i)
+{
+    unlink_key(shared_keys, i);
+    link_newest(shared_keys, i);
+}
+
+void shared_keys_add(Shared_Keys *shared_keys, const uint8_t *public_key, const uint8_t *shared_key)
+{
+    ++shared_keys->stats.misses;
+
+    if (shared_keys->size == 0)
+        return;
+
+    int i = hash_list_find(&shared_keys->index, public_key);
+
+    if (i != -1) {
+        use_key(shared_keys, i);
+        return;
+    }
+
+    if (shared_keys->num < shared_keys->size) {
+        if (store_key(shared_keys, shared_keys->num, public_key, shared_key) == 0)
+            ++shared_keys->num;
+
+        return;
+    }
+
+    /* Replace the least recently used key. */
+    uint32_t oldest = shared_keys->oldest;
+    hash_list_remove(&shared_keys->index, shared_keys->keys[oldest].public_key, oldest);
+    unlink_key(shared_keys, oldest);
+    ++shared_keys->stats.evictions;
+    store_key(shared_keys, oldest, public_key, shared_key);
+}
+
+void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key,
+                    const uint8_t *public_key)
+{
+    int i = hash_list_find(&shared_keys->index, public_key);
+
+    if (i != -1) {
+        memcpy(shared_key, shared_keys->keys[i].shared_key, crypto_box_BEFORENMBYTES);
+        use_key(shared_keys, i);
+        ++shared_keys->stats.hits;
+        return;
+    }
+
+    encrypt_precompute(public_key, secret_key, shared_key);
+    shared_keys_add(shared_keys, public_key, shared_key);
+}
+
+void shared_keys_get_stats(const Shared_Keys *shared_keys, Shared_Keys_Stats *stats)
+{
+    *stats = shared_keys->stats;
+}
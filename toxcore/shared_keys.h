@@ -0,0 +1,101 @@
+/* shared_keys.h
+ *
+ * Least recently used cache of the shared keys computed with our secret key
+ * and the public keys of other peers.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SHARED_KEYS_H
+#define SHARED_KEYS_H
+
+#include "crypto_core.h"
+#include "hash_list.h"
+
+/* Number of keys a cache holds unless shared_keys_set_size() is used. */
+#define SHARED_KEYS_DEFAULT_SIZE 1024
+
+typedef struct {
+    uint64_t hits; /* keys found in the cache */
+    uint64_t misses; /* keys that had to be computed */
+    uint64_t evictions; /* keys removed from the cache to make room for others */
+} Shared_Keys_Stats;
+
+typedef struct {
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    uint32_t newer; /* index of the next most recently used key */
+    uint32_t older; /* index of the next least recently used key */
+} Shared_Key_Entry;
+
+typedef struct {
+    Shared_Key_Entry *keys;
+    uint32_t size; /* maximum number of keys */
+    uint32_t num; /* number of keys stored, keys[0] to keys[num - 1] */
+    uint32_t newest; /* index of the most recently used key */
+    uint32_t oldest; /* index of the least recently used key, the next one evicted */
+    HASH_LIST index; /* public key -> index in keys */
+    Shared_Keys_Stats stats;
+} Shared_Keys;
+
+/* Initialize a cache of at most size keys.
+ * A zeroed cache that was not initialized (or failed to be) stores no keys but can still be used.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int shared_keys_init(Shared_Keys *shared_keys, uint32_t size);
+
+/* Free a cache initialized with shared_keys_init. */
+void shared_keys_free(Shared_Keys *shared_keys);
+
+/* Change the maximum number of keys of the cache to size, keeping the most recently used ones.
+ * The stats are kept.
+ *
+ * return 0 on success.
+ * return -1 on failure (the cache is left unchanged).
+ */
+int shared_keys_set_size(Shared_Keys *shared_keys, uint32_t size);
+
+/* Shared key generations are costly, it is therefor smart to store commonly used
+ * ones so that they can re used later without being computed again.
+ *
+ * If shared key is already in shared_keys, copy it to shared_key.
+ * else generate it into shared_key and copy it to shared_keys, evicting the
+ * least recently used key if the cache is full.
+ */
+void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key,
+                    const uint8_t *public_key);
+
+/* return 1 if the shared key of public_key is in the cache.
+ * return 0 if it isn't.
+ *
+ * Doesn't count as a use of the key.
+ */
+int shared_keys_contains(const Shared_Keys *shared_keys, const uint8_t *public_key);
+
+/* Put the shared key of public_key, computed outside of the cache, in it as the most recently
+ * used key. It counts as a miss.
+ */
+void shared_keys_add(Shared_Keys *shared_keys, const uint8_t *public_key, const uint8_t *shared_key);
+
+/* Copy the hit/miss/eviction counters of the cache into stats. */
+void shared_keys_get_stats(const Shared_Keys *shared_keys, Shared_Keys_Stats *stats);
+
+#endif
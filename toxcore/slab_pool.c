@@ -0,0 +1,225 @@
+/* slab_pool.c
+ *
+ * Allocator of fixed size elements that carves them out of bigger slabs, for
+ * objects allocated and freed at a high rate like queued packets.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+
+#include "slab_pool.h"
+
+/* Each element is preceded by a header pointing to its slab. The slabs with free elements are
+ * kept in a list, each with a stack of its free elements. A slab is freed when none of its
+ * elements are used anymore, except for the last MAX_EMPTY_SLABS, so that a pool that is
+ * used in bursts doesn't allocate and free a slab every time.
+ */
+
+#define MAX_EMPTY_SLABS 1
+
+typedef union Element_Header {
+    struct {
+        struct Slab *slab;
+        union Element_Header *next_free;
+    } h;
+    /* Keep the elements aligned for anything they might contain. */
+    long double align_ld;
+    uint64_t align_u64;
+    void *align_ptr;
+} Element_Header;
+
+struct Slab {
+    struct Slab *prev;
+    struct Slab *next;
+    Element_Header *free;
+    uint32_t used;
+};
+
+static size_t entry_size(const Slab_Pool *pool)
+{
+    size_t size = sizeof(Element_Header) + pool->element_size;
+    return (size + sizeof(Element_Header) - 1) / sizeof(Element_Header) * sizeof(Element_Header);
+}
+
+static size_t slab_header_size(void)
+{
+    return (sizeof(struct Slab) + sizeof(Element_Header) - 1) / sizeof(Element_Header) * sizeof(Element_Header);
+}
+
+static void unlink_slab(Slab_Pool *pool, struct Slab *slab)
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        pool->partial = slab->next;
+    }
+
+    if (slab->next)
+        slab->next->prev = slab->prev;
+
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+static void link_slab(Slab_Pool *pool, struct Slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = pool->partial;
+
+    if (pool->partial)
+        pool->partial->prev = slab;
+
+    pool->partial = slab;
+}
+
+static struct Slab *new_slab(Slab_Pool *pool)
+{
+    size_t size = entry_size(pool);
+    struct Slab *slab = malloc(slab_header_size() + size * pool->slab_length);
+
+    if (slab == NULL)
+        return NULL;
+
+    uint8_t *entries = (uint8_t *)slab + slab_header_size();
+    slab->free = NULL;
+    slab->used = 0;
+
+    uint32_t i;
+
+    for (i = pool->slab_length; i != 0; --i) {
+        Element_Header *header = (Element_Header *)(entries + size * (i - 1));
+        header->h.slab = slab;
+        header->h.next_free = slab->free;
+        slab->free = header;
+    }
+
+    link_slab(pool, slab);
+    ++pool->empty_slabs;
+    ++pool->stats.slabs;
+    pool->stats.elements_free += pool->slab_length;
+    return slab;
+}
+
+int slab_pool_init(Slab_Pool *pool, size_t element_size, uint32_t slab_length)
+{
+    if (element_size == 0 || slab_length == 0)
+        return -1;
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0)
+        return -1;
+
+    pool->element_size = element_size;
+    pool->slab_length = slab_length;
+    pool->partial = NULL;
+    pool->empty_slabs = 0;
+    pool->stats.slabs = 0;
+    pool->stats.elements_used = 0;
+    pool->stats.elements_free = 0;
+    return 0;
+}
+
+void slab_pool_free(Slab_Pool *pool)
+{
+    /* Full slabs are only reachable from their elements, which are lost once the pool is freed,
+     * so the pool must only be freed once all elements were given back.
+     */
+    while (pool->partial) {
+        struct Slab *slab = pool->partial;
+        unlink_slab(pool, slab);
+        free(slab);
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+void *slab_pool_alloc(Slab_Pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    struct Slab *slab = pool->partial;
+
+    if (slab == NULL) {
+        slab = new_slab(pool);
+
+        if (slab == NULL) {
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
+        }
+    }
+
+    Element_Header *header = slab->free;
+    slab->free = header->h.next_free;
+
+    if (slab->used == 0)
+        --pool->empty_slabs;
+
+    ++slab->used;
+
+    if (slab->free == NULL)
+        unlink_slab(pool, slab);
+
+    ++pool->stats.elements_used;
+    --pool->stats.elements_free;
+    pthread_mutex_unlock(&pool->mutex);
+    return header + 1;
+}
+
+void slab_pool_release(Slab_Pool *pool, void *element)
+{
+    if (element == NULL)
+        return;
+
+    Element_Header *header = (Element_Header *)element - 1;
+    struct Slab *slab = header->h.slab;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (slab->free == NULL)
+        link_slab(pool, slab);
+
+    header->h.next_free = slab->free;
+    slab->free = header;
+    --slab->used;
+    --pool->stats.elements_used;
+    ++pool->stats.elements_free;
+
+    if (slab->used == 0) {
+        if (pool->empty_slabs < MAX_EMPTY_SLABS) {
+            ++pool->empty_slabs;
+        } else {
+            unlink_slab(pool, slab);
+            free(slab);
+            --pool->stats.slabs;
+            pool->stats.elements_free -= pool->slab_length;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void slab_pool_get_stats(Slab_Pool *pool, Slab_Pool_Stats *stats)
+{
+    pthread_mutex_lock(&pool->mutex);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->mutex);
+}
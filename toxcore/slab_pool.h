@@ -0,0 +1,78 @@
+/* slab_pool.h
+ *
+ * Allocator of fixed size elements that carves them out of bigger slabs, for
+ * objects allocated and freed at a high rate like queued packets.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Defined in slab_pool.c */
+struct Slab;
+
+typedef struct {
+    uint32_t slabs; /* number of slabs allocated */
+    uint32_t elements_used; /* number of elements handed out */
+    uint32_t elements_free; /* number of elements in the slabs that are not handed out */
+} Slab_Pool_Stats;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    size_t element_size;
+    uint32_t slab_length; /* number of elements per slab */
+
+    struct Slab *partial; /* slabs with free elements */
+    uint32_t empty_slabs; /* number of slabs with no element handed out */
+
+    Slab_Pool_Stats stats;
+} Slab_Pool;
+
+/* Initialize a pool of elements of element_size bytes, allocated slab_length at a time.
+ * The pool is thread safe.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int slab_pool_init(Slab_Pool *pool, size_t element_size, uint32_t slab_length);
+
+/* Free a pool initialized with slab_pool_init.
+ * Elements still handed out become invalid.
+ */
+void slab_pool_free(Slab_Pool *pool);
+
+/* return a pointer to an uninitialized element on success.
+ * return NULL on failure.
+ */
+void *slab_pool_alloc(Slab_Pool *pool);
+
+/* Give back an element returned by slab_pool_alloc on the same pool.
+ * element can be NULL.
+ */
+void slab_pool_release(Slab_Pool *pool, void *element);
+
+/* Copy the counters of the pool into stats. */
+void slab_pool_get_stats(Slab_Pool *pool, Slab_Pool_Stats *stats);
+
+#endif
@@ -54,6 +54,10 @@ typedef struct Messenger Tox;
 #error TOX_FILE_ID_LENGTH is assumed to be equal to TOX_HASH_LENGTH
 #endif
 
+#if TOX_PACKET_STATS_HISTOGRAM_SIZE != NET_STATS_HISTOGRAM_SIZE
+#error TOX_PACKET_STATS_HISTOGRAM_SIZE is assumed to be equal to NET_STATS_HISTOGRAM_SIZE
+#endif
+
 #if TOX_PUBLIC_KEY_SIZE != crypto_box_PUBLICKEYBYTES
 #error TOX_PUBLIC_KEY_SIZE is assumed to be equal to crypto_box_PUBLICKEYBYTES
 #endif
@@ -102,6 +106,7 @@ void tox_options_default(struct Tox_Options *options)
         options->ipv6_enabled = 1;
         options->udp_enabled = 1;
         options->proxy_type = TOX_PROXY_TYPE_NONE;
+        options->congestion_control = TOX_CONGESTION_CONTROL_LEGACY;
     }
 }
 
@@ -207,6 +212,20 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
 
             m_options.proxy_info.ip_port.port = htons(options->proxy_port);
         }
+
+        switch (options->congestion_control) {
+            case TOX_CONGESTION_CONTROL_LEGACY:
+                m_options.congestion_control = CONGESTION_CONTROL_LEGACY;
+                break;
+
+            case TOX_CONGESTION_CONTROL_LEDBAT:
+                m_options.congestion_control = CONGESTION_CONTROL_LEDBAT;
+                break;
+
+            default:
+                SET_ERROR_PARAMETER(error, TOX_ERR_NEW_CONGESTION_CONTROL_BAD_TYPE);
+                return NULL;
+        }
     }
 
     unsigned int m_error;
@@ -409,6 +428,12 @@ void tox_iterate(Tox *tox)
     do_groupchats(m->group_chat_object);
 }
 
+bool tox_wait(Tox *tox, uint32_t max_wait)
+{
+    Messenger *m = tox;
+    return messenger_wait(m, max_wait) == 1;
+}
+
 void tox_self_get_address(const Tox *tox, uint8_t *address)
 {
     if (address) {
@@ -1276,4 +1301,102 @@ uint16_t tox_self_get_tcp_port(const Tox *tox, TOX_ERR_GET_PORT *error)
     }
 }
 
+void tox_self_get_packet_stats(const Tox *tox, uint8_t packet_id, struct Tox_Packet_Stats *stats)
+{
+    if (!stats)
+        return;
+
+    const Messenger *m = tox;
+    Net_Packet_Stats net_stats;
+    networking_get_packet_stats(m->net, packet_id, &net_stats);
+
+    stats->packets_received = net_stats.packets_recv;
+    stats->bytes_received = net_stats.bytes_recv;
+    stats->packets_sent = net_stats.packets_sent;
+    stats->bytes_sent = net_stats.bytes_sent;
+    stats->packets_dropped = net_stats.packets_dropped;
+    memcpy(stats->handler_time, net_stats.handler_time, sizeof(stats->handler_time));
+}
+
+static TOX_CONNECTION transport_connection(const Crypto_Connection_Stats *stats)
+{
+    if (stats->status != CRYPTO_CONN_ESTABLISHED)
+        return TOX_CONNECTION_NONE;
+
+    if (stats->direct_connected)
+        return TOX_CONNECTION_UDP;
+
+    if (stats->online_tcp_relays)
+        return TOX_CONNECTION_TCP;
+
+    return TOX_CONNECTION_NONE;
+}
+
+bool tox_friend_get_transport_stats(const Tox *tox, uint32_t friend_number, struct Tox_Transport_Stats *stats,
+                                    TOX_ERR_FRIEND_QUERY *error)
+{
+    if (!stats) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_NULL);
+        return 0;
+    }
+
+    const Messenger *m = tox;
+    Crypto_Connection_Stats crypto_stats;
+
+    if (m_get_friend_transport_stats(m, friend_number, &crypto_stats) == -1) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND);
+        return 0;
+    }
+
+    stats->connection = transport_connection(&crypto_stats);
+    stats->online_tcp_relays = crypto_stats.online_tcp_relays;
+    stats->relay_set = crypto_stats.relay_set;
+    memcpy(stats->relay_public_key, crypto_stats.relay_public_key, TOX_PUBLIC_KEY_SIZE);
+    stats->rtt = crypto_stats.rtt;
+    stats->send_rate = crypto_stats.packet_send_rate;
+    stats->recv_rate = crypto_stats.packet_recv_rate;
+    stats->packets_sent = crypto_stats.packets_sent;
+    stats->packets_resent = crypto_stats.packets_resent;
+    stats->packets_received = crypto_stats.packets_received;
+    stats->send_queue_size = crypto_stats.send_queue_size;
+    stats->recv_queue_size = crypto_stats.recv_queue_size;
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_OK);
+    return 1;
+}
+
+void tox_self_get_transport_stats(const Tox *tox, struct Tox_Self_Transport_Stats *stats)
+{
+    if (!stats)
+        return;
+
+    const Messenger *m = tox;
+    memset(stats, 0, sizeof(struct Tox_Self_Transport_Stats));
+
+    uint32_t i;
+
+    for (i = 0; i < m->numfriends; ++i) {
+        Crypto_Connection_Stats crypto_stats;
+
+        if (m_get_friend_transport_stats(m, i, &crypto_stats) == -1)
+            continue;
+
+        TOX_CONNECTION connection = transport_connection(&crypto_stats);
+
+        if (connection == TOX_CONNECTION_UDP) {
+            ++stats->friends_udp;
+        } else if (connection == TOX_CONNECTION_TCP) {
+            ++stats->friends_tcp;
+        }
+
+        stats->send_rate += crypto_stats.packet_send_rate;
+        stats->recv_rate += crypto_stats.packet_recv_rate;
+        stats->packets_sent += crypto_stats.packets_sent;
+        stats->packets_resent += crypto_stats.packets_resent;
+        stats->packets_received += crypto_stats.packets_received;
+        stats->send_queue_size += crypto_stats.send_queue_size;
+        stats->recv_queue_size += crypto_stats.recv_queue_size;
+    }
+}
+
 #include "tox_old_code.h"
@@ -91,7 +91,8 @@ extern "C" {
  * each thread. It is also possible to run all Tox instances in the same thread.
  * A common way to run Tox (multiple or single instance) is to have one thread
  * running a simple tox_iterate loop, sleeping for tox_iteration_interval
- * milliseconds on each iteration.
+ * milliseconds on each iteration, or waiting for new data with tox_wait for at
+ * most that long.
  *
  * If you want to access a single Tox instance from multiple threads, access
  * to the instance must be synchronised. While multiple threads can concurrently
@@ -383,6 +384,26 @@ typedef enum TOX_SAVEDATA_TYPE {
 } TOX_SAVEDATA_TYPE;
 
 
+/**
+ * Algorithm deciding how fast data is sent to friends.
+ */
+typedef enum TOX_CONGESTION_CONTROL {
+
+    /**
+     * Adapt the speed to how the queue of unacknowledged data grows and shrinks.
+     */
+    TOX_CONGESTION_CONTROL_LEGACY,
+
+    /**
+     * Adapt the speed to keep the delay the connection adds to the round trip
+     * time under 100 ms, like LEDBAT. This ramps up faster and keeps queues
+     * shorter on fast links with a high round trip time.
+     */
+    TOX_CONGESTION_CONTROL_LEDBAT,
+
+} TOX_CONGESTION_CONTROL;
+
+
 /**
  * This struct contains all the startup options for Tox. You can either allocate
  * this object yourself, and pass it to tox_options_default, or call
@@ -490,6 +511,12 @@ struct Tox_Options {
      */
     size_t savedata_length;
 
+
+    /**
+     * The congestion control algorithm of the connections to friends.
+     */
+    TOX_CONGESTION_CONTROL congestion_control;
+
 };
 
 
@@ -610,6 +637,11 @@ typedef enum TOX_ERR_NEW {
      */
     TOX_ERR_NEW_LOAD_BAD_FORMAT,
 
+    /**
+     * congestion_control was invalid.
+     */
+    TOX_ERR_NEW_CONGESTION_CONTROL_BAD_TYPE,
+
 } TOX_ERR_NEW;
 
 
@@ -791,6 +823,21 @@ uint32_t tox_iteration_interval(const Tox *tox);
 void tox_iterate(Tox *tox);
 
 
+/**
+ * Block until data arrives on one of the sockets of the Tox instance or until
+ * max_wait milliseconds have passed, whichever comes first.
+ *
+ * Call it in place of sleeping between two calls to tox_iterate(), so that
+ * incoming packets are handled as soon as they arrive instead of at the next
+ * fixed interval. It never waits longer than tox_iteration_interval(), so that
+ * tox_iterate() runs in time for the next internal deadline.
+ *
+ * @return true if data is ready to be handled by tox_iterate(), false on timeout
+ *   or error.
+ */
+bool tox_wait(Tox *tox, uint32_t max_wait);
+
+
 /*******************************************************************************
  *
  * :: Internal client information (Tox address/id)
@@ -2301,6 +2348,153 @@ uint16_t tox_self_get_udp_port(const Tox *tox, TOX_ERR_GET_PORT *error);
  */
 uint16_t tox_self_get_tcp_port(const Tox *tox, TOX_ERR_GET_PORT *error);
 
+/**
+ * Number of buckets in the handler time histogram of struct Tox_Packet_Stats.
+ *
+ * Bucket 0 counts the packets that were handled in less than 1 microsecond,
+ * bucket i those handled in [2^(i-1), 2^i) microseconds and the last bucket
+ * all the slower ones.
+ */
+#define TOX_PACKET_STATS_HISTOGRAM_SIZE 16
+
+/**
+ * Counters of the UDP packets with one packet id (their first byte), since the
+ * Tox instance was created.
+ */
+struct Tox_Packet_Stats {
+    uint64_t packets_received;
+    uint64_t bytes_received;
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+
+    /**
+     * Packets received that nothing was registered to handle.
+     */
+    uint64_t packets_dropped;
+
+    /**
+     * Histogram of the time spent handling each received packet.
+     */
+    uint64_t handler_time[TOX_PACKET_STATS_HISTOGRAM_SIZE];
+};
+
+/**
+ * Copy the counters of the UDP packets starting with packet_id into stats.
+ *
+ * Unlike other functions, this one may be called from any thread while another
+ * thread runs tox_iterate. Each counter is read atomically, but they are not
+ * all read at once so they may be slightly out of sync with each other.
+ */
+void tox_self_get_packet_stats(const Tox *tox, uint8_t packet_id, struct Tox_Packet_Stats *stats);
+
+/**
+ * Transport figures of the connection to a friend. The rates and counters are
+ * about lossless packets: messages, file transfers and custom lossless packets.
+ */
+struct Tox_Transport_Stats {
+    /**
+     * Path packets are sent to the friend through right now, TOX_CONNECTION_NONE
+     * if the connection isn't established. This can change before the
+     * `friend_connection_status` event reports it.
+     */
+    TOX_CONNECTION connection;
+
+    /**
+     * Number of TCP relays the friend can be reached through.
+     */
+    uint32_t online_tcp_relays;
+
+    /**
+     * True if relay_public_key is set.
+     */
+    bool relay_set;
+
+    /**
+     * Public key of the TCP relay packets are sent through when connection is
+     * TOX_CONNECTION_TCP.
+     */
+    uint8_t relay_public_key[TOX_PUBLIC_KEY_SIZE];
+
+    /**
+     * Lowest round trip time measured on the connection, in milliseconds.
+     */
+    uint64_t rtt;
+
+    /**
+     * Packets per second congestion control lets the connection send.
+     */
+    double send_rate;
+
+    /**
+     * Packets per second received lately.
+     */
+    double recv_rate;
+
+    /**
+     * Packets sent since the connection was established.
+     */
+    uint64_t packets_sent;
+
+    /**
+     * Packets sent again because the friend didn't receive them. Divided by
+     * packets_sent this estimates the loss rate of the path.
+     */
+    uint64_t packets_resent;
+
+    /**
+     * Packets received since the connection was established.
+     */
+    uint64_t packets_received;
+
+    /**
+     * Packets sent that the friend didn't acknowledge yet.
+     */
+    uint32_t send_queue_size;
+
+    /**
+     * Packets received out of order, waiting for earlier ones that were lost.
+     */
+    uint32_t recv_queue_size;
+};
+
+/**
+ * Copy the transport figures of the connection to a friend into stats.
+ *
+ * If the connection isn't established, all fields other than online_tcp_relays,
+ * relay_set and relay_public_key are 0.
+ *
+ * @return true on success.
+ */
+bool tox_friend_get_transport_stats(const Tox *tox, uint32_t friend_number, struct Tox_Transport_Stats *stats,
+                                    TOX_ERR_FRIEND_QUERY *error);
+
+/**
+ * Transport figures of the connections to all friends, added up.
+ */
+struct Tox_Self_Transport_Stats {
+    /**
+     * Number of friends connected over UDP and over a TCP relay.
+     */
+    uint32_t friends_udp;
+    uint32_t friends_tcp;
+
+    /**
+     * Sums of the fields of the same name of struct Tox_Transport_Stats.
+     */
+    double send_rate;
+    double recv_rate;
+    uint64_t packets_sent;
+    uint64_t packets_resent;
+    uint64_t packets_received;
+    uint32_t send_queue_size;
+    uint32_t recv_queue_size;
+};
+
+/**
+ * Add up the transport figures of the connections to all friends into stats.
+ */
+void tox_self_get_transport_stats(const Tox *tox, struct Tox_Self_Transport_Stats *stats);
+
 #include "tox_old.h"
 
 #ifdef __cplusplus
@@ -0,0 +1,239 @@
+/* uring.c
+ *
+ * Minimal wrapper around the linux io_uring system calls.
+ * Only built when NETWORK_USE_IO_URING is defined.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef NETWORK_USE_IO_URING
+
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+Uring *new_uring(unsigned int entries)
+{
+    Uring *ring = calloc(1, sizeof(Uring));
+
+    if (ring == NULL)
+        return NULL;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = sys_io_uring_setup(entries, &params);
+
+    if (ring->fd == -1) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* Since linux 5.4 both rings live in a single mapping. */
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    if (ring->cq_ring_size) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            free(ring);
+            return NULL;
+        }
+    } else {
+        ring->cq_ring = ring->sq_ring;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring_size)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    uint8_t *sq = ring->sq_ring;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+
+    uint8_t *cq = ring->cq_ring;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return ring;
+}
+
+void kill_uring(Uring *ring)
+{
+    if (ring == NULL)
+        return;
+
+    munmap(ring->sqes, ring->sqes_size);
+
+    if (ring->cq_ring_size)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *ring->sq_tail + ring->sq_pending;
+
+    if (tail - head > *ring->sq_mask)
+        return NULL;
+
+    unsigned int index = tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    ++ring->sq_pending;
+
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+int uring_submit(Uring *ring)
+{
+    if (ring->sq_pending == 0)
+        return 0;
+
+    unsigned int count = ring->sq_pending;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+
+    int ret;
+
+    do {
+        ret = sys_io_uring_enter(ring->fd, count, 0, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(const Uring *ring)
+{
+    unsigned int head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_wait_cqe(Uring *ring)
+{
+    unsigned int count = ring->sq_pending;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+
+    while (uring_peek_cqe(ring) == NULL) {
+        if (sys_io_uring_enter(ring->fd, count, 1, IORING_ENTER_GETEVENTS) == -1) {
+            if (errno != EINTR)
+                return -1;
+
+            continue;
+        }
+
+        count = 0;
+    }
+
+    return 0;
+}
+
+int uring_get_events(Uring *ring)
+{
+    unsigned int count = ring->sq_pending;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+
+    int ret;
+
+    do {
+        ret = sys_io_uring_enter(ring->fd, count, 0, IORING_ENTER_GETEVENTS);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret == -1 ? -1 : 0;
+}
+
+int uring_register(Uring *ring, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return sys_io_uring_register(ring->fd, opcode, arg, nr_args) == -1 ? -1 : 0;
+}
+
+#endif /* NETWORK_USE_IO_URING */
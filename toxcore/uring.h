@@ -0,0 +1,116 @@
+/* uring.h
+ *
+ * Minimal wrapper around the linux io_uring system calls.
+ * Only built when NETWORK_USE_IO_URING is defined.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#ifdef NETWORK_USE_IO_URING
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+    int fd;
+
+    /* Submission queue, mapped from the kernel. */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /* Entries filled with uring_get_sqe() but not submitted yet. */
+    unsigned int sq_pending;
+
+    /* Completion queue, mapped from the kernel. */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+} Uring;
+
+/* Create a new ring with room for at least entries submissions
+ * (the completion queue is twice as big).
+ *
+ * return the ring on success.
+ * return NULL on failure (for example if the kernel doesn't support io_uring).
+ */
+Uring *new_uring(unsigned int entries);
+
+void kill_uring(Uring *ring);
+
+/* Get a zeroed submission queue entry to fill in.
+ * It is passed to the kernel on the next uring_submit().
+ *
+ * return NULL if the submission queue is full.
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+
+/* Pass the pending submission queue entries to the kernel.
+ *
+ * return the number of entries submitted.
+ * return -1 on failure.
+ */
+int uring_submit(Uring *ring);
+
+/* return the oldest completion queue entry.
+ * return NULL if there is none.
+ *
+ * The entry must be released with uring_cqe_seen() after use.
+ */
+struct io_uring_cqe *uring_peek_cqe(const Uring *ring);
+
+void uring_cqe_seen(Uring *ring);
+
+/* Pass the pending submission queue entries to the kernel and block until
+ * there is at least one completion queue entry.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int uring_wait_cqe(Uring *ring);
+
+/* Pass the pending submission queue entries to the kernel and let it post the
+ * completions it has ready, without blocking.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int uring_get_events(Uring *ring);
+
+/* Register resources with the ring, see io_uring_register(2).
+ *
+ * return 0 on success.
+ * return -1 on failure (for example if the kernel doesn't know opcode).
+ */
+int uring_register(Uring *ring, unsigned int opcode, void *arg, unsigned int nr_args);
+
+#endif /* NETWORK_USE_IO_URING */
+
+#endif
@@ -34,21 +34,29 @@
 #include "util.h"
 
 
-/* don't call into system billions of times for no reason */
+/* don't call into system billions of times for no reason
+ *
+ * Only one thread updates the time, others (bootstrap daemon DHT workers)
+ * may read it concurrently, hence the atomic accesses.
+ */
 static uint64_t unix_time_value;
 static uint64_t unix_base_time_value;
 
 void unix_time_update()
 {
-    if (unix_base_time_value == 0)
-        unix_base_time_value = ((uint64_t)time(NULL) - (current_time_monotonic() / 1000ULL));
+    uint64_t base = __atomic_load_n(&unix_base_time_value, __ATOMIC_RELAXED);
+
+    if (base == 0) {
+        base = ((uint64_t)time(NULL) - (current_time_monotonic() / 1000ULL));
+        __atomic_store_n(&unix_base_time_value, base, __ATOMIC_RELAXED);
+    }
 
-    unix_time_value = (current_time_monotonic() / 1000ULL) + unix_base_time_value;
+    __atomic_store_n(&unix_time_value, (current_time_monotonic() / 1000ULL) + base, __ATOMIC_RELAXED);
 }
 
 uint64_t unix_time()
 {
-    return unix_time_value;
+    return __atomic_load_n(&unix_time_value, __ATOMIC_RELAXED);
 }
 
 int is_timeout(uint64_t timestamp, uint64_t timeout)